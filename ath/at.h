@@ -15,6 +15,11 @@
 #define AT_OUTPUT_BUFFER_SIZE 32
 #endif
 
+// Commands of one command line, a line with more fails as a whole
+#ifndef AT_LINE_COMMANDS_MAX
+#define AT_LINE_COMMANDS_MAX 16
+#endif
+
 enum AT_CMD_TYPE {
    AT_STANDALONE_COMMAND = 1,
    AT_ASSIGNMENT_COMMAND = 2,
@@ -22,6 +27,27 @@ enum AT_CMD_TYPE {
    AT_UNKOWN_COMMAND = 4
 };
 
+enum AT_ECHO_POLICY {
+   AT_ECHO_IMMEDIATE = 0,
+   AT_ECHO_MERGED = 1,
+   AT_ECHO_DEFERRED = 2
+};
+
+// TE character set of string parameters and responses, AT+CSCS
+enum AT_CHARSET {
+   AT_CHARSET_IRA = 0,
+   AT_CHARSET_GSM = 1,
+   AT_CHARSET_UCS2 = 2,
+   AT_CHARSET_HEX = 3
+};
+
+enum AT_FLUSH_POLICY {
+   AT_FLUSH_PER_RESPONSE = 0,
+   AT_FLUSH_ON_FULL = 1,
+   AT_FLUSH_PER_INPUT = 2,
+   AT_FLUSH_COALESCE = 3
+};
+
 struct at_command_register_t;
 
 struct at_function_result {
@@ -32,28 +58,197 @@ struct at_function_result {
 
 struct at_context_t;
 
+enum AT_RECORD_TYPE {
+   AT_RECORD_INPUT = 1,
+   AT_RECORD_OUTPUT = 2,
+   AT_RECORD_UNSOLICITED = 3,
+   AT_RECORD_UNSOLICITED_LINE = 4
+};
+
+struct at_record_event_t {
+   enum AT_RECORD_TYPE type;
+   struct range_t data;
+   struct range_t prefix;
+};
+
 struct at_function_context_t{
    struct at_context_t *context;
    struct range_t parameters;
+   void *user_data;
+};
+
+struct at_command_t {
+   const char *tag;
+   enum AT_CMD_TYPE cmd_type;
+   void (*function)(struct at_function_result*, struct at_function_context_t*);
+   void *user_data;
 };
 
 void at_function_result_init(struct at_function_result *p);
 void at_context_init(struct at_context_t **ctx, void (*flush)(struct range_t*));
 
+// Allocator hook, 'free' gets the size that was allocated. Contexts keep the
+// allocator they were created with, at_set_default_allocator() applies to
+// contexts created afterwards and 0 restores malloc and free.
+struct at_allocator_t {
+   void *(*alloc)(void *user_data, size_t size);
+   void (*free)(void *user_data, void *p, size_t size);
+   void *user_data;
+};
+
+// 'bytes' are allocated now, 'guarded' counts allocations made while
+// processing input with the guard enabled
+struct at_alloc_stats_t {
+   unsigned long long allocs;
+   size_t bytes;
+   size_t peak;
+   unsigned long long guarded;
+};
+
+void at_set_default_allocator(const struct at_allocator_t *allocator);
+
+void at_context_init_with(
+      struct at_context_t **ctx,
+      void (*flush)(struct range_t*),
+      const struct at_allocator_t *allocator);
+
+// New context with the settings of 'prototype': output, echo, verbose, quiet
+// and CMEE modes, flush and echo policies, clock, S registers, command
+// lookup, command set and registry. Commands added to the prototype itself,
+// the command fallback (and with it a proxy attachment), cached responses,
+// URC queue and recording are not copied. The context and its buffers take
+// one allocation.
+void at_context_clone(struct at_context_t **ctx, struct at_context_t *prototype);
+
+void at_get_alloc_stats(struct at_context_t *ctx, struct at_alloc_stats_t *stats);
+
+// Output buffers a pooled context makes its pool allocate count as its own
+// guarded allocations. The hook runs for each guarded allocation, e.g. to
+// abort() at the first one in tests.
+void at_set_alloc_guard(struct at_context_t *ctx, bool enabled);
+void at_set_alloc_guard_hook(struct at_context_t *ctx, void (*hook)(void *user, size_t size), void *user);
+
 void at_command_add(
       struct at_context_t *ctx,
       const char *tag,
       enum AT_CMD_TYPE cmd_type,
       void (*function)(struct at_function_result*, struct at_function_context_t*));
 
+void at_command_add_ex(
+      struct at_context_t *ctx,
+      const char *tag,
+      enum AT_CMD_TYPE cmd_type,
+      void (*function)(struct at_function_result*, struct at_function_context_t*),
+      void *user_data);
+
+// Assignment command that gets its parameter in chunks as the bytes arrive,
+// instead of from the line buffer, so parameters may be of any size. It has
+// to be the first command of its line and its parameter is every byte up to
+// the line terminator. 'end' sets the result, it may also defer it.
+struct at_stream_command_t {
+   const char *tag;
+   void (*begin)(struct at_function_context_t *ctx);
+   void (*data)(struct at_function_context_t *ctx, struct range_t *data);
+   void (*end)(struct at_function_result *result, struct at_function_context_t *ctx);
+   void *user_data;
+};
+
+void at_stream_command_add(
+      struct at_context_t *ctx,
+      const struct at_stream_command_t *command);
+
+// Makes a registered standalone or status command cacheable: its output and
+// result are captured, later calls replay them without running the handler.
+// Entries expire 'ttl_us' after capture, measured with the at_set_clock()
+// clock (a TTL entry is never reused without one), never for 0, and
+// at_invalidate() drops all entries of a tag. Only successful results that
+// were not deferred are cached, and only replayed with the S3, S4 and
+// character set they were captured with, while the same handler is found
+// (a registry publish or a new overlay command drops them).
+struct at_cache_stats_t {
+   unsigned long long hits;
+   unsigned long long misses;
+};
+
+void at_command_cache(
+      struct at_context_t *ctx,
+      const char *tag,
+      enum AT_CMD_TYPE cmd_type,
+      unsigned long long ttl_us);
+
+void at_invalidate(struct at_context_t *ctx, const char *tag);
+void at_get_cache_stats(struct at_context_t *ctx, struct at_cache_stats_t *stats);
+
+void at_set_command_lookup(
+      struct at_context_t *ctx,
+      const struct at_command_t *(*lookup)(void *user, const struct range_t *tag, enum AT_CMD_TYPE cmd_type),
+      void *user);
+
+// Runs commands that no handler takes, instead of failing them with
+// "operation not supported". The parameters are the whole command, e.g.
+// "+cops?" (tags are lowercase), user data is 'user'.
+void at_set_command_fallback(
+      struct at_context_t *ctx,
+      void (*fallback)(struct at_function_result*, struct at_function_context_t*),
+      void *user);
+
 void at_process_input(
       struct at_context_t *ctx,
       struct range_t *data);
 
+// Runs 'count' fragments, e.g. from readv() or a wrapped ring buffer, as one
+// stream: lines may span fragments, immediate echo is appended in one pass
+// and the flush at the end of input happens once for the whole batch.
+void at_process_inputv(
+      struct at_context_t *ctx,
+      const struct range_t *iov,
+      size_t count);
+
+// A handler that cannot answer right away calls at_defer() and returns, its
+// result is then ignored. The context holds further input until at_resume()
+// supplies the result, so responses keep their order. The parameters stay
+// valid until at_resume().
+void at_defer(struct at_function_context_t *fctx);
+bool at_is_deferred(struct at_context_t *ctx);
+void at_resume(struct at_context_t *ctx, const struct at_function_result *result);
+
 void at_context_free(struct at_context_t *ctx);
 
 void at_flush_output(struct at_context_t *ctx);
 
+void at_set_echo_policy(struct at_context_t *ctx, enum AT_ECHO_POLICY policy);
+
+// Set by AT+CSCS as well, IRA by default. codec.h converts strings between
+// the character set and UTF-8.
+void at_set_charset(struct at_context_t *ctx, enum AT_CHARSET charset);
+enum AT_CHARSET at_get_charset(struct at_context_t *ctx);
+
+void at_set_flush_policy(struct at_context_t *ctx, enum AT_FLUSH_POLICY policy);
+
+// Limits of AT_FLUSH_COALESCE: pending output goes out once it reaches
+// 'bytes' or its oldest byte waited 'time_us' by the at_set_clock() clock.
+// 0 sets no limit, with neither output waits for a full buffer.
+void at_set_flush_budget(struct at_context_t *ctx, unsigned int bytes, unsigned int time_us);
+
+// Monotonic time in microseconds, used by the flush time budget and the TTL
+// of cached responses. Without a clock output has no time limit and cached
+// responses with a TTL are not used.
+void at_set_clock(struct at_context_t *ctx, unsigned long long (*now_us)(void));
+
+// Called periodically by the driver under AT_FLUSH_COALESCE, flushes output
+// that used up its time budget. Without a clock it flushes whatever pends.
+void at_flush_poll(struct at_context_t *ctx);
+
+void at_set_output_hook(
+      struct at_context_t *ctx,
+      void (*output)(void *user, struct range_t *data),
+      void *user);
+
+void at_set_record_hook(
+      struct at_context_t *ctx,
+      void (*record)(void *user, const struct at_record_event_t *event),
+      void *user);
+
 iterator_t at_get_parameter(iterator_t begin, iterator_t end, struct range_t *result);
 
 bool at_get_in_quota_value(struct range_t *range, struct range_t *result);
@@ -66,13 +261,65 @@ void at_return_not_found_error(struct at_function_result *r);
 void at_return_invalid_index_error(struct at_function_result *r);
 void at_return_operation_not_supported_error(struct at_function_result *r);
 void at_return_operation_not_allowed_error(struct at_function_result *r);
+void at_return_memory_full_error(struct at_function_result *r);
 
 void at_add_unsolicited(struct at_context_t *ctx, const char *prefix, const char *text);
 void at_add_unsolicited_line(struct at_context_t *ctx, const char *text);
 
+// Queue for unsolicited results on slow links. A queued URC replaces a
+// pending one with the same prefix, a full queue drops the oldest URC of the
+// lowest priority, or the new one when everything pending is more important.
+// at_send_unsolicited() writes up to 'max' of them, the highest priority
+// first, whenever the link has room; it returns how many it wrote.
+enum AT_URC_PRIORITY {
+   AT_URC_LOW = 0,
+   AT_URC_NORMAL = 1,
+   AT_URC_HIGH = 2
+};
+
+struct at_urc_stats_t {
+   unsigned long long queued;
+   unsigned long long merged;
+   unsigned long long dropped;
+   unsigned long long sent;
+};
+
+bool at_set_urc_queue(struct at_context_t *ctx, unsigned int capacity);
+
+void at_queue_unsolicited(
+      struct at_context_t *ctx,
+      const char *prefix,
+      const char *text,
+      enum AT_URC_PRIORITY priority);
+
+unsigned int at_send_unsolicited(struct at_context_t *ctx, unsigned int max);
+unsigned int at_pending_unsolicited(struct at_context_t *ctx);
+void at_get_urc_stats(struct at_context_t *ctx, struct at_urc_stats_t *stats);
+
+// Builder of "+TAG: field,field" response lines that formats the fields
+// straight into the output buffer and places the commas. Strings are quoted,
+// '"', backslash and control characters escaped as \HH. at_response_row() ends
+// a row and starts the next one of a list response with the same tag.
+struct at_response_t {
+   struct at_context_t *ctx;
+   const char *tag;
+   unsigned int fields;
+};
+
+void at_response_begin(struct at_response_t *r, struct at_context_t *ctx, const char *tag);
+void at_response_int(struct at_response_t *r, int value);
+void at_response_uint(struct at_response_t *r, unsigned int value);
+void at_response_hex(struct at_response_t *r, unsigned int value, unsigned int digits);
+void at_response_string(struct at_response_t *r, const char *text);
+void at_response_string_range(struct at_response_t *r, const struct range_t *text);
+void at_response_raw(struct at_response_t *r, const char *text);
+void at_response_row(struct at_response_t *r);
+void at_response_end(struct at_response_t *r);
+
 void at_append_line(struct at_context_t *ctx, const char *text);
 void at_append_int(struct at_context_t *ctx, int value);
 void at_append_text(struct at_context_t *ctx, const char *text);
 void at_append_char(struct at_context_t *ctx, unsigned char c);
+void at_append_range(struct at_context_t *ctx, struct range_t *range);
 
 #endif
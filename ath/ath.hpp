@@ -0,0 +1,359 @@
+#ifndef ATH_HPP
+#define ATH_HPP
+
+// Header-only C++17 layer over the C API.
+//
+// Handlers take an ath::call& and are registered without std::function:
+// plain functions and captureless lambdas are stored as function pointers,
+// capturing lambdas and other callables are referenced (they must outlive
+// the context), member functions are bound with add<&T::method>(...).
+//
+// Command tables are built and sorted at compile time:
+//
+//    static constexpr auto commands = ath::make_command_table({
+//       { "+cpin", AT_ASSIGNMENT_COMMAND, ath::handler<cpin_set> },
+//       { "+cpin", AT_STATUS_COMMAND, ath::handler<cpin_get> },
+//    });
+//    ctx.set_commands(commands);
+//
+// Tags must be lowercase and every (tag, type) pair unique, otherwise the
+// table does not compile when declared constexpr.
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+
+extern "C" {
+#include "at.h"
+}
+
+namespace ath {
+
+using handler_function = void (*)(at_function_result*, at_function_context_t*);
+
+class call {
+public:
+   call(at_function_result *result, at_function_context_t *fctx) noexcept
+      : result_(result), fctx_(fctx) {
+   }
+
+   std::string_view parameters() const noexcept {
+      return view(fctx_->parameters);
+   }
+
+   // Comma separated parameter, empty when the index is out of range
+   std::string_view parameter(std::size_t index) const noexcept {
+      iterator_t it = fctx_->parameters.begin;
+      iterator_t end = fctx_->parameters.end;
+      range_t r = range_empty();
+
+      for (std::size_t i = 0; i <= index; ++i) {
+         if (i != 0 && it == end)
+            return std::string_view();
+         it = at_get_parameter(it, end, &r);
+      }
+
+      return view(r);
+   }
+
+   std::size_t parameter_count() const noexcept {
+      if (range_is_empty(&fctx_->parameters))
+         return 0;
+
+      std::size_t count = 1;
+      for (iterator_t it = fctx_->parameters.begin; it != fctx_->parameters.end; ++it) {
+         if (*it == ',')
+            count++;
+      }
+      return count;
+   }
+
+   // Value of a "quoted" parameter without the quotes
+   static bool unquote(std::string_view value, std::string_view &result) noexcept {
+      if (value.size() < 2 || value.front() != '"' || value.back() != '"')
+         return false;
+      result = value.substr(1, value.size() - 2);
+      return true;
+   }
+
+   void ok() noexcept {
+      at_ok_result(result_);
+   }
+
+   void error(int code, const char *detailed) noexcept {
+      result_->result = false;
+      result_->code = code;
+      result_->detailed = detailed;
+   }
+
+   void not_allowed() noexcept {
+      at_return_operation_not_allowed_error(result_);
+   }
+
+   void not_supported() noexcept {
+      at_return_operation_not_supported_error(result_);
+   }
+
+   void append(std::string_view text) noexcept {
+      range_t r = range_create_cnt(
+               reinterpret_cast<iterator_t>(const_cast<char*>(text.data())),
+               static_cast<unsigned int>(text.size()));
+      at_append_range(fctx_->context, &r);
+   }
+
+   void append(int value) noexcept {
+      at_append_int(fctx_->context, value);
+   }
+
+   // Ends the line with S3 and S4, like at_append_line()
+   void append_line(std::string_view text) noexcept {
+      append(text);
+      at_append_line(fctx_->context, "");
+   }
+
+   at_context_t *context() const noexcept {
+      return fctx_->context;
+   }
+
+   at_function_result *result() const noexcept {
+      return result_;
+   }
+
+   static std::string_view view(const range_t &r) noexcept {
+      return std::string_view(reinterpret_cast<const char*>(r.begin), r.end - r.begin);
+   }
+
+private:
+   at_function_result *result_;
+   at_function_context_t *fctx_;
+};
+
+namespace detail {
+
+template <void (*F)(call&)>
+void function_trampoline(at_function_result *r, at_function_context_t *f) {
+   call c(r, f);
+   F(c);
+}
+
+inline void pointer_trampoline(at_function_result *r, at_function_context_t *f) {
+   call c(r, f);
+   reinterpret_cast<void (*)(call&)>(f->user_data)(c);
+}
+
+template <typename F>
+void callable_trampoline(at_function_result *r, at_function_context_t *f) {
+   call c(r, f);
+   (*static_cast<F*>(f->user_data))(c);
+}
+
+template <auto Method, typename T>
+void member_trampoline(at_function_result *r, at_function_context_t *f) {
+   call c(r, f);
+   (static_cast<T*>(f->user_data)->*Method)(c);
+}
+
+template <typename Output>
+void output_trampoline(void *user, range_t *data) {
+   (*static_cast<Output*>(user))(call::view(*data));
+}
+
+}
+
+// C handler for a function taking ath::call&, usable in constexpr tables
+template <void (*F)(call&)>
+inline constexpr handler_function handler = &detail::function_trampoline<F>;
+
+struct command {
+   std::string_view tag;
+   AT_CMD_TYPE type;
+   handler_function function;
+};
+
+template <std::size_t N>
+class command_table {
+public:
+   constexpr explicit command_table(const command (&commands)[N])
+      : commands_{}, entries_{} {
+
+      for (std::size_t i = 0; i < N; ++i) {
+
+         for (char c : commands[i].tag) {
+            if (c >= 'A' && c <= 'Z')
+               throw "command tag must be lowercase";
+         }
+
+         if (commands[i].function == nullptr)
+            throw "command handler missing";
+
+         // Insertion sort by (tag, type)
+         std::size_t j = i;
+         while (j > 0 && less(commands[i], commands_[j - 1])) {
+            commands_[j] = commands_[j - 1];
+            --j;
+         }
+         commands_[j] = commands[i];
+      }
+
+      for (std::size_t i = 1; i < N; ++i) {
+         if (less(commands_[i - 1], commands_[i]) == false)
+            throw "duplicate command tag and type";
+      }
+
+      for (std::size_t i = 0; i < N; ++i) {
+         entries_[i].tag = commands_[i].tag.data();
+         entries_[i].cmd_type = commands_[i].type;
+         entries_[i].function = commands_[i].function;
+         entries_[i].user_data = nullptr;
+      }
+   }
+
+   constexpr const at_command_t *find(std::string_view tag, AT_CMD_TYPE type) const noexcept {
+      std::size_t first = 0;
+      std::size_t last = N;
+      command key{ tag, type, nullptr };
+
+      while (first < last) {
+         std::size_t middle = first + (last - first) / 2;
+
+         if (less(commands_[middle], key)) {
+            first = middle + 1;
+         } else {
+            last = middle;
+         }
+      }
+
+      if (first < N && less(key, commands_[first]) == false)
+         return &entries_[first];
+
+      return nullptr;
+   }
+
+   constexpr std::size_t size() const noexcept {
+      return N;
+   }
+
+private:
+   static constexpr bool less(const command &a, const command &b) noexcept {
+      int c = a.tag.compare(b.tag);
+      return c < 0 || (c == 0 && a.type < b.type);
+   }
+
+   command commands_[N];
+   at_command_t entries_[N];
+};
+
+template <std::size_t N>
+constexpr command_table<N> make_command_table(const command (&commands)[N]) {
+   return command_table<N>(commands);
+}
+
+namespace detail {
+
+template <std::size_t N>
+const at_command_t *table_lookup(void *user, const range_t *tag, AT_CMD_TYPE type) {
+   return static_cast<const command_table<N>*>(user)->find(call::view(*tag), type);
+}
+
+}
+
+class context {
+public:
+   context() : ctx_(nullptr) {
+      at_context_init(&ctx_, nullptr);
+      if (ctx_ == nullptr)
+         throw std::bad_alloc();
+   }
+
+   // Output is any callable taking std::string_view, referenced not copied
+   template <typename Output>
+   explicit context(Output &output) : context() {
+      set_output(output);
+   }
+
+   ~context() {
+      if (ctx_ != nullptr)
+         at_context_free(ctx_);
+   }
+
+   context(const context&) = delete;
+   context &operator=(const context&) = delete;
+
+   context(context &&other) noexcept : ctx_(other.ctx_) {
+      other.ctx_ = nullptr;
+   }
+
+   context &operator=(context &&other) noexcept {
+      if (this != &other) {
+         if (ctx_ != nullptr)
+            at_context_free(ctx_);
+         ctx_ = other.ctx_;
+         other.ctx_ = nullptr;
+      }
+      return *this;
+   }
+
+   template <typename Output>
+   void set_output(Output &output) {
+      at_set_output_hook(ctx_, &detail::output_trampoline<Output>, std::addressof(output));
+   }
+
+   // Tags are not copied, pass string literals or storage outliving the context
+   template <typename F>
+   void add(const char *tag, AT_CMD_TYPE type, F &&handler) {
+      using T = std::remove_reference_t<F>;
+
+      if constexpr (std::is_convertible_v<T, void (*)(call&)>) {
+         void (*function)(call&) = handler;
+         at_command_add_ex(ctx_, tag, type, &detail::pointer_trampoline, reinterpret_cast<void*>(function));
+      } else {
+         static_assert(std::is_lvalue_reference_v<F>,
+                       "capturing handlers are referenced, pass an object that outlives the context");
+         at_command_add_ex(ctx_, tag, type, &detail::callable_trampoline<T>,
+                           const_cast<void*>(static_cast<const void*>(std::addressof(handler))));
+      }
+   }
+
+   template <auto Method, typename T>
+   void add(const char *tag, AT_CMD_TYPE type, T &object) {
+      at_command_add_ex(ctx_, tag, type, &detail::member_trampoline<Method, T>, std::addressof(object));
+   }
+
+   // Table commands take precedence over commands added with add()
+   template <std::size_t N>
+   void set_commands(const command_table<N> &table) {
+      at_set_command_lookup(ctx_, &detail::table_lookup<N>, const_cast<command_table<N>*>(&table));
+   }
+
+   void input(std::string_view data) {
+      range_t r = range_create_cnt(
+               reinterpret_cast<iterator_t>(const_cast<char*>(data.data())),
+               static_cast<unsigned int>(data.size()));
+      at_process_input(ctx_, &r);
+   }
+
+   void flush() {
+      at_flush_output(ctx_);
+   }
+
+   void unsolicited(const char *prefix, const char *text) {
+      at_add_unsolicited(ctx_, prefix, text);
+   }
+
+   void unsolicited_line(const char *text) {
+      at_add_unsolicited_line(ctx_, text);
+   }
+
+   at_context_t *get() const noexcept {
+      return ctx_;
+   }
+
+private:
+   at_context_t *ctx_;
+};
+
+}
+
+#endif // ATH_HPP
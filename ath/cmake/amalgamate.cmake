@@ -0,0 +1,59 @@
+cmake_minimum_required(VERSION 3.9)
+
+# Concatenates the library sources into one translation unit. Every local
+# header is inlined where it is first included and dropped afterwards.
+#
+# cmake -DSOURCES=a.c|b.c -DINCLUDE_DIRS=dir1|dir2 -DOUTPUT=ath.c -P amalgamate.cmake
+
+string(REPLACE "|" ";" SOURCES "${SOURCES}")
+string(REPLACE "|" ";" INCLUDE_DIRS "${INCLUDE_DIRS}")
+
+set(result "/* ath single-file amalgamation, generated file */\n")
+
+foreach(source ${SOURCES})
+   get_filename_component(name "${source}" NAME)
+   file(READ "${source}" text)
+   string(APPEND result "\n/* ${name} */\n${text}")
+endforeach()
+
+set(included "")
+
+while(TRUE)
+   string(REGEX MATCH "#include \"([^\"]+)\"[^\n]*\n" match "${result}")
+
+   if(NOT match)
+      break()
+   endif()
+
+   set(header "${CMAKE_MATCH_1}")
+
+   string(FIND "${result}" "${match}" position)
+   string(LENGTH "${match}" length)
+   math(EXPR after_position "${position} + ${length}")
+   string(SUBSTRING "${result}" 0 ${position} before)
+   string(SUBSTRING "${result}" ${after_position} -1 after)
+
+   list(FIND included "${header}" found)
+
+   if(found EQUAL -1)
+      list(APPEND included "${header}")
+
+      set(path "")
+      foreach(dir ${INCLUDE_DIRS})
+         if(NOT path AND EXISTS "${dir}/${header}")
+            set(path "${dir}/${header}")
+         endif()
+      endforeach()
+
+      if(NOT path)
+         message(FATAL_ERROR "amalgamate: cannot find ${header}")
+      endif()
+
+      file(READ "${path}" content)
+      set(result "${before}/* ${header} */\n${content}${after}")
+   else()
+      set(result "${before}${after}")
+   endif()
+endwhile()
+
+file(WRITE "${OUTPUT}" "${result}")
@@ -0,0 +1,21 @@
+# ath_generate_commands(NAME MANIFEST)
+#
+# Generates NAME.c and NAME.h in the current binary directory from a command
+# manifest with ath-gen, and sets NAME_SOURCES in the caller scope. A bad or
+# duplicate manifest entry fails the build.
+
+function(ath_generate_commands name manifest)
+
+   get_filename_component(manifest "${manifest}" ABSOLUTE)
+   set(output "${CMAKE_CURRENT_BINARY_DIR}/${name}")
+
+   add_custom_command(
+      OUTPUT "${output}.c" "${output}.h"
+      COMMAND ath-gen -n "${name}" -o "${output}" "${manifest}"
+      DEPENDS ath-gen "${manifest}"
+      COMMENT "Generating ${name} command dispatcher from ${manifest}"
+      VERBATIM)
+
+   set(${name}_SOURCES "${output}.c" "${output}.h" PARENT_SCOPE)
+
+endfunction()
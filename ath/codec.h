@@ -0,0 +1,65 @@
+#ifndef AT_CODEC_H
+#define AT_CODEC_H
+
+#include "at.h"
+
+// Hex and base64 codecs for binary payloads of parameters and responses.
+// Decoders accept upper and lower case hex and padded standard base64, they
+// check every character and return false on invalid input. The output may
+// be the input itself. Encoders write upper case hex and padded base64.
+// Large blocks go through SSSE3 or AVX2 kernels where the CPU has them.
+
+bool at_hex_decode(const struct range_t *in, unsigned char *out, unsigned int *size);
+bool at_base64_decode(const struct range_t *in, unsigned char *out, unsigned int *size);
+
+// Decode a quoted parameter, see at_get_in_quota_value, in place.
+// 'result' gets the decoded bytes.
+bool at_hex_decode_quoted(struct range_t *parameter, struct range_t *result);
+bool at_base64_decode_quoted(struct range_t *parameter, struct range_t *result);
+
+// Return the number of characters written, 2 * size and 4 * ceil(size / 3)
+unsigned int at_hex_encode(const unsigned char *data, unsigned int size, unsigned char *out);
+unsigned int at_base64_encode(const unsigned char *data, unsigned int size, unsigned char *out);
+
+// Encode straight into the output buffer of the context
+void at_append_hex(struct at_context_t *ctx, const unsigned char *data, unsigned int size);
+void at_append_base64(struct at_context_t *ctx, const unsigned char *data, unsigned int size);
+
+// Hex encoded UCS2 of AT+CSCS="UCS2": UTF-16 code units, big endian, four
+// hex digits each, surrogate pairs above U+FFFF. The decoder writes UTF-8
+// and checks the digits and the surrogate pairs, the output may be the
+// input. The encoder reads UTF-8, writes U+FFFD for invalid sequences and
+// needs room for 4 * size characters, it returns the number written. Runs
+// of ASCII go through SSSE3 or AVX2 kernels.
+bool at_ucs2_hex_decode(const struct range_t *in, unsigned char *out, unsigned int *size);
+unsigned int at_ucs2_hex_encode(const unsigned char *utf8, unsigned int size, unsigned char *out);
+
+// A string in the TE character set of the context (see at_set_charset) to
+// UTF-8. Returns false on invalid input or when it needs more than
+// 'capacity' bytes, twice the input size always does. GSM is the unpacked
+// default alphabet with its extension table.
+bool at_charset_decode(
+      struct at_context_t *ctx,
+      const struct range_t *in,
+      unsigned char *out,
+      unsigned int capacity,
+      unsigned int *size);
+
+// Quoted parameter, see at_get_in_quota_value. The output may be the
+// parameter itself unless the character set is GSM.
+bool at_charset_decode_quoted(
+      struct at_context_t *ctx,
+      struct range_t *parameter,
+      unsigned char *out,
+      unsigned int capacity,
+      struct range_t *result);
+
+// UTF-8 text converted to the TE character set of the context, straight
+// into the output buffer. Characters IRA or GSM cannot represent become '?'.
+void at_append_charset(struct at_context_t *ctx, const unsigned char *utf8, unsigned int size);
+
+// Quoted string field of a response in the TE character set, IRA and GSM
+// escaped as by at_response_string()
+void at_response_charset_string(struct at_response_t *r, const char *utf8);
+
+#endif // AT_CODEC_H
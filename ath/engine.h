@@ -0,0 +1,78 @@
+#ifndef AT_ENGINE_H
+#define AT_ENGINE_H
+
+#include "at.h"
+
+// Multi-threaded runtime for many channels. Channels are sharded over event
+// loop threads, one per core by default, and each context only ever runs
+// on the thread of its shard. Handlers that block or take long hand their
+// work to a work-stealing pool with at_engine_defer(); the channel holds
+// further input until the work is done, so responses keep their order.
+
+struct at_engine_t;
+struct at_channel_t;
+struct at_buffer_pool_t;
+
+struct at_engine_config_t {
+   unsigned int shards;   // event loop threads, 0 for one per online CPU
+   unsigned int workers;  // handler pool threads, 0 for one per shard
+   bool pin;              // pin shards round robin to the CPUs the process may use
+   struct at_buffer_pool_t *buffer_pool;  // output buffers of the channels, 0 for their own
+};
+
+struct at_engine_stats_t {
+   unsigned long long channels;
+   unsigned long long inputs;
+   unsigned long long deferred;
+   unsigned long long stolen;
+};
+
+void at_engine_config_init(struct at_engine_config_t *config);
+
+// Returns 0 if the memory or any of the threads can not be had
+struct at_engine_t *at_engine_create(const struct at_engine_config_t *config);
+
+// Stops the threads, frees every channel and closes their descriptors, handles
+// not released yet included
+void at_engine_free(struct at_engine_t *engine);
+
+unsigned int at_engine_shards(struct at_engine_t *engine);
+
+// Hands a connected descriptor over to the engine, which makes it
+// non-blocking, reads commands from it, writes responses to it and closes it
+// on end of input. Responses the peer does not take yet are queued, and the
+// channel reads no further commands until they went out. 'setup' runs on the
+// channel thread before the first input, to add commands to the context. The
+// handle stays valid until at_channel_release().
+struct at_channel_t *at_engine_add_channel(
+      struct at_engine_t *engine,
+      int fd,
+      void (*setup)(void *user, struct at_context_t *ctx),
+      void *user);
+
+// Runs 'function' on the channel thread, e.g. to post unsolicited messages.
+// Once the channel is closed it still runs, with a null 'ctx', to release 'arg'.
+void at_channel_post(
+      struct at_channel_t *channel,
+      void (*function)(void *arg, struct at_context_t *ctx),
+      void *arg);
+
+// Gives up the handle, the channel is freed once it is closed and no posted
+// function or deferred work refers to it. Null is ignored.
+void at_channel_release(struct at_channel_t *channel);
+
+unsigned int at_channel_shard(struct at_channel_t *channel);
+
+// Called from a handler: defers the command and runs 'work' on the pool.
+// 'done', if set, runs afterwards on the channel thread, before the result
+// is appended, to add response lines and release 'arg'. If the channel was
+// closed meanwhile 'done' gets a null 'ctx' and only releases 'arg'.
+void at_engine_defer(
+      struct at_function_context_t *fctx,
+      void (*work)(void *arg, struct at_function_result *result),
+      void (*done)(void *arg, struct at_context_t *ctx),
+      void *arg);
+
+void at_engine_get_stats(struct at_engine_t *engine, struct at_engine_stats_t *stats);
+
+#endif // AT_ENGINE_H
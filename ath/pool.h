@@ -0,0 +1,55 @@
+#ifndef AT_POOL_H
+#define AT_POOL_H
+
+#include "at.h"
+
+// Output buffers shared by many contexts. A context created with a pool has
+// no output buffer of its own; it takes one from the pool when it appends
+// the first byte of a response or URC and returns it when the output is
+// flushed, so idle channels hold no output memory at all. Contexts on any
+// threads may share a pool, buffers are handed out under a lock. When no
+// buffer can be allocated the output is dropped and the final result of the
+// command line becomes a "Memory full" error (+CME ERROR: 20).
+
+struct at_buffer_pool_t;
+
+struct at_buffer_pool_stats_t {
+   unsigned long long taken;      // buffers handed to contexts
+   unsigned long long allocated;  // taken buffers that were not idle in the pool
+   unsigned long long large;      // large buffers taken
+   unsigned long long failed;     // out of memory, output was dropped
+   unsigned int in_use;
+   unsigned int peak_in_use;
+   unsigned int idle;             // returned buffers kept for reuse
+   size_t bytes;                  // buffer memory in use or idle
+};
+
+// Regular buffers have 'buffer_size' bytes, at least AT_OUTPUT_BUFFER_SIZE.
+// Large buffers of up to 'large_size' bytes are allocated on demand and
+// freed when returned. At most 'max_idle' regular buffers are kept for reuse.
+// Memory comes from the default allocator, which has to be thread safe when
+// contexts on several threads share the pool.
+struct at_buffer_pool_t *at_buffer_pool_create(unsigned int buffer_size, unsigned int large_size, unsigned int max_idle);
+
+// No context may use the pool anymore
+void at_buffer_pool_free(struct at_buffer_pool_t *pool);
+
+void at_buffer_pool_get_stats(struct at_buffer_pool_t *pool, struct at_buffer_pool_stats_t *stats);
+
+// Contexts cloned from a pooled context share its pool
+void at_context_init_pooled(
+      struct at_context_t **ctx,
+      void (*flush)(struct range_t*),
+      struct at_buffer_pool_t *pool);
+
+// Makes room for 'size' more bytes of output without a flush, moving the
+// pending output to a large buffer of the pool if needed, e.g. before a
+// response that should go out in one piece. The buffer is returned on the
+// next flush. Returns false if there is no room and none can be taken.
+bool at_reserve_output(struct at_context_t *ctx, unsigned int size);
+
+// Bytes of input, command token and output buffers the context holds now,
+// with nothing pending the buffer memory of an idle channel
+size_t at_get_buffer_bytes(struct at_context_t *ctx);
+
+#endif // AT_POOL_H
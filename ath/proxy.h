@@ -0,0 +1,41 @@
+#ifndef AT_PROXY_H
+#define AT_PROXY_H
+
+#include "at.h"
+
+// Passthrough to a downstream AT device, e.g. a real modem. Commands that no
+// local handler takes are deferred and forwarded downstream one at a time,
+// queued in order from all attached contexts. Response lines are relayed to
+// the context that sent the command, spliced from pipes straight to its
+// upstream descriptor where the kernel allows, the final result resumes the
+// command. Lines arriving while nothing is in flight are relayed to every
+// attached context as unsolicited results. Everything runs on the caller's
+// thread, the contexts of a proxy have to share it.
+
+struct at_proxy_t;
+
+struct at_proxy_stats_t {
+   unsigned long long forwarded;
+   unsigned long long rejected;  // queue full or downstream write failed
+   unsigned long long spliced;   // response bytes moved by splice()
+   unsigned long long copied;    // response bytes copied into the output
+   unsigned long long unsolicited;
+};
+
+// 'queue_size' bounds the forwarded commands waiting or in flight, further
+// ones fail at once. The descriptor stays owned by the caller.
+struct at_proxy_t *at_proxy_create(int downstream, unsigned int queue_size);
+void at_proxy_free(struct at_proxy_t *proxy);
+
+// 'upstream' is the descriptor the context output goes to, -1 relays
+// responses through the output buffer. Detach before freeing the context.
+bool at_proxy_attach(struct at_proxy_t *proxy, struct at_context_t *ctx, int upstream);
+void at_proxy_detach(struct at_proxy_t *proxy, struct at_context_t *ctx);
+
+// Call when the downstream descriptor is readable. Returns false on end of
+// input or a read error.
+bool at_proxy_process(struct at_proxy_t *proxy);
+
+void at_proxy_get_stats(struct at_proxy_t *proxy, struct at_proxy_stats_t *stats);
+
+#endif // AT_PROXY_H
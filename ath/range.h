@@ -3,16 +3,8 @@
 
 #define iterator_t unsigned char *
 
-#ifndef bool
-#define bool int
-#endif
-
-#ifndef true
-#define true 1
-#endif
-
-#ifndef false
-#define false 0
+#ifndef __cplusplus
+#include <stdbool.h>
 #endif
 
 struct range_t {
@@ -24,12 +16,29 @@ void range_init(struct range_t *range);
 
 struct range_t range_create_cnt(iterator_t begin, unsigned int size);
 struct range_t range_empty(void);
-struct range_t range_create_it(iterator_t begin, iterator_t end);
-bool range_is_empty(struct range_t *range);
 
-unsigned int range_size(struct range_t *range);
+// Per byte helpers of the parser loops, inline so they never cost a call.
+// range.c still exports them for code built against older headers.
+
+inline struct range_t range_create_it(iterator_t begin, iterator_t end) {
+   struct range_t r;
+   r.begin = begin;
+   r.end = end;
+   return r;
+}
+
+inline bool range_is_empty(struct range_t *range) {
+   return range->begin == range->end;
+}
+
+inline unsigned int range_size(struct range_t *range) {
+   return range->end - range->begin;
+}
 
-bool is_digit(unsigned char v);
+// Returns int as the exported is_digit always did
+inline int is_digit(unsigned char v) {
+   return v >= '0' && v <= '9';
+}
 
 bool range_convert_to_int(struct range_t *range, int *result);
 
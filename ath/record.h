@@ -0,0 +1,24 @@
+#ifndef AT_RECORD_H
+#define AT_RECORD_H
+
+#include "at.h"
+
+struct at_recorder_t;
+struct at_record_reader_t;
+
+struct at_record_t {
+   enum AT_RECORD_TYPE type;
+   unsigned long long timestamp_ns;
+   struct range_t data;
+   struct range_t prefix;
+};
+
+struct at_recorder_t *at_recorder_open(const char *path);
+void at_recorder_attach(struct at_recorder_t *recorder, struct at_context_t *ctx);
+void at_recorder_close(struct at_recorder_t *recorder);
+
+struct at_record_reader_t *at_record_reader_open(const char *path);
+bool at_record_read(struct at_record_reader_t *reader, struct at_record_t *record);
+void at_record_reader_close(struct at_record_reader_t *reader);
+
+#endif // AT_RECORD_H
@@ -0,0 +1,52 @@
+#ifndef AT_REGISTRY_H
+#define AT_REGISTRY_H
+
+#include "at.h"
+
+struct at_registry_t;
+struct at_command_set_t;
+
+// Immutable, reference counted command set that any number of contexts, on
+// any threads, share. Tags are copied and have to be lowercase.
+struct at_command_set_t *at_command_set_create(const struct at_command_t *commands, unsigned int count);
+struct at_command_set_t *at_command_set_retain(struct at_command_set_t *set);
+void at_command_set_release(struct at_command_set_t *set);
+
+// The context holds a reference until it is freed or gets another set, 0
+// drops it. Commands of the context itself form an overlay on top of it.
+void at_set_command_set(struct at_context_t *ctx, struct at_command_set_t *set);
+
+// Command set that can be replaced while channels keep dispatching from it.
+// Each published set is an immutable snapshot; dispatch reads the current
+// one without locks, a writer replaces it with one atomic pointer swap. A
+// replaced snapshot is freed, and its 'reclaim' callback run, once no
+// dispatch that might still use it is running (epoch based reclamation).
+
+struct at_registry_t *at_registry_create(void);
+
+// No context may be attached to the registry anymore
+void at_registry_free(struct at_registry_t *registry);
+
+// Publishes 'count' commands, tags are copied and have to be lowercase.
+// Returns the version of the new snapshot, 0 when out of memory. Writers
+// may publish from any thread.
+unsigned long long at_registry_publish(
+      struct at_registry_t *registry,
+      const struct at_command_t *commands,
+      unsigned int count,
+      void (*reclaim)(void *arg),
+      void *arg);
+
+unsigned long long at_registry_version(struct at_registry_t *registry);
+
+// Frees replaced snapshots that no dispatch uses anymore, returns how many
+// are still waiting. Publishing does this too.
+unsigned int at_registry_reclaim(struct at_registry_t *registry);
+
+// Commands are looked up in the lookup hook, the commands of the context
+// itself, the registry, the command set and the built-in commands, in that
+// order, so each of them can override the ones after it. A context is attached to at most one
+// registry, until it is freed.
+bool at_registry_attach(struct at_registry_t *registry, struct at_context_t *ctx);
+
+#endif // AT_REGISTRY_H
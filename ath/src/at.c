@@ -1,26 +1,227 @@
 #include "at.h"
 #include "at_internal.h"
+#include "result_internal.h"
+#include "lexer_internal.h"
+#include "registry_internal.h"
+#include "pool_internal.h"
 
 struct at_context_t {
    void (*flush)(struct range_t*);
+   void (*output)(void *user, struct range_t *data);
+   void *output_user;
    unsigned char *output_buffer;
    iterator_t outputbuff_iterator;
+   iterator_t outputbuff_end;
+   struct at_buffer_pool_t *buffer_pool;
+   bool output_lost;
+   bool output_borrowed;
    struct at_command_register_t *first;
+   struct at_stream_register_t *first_stream;
+   const struct at_stream_command_t *stream;
+   struct at_cache_entry_t *first_cache;
+   struct at_cache_entry_t *capture;
+   struct at_cache_stats_t cache_stats;
+   struct at_urc_queue_t *urc_queue;
+   struct at_function_context_t stream_context;
+   const struct at_command_t *(*lookup)(void *user, const struct range_t *tag, enum AT_CMD_TYPE cmd_type);
+   void *lookup_user;
+   struct at_registry_reader_t *registry_reader;
+   struct at_command_set_t *command_set;
+   void (*fallback)(struct at_function_result*, struct at_function_context_t*);
+   void *fallback_user;
    void *state;
    unsigned char *input_buffer;
    iterator_t inputbuff_iterator;
    unsigned char *last_input_buffer;
    iterator_t lastinbuff_iterator;
    int cmee_level;
+   enum AT_CHARSET charset;
+   const unsigned short *classes;
+   unsigned short *own_classes;
+   unsigned char s3;
+   unsigned char s4;
+   unsigned char s5;
+   struct at_lexer_t lexer;
    bool echo;
+   bool verbose;
+   bool quiet;
+   enum AT_ECHO_POLICY echo_policy;
+   enum AT_FLUSH_POLICY flush_policy;
+   unsigned int flush_budget_bytes;
+   unsigned int flush_budget_us;
+   unsigned long long (*clock)(void);
+   unsigned long long pending_since;
+   bool pending_timer;
+   bool in_input;
+   bool deferred;
+   unsigned char *held_input;
+   unsigned int held_input_size;
+   unsigned int held_input_capacity;
+   bool held_input_echoed;
+   unsigned char *held_line;
+   unsigned int held_line_size;
+   unsigned char *line_storage;
+   unsigned int line_storage_size;
+   struct at_allocator_t allocator;
+   struct at_alloc_stats_t alloc_stats;
+   bool alloc_guard;
+   void (*alloc_guard_hook)(void *user, size_t size);
+   void *alloc_guard_user;
+   void (*record)(void *user, const struct at_record_event_t *event);
+   void *record_user;
 };
 
+static void *at_malloc_hook(void *user_data, size_t size) {
+   (void)user_data;
+   return malloc(size);
+}
+
+static void at_free_hook(void *user_data, void *p, size_t size) {
+   (void)user_data;
+   (void)size;
+   free(p);
+}
+
+static struct at_allocator_t at_default_allocator = { at_malloc_hook, at_free_hook, 0 };
+
+void at_set_default_allocator(const struct at_allocator_t *allocator) {
+
+   if (allocator != 0) {
+      at_default_allocator = *allocator;
+   } else {
+      at_default_allocator.alloc = at_malloc_hook;
+      at_default_allocator.free = at_free_hook;
+      at_default_allocator.user_data = 0;
+   }
+}
+
+const struct at_allocator_t *at_get_default_allocator(void) {
+   return &at_default_allocator;
+}
+
+// Allocations for the context, its own or taken from shared pools
+static void at_guard_alloc(struct at_context_t *ctx, size_t size) {
+
+   if (ctx->alloc_guard == false || ctx->in_input == false)
+      return;
+
+   ctx->alloc_stats.guarded++;
+
+   if (ctx->alloc_guard_hook != 0)
+      ctx->alloc_guard_hook(ctx->alloc_guard_user, size);
+}
+
+static void at_count_alloc(struct at_context_t *ctx, size_t size) {
+
+   ctx->alloc_stats.allocs++;
+   ctx->alloc_stats.bytes += size;
+
+   if (ctx->alloc_stats.bytes > ctx->alloc_stats.peak)
+      ctx->alloc_stats.peak = ctx->alloc_stats.bytes;
+
+   at_guard_alloc(ctx, size);
+}
+
+// Zero sized blocks take one byte so that every block has a distinct address
+void *at_alloc(struct at_context_t *ctx, size_t size) {
+
+   if (size == 0)
+      size = 1;
+
+   void *p = ctx->allocator.alloc(ctx->allocator.user_data, size);
+
+   if (p != 0)
+      at_count_alloc(ctx, size);
+
+   return p;
+}
+
+void at_free(struct at_context_t *ctx, void *p, size_t size) {
+
+   if (p == 0)
+      return;
+
+   if (size == 0)
+      size = 1;
+
+   ctx->alloc_stats.bytes -= size;
+   ctx->allocator.free(ctx->allocator.user_data, p, size);
+}
+
+// Hooks have no realloc, the default allocator keeps using the C library one
+void *at_realloc(struct at_context_t *ctx, void *p, size_t old_size, size_t size) {
+
+   if (p == 0)
+      return at_alloc(ctx, size);
+
+   if (ctx->allocator.alloc == at_malloc_hook) {
+
+      void *q = realloc(p, size);
+
+      if (q != 0) {
+         ctx->alloc_stats.bytes -= old_size;
+         at_count_alloc(ctx, size);
+      }
+
+      return q;
+   }
+
+   void *q = at_alloc(ctx, size);
+
+   if (q != 0) {
+      memcpy(q, p, old_size < size ? old_size : size);
+      at_free(ctx, p, old_size);
+   }
+
+   return q;
+}
+
+void at_get_alloc_stats(struct at_context_t *ctx, struct at_alloc_stats_t *stats) {
+   *stats = ctx->alloc_stats;
+}
+
+void at_set_alloc_guard(struct at_context_t *ctx, bool enabled) {
+   ctx->alloc_guard = enabled;
+}
+
+void at_set_alloc_guard_hook(struct at_context_t *ctx, void (*hook)(void *user, size_t size), void *user) {
+   ctx->alloc_guard_hook = hook;
+   ctx->alloc_guard_user = user;
+}
+
+// The context and its buffers in one block, contexts with a buffer pool
+// have no output buffer in it
+#define AT_CONTEXT_BLOCK_SIZE(pooled) \
+   (sizeof(struct at_context_t) + 2 * AT_INPUT_BUFFER_SIZE + ((pooled) ? 0 : AT_OUTPUT_BUFFER_SIZE))
 
 struct at_command_register_t {
-   const char *tag;
-   void (*function)(struct at_function_result*, struct at_function_context_t*);
+   struct at_command_t command;
    struct at_command_register_t *next;
+};
+
+struct at_stream_register_t {
+   struct at_stream_command_t command;
+   struct at_stream_register_t *next;
+};
+
+// Output and result of a cacheable command, replayed while valid
+struct at_cache_entry_t {
+   const char *tag;
    enum AT_CMD_TYPE cmd_type;
+   const struct at_command_t *command;
+   unsigned long long version;
+   unsigned long long ttl_us;
+   unsigned long long captured_at;
+   bool valid;
+   bool capture_failed;
+   unsigned char s3;
+   unsigned char s4;
+   enum AT_CHARSET charset;
+   struct at_function_result result;
+   unsigned char *data;
+   unsigned int size;
+   unsigned int capacity;
+   struct at_cache_entry_t *next;
 };
 
 void at_function_result_init(struct at_function_result *p) {
@@ -29,8 +230,81 @@ void at_function_result_init(struct at_function_result *p) {
    p->code = 0;
 }
 
+static void at_record(
+      struct at_context_t *ctx,
+      enum AT_RECORD_TYPE type,
+      struct range_t data,
+      struct range_t prefix) {
+
+   struct at_record_event_t event;
+   event.type = type;
+   event.data = data;
+   event.prefix = prefix;
+
+   ctx->record(ctx->record_user, &event);
+}
+
+void at_set_record_hook(
+      struct at_context_t *ctx,
+      void (*record)(void *user, const struct at_record_event_t *event),
+      void *user) {
+
+   ctx->record = record;
+   ctx->record_user = user;
+}
+
+void at_set_output_hook(
+      struct at_context_t *ctx,
+      void (*output)(void *user, struct range_t *data),
+      void *user) {
+
+   ctx->output = output;
+   ctx->output_user = user;
+}
+
+// A pooled context holds a buffer only while output is pending. Without
+// one output is dropped, the final result of the line reports it.
+static bool at_output_acquire(struct at_context_t *ctx, unsigned int size) {
+
+   unsigned int capacity;
+   bool allocated;
+   unsigned char *buffer = at_buffer_pool_take(ctx->buffer_pool, size, &capacity, &allocated);
+
+   if (allocated)
+      at_guard_alloc(ctx, capacity);
+
+   if (buffer == 0) {
+
+      ctx->output_lost = true;
+
+      if (ctx->capture != 0)
+         ctx->capture->capture_failed = true;
+
+      return false;
+   }
+
+   ctx->output_buffer = buffer;
+   ctx->outputbuff_iterator = buffer;
+   ctx->outputbuff_end = buffer + capacity;
+   return true;
+}
+
+static void at_output_release(struct at_context_t *ctx) {
+
+   if (ctx->buffer_pool == 0 || ctx->output_buffer == 0)
+      return;
+
+   if (ctx->output_borrowed == false)
+      at_buffer_pool_return(ctx->buffer_pool, ctx->output_buffer, ctx->outputbuff_end - ctx->output_buffer);
+
+   ctx->output_buffer = 0;
+   ctx->outputbuff_iterator = 0;
+   ctx->outputbuff_end = 0;
+   ctx->output_borrowed = false;
+}
+
 void at_flush_output(struct at_context_t *ctx){
-   if (ctx->flush != 0){
+   if (ctx->flush != 0 || ctx->output != 0){
 
       struct range_t range;
 
@@ -38,89 +312,285 @@ void at_flush_output(struct at_context_t *ctx){
       range.end = ctx->outputbuff_iterator;
 
       if ( range_is_empty (&range) == false) {
-         ctx->flush(&range);
+
+         if (ctx->record != 0) {
+            at_record(ctx, AT_RECORD_OUTPUT, range, range_empty());
+         }
+
+         if (ctx->output != 0) {
+            ctx->output(ctx->output_user, &range);
+         } else {
+            ctx->flush(&range);
+         }
       }
    }
 
    ctx->outputbuff_iterator = ctx->output_buffer;
+   ctx->pending_timer = false;
+   at_output_release(ctx);
 }
 
 iterator_t at_get_output_buffer_end_iterator(struct at_context_t *ctx) {
-   return ctx->output_buffer + AT_OUTPUT_BUFFER_SIZE;
+   return ctx->outputbuff_end;
 }
 
-void at_append_char(struct at_context_t *ctx, unsigned char c){
+// Flushes a full buffer, a pooled context takes a new one for 'min' bytes.
+// False when there is none, the output is then dropped.
+static bool at_output_make_room(struct at_context_t *ctx, unsigned int min) {
 
-   if (ctx->outputbuff_iterator == at_get_output_buffer_end_iterator(ctx)) {
-      at_flush_output(ctx);
+   at_flush_output(ctx);
+
+   return ctx->output_buffer != 0 || at_output_acquire(ctx, min);
+}
+
+bool at_reserve_output(struct at_context_t *ctx, unsigned int size) {
+
+   unsigned int pending = ctx->outputbuff_iterator - ctx->output_buffer;
+
+   if ((unsigned int)(ctx->outputbuff_end - ctx->outputbuff_iterator) >= size)
+      return true;
+
+   if (ctx->buffer_pool == 0)
+      return false;
+
+   unsigned int capacity;
+   bool allocated;
+   unsigned char *buffer = at_buffer_pool_take(ctx->buffer_pool, pending + size, &capacity, &allocated);
+
+   if (allocated)
+      at_guard_alloc(ctx, capacity);
+
+   if (buffer == 0)
+      return false;
+
+   if (pending != 0)
+      memcpy(buffer, ctx->output_buffer, pending);
+
+   at_output_release(ctx);
+
+   ctx->output_buffer = buffer;
+   ctx->outputbuff_iterator = buffer + pending;
+   ctx->outputbuff_end = buffer + capacity;
+   return true;
+}
+
+size_t at_get_buffer_bytes(struct at_context_t *ctx) {
+
+   size_t bytes = 2 * AT_INPUT_BUFFER_SIZE + AT_LEXER_TOKEN_BYTES + ctx->held_input_capacity + ctx->line_storage_size;
+
+   if (ctx->output_borrowed == false)
+      bytes += ctx->outputbuff_end - ctx->output_buffer;
+
+   return bytes;
+}
+
+enum AT_FLUSH_EVENT {
+   AT_FLUSH_EVENT_RESPONSE,
+   AT_FLUSH_EVENT_UNSOLICITED,
+   AT_FLUSH_EVENT_ECHO,
+   AT_FLUSH_EVENT_INPUT_END
+};
+
+static bool at_flush_budget_expired(struct at_context_t *ctx) {
+
+   unsigned int pending = ctx->outputbuff_iterator - ctx->output_buffer;
+
+   if (pending == 0)
+      return false;
+
+   if (ctx->flush_budget_bytes != 0 && pending >= ctx->flush_budget_bytes)
+      return true;
+
+   // A time budget of 0 sets no time limit
+   if (ctx->clock == 0 || ctx->flush_budget_us == 0)
+      return false;
+
+   unsigned long long now = ctx->clock();
+
+   if (ctx->pending_timer == false) {
+      ctx->pending_timer = true;
+      ctx->pending_since = now;
    }
 
-   *ctx->outputbuff_iterator++ = c;
+   return now - ctx->pending_since >= ctx->flush_budget_us;
 }
 
-void at_append_text(struct at_context_t *ctx, const char *text){
-   while (*text != 0) {
-      at_append_char(ctx, *text++);
+// Flush requested by the library itself, the policy decides whether it
+// goes out now. Explicit at_flush_output calls and a full buffer always flush.
+static void at_flush_soft(struct at_context_t *ctx, enum AT_FLUSH_EVENT event) {
+
+   bool flush = false;
+
+   switch (ctx->flush_policy) {
+
+   case AT_FLUSH_PER_RESPONSE:
+      flush = event != AT_FLUSH_EVENT_INPUT_END;
+      break;
+   case AT_FLUSH_ON_FULL:
+      break;
+   case AT_FLUSH_PER_INPUT:
+      flush = event == AT_FLUSH_EVENT_INPUT_END ||
+            (event == AT_FLUSH_EVENT_UNSOLICITED && ctx->in_input == false);
+      break;
+   case AT_FLUSH_COALESCE:
+      flush = at_flush_budget_expired(ctx);
+      break;
+   }
+
+   if (flush) {
+      at_flush_output(ctx);
    }
 }
 
-void at_append_int(struct at_context_t *ctx, int value){
-   char buff[20];
-   snprintf(buff, 20, "%i", value);
-   at_append_text(ctx, buff);
+void at_set_flush_policy(struct at_context_t *ctx, enum AT_FLUSH_POLICY policy) {
+   ctx->flush_policy = policy;
 }
 
-void at_append_line(struct at_context_t *ctx, const char *text){
-   at_append_text(ctx, text);
-   at_append_text(ctx, "\r\n");
+void at_set_flush_budget(struct at_context_t *ctx, unsigned int bytes, unsigned int time_us) {
+   ctx->flush_budget_bytes = bytes;
+   ctx->flush_budget_us = time_us;
+}
+
+void at_set_clock(struct at_context_t *ctx, unsigned long long (*now_us)(void)) {
+   ctx->clock = now_us;
+}
+
+void at_flush_poll(struct at_context_t *ctx) {
+
+   if (ctx->flush_policy != AT_FLUSH_COALESCE ||
+       ctx->outputbuff_iterator == ctx->output_buffer)
+      return;
+
+   if (ctx->clock == 0 || at_flush_budget_expired(ctx)) {
+      at_flush_output(ctx);
+   }
+}
+
+// Copies output of a cacheable command into its cache entry
+static void at_capture(struct at_context_t *ctx, const unsigned char *data, unsigned int size){
+
+   struct at_cache_entry_t *e = ctx->capture;
+
+   if (e->size + size > e->capacity) {
+
+      unsigned int capacity = e->capacity != 0 ? e->capacity : AT_OUTPUT_BUFFER_SIZE;
+
+      while (capacity < e->size + size)
+         capacity *= 2;
+
+      unsigned char *p = (unsigned char*)at_realloc(ctx, e->data, e->capacity, capacity);
+
+      if (p == 0) {
+         e->capture_failed = true;
+         return;
+      }
+
+      e->data = p;
+      e->capacity = capacity;
+   }
+
+   memcpy(e->data + e->size, data, size);
+   e->size += size;
 }
 
+void at_append_char(struct at_context_t *ctx, unsigned char c){
+
+   if (ctx->capture != 0) {
+      at_capture(ctx, &c, 1);
+   }
+
+   if (ctx->outputbuff_iterator == at_get_output_buffer_end_iterator(ctx) &&
+       at_output_make_room(ctx, 1) == false) {
+      return;
+   }
 
-void at_return_operation_not_allowed_error(struct at_function_result *r) {
-   r->code = 3;
-   r->detailed = "Operation not allowed";
-   r->result = false;
+   *ctx->outputbuff_iterator++ = c;
 }
 
-void at_return_operation_not_supported_error(struct at_function_result *r) {
-   r->code = 4;
-   r->detailed = "Operation not supported";
-   r->result = false;
+static void at_append_data(struct at_context_t *ctx, const unsigned char *data, unsigned int size){
+
+   if (ctx->capture != 0) {
+      at_capture(ctx, data, size);
+   }
+
+   while (size > 0) {
+
+      if (ctx->outputbuff_iterator == at_get_output_buffer_end_iterator(ctx) &&
+          at_output_make_room(ctx, 1) == false) {
+         return;
+      }
+
+      unsigned int chunk = at_get_output_buffer_end_iterator(ctx) - ctx->outputbuff_iterator;
+
+      if (chunk > size)
+         chunk = size;
+
+      memcpy(ctx->outputbuff_iterator, data, chunk);
+      ctx->outputbuff_iterator += chunk;
+      data += chunk;
+      size -= chunk;
+   }
 }
 
+iterator_t at_output_reserve(struct at_context_t *ctx, unsigned int min, unsigned int *size){
+
+   if ((unsigned int)(at_get_output_buffer_end_iterator(ctx) - ctx->outputbuff_iterator) < min &&
+       at_output_make_room(ctx, min) == false) {
+      *size = 0;
+      return 0;
+   }
+
+   *size = at_get_output_buffer_end_iterator(ctx) - ctx->outputbuff_iterator;
+   return ctx->outputbuff_iterator;
+}
 
-void at_return_invalid_index_error(struct at_function_result *r) {
-   r->code = 21;
-   r->detailed = "Invalid index";
-   r->result = false;
+struct at_urc_queue_t **at_get_urc_queue(struct at_context_t *ctx){
+   return &ctx->urc_queue;
 }
 
-void at_return_not_found_error(struct at_function_result *r) {
-   r->code = 22;
-   r->detailed = "Not found";
-   r->result = false;
+struct at_registry_reader_t **at_get_registry_reader(struct at_context_t *ctx){
+   return &ctx->registry_reader;
 }
 
-void at_text_string_too_long_error(struct at_function_result *r) {
-   r->code = 24;
-   r->detailed = "Text string too long";
-   r->result = false;
+struct at_command_set_t **at_get_command_set(struct at_context_t *ctx){
+   return &ctx->command_set;
 }
 
+void at_output_commit(struct at_context_t *ctx, iterator_t end){
+
+   if (ctx->capture != 0 && end != ctx->outputbuff_iterator) {
+      at_capture(ctx, ctx->outputbuff_iterator, end - ctx->outputbuff_iterator);
+   }
+
+   ctx->outputbuff_iterator = end;
+}
 
-void at_invalid_chars_error(struct at_function_result *r) {
-   r->code = 25;
-   r->detailed = "Invalid characters in text string";
-   r->result = false;
+void at_append_text(struct at_context_t *ctx, const char *text){
+   at_append_data(ctx, (const unsigned char*)text, strlen(text));
 }
 
+void at_append_int(struct at_context_t *ctx, int value){
+   char buff[20];
+   snprintf(buff, 20, "%i", value);
+   at_append_text(ctx, buff);
+}
 
-void at_unknown_error(struct at_function_result *r) {
-   r->code = 100;
-   r->detailed = "Unknown error";
-   r->result = false;
+void at_append_line(struct at_context_t *ctx, const char *text){
+   unsigned char eol[2] = { ctx->s3, ctx->s4 };
+   at_append_text(ctx, text);
+   at_append_data(ctx, eol, 2);
 }
 
+
+#define AT_ERROR_FUNCTION(error_code, function, text) \
+   void function(struct at_function_result *r) { \
+      r->code = error_code; \
+      r->detailed = text; \
+      r->result = false; \
+   }
+
+AT_ERROR_LIST(AT_ERROR_FUNCTION)
+
 void at_ok_result(struct at_function_result *r) {
    r->code = 0;
    r->result = true;
@@ -129,10 +599,10 @@ void at_ok_result(struct at_function_result *r) {
 
 
 void  at_cmee_buildin_status(struct at_function_result *r, struct at_function_context_t *ctx){
-   at_append_line(ctx->context, "");
-   at_append_text(ctx->context, "+CMEE: ");
-   at_append_int(ctx->context, ctx->context->cmee_level);
-   at_append_line(ctx->context, "");
+   struct at_response_t response;
+   at_response_begin(&response, ctx->context, "+CMEE");
+   at_response_int(&response, ctx->context->cmee_level);
+   at_response_end(&response);
    at_ok_result(r);
 }
 
@@ -147,6 +617,133 @@ static void ate1_buildin_status(struct at_function_result  *r, struct at_functio
    at_ok_result(r);
 }
 
+static void atv0_buildin_status(struct at_function_result  *r, struct at_function_context_t *ctx){
+   ctx->context->verbose = false;
+   at_ok_result(r);
+}
+
+static void atv1_buildin_status(struct at_function_result  *r, struct at_function_context_t *ctx){
+   ctx->context->verbose = true;
+   at_ok_result(r);
+}
+
+static void atq0_buildin_status(struct at_function_result  *r, struct at_function_context_t *ctx){
+   ctx->context->quiet = false;
+   at_ok_result(r);
+}
+
+static void atq1_buildin_status(struct at_function_result  *r, struct at_function_context_t *ctx){
+   ctx->context->quiet = true;
+   at_ok_result(r);
+}
+
+// Moves a class from the byte in 'reg' to 'value', the context gets its own
+// table on the first change
+static bool at_set_class_register(
+      struct at_context_t *ctx,
+      unsigned char *reg,
+      unsigned char value,
+      unsigned short cls) {
+
+   if (ctx->own_classes == 0) {
+      ctx->own_classes = (unsigned short*)at_alloc(ctx, sizeof(at_default_classes));
+
+      if (ctx->own_classes == 0)
+         return false;
+
+      memcpy(ctx->own_classes, at_default_classes, sizeof(at_default_classes));
+      ctx->classes = ctx->own_classes;
+   }
+
+   ctx->own_classes[*reg] &= ~cls;
+   ctx->own_classes[value] |= cls;
+   *reg = value;
+
+   return true;
+}
+
+// Built-in commands are shared by every context, user data of the S register
+// commands is the register number
+static unsigned char at_s_register_numbers[] = { 3, 4, 5 };
+
+static unsigned char *at_get_s_register(struct at_function_context_t *ctx) {
+
+   struct at_context_t *context = ctx->context;
+
+   switch (*(unsigned char*)ctx->user_data) {
+   case 3:
+      return &context->s3;
+   case 4:
+      return &context->s4;
+   default:
+      return &context->s5;
+   }
+}
+
+// S registers take no byte of another one and none that has a meaning in a
+// command line: tag, quote, separator, repeat, space and parameter bytes
+static bool at_s_register_value_valid(struct at_context_t *ctx, unsigned char *reg, int value) {
+
+   unsigned short parser_classes = AT_CLASS_ALPHA | AT_CLASS_DIGIT | AT_CLASS_TAG_PREFIX |
+         AT_CLASS_QUOTE | AT_CLASS_SEPARATOR | AT_CLASS_REPEAT;
+
+   if (value > 127 || (at_default_classes[value] & parser_classes) != 0)
+      return false;
+
+   if (value == ' ' || value == '=' || value == '?' || value == ',')
+      return false;
+
+   unsigned char *registers[] = { &ctx->s3, &ctx->s4, &ctx->s5 };
+
+   for (unsigned int i = 0; i < sizeof(registers) / sizeof(registers[0]); ++i) {
+      if (registers[i] != reg && *registers[i] == value)
+         return false;
+   }
+
+   return true;
+}
+
+static void ats_buildin_assignment(struct at_function_result *r, struct at_function_context_t *ctx){
+
+   struct at_context_t *context = ctx->context;
+   unsigned char *reg = at_get_s_register(ctx);
+   int value;
+
+   if (range_is_empty(&ctx->parameters) == false &&
+       range_all_digits(&ctx->parameters) &&
+       range_size(&ctx->parameters) <= 3 &&
+       range_convert_to_int(&ctx->parameters, &value) &&
+       at_s_register_value_valid(context, reg, value)) {
+
+      bool ok = true;
+
+      if (reg == &context->s3) {
+         ok = at_set_class_register(context, reg, value, AT_CLASS_TERMINATOR);
+      } else if (reg == &context->s5) {
+         ok = at_set_class_register(context, reg, value, AT_CLASS_BACKSPACE);
+      } else {
+         *reg = value;
+      }
+
+      if (ok) {
+         at_ok_result(r);
+         return;
+      }
+   }
+
+   at_return_operation_not_supported_error(r);
+}
+
+static void ats_buildin_status(struct at_function_result *r, struct at_function_context_t *ctx){
+
+   char buff[4];
+   snprintf(buff, sizeof(buff), "%03u", *at_get_s_register(ctx));
+
+   at_append_line(ctx->context, "");
+   at_append_line(ctx->context, buff);
+   at_ok_result(r);
+}
+
 iterator_t at_get_parameter(iterator_t begin, iterator_t end, struct range_t *result){
 
    for (iterator_t i = begin; i != end; ++i){
@@ -209,473 +806,1269 @@ static void at_cmee_buildin_assignment(
    return;
 }
 
-void at_command_free(struct at_command_register_t *c){
+static const char *at_charset_names[] = { "IRA", "GSM", "UCS2", "HEX" };
 
-   if (c->next != 0) {
-      at_command_free(c->next);
-   }
-
-   free(c);
+static void at_cscs_buildin_status(struct at_function_result *r, struct at_function_context_t *ctx){
+   struct at_response_t response;
+   at_response_begin(&response, ctx->context, "+CSCS");
+   at_response_string(&response, at_charset_names[ctx->context->charset]);
+   at_response_end(&response);
+   at_ok_result(r);
 }
 
+static void at_cscs_buildin_assignment(
+      struct at_function_result *r,
+      struct at_function_context_t *ctx){
 
-void at_context_free(struct at_context_t *ctx){
-
-   if (ctx->first != 0) {
-      at_command_free(ctx->first);
+   if (range_equals(&ctx->parameters, "?")) {
+      at_append_line(ctx->context, "");
+      at_append_line(ctx->context, "+CSCS: (\"IRA\",\"GSM\",\"UCS2\",\"HEX\")");
+      at_ok_result(r);
+      return;
    }
 
-   if (ctx->input_buffer != 0) {
-      free (ctx->input_buffer);
+   struct range_t value;
+
+   if (at_get_in_quota_value(&ctx->parameters, &value)) {
+
+      range_uppercase(&value);
+
+      for (unsigned int i = 0; i < sizeof(at_charset_names) / sizeof(at_charset_names[0]); ++i) {
+
+         if (range_equals(&value, at_charset_names[i])) {
+            ctx->context->charset = (enum AT_CHARSET)i;
+            at_ok_result(r);
+            return;
+         }
+      }
    }
 
-   if (ctx->output_buffer != 0) {
-      free (ctx->output_buffer);
+   at_return_operation_not_supported_error(r);
+}
+
+void at_context_free(struct at_context_t *ctx){
+
+   while (ctx->first != 0) {
+      struct at_command_register_t *next = ctx->first->next;
+      at_free(ctx, ctx->first, sizeof(struct at_command_register_t));
+      ctx->first = next;
    }
 
-   if (ctx->last_input_buffer != 0) {
-      free(ctx->last_input_buffer);
+   while (ctx->first_cache != 0) {
+      struct at_cache_entry_t *next = ctx->first_cache->next;
+      at_free(ctx, ctx->first_cache->data, ctx->first_cache->capacity);
+      at_free(ctx, ctx->first_cache, sizeof(struct at_cache_entry_t));
+      ctx->first_cache = next;
    }
 
-   free (ctx);
+   while (ctx->first_stream != 0) {
+      struct at_stream_register_t *next = ctx->first_stream->next;
+      at_free(ctx, ctx->first_stream, sizeof(struct at_stream_register_t));
+      ctx->first_stream = next;
+   }
+
+   at_urc_queue_free(ctx, ctx->urc_queue);
+   at_command_set_release(ctx->command_set);
+
+   if (ctx->registry_reader != 0)
+      at_registry_release(ctx->registry_reader);
+   at_free(ctx, ctx->own_classes, sizeof(at_default_classes));
+   at_free(ctx, ctx->held_input, ctx->held_input_capacity);
+   at_free(ctx, ctx->held_line, ctx->held_line_size);
+   at_free(ctx, ctx->line_storage, ctx->line_storage_size);
+   at_output_release(ctx);
+
+   // The context and its buffers go last, with a copy of the allocator
+   struct at_allocator_t allocator = ctx->allocator;
+   allocator.free(allocator.user_data, ctx, AT_CONTEXT_BLOCK_SIZE(ctx->buffer_pool != 0));
 }
 
 void at_command_init(struct at_command_register_t *c){
-   c->tag = 0;
-   c->cmd_type = AT_STANDALONE_COMMAND;
+   c->command.tag = 0;
+   c->command.cmd_type = AT_STANDALONE_COMMAND;
+   c->command.function = 0;
+   c->command.user_data = 0;
    c->next = 0;
-   c->function = 0;
 }
 
-void at_command_add(
+void at_command_add_ex(
       struct at_context_t *ctx,
       const char *tag,
       enum AT_CMD_TYPE cmd_type,
-      void (*function)(struct at_function_result*, struct at_function_context_t*)){
+      void (*function)(struct at_function_result*, struct at_function_context_t*),
+      void *user_data){
+
+   struct at_command_register_t *p = (struct at_command_register_t*)at_alloc(ctx, sizeof(struct at_command_register_t));
+
+   if (p == 0)
+      return;
 
-   struct at_command_register_t *p = (struct at_command_register_t*)malloc(sizeof(struct at_command_register_t));
    at_command_init(p);
 
-   p->cmd_type = cmd_type;
-   p->function = function;
-   p->tag = tag;
+   p->command.cmd_type = cmd_type;
+   p->command.function = function;
+   p->command.tag = tag;
+   p->command.user_data = user_data;
    p->next = ctx->first;
    ctx->first = p;
 }
 
+void at_command_add(
+      struct at_context_t *ctx,
+      const char *tag,
+      enum AT_CMD_TYPE cmd_type,
+      void (*function)(struct at_function_result*, struct at_function_context_t*)){
+
+   at_command_add_ex(ctx, tag, cmd_type, function, 0);
+}
+
+void at_stream_command_add(
+      struct at_context_t *ctx,
+      const struct at_stream_command_t *command){
+
+   struct at_stream_register_t *p = (struct at_stream_register_t*)at_alloc(ctx, sizeof(struct at_stream_register_t));
+
+   if (p == 0)
+      return;
+
+   p->command = *command;
+   p->next = ctx->first_stream;
+   ctx->first_stream = p;
+}
+
+void at_command_cache(
+      struct at_context_t *ctx,
+      const char *tag,
+      enum AT_CMD_TYPE cmd_type,
+      unsigned long long ttl_us){
+
+   // Parameters are not part of the key
+   if (cmd_type == AT_ASSIGNMENT_COMMAND)
+      return;
+
+   struct at_cache_entry_t *e = (struct at_cache_entry_t*)at_alloc(ctx, sizeof(struct at_cache_entry_t));
+
+   if (e == 0)
+      return;
+
+   memset(e, 0, sizeof(struct at_cache_entry_t));
+
+   e->tag = tag;
+   e->cmd_type = cmd_type;
+   e->ttl_us = ttl_us;
+   e->next = ctx->first_cache;
+   ctx->first_cache = e;
+}
+
+void at_invalidate(struct at_context_t *ctx, const char *tag){
+
+   for (struct at_cache_entry_t *e = ctx->first_cache; e != 0; e = e->next) {
+      if (strcmp(e->tag, tag) == 0)
+         e->valid = false;
+   }
+}
+
+void at_get_cache_stats(struct at_context_t *ctx, struct at_cache_stats_t *stats){
+   *stats = ctx->cache_stats;
+}
+
+static struct at_cache_entry_t *at_find_cache_entry(
+      struct at_context_t *ctx,
+      struct range_t *tag,
+      enum AT_CMD_TYPE cmd_type) {
+
+   for (struct at_cache_entry_t *e = ctx->first_cache; e != 0; e = e->next) {
+      if (e->cmd_type == cmd_type && range_equals(tag, e->tag))
+         return e;
+   }
+
+   return 0;
+}
+
+// Registry commands are identified by the snapshot they were found in, a
+// publish may put a new handler at the address of the old one
+static unsigned long long at_command_version(struct at_context_t *ctx) {
+   return ctx->registry_reader != 0 ? at_registry_snapshot_version(ctx->registry_reader) : 0;
+}
+
+// Entries with a TTL need the clock, without one they are never reused.
+// Output of a replaced handler is not replayed.
+static bool at_cache_entry_usable(
+      struct at_context_t *ctx,
+      struct at_cache_entry_t *e,
+      const struct at_command_t *command) {
+
+   if (e->valid == false || e->s3 != ctx->s3 || e->s4 != ctx->s4 || e->charset != ctx->charset)
+      return false;
+
+   if (e->command != command || e->version != at_command_version(ctx))
+      return false;
+
+   if (e->ttl_us == 0)
+      return true;
+
+   return ctx->clock != 0 && ctx->clock() - e->captured_at < e->ttl_us;
+}
+
+void at_set_command_fallback(
+      struct at_context_t *ctx,
+      void (*fallback)(struct at_function_result*, struct at_function_context_t*),
+      void *user){
+
+   ctx->fallback = fallback;
+   ctx->fallback_user = user;
+}
+
+void at_set_command_lookup(
+      struct at_context_t *ctx,
+      const struct at_command_t *(*lookup)(void *user, const struct range_t *tag, enum AT_CMD_TYPE cmd_type),
+      void *user){
+
+   ctx->lookup = lookup;
+   ctx->lookup_user = user;
+}
+
 void at_context_init(struct at_context_t **ctx, void (*flush)(struct range_t*)) {
+   at_context_init_with(ctx, flush, 0);
+}
+
+static struct at_context_t *at_context_create(
+      void (*flush)(struct range_t*),
+      const struct at_allocator_t *allocator,
+      struct at_buffer_pool_t *pool) {
+
+   struct at_context_t *ctx = (struct at_context_t*)allocator->alloc(allocator->user_data, AT_CONTEXT_BLOCK_SIZE(pool != 0));
+
+   if (ctx == 0)
+      return 0;
+
+   ctx->allocator = *allocator;
+   ctx->alloc_guard = false;
+   ctx->alloc_guard_hook = 0;
+   ctx->alloc_guard_user = 0;
+   ctx->alloc_stats.allocs = 0;
+   ctx->alloc_stats.bytes = 0;
+   ctx->alloc_stats.peak = 0;
+   ctx->alloc_stats.guarded = 0;
+   ctx->in_input = false;
+   at_count_alloc(ctx, AT_CONTEXT_BLOCK_SIZE(pool != 0));
+
+   ctx->cmee_level = 0;
+   ctx->charset = AT_CHARSET_IRA;
+   ctx->classes = at_default_classes;
+   ctx->own_classes = 0;
+   ctx->s3 = AT_DEFAULT_S3;
+   ctx->s4 = AT_DEFAULT_S4;
+   ctx->s5 = AT_DEFAULT_S5;
+   at_lexer_reset(&ctx->lexer, true);
+   ctx->flush = flush;
+   ctx->output = 0;
+   ctx->output_user = 0;
+   ctx->lookup = 0;
+   ctx->lookup_user = 0;
+   ctx->registry_reader = 0;
+   ctx->command_set = 0;
+   ctx->fallback = 0;
+   ctx->fallback_user = 0;
+   ctx->echo = true;
+   ctx->verbose = true;
+   ctx->quiet = false;
+   ctx->echo_policy = AT_ECHO_IMMEDIATE;
+   ctx->flush_policy = AT_FLUSH_PER_RESPONSE;
+   ctx->flush_budget_bytes = 0;
+   ctx->flush_budget_us = 0;
+   ctx->clock = 0;
+   ctx->pending_since = 0;
+   ctx->pending_timer = false;
+   ctx->deferred = false;
+   ctx->held_input = 0;
+   ctx->held_input_size = 0;
+   ctx->held_input_capacity = 0;
+   ctx->held_input_echoed = false;
+   ctx->held_line = 0;
+   ctx->held_line_size = 0;
+   ctx->line_storage = 0;
+   ctx->line_storage_size = 0;
+   ctx->first = 0;
+   ctx->first_stream = 0;
+   ctx->first_cache = 0;
+   ctx->capture = 0;
+   ctx->cache_stats.hits = 0;
+   ctx->cache_stats.misses = 0;
+   ctx->urc_queue = 0;
+   ctx->stream = 0;
+   ctx->state = 0;
+   ctx->record = 0;
+   ctx->record_user = 0;
+
+   ctx->input_buffer = (unsigned char*)(ctx + 1);
+   ctx->inputbuff_iterator = ctx->input_buffer;
+   ctx->last_input_buffer = ctx->input_buffer + AT_INPUT_BUFFER_SIZE;
+   ctx->lastinbuff_iterator = ctx->last_input_buffer;
+   ctx->buffer_pool = pool;
+   ctx->output_lost = false;
+   ctx->output_borrowed = false;
+
+   if (pool != 0) {
+      ctx->output_buffer = 0;
+      ctx->outputbuff_end = 0;
+   } else {
+      ctx->output_buffer = ctx->last_input_buffer + AT_INPUT_BUFFER_SIZE;
+      ctx->outputbuff_end = ctx->output_buffer + AT_OUTPUT_BUFFER_SIZE;
+   }
+
+   ctx->outputbuff_iterator = ctx->output_buffer;
+
+   return ctx;
+}
+
+void at_context_init_with(
+      struct at_context_t **ctx,
+      void (*flush)(struct range_t*),
+      const struct at_allocator_t *allocator) {
+
+   *ctx = at_context_create(flush, allocator != 0 ? allocator : &at_default_allocator, 0);
+}
+
+void at_context_init_pooled(
+      struct at_context_t **ctx,
+      void (*flush)(struct range_t*),
+      struct at_buffer_pool_t *pool) {
+
+   *ctx = at_context_create(flush, &at_default_allocator, pool);
+}
+
+void at_context_clone(struct at_context_t **ctx, struct at_context_t *prototype) {
+
+   struct at_context_t *c = at_context_create(prototype->flush, &prototype->allocator, prototype->buffer_pool);
+
+   *ctx = c;
+
+   if (c == 0)
+      return;
+
+   c->output = prototype->output;
+   c->output_user = prototype->output_user;
+   c->lookup = prototype->lookup;
+   c->lookup_user = prototype->lookup_user;
+   c->cmee_level = prototype->cmee_level;
+   c->charset = prototype->charset;
+   c->echo = prototype->echo;
+   c->verbose = prototype->verbose;
+   c->quiet = prototype->quiet;
+   c->echo_policy = prototype->echo_policy;
+   c->flush_policy = prototype->flush_policy;
+   c->flush_budget_bytes = prototype->flush_budget_bytes;
+   c->flush_budget_us = prototype->flush_budget_us;
+   c->clock = prototype->clock;
+   c->s3 = prototype->s3;
+   c->s4 = prototype->s4;
+   c->s5 = prototype->s5;
+
+   // Changed S3 or S5 need a class table of its own, failures fall back to
+   // the defaults
+   if (prototype->own_classes != 0) {
+
+      c->own_classes = (unsigned short*)at_alloc(c, sizeof(at_default_classes));
+
+      if (c->own_classes != 0) {
+         memcpy(c->own_classes, prototype->own_classes, sizeof(at_default_classes));
+         c->classes = c->own_classes;
+      } else {
+         c->s3 = AT_DEFAULT_S3;
+         c->s5 = AT_DEFAULT_S5;
+      }
+   }
+
+   if (prototype->command_set != 0)
+      c->command_set = at_command_set_retain(prototype->command_set);
+
+   if (prototype->registry_reader != 0)
+      at_registry_attach(at_registry_of(prototype->registry_reader), c);
+}
+
+struct range_t get_line(struct range_t *data){
+
+   iterator_t r = range_search_character(data, '\r');
+
+   if (r != data->end) {
+      return range_create_it(data->begin, r);
+   } else {
+      return range_empty();
+   }
+}
+
+static void *at_get_state (struct at_context_t *context) {
+   return context->state;
+}
+
+bool at_get_in_quota_value(struct range_t *range, struct range_t *result){
+
+   if (range_is_empty(range) == false &&
+       *(range->begin) == '\"' && *((range)->end -1) == '\"' ) {
+
+      result->begin = range->begin + 1;
+      result->end = range->end - 1;
+      return true;
+   }
+
+   return false;
+}
+
+
+void split_at_commands(struct range_t *command, void(*ptr)(struct range_t* )){
+
+   bool qt = false;
+
+   iterator_t b_cmd = command->begin;
+
+   for (iterator_t it = command->begin; it != command->end; ++it) {
+      if (*it == '"') {
+         qt = !qt;
+      }
+
+      if (qt == false && *it == ';'){
+
+         struct range_t cmd_range;
+
+
+         cmd_range.begin = b_cmd;
+         cmd_range.end = it;
+
+         cmd_range = range_trim(&cmd_range);
+
+         ptr(&cmd_range);
+         b_cmd = it + 1;
+      }
+   }
+
+   struct range_t cmd_range = range_create_it(b_cmd, command->end);
+   cmd_range = range_trim(&cmd_range);
+   ptr(&cmd_range);
+}
+
+bool get_at_command(struct range_t *input, struct range_t *result){
+
+   if ( range_size(input) < 2) {
+      return  false;
+   };
+
+   unsigned char first = *input->begin;
+   unsigned char second = *(input->begin + 1);
+
+   if ((first == 'a' || first == 'A') && (second == 't' || second == 'T')) {
+      result->begin = input->begin + 2;
+      result->end = input->end;
+      return true;
+   }
+
+   return false;
+}
+
+void at_append_range(struct at_context_t *ctx, struct range_t *range){
+   at_append_data(ctx, range->begin, range_size(range));
+}
+
+void at_set_echo_policy(struct at_context_t *ctx, enum AT_ECHO_POLICY policy){
+   ctx->echo_policy = policy;
+}
+
+void at_set_charset(struct at_context_t *ctx, enum AT_CHARSET charset){
+   ctx->charset = charset;
+}
+
+enum AT_CHARSET at_get_charset(struct at_context_t *ctx){
+   return ctx->charset;
+}
+
+// Appends input bytes that were not echoed yet, up to 'end'.
+static void at_append_echo(struct at_context_t *ctx, iterator_t *echo_begin, iterator_t end){
+
+   if (*echo_begin >= end)
+      return;
+
+   if (ctx->echo) {
+      struct range_t echo = range_create_it(*echo_begin, end);
+      at_append_range(ctx, &echo);
+   }
+
+   *echo_begin = end;
+}
+
+
+static enum AT_CMD_TYPE at_get_cmd_type(struct range_t *tag, struct range_t *command){
+
+   if (tag->end == command->end) {
+      return AT_STANDALONE_COMMAND;
+   } else if ( *(tag->end) == '=' && ((range_size(tag) + 1) < range_size(command)))  {
+      return AT_ASSIGNMENT_COMMAND;
+   } else if ( *(tag->end) == '?' && ((range_size(tag) + 1) == range_size(command))) {
+      return AT_STATUS_COMMAND;
+   } else {
+      return AT_UNKOWN_COMMAND;
+   }
+}
+
+struct range_t at_get_tag(struct at_context_t *ctx, struct range_t *range) {
+
+   for (iterator_t it = range->begin; it != range->end; ++it) {
+
+      unsigned short cls = ctx->classes[*it];
+
+      if (it == range->begin) {
+         if (cls & (AT_CLASS_TAG_PREFIX | AT_CLASS_ALPHA))
+            continue;
+      } else {
+         if (cls & (AT_CLASS_ALPHA | AT_CLASS_DIGIT))
+            continue;
+      }
+
+      struct range_t result;
+
+      result.begin = range->begin;
+      result.end = it;
+
+      return result;
+   }
+
+   return *range;
+}
+
+static const struct at_command_t at_buildin_commands[] = {
+   { "+cmee", AT_ASSIGNMENT_COMMAND, at_cmee_buildin_assignment, 0 },
+   { "+cmee", AT_STATUS_COMMAND, at_cmee_buildin_status, 0 },
+   { "+cscs", AT_ASSIGNMENT_COMMAND, at_cscs_buildin_assignment, 0 },
+   { "+cscs", AT_STATUS_COMMAND, at_cscs_buildin_status, 0 },
+   { "", AT_STANDALONE_COMMAND, at_standalone_buildin, 0 },
+   { "e0", AT_STANDALONE_COMMAND, ate0_buildin_status, 0 },
+   { "e1", AT_STANDALONE_COMMAND, ate1_buildin_status, 0 },
+   { "v0", AT_STANDALONE_COMMAND, atv0_buildin_status, 0 },
+   { "v1", AT_STANDALONE_COMMAND, atv1_buildin_status, 0 },
+   { "q0", AT_STANDALONE_COMMAND, atq0_buildin_status, 0 },
+   { "q1", AT_STANDALONE_COMMAND, atq1_buildin_status, 0 },
+   { "s3", AT_ASSIGNMENT_COMMAND, ats_buildin_assignment, &at_s_register_numbers[0] },
+   { "s3", AT_STATUS_COMMAND, ats_buildin_status, &at_s_register_numbers[0] },
+   { "s4", AT_ASSIGNMENT_COMMAND, ats_buildin_assignment, &at_s_register_numbers[1] },
+   { "s4", AT_STATUS_COMMAND, ats_buildin_status, &at_s_register_numbers[1] },
+   { "s5", AT_ASSIGNMENT_COMMAND, ats_buildin_assignment, &at_s_register_numbers[2] },
+   { "s5", AT_STATUS_COMMAND, ats_buildin_status, &at_s_register_numbers[2] },
+};
+
+static const struct at_command_t *at_find_command_register(
+      struct at_context_t *ctx,
+      struct range_t tag,
+      enum AT_CMD_TYPE cmd_type) {
+
+   if (ctx->lookup != 0) {
+      const struct at_command_t *c = ctx->lookup(ctx->lookup_user, &tag, cmd_type);
+
+      if (c != 0)
+         return c;
+   }
+
+   struct at_command_register_t *p = ctx->first;
+
+   while (p != 0){
+      if (range_equals(&tag, p->command.tag) && p->command.cmd_type == cmd_type)
+         return &p->command;
+
+      p = p->next;
+   }
+
+   if (ctx->registry_reader != 0) {
+      const struct at_command_t *c = at_registry_find(ctx->registry_reader, &tag, cmd_type);
+
+      if (c != 0)
+         return c;
+   }
+
+   if (ctx->command_set != 0) {
+      const struct at_command_t *c = at_command_set_find(ctx->command_set, &tag, cmd_type);
+
+      if (c != 0)
+         return c;
+   }
+
+   // Built-in commands come last so that applications can override them
+   for (unsigned int i = 0; i < sizeof(at_buildin_commands) / sizeof(at_buildin_commands[0]); ++i) {
+
+      const struct at_command_t *c = &at_buildin_commands[i];
+
+      if (c->cmd_type == cmd_type && range_equals(&tag, c->tag))
+         return c;
+   }
+
+   return 0;
+}
+
+static void at_append_result_text(struct at_context_t *ctx, struct at_function_result *result) {
+
+   // Precomputed results use the default S3 and S4
+   if (ctx->s3 == AT_DEFAULT_S3 && ctx->s4 == AT_DEFAULT_S4) {
+
+      const struct at_result_blob_t *blob = at_get_result_blob(ctx->verbose, ctx->cmee_level, result);
+
+      if (blob != 0) {
+         at_append_data(ctx, (const unsigned char*)blob->data, blob->size);
+         return;
+      }
+   }
+
+   if (ctx->verbose) {
+      at_append_line(ctx, "");
+   }
+
+   if (result->result) {
+      at_append_text(ctx, ctx->verbose ? "OK" : "0");
+   } else if (ctx->cmee_level == 0) {
+      at_append_text(ctx, ctx->verbose ? "ERROR" : "4");
+   } else {
+      at_append_text(ctx, "+CME ERROR: ");
+
+      if (ctx->cmee_level == 1) {
+         at_append_int(ctx, result->code);
+      } else {
+         at_append_text(ctx, result->detailed);
+      }
+   }
+
+   if (ctx->verbose) {
+      at_append_line(ctx, "");
+   } else {
+      at_append_char(ctx, ctx->s3);
+   }
+}
+
+// Output lost for want of a pooled buffer turns the final result into an
+// error, so the peer is never left waiting. Without a buffer it goes out
+// from the stack.
+static void at_append_result(struct at_context_t *ctx, struct at_function_result *result) {
+
+   unsigned char fallback[AT_OUTPUT_BUFFER_SIZE];
+   struct at_function_result memory_full;
+
+   if (ctx->quiet) {
+      ctx->output_lost = false;
+      return;
+   }
+
+   if (ctx->buffer_pool != 0 &&
+       (unsigned int)(ctx->outputbuff_end - ctx->outputbuff_iterator) < sizeof(fallback) &&
+       at_output_make_room(ctx, sizeof(fallback)) == false) {
+      ctx->output_buffer = fallback;
+      ctx->outputbuff_iterator = fallback;
+      ctx->outputbuff_end = fallback + sizeof(fallback);
+      ctx->output_borrowed = true;
+   }
+
+   if (ctx->output_lost) {
+      at_return_memory_full_error(&memory_full);
+      result = &memory_full;
+      ctx->output_lost = false;
+   }
+
+   at_append_result_text(ctx, result);
+
+   if (ctx->output_borrowed)
+      at_flush_output(ctx);
+}
+
+static struct at_function_result at_run_command(
+      struct at_context_t *ctx,
+      iterator_t line,
+      const struct at_token_t *token) {
+
+   struct range_t command = range_create_it(line + token->begin, line + token->end);
+   struct range_t tag = range_create_it(line + token->begin, line + token->tag_end);
+
+   enum AT_CMD_TYPE cmd_type = at_get_cmd_type(&tag, &command);
+
+
+   if (cmd_type != AT_UNKOWN_COMMAND) {
+
+      const struct at_command_t *reg_ptr = at_find_command_register(
+               ctx,
+               tag,
+               cmd_type
+      );
+
+      if (reg_ptr != 0) {
+
+         struct at_function_context_t fctx;
+         fctx.context = ctx;
+         fctx.user_data = reg_ptr->user_data;
+         range_init(&fctx.parameters);
+
+         if (cmd_type == AT_ASSIGNMENT_COMMAND) {
+            fctx.parameters.begin = tag.end + 1;
+            fctx.parameters.end = command.end;
+         }
+
+         struct at_cache_entry_t *cache = 0;
+
+         if (ctx->first_cache != 0 && (cache = at_find_cache_entry(ctx, &tag, cmd_type)) != 0) {
+
+            if (at_cache_entry_usable(ctx, cache, reg_ptr)) {
+               ctx->cache_stats.hits++;
+               at_append_data(ctx, cache->data, cache->size);
+               return cache->result;
+            }
+
+            ctx->cache_stats.misses++;
+            cache->valid = false;
+            cache->capture_failed = false;
+            cache->size = 0;
+            ctx->capture = cache;
+         }
+
+         struct at_function_result result;
+
+         at_function_result_init(&result);
+         at_unknown_error(&result);
+
+         reg_ptr->function(&result, &fctx);
+
+         if (cache != 0) {
+
+            ctx->capture = 0;
+
+            // Deferred and failed results are not kept
+            if (ctx->deferred == false && result.result && cache->capture_failed == false) {
+               cache->valid = true;
+               cache->result = result;
+               cache->s3 = ctx->s3;
+               cache->s4 = ctx->s4;
+               cache->charset = ctx->charset;
+               cache->command = reg_ptr;
+               cache->version = at_command_version(ctx);
+               cache->captured_at = ctx->clock != 0 ? ctx->clock() : 0;
+            }
+         }
+
+         return result;
+      }
+   }
+
+   struct at_function_result r;
+   at_return_operation_not_supported_error(&r);
+
+   // The fallback gets the whole command as parameters
+   if (ctx->fallback != 0) {
+
+      struct at_function_context_t fctx;
+      fctx.context = ctx;
+      fctx.parameters = command;
+      fctx.user_data = ctx->fallback_user;
+
+      ctx->fallback(&r, &fctx);
+   }
+
+   return r;
+}
+
+// A registry snapshot stays alive until the handler returned
+static struct at_function_result at_process_command(
+      struct at_context_t *ctx,
+      iterator_t line,
+      const struct at_token_t *token) {
+
+   if (ctx->registry_reader == 0)
+      return at_run_command(ctx, line, token);
+
+   at_registry_enter(ctx->registry_reader);
+   struct at_function_result result = at_run_command(ctx, line, token);
+   at_registry_leave(ctx->registry_reader);
+
+   return result;
+}
 
-   *ctx = (struct at_context_t*)malloc(sizeof(struct at_context_t));
+// Keeps the commands following a deferred one on the same line
+static void at_hold_line(struct at_context_t *ctx, iterator_t begin, iterator_t end) {
 
-   if (ctx == 0)
-      return;
+   unsigned int size = end - begin;
 
-   (*ctx)->cmee_level = 0;
-   (*ctx)->flush = flush;
-   (*ctx)->echo = true;
-   (*ctx)->first = 0;
-   (*ctx)->state = 0;
-   (*ctx)->input_buffer = (unsigned char *)malloc(AT_INPUT_BUFFER_SIZE);
-   (*ctx)->inputbuff_iterator = (*ctx)->input_buffer;
-   (*ctx)->output_buffer = (unsigned char *)malloc(AT_OUTPUT_BUFFER_SIZE);
-   (*ctx)->outputbuff_iterator = (*ctx)->output_buffer;
+   ctx->held_line = (unsigned char*)at_alloc(ctx, size);
+   ctx->held_line_size = 0;
 
-   (*ctx)->last_input_buffer = (unsigned char *)malloc(AT_INPUT_BUFFER_SIZE);
-   (*ctx)->lastinbuff_iterator = (*ctx)->last_input_buffer;
+   if (ctx->held_line != 0) {
+      memcpy(ctx->held_line, begin, size);
+      ctx->held_line_size = size;
+   }
+}
 
-   if ((*ctx)->input_buffer == 0  ||
-       (*ctx)->output_buffer == 0 ||
-       (*ctx)->last_input_buffer == 0) {
+// Runs the commands of a tokenized line
+static void at_process_commands(
+      struct at_context_t *ctx,
+      iterator_t line,
+      const struct at_lexer_t *lexer) {
 
-      at_context_free(*ctx);
-      *ctx = 0;
+   struct at_function_result result;
+   at_function_result_init (&result);
 
-      return;
-   }
+   for (unsigned int i = 0; i != lexer->count; ++i) {
 
-   at_command_add(*ctx, "+cmee", AT_ASSIGNMENT_COMMAND, at_cmee_buildin_assignment);
-   at_command_add(*ctx, "+cmee", AT_STATUS_COMMAND, at_cmee_buildin_status);
-   at_command_add(*ctx, "", AT_STANDALONE_COMMAND, at_standalone_buildin);
+      if (i == 0 && (lexer->bad_prefix || lexer->overflow)) {
+         at_return_operation_not_supported_error(&result);
+         break;
+      }
 
-   at_command_add(*ctx, "e0", AT_STANDALONE_COMMAND, ate0_buildin_status);
-   at_command_add(*ctx, "e1", AT_STANDALONE_COMMAND, ate1_buildin_status);
+      result = at_process_command(ctx, line, &lexer->tokens[i]);
 
-}
+      if (ctx->deferred) {
 
-struct range_t get_line(struct range_t *data){
+         if (i + 1 != lexer->count)
+            at_hold_line(ctx, line + lexer->tokens[i + 1].begin, line + lexer->line_end);
 
-   iterator_t r = range_search_character(data, '\r');
+         return;
+      }
 
-   if (r != data->end) {
-      return range_create_it(data->begin, r);
-   } else {
-      return range_empty();
+      if (result.result == false)
+         break;
    }
-}
 
-static void *at_get_state (struct at_context_t *context) {
-   return context->state;
+   at_append_result(ctx, &result);
+
+   at_flush_soft(ctx, AT_FLUSH_EVENT_RESPONSE);
 }
 
-bool at_get_in_quota_value(struct range_t *range, struct range_t *result){
+// Tokenizes and runs a line that was not fed to the context lexer
+static void at_process_line_data(
+      struct at_context_t *ctx,
+      struct range_t *line,
+      bool prefix) {
 
-   if (range_is_empty(range) == false &&
-       *(range->begin) == '\"' && *((range)->end -1) == '\"' ) {
+   struct at_lexer_t *lexer = &ctx->lexer;
 
-      result->begin = range->begin + 1;
-      result->end = range->end - 1;
-      return true;
+   at_lexer_run(lexer, ctx->classes, line->begin, range_size(line), prefix);
+
+   if (prefix && at_lexer_line_size(lexer) < 2) {
+      at_lexer_reset(lexer, true);
+      return;
    }
 
-   return false;
+   at_lexer_end(lexer);
+   at_process_commands(ctx, line->begin, lexer);
+   at_lexer_reset(lexer, true);
 }
 
+void at_process_line(
+      struct at_context_t *ctx,
+      struct range_t *line) {
 
-void split_at_commands(struct range_t *command, void(*ptr)(struct range_t* )){
+   at_process_line_data(ctx, line, true);
+}
 
-   bool qt = false;
+static iterator_t at_get_input_buffer_end_iterator(
+      struct at_context_t *ctx) {
 
-   iterator_t b_cmd = command->begin;
+   return ctx->input_buffer + AT_INPUT_BUFFER_SIZE;
+}
 
-   for (iterator_t it = command->begin; it != command->end; ++it) {
-      if (*it == '"') {
-         qt = !qt;
-      }
+// Keeps input that arrives or is left over while a command is deferred
+static void at_hold_input(struct at_context_t *ctx, iterator_t begin, iterator_t end, bool echoed) {
 
-      if (qt == false && *it == ';'){
+   unsigned int size = end - begin;
 
-         struct range_t cmd_range;
+   if (size == 0)
+      return;
 
+   if (ctx->held_input_size + size > ctx->held_input_capacity) {
 
-         cmd_range.begin = b_cmd;
-         cmd_range.end = it;
+      unsigned int capacity = ctx->held_input_capacity != 0 ? ctx->held_input_capacity : AT_INPUT_BUFFER_SIZE;
 
-         cmd_range = range_trim(&cmd_range);
+      while (capacity < ctx->held_input_size + size)
+         capacity *= 2;
 
-         ptr(&cmd_range);
-         b_cmd = it + 1;
-      }
+      unsigned char *p = (unsigned char*)at_realloc(ctx, ctx->held_input, ctx->held_input_capacity, capacity);
+
+      // Silently discard input, as on input buffer overflow
+      if (p == 0)
+         return;
+
+      ctx->held_input = p;
+      ctx->held_input_capacity = capacity;
    }
 
-   struct range_t cmd_range = range_create_it(b_cmd, command->end);
-   cmd_range = range_trim(&cmd_range);
-   ptr(&cmd_range);
+   memcpy(ctx->held_input + ctx->held_input_size, begin, size);
+   ctx->held_input_size += size;
+   ctx->held_input_echoed = echoed;
 }
 
-bool get_at_command(struct range_t *input, struct range_t *result){
-
-   if ( range_size(input) < 2) {
-      return  false;
-   };
+// Starts a streamed parameter at the '=' of the first command of the line
+static void at_begin_stream(struct at_context_t *ctx) {
 
-   unsigned char first = *input->begin;
-   unsigned char second = *(input->begin + 1);
+   struct range_t tag = range_create_it(
+         ctx->input_buffer + ctx->lexer.current.begin,
+         ctx->input_buffer + ctx->lexer.current.tag_end);
 
-   if ((first == 'a' || first == 'A') && (second == 't' || second == 'T')) {
-      result->begin = input->begin + 2;
-      result->end = input->end;
-      return true;
-   }
+   struct at_stream_register_t *p = ctx->first_stream;
 
-   return false;
-}
+   while (p != 0 && range_equals(&tag, p->command.tag) == false)
+      p = p->next;
 
-static void at_append_range(struct at_context_t *ctx, struct range_t *range){
-   for (iterator_t it = range->begin; it != range->end; ++it) {
-      at_append_char(ctx, *it);
-   }
-}
+   if (p == 0)
+      return;
 
+   ctx->stream = &p->command;
+   ctx->stream_context.context = ctx;
+   ctx->stream_context.user_data = p->command.user_data;
+   range_init(&ctx->stream_context.parameters);
 
-static bool is_character(unsigned char c){
-   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+   if (p->command.begin != 0)
+      p->command.begin(&ctx->stream_context);
 }
 
-static enum AT_CMD_TYPE at_get_cmd_type(struct range_t *tag, struct range_t *command){
+static void at_end_stream(struct at_context_t *ctx) {
 
-   if (tag->end == command->end) {
-      return AT_STANDALONE_COMMAND;
-   } else if ( *(tag->end) == '=' && ((range_size(tag) + 1) < range_size(command)))  {
-      return AT_ASSIGNMENT_COMMAND;
-   } else if ( *(tag->end) == '?' && ((range_size(tag) + 1) == range_size(command))) {
-      return AT_STATUS_COMMAND;
-   } else {
-      return AT_UNKOWN_COMMAND;
-   }
-}
+   const struct at_stream_command_t *command = ctx->stream;
+   struct at_function_result result;
 
-struct range_t at_get_tag(struct range_t *range) {
+   at_function_result_init(&result);
+   at_unknown_error(&result);
 
-   for (iterator_t it = range->begin; it != range->end; ++it) {
+   ctx->stream = 0;
+   ctx->inputbuff_iterator = ctx->input_buffer;
+   at_lexer_reset(&ctx->lexer, true);
 
-      if (it == range->begin) {
-         if (*it == '+' || *it == '&' || *it == '^'|| is_character(*it))
-            continue;
-      } else {
-         if (is_character(*it) || is_digit(*it))
-            continue;
-      }
+   command->end(&result, &ctx->stream_context);
 
-      struct range_t result;
+   if (ctx->deferred)
+      return;
 
-      result.begin = range->begin;
-      result.end = it;
+   at_append_result(ctx, &result);
+   at_flush_soft(ctx, AT_FLUSH_EVENT_RESPONSE);
+}
 
-      return result;
+// Buffers a byte of the current line and tokenizes it
+static void at_store_input(struct at_context_t *ctx, unsigned char c) {
+
+   if ( ctx->inputbuff_iterator == at_get_input_buffer_end_iterator(ctx)) {
+      // Silently discard input buffer, on buffer overflow
+      ctx->inputbuff_iterator = ctx->input_buffer;
+      at_lexer_reset(&ctx->lexer, true);
+      return;
    }
 
-   return *range;
+   *ctx->inputbuff_iterator = c;
+
+   bool assignment = at_lexer_feed(&ctx->lexer, ctx->classes, ctx->input_buffer,
+                                   ctx->inputbuff_iterator - ctx->input_buffer);
+
+   ctx->inputbuff_iterator++;
+
+   if (assignment && ctx->first_stream != 0)
+      at_begin_stream(ctx);
 }
 
-static struct at_command_register_t *at_find_command_register(
+// Runs the input of one fragment, returns where it stopped when a command
+// got deferred. Lines carry over to the next fragment in the input buffer.
+static iterator_t at_process_fragment(
       struct at_context_t *ctx,
-      struct range_t tag,
-      enum AT_CMD_TYPE cmd_type) {
+      const struct range_t *data,
+      iterator_t *echo_begin){
 
-   struct at_command_register_t *p = ctx->first;
+   const unsigned short *classes = ctx->classes;
+   struct at_lexer_t *lexer = &ctx->lexer;
 
-   while (p != 0){
-      if (range_equals(&tag, p->tag) && p->cmd_type == cmd_type)
-         return p;
+   for (iterator_t i = data->begin; i != data->end; ++i) {
 
-      p = p->next;
-   }
+      if (ctx->stream != 0) {
 
-   return 0;
-}
+         // Parameter bytes go to the handler straight from the input
+         iterator_t end = i;
 
-static void at_append_ok(struct at_context_t *ctx) {
-   at_append_line(ctx, "");
-   at_append_line(ctx, "OK");
-}
+         while (end != data->end && (classes[*end] & AT_CLASS_TERMINATOR) == 0)
+            ++end;
 
-static void at_append_error(struct at_context_t *ctx) {
-   at_append_line(ctx, "");
-   at_append_line(ctx, "ERROR");
-}
+         if (end != i) {
+            struct range_t chunk = range_create_it(i, end);
+            ctx->stream->data(&ctx->stream_context, &chunk);
+         }
 
+         if (end == data->end)
+            break;
 
-static struct at_function_result at_process_command(
-      struct at_context_t *ctx,
-      struct range_t *command) {
+         i = end;
 
-   struct range_t tag = at_get_tag(command);
+         at_append_echo(ctx, echo_begin, i + 1);
+         at_end_stream(ctx);
 
-   enum AT_CMD_TYPE cmd_type = at_get_cmd_type(&tag, command);
+         if (ctx->deferred) {
+            return i + 1;
+         }
 
+         continue;
+      }
 
-   if (cmd_type != AT_UNKOWN_COMMAND) {
+      unsigned short cls = classes[*i];
 
-      range_lowercase(&tag);
+      if ((cls & AT_CLASS_INPUT_CONTROL) == 0) {
+         at_store_input(ctx, *i);
+         continue;
+      }
 
-      struct at_command_register_t *reg_ptr = at_find_command_register(
-               ctx,
-               tag,
-               cmd_type
-      );
+      if (cls & AT_CLASS_TERMINATOR) {
 
-      if (reg_ptr != 0) {
+         // Terminators on an empty line are skipped
+         if (ctx->inputbuff_iterator == ctx->input_buffer)
+            continue;
 
-         struct at_function_context_t fctx;
-         fctx.context = ctx;
-         range_init(&fctx.parameters);
+         // Echo of the line goes out together with its response
+         at_append_echo(ctx, echo_begin, i + 1);
 
-         if (cmd_type == AT_ASSIGNMENT_COMMAND) {
-            fctx.parameters.begin = tag.end + 1;
-            fctx.parameters.end = command->end;
+         if (at_lexer_line_size(lexer) >= 2) {
+            at_lexer_end(lexer);
+            at_process_commands(ctx, ctx->input_buffer, lexer);
          }
 
-         struct at_function_result result;
+         at_lexer_reset(lexer, true);
 
-         at_function_result_init(&result);
+         // The line becomes the last line for A/ without being copied
+         unsigned char *last = ctx->last_input_buffer;
 
-         result.code = 100;
-         result.detailed = "Unknown error";
-         result.result = false;
+         ctx->last_input_buffer = ctx->input_buffer;
+         ctx->lastinbuff_iterator = ctx->inputbuff_iterator;
+         ctx->input_buffer = last;
+         ctx->inputbuff_iterator = last;
 
-         reg_ptr->function(&result, &fctx);
+         if (ctx->deferred) {
+            return i + 1;
+         }
 
-         return result;
+         continue;
       }
-   }
 
-   struct at_function_result r;
-   at_return_operation_not_supported_error(&r);
-   return r;
-}
+      if (cls & AT_CLASS_BACKSPACE) {
 
+         // Rare, the line is tokenized again without its last byte
+         if (ctx->inputbuff_iterator != ctx->input_buffer) {
+            ctx->inputbuff_iterator--;
+            at_lexer_run(lexer, classes, ctx->input_buffer,
+                         ctx->inputbuff_iterator - ctx->input_buffer, true);
+         }
 
-static struct at_function_result at_process_chunk(
-      struct at_context_t *ctx,
-      struct range_t *data,
-      bool first_chunk){
+         continue;
+      }
 
-   if (first_chunk) {
-      struct range_t r;
-      if (get_at_command(data, &r)){
-         return at_process_command(ctx, &r);
-      } else {
-         struct at_function_result r;
-         at_return_operation_not_supported_error(&r);
-         return r;
+      // A/ repeats the last command line
+      if ( (ctx->inputbuff_iterator - ctx->input_buffer) == 1 &&
+           ( *ctx->input_buffer == 'A' || *ctx->input_buffer == 'a' )) {
+
+         struct range_t lline = get_range_by_iterators(ctx->last_input_buffer, ctx->lastinbuff_iterator);
+
+         at_append_echo(ctx, echo_begin, i + 1);
+
+         if (range_is_empty(&lline) == false) {
+            at_process_line(ctx, &lline);
+         }
+
+         ctx->inputbuff_iterator = ctx->input_buffer;
+
+         if (ctx->deferred) {
+            return i + 1;
+         }
+
+         continue;
       }
-   } else {
-      return at_process_command(ctx, data);
+
+      at_store_input(ctx, *i);
    }
+
+   return data->end;
 }
 
-static void at_process_commands(
+// Runs a batch of fragments as one stream: immediate echo is appended in one
+// pass and the input end flush happens once for the batch.
+static void at_process_data(
       struct at_context_t *ctx,
-      struct range_t *line) {
+      const struct range_t *iov,
+      size_t count,
+      bool echoed){
 
-   bool qt = false;
-   bool first_chunk = true;
-   iterator_t b_cmd = line->begin;
-   struct at_function_result result;
-   at_function_result_init (&result);
+   bool partial_echo = false;
 
-   for (iterator_t it = line->begin; it != line->end; ++it) {
+   ctx->in_input = true;
 
-      if (*it == '"') {
-         qt = !qt;
-      }
+   if (echoed == false && ctx->echo && ctx->echo_policy == AT_ECHO_IMMEDIATE) {
 
-      if (qt == false && *it == ';') {
+      for (size_t f = 0; f < count; ++f)
+         at_append_data(ctx, iov[f].begin, iov[f].end - iov[f].begin);
 
-         struct range_t cmd_range;
+      at_flush_soft(ctx, AT_FLUSH_EVENT_ECHO);
+      echoed = true;
+   }
 
-         cmd_range.begin = b_cmd;
-         cmd_range.end = it;
+   for (size_t f = 0; f < count; ++f) {
 
-         cmd_range = range_trim(&cmd_range);
+      iterator_t echo_begin = echoed ? iov[f].end : iov[f].begin;
+      iterator_t rest = at_process_fragment(ctx, &iov[f], &echo_begin);
 
-         result = at_process_chunk(ctx, &cmd_range, first_chunk);
+      if (ctx->deferred) {
 
-         if (result.result == false)
-            break;
+         at_hold_input(ctx, rest, iov[f].end, echo_begin == iov[f].end);
 
-         first_chunk = false;
-         b_cmd = it + 1;
+         while (++f < count)
+            at_hold_input(ctx, iov[f].begin, iov[f].end, echoed);
+
+         partial_echo = false;
+         break;
       }
+
+      partial_echo = ctx->echo && echo_begin != iov[f].end;
+      at_append_echo(ctx, &echo_begin, iov[f].end);
    }
 
-   if (result.result == true) {
-      struct range_t cmd_range = range_create_it(b_cmd, line->end);
-      cmd_range = range_trim(&cmd_range);
-      result = at_process_chunk(ctx, &cmd_range, first_chunk);
+   // Echo of an unfinished line, show it without waiting for the response
+   if (partial_echo && ctx->echo_policy == AT_ECHO_MERGED) {
+      at_flush_soft(ctx, AT_FLUSH_EVENT_ECHO);
    }
 
-   if (result.result == true) {
-      at_append_ok(ctx);
-   } else {
+   ctx->in_input = false;
+   at_flush_soft(ctx, AT_FLUSH_EVENT_INPUT_END);
+}
 
-      switch (ctx->cmee_level){
+void at_process_input(
+      struct at_context_t *ctx,
+      struct range_t *data){
 
-      case 0:
-         at_append_error(ctx);
-         break;
-      case 1:
-         at_append_line(ctx, "");
-         at_append_text(ctx, "+CME ERROR: ");
-         at_append_int(ctx, result.code);
-         at_append_line(ctx, "");
-         break;
-      case 2:
-         at_append_line(ctx, "");
-         at_append_text(ctx, "+CME ERROR: ");
-         at_append_line(ctx, result.detailed);
-      }
+   at_process_inputv(ctx, data, 1);
+}
+
+void at_process_inputv(
+      struct at_context_t *ctx,
+      const struct range_t *iov,
+      size_t count){
+
+   // Empty fragments are dropped, they would only split the echo
+   while (count != 0 && iov->begin == iov->end) {
+      iov++;
+      count--;
    }
 
-   at_flush_output(ctx);
-}
+   while (count != 0 && iov[count - 1].begin == iov[count - 1].end)
+      count--;
 
+   if (count == 0)
+      return;
 
-void at_process_line(
-      struct at_context_t *ctx,
-      struct range_t *line) {
+   if (ctx->record != 0) {
+      for (size_t f = 0; f < count; ++f)
+         at_record(ctx, AT_RECORD_INPUT, iov[f], range_empty());
+   }
+
+   if (ctx->deferred) {
+
+      bool echoed = ctx->echo && ctx->echo_policy == AT_ECHO_IMMEDIATE;
+
+      for (size_t f = 0; f < count; ++f) {
+         if (echoed)
+            at_append_data(ctx, iov[f].begin, iov[f].end - iov[f].begin);
 
-   struct range_t trimmed_line =  range_trim(line);
+         at_hold_input(ctx, iov[f].begin, iov[f].end, echoed);
+      }
+
+      if (echoed)
+         at_flush_soft(ctx, AT_FLUSH_EVENT_ECHO);
 
-   if ( range_is_empty(&trimmed_line) || range_size(&trimmed_line) < 2) {
       return;
    }
 
-   at_process_commands(ctx, &trimmed_line);
+   at_process_data(ctx, iov, count, false);
 }
 
-static iterator_t at_get_input_buffer_end_iterator(
-      struct at_context_t *ctx) {
+void at_defer(struct at_function_context_t *fctx) {
+   fctx->context->deferred = true;
+}
 
-   return ctx->input_buffer + AT_INPUT_BUFFER_SIZE;
+bool at_is_deferred(struct at_context_t *ctx) {
+   return ctx->deferred;
 }
 
-void at_process_input(
-      struct at_context_t *ctx,
-      struct range_t *data){
+void at_resume(struct at_context_t *ctx, const struct at_function_result *result) {
 
-   if ( range_is_empty(data))
+   if (ctx->deferred == false)
       return;
 
-   if (ctx->echo) {
-      at_append_range(ctx, data);
-      at_flush_output(ctx);
-   }
+   ctx->deferred = false;
 
-   for (iterator_t i = data->begin; i != data->end; ++i) {
+   // The deferred command is done, its parameters may go
+   at_free(ctx, ctx->line_storage, ctx->line_storage_size);
+   ctx->line_storage = 0;
 
-      if ( *i == '\r' && ctx->inputbuff_iterator != ctx->input_buffer) {
-         struct range_t line = get_range_by_iterators(ctx->input_buffer, ctx->inputbuff_iterator);
-         at_process_line( ctx, &line);
+   if (ctx->held_line != 0 && result->result) {
 
-         ctx->lastinbuff_iterator = ctx->last_input_buffer;
+      struct range_t line = range_create_cnt(ctx->held_line, ctx->held_line_size);
 
-         for (iterator_t i = ctx->input_buffer; i != ctx->inputbuff_iterator; ++i) {
-            *(ctx->lastinbuff_iterator)++ = *i;
-         }
+      ctx->line_storage = ctx->held_line;
+      ctx->line_storage_size = ctx->held_line_size;
+      ctx->held_line = 0;
+      ctx->held_line_size = 0;
 
-         ctx->inputbuff_iterator = ctx->input_buffer;
-         continue;
-      }
+      at_process_line_data(ctx, &line, false);
 
-      if (*i == '/') {
+      if (ctx->deferred)
+         return;
 
-         struct range_t line = get_range_by_iterators(ctx->input_buffer, ctx->inputbuff_iterator);
+      at_free(ctx, ctx->line_storage, ctx->line_storage_size);
+      ctx->line_storage = 0;
 
-         if ( (range_size(&line) == 1) && ( *ctx->input_buffer == 'A' || *ctx->input_buffer == 'a' )) {
+   } else {
 
-            struct range_t lline = get_range_by_iterators(ctx->last_input_buffer, ctx->lastinbuff_iterator);
+      at_free(ctx, ctx->held_line, ctx->held_line_size);
+      ctx->held_line = 0;
+      ctx->held_line_size = 0;
 
-            if (range_is_empty(&lline) == false) {
-               at_process_line(ctx, &lline);
-            }
+      struct at_function_result r = *result;
+      at_append_result(ctx, &r);
+      at_flush_soft(ctx, AT_FLUSH_EVENT_RESPONSE);
+   }
 
-            ctx->inputbuff_iterator = ctx->input_buffer;
-            continue;
-         }
-      }
+   if (ctx->held_input_size != 0) {
 
-      if ( ctx->inputbuff_iterator == at_get_input_buffer_end_iterator(ctx)) {
-         // Silently discard input buffer, on buffer overflow
-         ctx->inputbuff_iterator = ctx->input_buffer;
-         continue;
-      }
+      unsigned char *held = ctx->held_input;
+      struct range_t data = range_create_cnt(held, ctx->held_input_size);
+      unsigned int capacity = ctx->held_input_capacity;
+      bool echoed = ctx->held_input_echoed;
+
+      ctx->held_input = 0;
+      ctx->held_input_size = 0;
+      ctx->held_input_capacity = 0;
+
+      at_process_data(ctx, &data, 1, echoed);
 
-      *ctx->inputbuff_iterator++ = *i;
+      at_free(ctx, held, capacity);
    }
 }
 
+void at_relay(struct at_context_t *ctx, const unsigned char *data, unsigned int size, bool unsolicited){
+
+   at_append_data(ctx, data, size);
+
+   if (unsolicited)
+      at_flush_soft(ctx, AT_FLUSH_EVENT_UNSOLICITED);
+}
+
 void at_add_unsolicited(struct at_context_t *ctx, const char *prefix, const char *text){
+
+   if (ctx->record != 0) {
+      at_record(ctx, AT_RECORD_UNSOLICITED, get_range((unsigned char*)text), get_range((unsigned char*)prefix));
+   }
+
    at_append_line(ctx, "");
    at_append_text(ctx, "+");
    at_append_text(ctx, prefix);
    at_append_text(ctx, ": ");
    at_append_line(ctx, text);
-   at_flush_output(ctx);
+   at_flush_soft(ctx, AT_FLUSH_EVENT_UNSOLICITED);
 }
 
 void at_add_unsolicited_line(struct at_context_t *ctx, const char *text) {
+
+   if (ctx->record != 0) {
+      at_record(ctx, AT_RECORD_UNSOLICITED_LINE, get_range((unsigned char*)text), range_empty());
+   }
+
    at_append_line(ctx, "");
    at_append_line(ctx, text);
-   at_flush_output(ctx);
+   at_flush_soft(ctx, AT_FLUSH_EVENT_UNSOLICITED);
 }
@@ -5,9 +5,33 @@
 #include "at.h"
 
 void split_at_commands(struct range_t *command, void(*ptr)(struct range_t* ));
-struct range_t at_get_tag(struct range_t *range);
+struct range_t at_get_tag(struct at_context_t *ctx, struct range_t *range);
 struct range_t get_line(struct range_t *data);
 bool get_at_command(struct range_t *input, struct range_t *result);
 
+// Output buffer space for encoders that write in place. Flushes first when
+// fewer than 'min' bytes are free, 'min' is at most AT_OUTPUT_BUFFER_SIZE.
+// Returns 0 when a pooled context gets no buffer, the output is dropped and
+// the final result of the line reports it.
+iterator_t at_output_reserve(struct at_context_t *ctx, unsigned int min, unsigned int *size);
+void at_output_commit(struct at_context_t *ctx, iterator_t end);
+
+// Appends bytes from another AT device as they are, unsolicited ones flush
+// like URCs
+void at_relay(struct at_context_t *ctx, const unsigned char *data, unsigned int size, bool unsolicited);
+
+// URC queue of a context, created by at_set_urc_queue()
+struct at_urc_queue_t;
+struct at_urc_queue_t **at_get_urc_queue(struct at_context_t *ctx);
+void at_urc_queue_free(struct at_context_t *ctx, struct at_urc_queue_t *queue);
+
+// Blocks from the context allocator, frees take the size of the block
+void *at_alloc(struct at_context_t *ctx, size_t size);
+void *at_realloc(struct at_context_t *ctx, void *p, size_t old_size, size_t size);
+void at_free(struct at_context_t *ctx, void *p, size_t size);
+
+// Allocator of contexts created without one, for objects shared by contexts
+const struct at_allocator_t *at_get_default_allocator(void);
+
 
 #endif // AT_INTERNAL_H
@@ -0,0 +1,683 @@
+#include "codec_internal.h"
+#include "at_internal.h"
+
+#if AT_OUTPUT_BUFFER_SIZE < 16
+#error The character set encoders need AT_OUTPUT_BUFFER_SIZE of at least 16
+#endif
+
+#define AT_UTF8_REPLACEMENT 0xfffd
+#define AT_GSM_ESCAPE 0x1b
+
+static const char at_ucs2_hex_digits[] = "0123456789ABCDEF";
+
+// GSM 03.38 default alphabet, the escape to the extension table reads as a
+// no-break space on its own
+static const unsigned short at_gsm_default[128] = {
+   0x0040, 0x00a3, 0x0024, 0x00a5, 0x00e8, 0x00e9, 0x00f9, 0x00ec,
+   0x00f2, 0x00c7, 0x000a, 0x00d8, 0x00f8, 0x000d, 0x00c5, 0x00e5,
+   0x0394, 0x005f, 0x03a6, 0x0393, 0x039b, 0x03a9, 0x03a0, 0x03a8,
+   0x03a3, 0x0398, 0x039e, 0x00a0, 0x00c6, 0x00e6, 0x00df, 0x00c9,
+   0x0020, 0x0021, 0x0022, 0x0023, 0x00a4, 0x0025, 0x0026, 0x0027,
+   0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+   0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+   0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+   0x00a1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+   0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+   0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+   0x0058, 0x0059, 0x005a, 0x00c4, 0x00d6, 0x00d1, 0x00dc, 0x00a7,
+   0x00bf, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+   0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+   0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+   0x0078, 0x0079, 0x007a, 0x00e4, 0x00f6, 0x00f1, 0x00fc, 0x00e0
+};
+
+struct at_gsm_extension_t {
+   unsigned char code;
+   unsigned short value;
+};
+
+static const struct at_gsm_extension_t at_gsm_extension[] = {
+   { 0x0a, 0x000c }, { 0x14, 0x005e }, { 0x28, 0x007b }, { 0x29, 0x007d },
+   { 0x2f, 0x005c }, { 0x3c, 0x005b }, { 0x3d, 0x007e }, { 0x3e, 0x005d },
+   { 0x40, 0x007c }, { 0x65, 0x20ac }
+};
+
+#define AT_GSM_EXTENSIONS (sizeof(at_gsm_extension) / sizeof(at_gsm_extension[0]))
+
+// Vector kernels for runs of ASCII, which is what most strings are. Like
+// the codec kernels they handle whole blocks from the start and return how
+// much input they consumed; they stop at the first block with a character
+// outside ASCII or an invalid hex digit and leave it to the scalar code.
+
+#ifdef AT_CODEC_X86
+
+// 16 hex digits to 8 bytes in the low half, false on an invalid digit
+__attribute__((target("ssse3")))
+static inline bool at_ucs2_hex_block_ssse3(const unsigned char *in, __m128i *bytes) {
+
+   __m128i c = _mm_loadu_si128((const __m128i*)in);
+   __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+   __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+   __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+   __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+   if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff)
+      return false;
+
+   __m128i value = _mm_or_si128(
+         _mm_and_si128(is_digit, digit),
+         _mm_andnot_si128(is_digit, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+
+   __m128i pairs = _mm_maddubs_epi16(value, _mm_set1_epi16(0x0110));
+   *bytes = _mm_packus_epi16(pairs, pairs);
+   return true;
+}
+
+// The high byte of every big endian code unit zero, the low one below 0x80
+#define AT_UCS2_NOT_ASCII 0x80ff
+
+// The low bytes of 8 code units
+#define AT_UCS2_LOW_BYTES \
+   1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static unsigned int at_ucs2_hex_decode_ssse3(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   const __m128i not_ascii = _mm_set1_epi16(AT_UCS2_NOT_ASCII);
+   const __m128i low_bytes = _mm_setr_epi8(AT_UCS2_LOW_BYTES);
+   unsigned int i = 0;
+
+   // 8 code units, 32 digits, per block
+   for (; i + 32 <= size; i += 32) {
+
+      __m128i first;
+      __m128i second;
+
+      if (at_ucs2_hex_block_ssse3(in + i, &first) == false ||
+          at_ucs2_hex_block_ssse3(in + i + 16, &second) == false)
+         break;
+
+      __m128i units = _mm_unpacklo_epi64(first, second);
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(units, not_ascii), _mm_setzero_si128())) != 0xffff)
+         break;
+
+      _mm_storel_epi64((__m128i*)(out + i / 4), _mm_shuffle_epi8(units, low_bytes));
+   }
+
+   return i;
+}
+
+// 32 hex digits to 16 bytes in the low lane, false on an invalid digit
+__attribute__((target("avx2")))
+static inline bool at_ucs2_hex_block_avx2(const unsigned char *in, __m128i *bytes) {
+
+   __m256i c = _mm256_loadu_si256((const __m256i*)in);
+   __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+   __m256i letter = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+   __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+   __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+
+   if (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)) != -1)
+      return false;
+
+   __m256i value = _mm256_blendv_epi8(_mm256_add_epi8(letter, _mm256_set1_epi8(10)), digit, is_digit);
+   __m256i pairs = _mm256_maddubs_epi16(value, _mm256_set1_epi16(0x0110));
+
+   *bytes = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x08));
+   return true;
+}
+
+__attribute__((target("avx2")))
+static unsigned int at_ucs2_hex_decode_avx2(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   const __m256i not_ascii = _mm256_set1_epi16(AT_UCS2_NOT_ASCII);
+   const __m256i low_bytes = _mm256_setr_epi8(AT_UCS2_LOW_BYTES, AT_UCS2_LOW_BYTES);
+   unsigned int i = 0;
+
+   // 16 code units, 64 digits, per block
+   for (; i + 64 <= size; i += 64) {
+
+      __m128i first;
+      __m128i second;
+
+      if (at_ucs2_hex_block_avx2(in + i, &first) == false ||
+          at_ucs2_hex_block_avx2(in + i + 32, &second) == false)
+         break;
+
+      __m256i units = _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+
+      if (_mm256_testz_si256(units, not_ascii) == 0)
+         break;
+
+      // 8 characters at the start of each lane, then the lanes together
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(units, low_bytes), 0x08);
+
+      _mm_storeu_si128((__m128i*)(out + i / 4), _mm256_castsi256_si128(packed));
+   }
+
+   return i;
+}
+
+__attribute__((target("ssse3")))
+static unsigned int at_ucs2_hex_encode_ssse3(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   const __m128i digits = _mm_setr_epi8(
+         '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+   const __m128i low_mask = _mm_set1_epi8(0x0f);
+   const __m128i zeros = _mm_set1_epi8('0');
+   unsigned int i = 0;
+
+   // 8 characters to 32 digits per block
+   for (; i + 8 <= size; i += 8) {
+
+      __m128i b = _mm_loadl_epi64((const __m128i*)(data + i));
+
+      if ((_mm_movemask_epi8(b) & 0xff) != 0)
+         break;
+
+      __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(b, 4), low_mask));
+      __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(b, low_mask));
+      __m128i pairs = _mm_unpacklo_epi8(high, low);
+
+      _mm_storeu_si128((__m128i*)(out + 4 * i), _mm_unpacklo_epi16(zeros, pairs));
+      _mm_storeu_si128((__m128i*)(out + 4 * i + 16), _mm_unpackhi_epi16(zeros, pairs));
+   }
+
+   return i;
+}
+
+__attribute__((target("avx2")))
+static unsigned int at_ucs2_hex_encode_avx2(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   const __m128i digits = _mm_setr_epi8(
+         '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+   const __m128i low_mask = _mm_set1_epi8(0x0f);
+   const __m256i zeros = _mm256_set1_epi8('0');
+   unsigned int i = 0;
+
+   // 16 characters to 64 digits per block
+   for (; i + 16 <= size; i += 16) {
+
+      __m128i b = _mm_loadu_si128((const __m128i*)(data + i));
+
+      if (_mm_movemask_epi8(b) != 0)
+         break;
+
+      __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(b, 4), low_mask));
+      __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(b, low_mask));
+      __m256i pairs = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_unpacklo_epi8(high, low)),
+            _mm_unpackhi_epi8(high, low), 1);
+
+      // Interleaving works per 128 bit lane, put the lanes back in order
+      __m256i first = _mm256_unpacklo_epi16(zeros, pairs);
+      __m256i second = _mm256_unpackhi_epi16(zeros, pairs);
+
+      _mm256_storeu_si256((__m256i*)(out + 4 * i), _mm256_permute2x128_si256(first, second, 0x20));
+      _mm256_storeu_si256((__m256i*)(out + 4 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+   }
+
+   return i;
+}
+
+#endif // AT_CODEC_X86
+
+static unsigned int at_ucs2_hex_kernel_decode(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+#ifdef AT_CODEC_X86
+   if (at_codec_has_avx2()) {
+      unsigned int done = at_ucs2_hex_decode_avx2(in, size, out);
+      return done + at_ucs2_hex_decode_ssse3(in + done, size - done, out + done / 4);
+   }
+
+   if (at_codec_has_ssse3())
+      return at_ucs2_hex_decode_ssse3(in, size, out);
+#endif
+
+   return 0;
+}
+
+static unsigned int at_ucs2_hex_kernel_encode(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+#ifdef AT_CODEC_X86
+   if (at_codec_has_avx2()) {
+      unsigned int done = at_ucs2_hex_encode_avx2(data, size, out);
+      return done + at_ucs2_hex_encode_ssse3(data + done, size - done, out + 4 * done);
+   }
+
+   if (at_codec_has_ssse3())
+      return at_ucs2_hex_encode_ssse3(data, size, out);
+#endif
+
+   return 0;
+}
+
+// Scalar code
+
+static unsigned int at_ucs2_nibble(unsigned char c) {
+
+   if (c >= '0' && c <= '9')
+      return c - '0';
+
+   c |= 0x20;
+
+   if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+
+   return 0x10000;
+}
+
+// One code unit from four digits, above 0xffff when a digit is invalid
+static unsigned int at_ucs2_unit(const unsigned char *in) {
+   return at_ucs2_nibble(in[0]) << 12 | at_ucs2_nibble(in[1]) << 8 |
+          at_ucs2_nibble(in[2]) << 4 | at_ucs2_nibble(in[3]);
+}
+
+static unsigned int at_utf8_put(unsigned int c, unsigned char *out) {
+
+   if (c < 0x80) {
+      out[0] = c;
+      return 1;
+   }
+
+   if (c < 0x800) {
+      out[0] = 0xc0 | c >> 6;
+      out[1] = 0x80 | (c & 0x3f);
+      return 2;
+   }
+
+   if (c < 0x10000) {
+      out[0] = 0xe0 | c >> 12;
+      out[1] = 0x80 | (c >> 6 & 0x3f);
+      out[2] = 0x80 | (c & 0x3f);
+      return 3;
+   }
+
+   out[0] = 0xf0 | c >> 18;
+   out[1] = 0x80 | (c >> 12 & 0x3f);
+   out[2] = 0x80 | (c >> 6 & 0x3f);
+   out[3] = 0x80 | (c & 0x3f);
+   return 4;
+}
+
+// Next code point, U+FFFD for one byte of an invalid, overlong or
+// truncated sequence or an encoded surrogate
+static unsigned int at_utf8_next(const unsigned char *data, unsigned int size, unsigned int *length) {
+
+   unsigned char c = data[0];
+   unsigned int count;
+   unsigned int value;
+   unsigned char low = 0x80;
+   unsigned char high = 0xbf;
+
+   *length = 1;
+
+   if (c < 0x80)
+      return c;
+
+   if (c >= 0xc2 && c <= 0xdf) {
+      count = 1;
+      value = c & 0x1f;
+   } else if (c >= 0xe0 && c <= 0xef) {
+      count = 2;
+      value = c & 0x0f;
+      low = c == 0xe0 ? 0xa0 : 0x80;
+      high = c == 0xed ? 0x9f : 0xbf;
+   } else if (c >= 0xf0 && c <= 0xf4) {
+      count = 3;
+      value = c & 0x07;
+      low = c == 0xf0 ? 0x90 : 0x80;
+      high = c == 0xf4 ? 0x8f : 0xbf;
+   } else {
+      return AT_UTF8_REPLACEMENT;
+   }
+
+   if (count >= size || data[1] < low || data[1] > high)
+      return AT_UTF8_REPLACEMENT;
+
+   for (unsigned int i = 1; i <= count; ++i) {
+
+      if ((data[i] & 0xc0) != 0x80)
+         return AT_UTF8_REPLACEMENT;
+
+      value = value << 6 | (data[i] & 0x3f);
+   }
+
+   *length = count + 1;
+   return value;
+}
+
+static void at_ucs2_put(unsigned int unit, unsigned char *out) {
+   out[0] = at_ucs2_hex_digits[unit >> 12];
+   out[1] = at_ucs2_hex_digits[unit >> 8 & 0x0f];
+   out[2] = at_ucs2_hex_digits[unit >> 4 & 0x0f];
+   out[3] = at_ucs2_hex_digits[unit & 0x0f];
+}
+
+bool at_ucs2_hex_decode(const struct range_t *in, unsigned char *out, unsigned int *size) {
+
+   unsigned int length = in->end - in->begin;
+   unsigned int i = 0;
+   unsigned int o = 0;
+
+   if (length % 4 != 0)
+      return false;
+
+   while (i < length) {
+
+      unsigned int done = at_ucs2_hex_kernel_decode(in->begin + i, length - i, out + o);
+
+      i += done;
+      o += done / 4;
+
+      // Up to the end of the first run outside ASCII, the kernel resumes
+      // behind it
+      bool other = false;
+
+      while (i < length) {
+
+         unsigned int unit = at_ucs2_unit(in->begin + i);
+
+         if (other && unit < 0x80)
+            break;
+
+         if (unit > 0xffff || (unit >= 0xdc00 && unit <= 0xdfff))
+            return false;
+
+         other = unit >= 0x80;
+         i += 4;
+
+         if (unit >= 0xd800 && unit <= 0xdbff) {
+
+            unsigned int second = i < length ? at_ucs2_unit(in->begin + i) : 0;
+
+            if (second < 0xdc00 || second > 0xdfff)
+               return false;
+
+            i += 4;
+            unit = 0x10000 + ((unit - 0xd800) << 10) + (second - 0xdc00);
+         }
+
+         o += at_utf8_put(unit, out + o);
+      }
+   }
+
+   *size = o;
+   return true;
+}
+
+unsigned int at_ucs2_hex_encode(const unsigned char *utf8, unsigned int size, unsigned char *out) {
+
+   unsigned int i = 0;
+   unsigned int o = 0;
+
+   while (i < size) {
+
+      unsigned int done = at_ucs2_hex_kernel_encode(utf8 + i, size - i, out + o);
+
+      i += done;
+      o += 4 * done;
+
+      // Up to the end of the first run outside ASCII, the kernel resumes
+      // behind it
+      bool other = false;
+
+      while (i < size && (other == false || utf8[i] >= 0x80)) {
+
+         unsigned int length;
+         unsigned int c = at_utf8_next(utf8 + i, size - i, &length);
+
+         if (c >= 0x10000) {
+            c -= 0x10000;
+            at_ucs2_put(0xd800 + (c >> 10), out + o);
+            at_ucs2_put(0xdc00 + (c & 0x3ff), out + o + 4);
+            o += 8;
+         } else {
+            at_ucs2_put(c, out + o);
+            o += 4;
+         }
+
+         other = c >= 0x80;
+         i += length;
+      }
+   }
+
+   return o;
+}
+
+static unsigned int at_gsm_to_unicode(unsigned char code) {
+
+   for (unsigned int i = 0; i < AT_GSM_EXTENSIONS; ++i) {
+      if (at_gsm_extension[i].code == code)
+         return at_gsm_extension[i].value;
+   }
+
+   // Unknown extensions read as the default alphabet character
+   return at_gsm_default[code];
+}
+
+// One or two bytes, 0 when the alphabet has no such character
+static unsigned int at_unicode_to_gsm(unsigned int c, unsigned char *out) {
+
+   if (c < 0x80 && at_gsm_default[c] == c) {
+      out[0] = c;
+      return 1;
+   }
+
+   for (unsigned int i = 0; i < 128; ++i) {
+      if (at_gsm_default[i] == c && i != AT_GSM_ESCAPE) {
+         out[0] = i;
+         return 1;
+      }
+   }
+
+   for (unsigned int i = 0; i < AT_GSM_EXTENSIONS; ++i) {
+      if (at_gsm_extension[i].value == c) {
+         out[0] = AT_GSM_ESCAPE;
+         out[1] = at_gsm_extension[i].code;
+         return 2;
+      }
+   }
+
+   return 0;
+}
+
+static bool at_gsm_decode(const struct range_t *in, unsigned char *out, unsigned int capacity, unsigned int *size) {
+
+   unsigned int o = 0;
+
+   for (iterator_t it = in->begin; it != in->end; ++it) {
+
+      unsigned int c;
+
+      if (*it >= 0x80)
+         return false;
+
+      if (*it == AT_GSM_ESCAPE) {
+
+         if (++it == in->end || *it >= 0x80)
+            return false;
+
+         c = at_gsm_to_unicode(*it);
+      } else {
+         c = at_gsm_default[*it];
+      }
+
+      if (capacity - o < 4)
+         return false;
+
+      o += at_utf8_put(c, out + o);
+   }
+
+   *size = o;
+   return true;
+}
+
+bool at_charset_decode(
+      struct at_context_t *ctx,
+      const struct range_t *in,
+      unsigned char *out,
+      unsigned int capacity,
+      unsigned int *size) {
+
+   unsigned int length = in->end - in->begin;
+
+   switch (at_get_charset(ctx)) {
+
+   case AT_CHARSET_IRA:
+
+      if (length > capacity)
+         return false;
+
+      for (unsigned int i = 0; i < length; ++i) {
+         if (in->begin[i] >= 0x80)
+            return false;
+      }
+
+      memmove(out, in->begin, length);
+      *size = length;
+      return true;
+
+   case AT_CHARSET_GSM:
+      return at_gsm_decode(in, out, capacity, size);
+
+   case AT_CHARSET_UCS2:
+      // At most three bytes per four digits
+      return length / 4 * 3 <= capacity && at_ucs2_hex_decode(in, out, size);
+
+   case AT_CHARSET_HEX:
+      return length / 2 <= capacity && at_hex_decode(in, out, size);
+   }
+
+   return false;
+}
+
+bool at_charset_decode_quoted(
+      struct at_context_t *ctx,
+      struct range_t *parameter,
+      unsigned char *out,
+      unsigned int capacity,
+      struct range_t *result) {
+
+   struct range_t value;
+   unsigned int size;
+
+   if (at_get_in_quota_value(parameter, &value) == false ||
+       at_charset_decode(ctx, &value, out, capacity, &size) == false)
+      return false;
+
+   *result = range_create_cnt(out, size);
+   return true;
+}
+
+// Bytes of IRA and GSM strings, escaped inside quoted strings
+struct at_charset_writer_t {
+   struct at_context_t *ctx;
+   iterator_t out;
+   iterator_t end;
+   bool escape;
+};
+
+static void at_charset_put(struct at_charset_writer_t *w, unsigned char c) {
+
+   if (w->end - w->out < 3) {
+
+      unsigned int space;
+
+      at_output_commit(w->ctx, w->out);
+      w->out = at_output_reserve(w->ctx, 3, &space);
+      w->end = w->out + space;
+
+      // No output buffer to be had, the character is dropped
+      if (w->out == 0)
+         return;
+   }
+
+   if (w->escape && (c < 0x20 || c == '"' || c == '\\' || c == 0x7f)) {
+      *w->out++ = '\\';
+      *w->out++ = at_ucs2_hex_digits[c >> 4];
+      *w->out++ = at_ucs2_hex_digits[c & 0x0f];
+   } else {
+      *w->out++ = c;
+   }
+}
+
+static void at_charset_append(struct at_context_t *ctx, const unsigned char *utf8, unsigned int size, bool escape) {
+
+   enum AT_CHARSET charset = at_get_charset(ctx);
+
+   if (charset == AT_CHARSET_HEX) {
+      at_append_hex(ctx, utf8, size);
+      return;
+   }
+
+   if (charset == AT_CHARSET_UCS2) {
+
+      while (size > 0) {
+
+         unsigned int space;
+         iterator_t out = at_output_reserve(ctx, 16, &space);
+
+         if (out == 0)
+            return;
+
+         unsigned int chunk = space / 4 < size ? space / 4 : size;
+
+         // Whole characters, a longer run of continuation bytes is invalid anyway
+         for (unsigned int i = 0; i < 3 && chunk < size && (utf8[chunk] & 0xc0) == 0x80; ++i)
+            chunk--;
+
+         at_output_commit(ctx, out + at_ucs2_hex_encode(utf8, chunk, out));
+         utf8 += chunk;
+         size -= chunk;
+      }
+
+      return;
+   }
+
+   struct at_charset_writer_t w;
+   unsigned int space;
+
+   w.ctx = ctx;
+   w.out = at_output_reserve(ctx, 3, &space);
+   w.end = w.out + space;
+   w.escape = escape;
+
+   for (unsigned int i = 0; i < size; ) {
+
+      unsigned int length;
+      unsigned int c = at_utf8_next(utf8 + i, size - i, &length);
+      unsigned char gsm[2];
+      unsigned int count;
+
+      i += length;
+
+      if (charset == AT_CHARSET_IRA) {
+         at_charset_put(&w, c < 0x80 ? c : '?');
+         continue;
+      }
+
+      count = at_unicode_to_gsm(c, gsm);
+
+      if (count == 0) {
+         at_charset_put(&w, '?');
+         continue;
+      }
+
+      for (unsigned int k = 0; k < count; ++k)
+         at_charset_put(&w, gsm[k]);
+   }
+
+   at_output_commit(ctx, w.out);
+}
+
+void at_append_charset(struct at_context_t *ctx, const unsigned char *utf8, unsigned int size) {
+   at_charset_append(ctx, utf8, size, false);
+}
+
+void at_response_charset_string(struct at_response_t *r, const char *utf8) {
+   at_response_raw(r, "\"");
+   at_charset_append(r->ctx, (const unsigned char*)utf8, strlen(utf8), true);
+   at_append_char(r->ctx, '"');
+}
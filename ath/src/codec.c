@@ -0,0 +1,555 @@
+#include "codec_internal.h"
+#include "at_internal.h"
+
+#if AT_OUTPUT_BUFFER_SIZE < 4
+#error The encoders need AT_OUTPUT_BUFFER_SIZE of at least 4
+#endif
+
+#define AT_CODEC_INVALID 0xff
+
+// Decoding tables, computed at compile time
+
+#define AT_HEX_VALUE(c) ( \
+   ((c) >= '0' && (c) <= '9') ? (c) - '0' : \
+   ((c) >= 'a' && (c) <= 'f') ? (c) - 'a' + 10 : \
+   ((c) >= 'A' && (c) <= 'F') ? (c) - 'A' + 10 : AT_CODEC_INVALID)
+
+#define AT_BASE64_VALUE(c) ( \
+   ((c) >= 'A' && (c) <= 'Z') ? (c) - 'A' : \
+   ((c) >= 'a' && (c) <= 'z') ? (c) - 'a' + 26 : \
+   ((c) >= '0' && (c) <= '9') ? (c) - '0' + 52 : \
+   (c) == '+' ? 62 : (c) == '/' ? 63 : AT_CODEC_INVALID)
+
+#define AT_CODEC_ROW(f, r) \
+   f(r + 0), f(r + 1), f(r + 2), f(r + 3), f(r + 4), f(r + 5), f(r + 6), f(r + 7), \
+   f(r + 8), f(r + 9), f(r + 10), f(r + 11), f(r + 12), f(r + 13), f(r + 14), f(r + 15)
+
+#define AT_CODEC_TABLE(f) { \
+   AT_CODEC_ROW(f, 0x00), AT_CODEC_ROW(f, 0x10), AT_CODEC_ROW(f, 0x20), AT_CODEC_ROW(f, 0x30), \
+   AT_CODEC_ROW(f, 0x40), AT_CODEC_ROW(f, 0x50), AT_CODEC_ROW(f, 0x60), AT_CODEC_ROW(f, 0x70), \
+   AT_CODEC_ROW(f, 0x80), AT_CODEC_ROW(f, 0x90), AT_CODEC_ROW(f, 0xa0), AT_CODEC_ROW(f, 0xb0), \
+   AT_CODEC_ROW(f, 0xc0), AT_CODEC_ROW(f, 0xd0), AT_CODEC_ROW(f, 0xe0), AT_CODEC_ROW(f, 0xf0) }
+
+static const unsigned char at_hex_values[256] = AT_CODEC_TABLE(AT_HEX_VALUE);
+static const unsigned char at_base64_values[256] = AT_CODEC_TABLE(AT_BASE64_VALUE);
+
+static const char at_hex_digits[] = "0123456789ABCDEF";
+static const char at_base64_digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Vector kernels. Each one handles whole blocks from the start of the data
+// and returns how much input it consumed, the scalar code does the rest.
+// Decoders stop at the first block with an invalid character, the scalar
+// code then finds it.
+
+static enum AT_CODEC_KERNELS at_codec_kernels = AT_CODEC_AVX2;
+
+void at_codec_limit(enum AT_CODEC_KERNELS kernels) {
+   at_codec_kernels = kernels;
+}
+
+#ifdef AT_CODEC_X86
+
+bool at_codec_has_avx2(void) {
+   return at_codec_kernels >= AT_CODEC_AVX2 && __builtin_cpu_supports("avx2");
+}
+
+bool at_codec_has_ssse3(void) {
+   return at_codec_kernels >= AT_CODEC_SSSE3 && __builtin_cpu_supports("ssse3");
+}
+
+__attribute__((target("avx2")))
+static unsigned int at_hex_decode_avx2(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   const __m256i nine = _mm256_set1_epi8(9);
+   const __m256i five = _mm256_set1_epi8(5);
+   const __m256i ten = _mm256_set1_epi8(10);
+   const __m256i weights = _mm256_set1_epi16(0x0110);
+   unsigned int i = 0;
+
+   for (; i + 32 <= size; i += 32) {
+
+      __m256i c = _mm256_loadu_si256((const __m256i*)(in + i));
+      __m256i digit = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+      __m256i letter = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+      __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, nine), digit);
+      __m256i is_letter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, five), letter);
+
+      if (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)) != -1)
+         break;
+
+      __m256i value = _mm256_blendv_epi8(_mm256_add_epi8(letter, ten), digit, is_digit);
+
+      // High nibble * 16 + low nibble, then the 16 bit results to bytes
+      __m256i pairs = _mm256_maddubs_epi16(value, weights);
+      __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x08);
+
+      _mm_storeu_si128((__m128i*)(out + i / 2), _mm256_castsi256_si128(packed));
+   }
+
+   return i;
+}
+
+__attribute__((target("ssse3")))
+static unsigned int at_hex_decode_ssse3(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   const __m128i nine = _mm_set1_epi8(9);
+   const __m128i five = _mm_set1_epi8(5);
+   const __m128i ten = _mm_set1_epi8(10);
+   const __m128i weights = _mm_set1_epi16(0x0110);
+   unsigned int i = 0;
+
+   for (; i + 16 <= size; i += 16) {
+
+      __m128i c = _mm_loadu_si128((const __m128i*)(in + i));
+      __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+      __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+      __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, nine), digit);
+      __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, five), letter);
+
+      if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff)
+         break;
+
+      __m128i value = _mm_or_si128(
+            _mm_and_si128(is_digit, digit),
+            _mm_andnot_si128(is_digit, _mm_add_epi8(letter, ten)));
+
+      __m128i pairs = _mm_maddubs_epi16(value, weights);
+      _mm_storel_epi64((__m128i*)(out + i / 2), _mm_packus_epi16(pairs, pairs));
+   }
+
+   return i;
+}
+
+__attribute__((target("avx2")))
+static unsigned int at_hex_encode_avx2(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   const __m256i digits = _mm256_setr_epi8(
+         '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F',
+         '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+   const __m256i low_mask = _mm256_set1_epi8(0x0f);
+   unsigned int i = 0;
+
+   for (; i + 32 <= size; i += 32) {
+
+      __m256i b = _mm256_loadu_si256((const __m256i*)(data + i));
+      __m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(b, 4), low_mask));
+      __m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(b, low_mask));
+
+      // Interleaving works per 128 bit lane, put the lanes back in order
+      __m256i first = _mm256_unpacklo_epi8(high, low);
+      __m256i second = _mm256_unpackhi_epi8(high, low);
+
+      _mm256_storeu_si256((__m256i*)(out + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+      _mm256_storeu_si256((__m256i*)(out + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+   }
+
+   return i;
+}
+
+__attribute__((target("ssse3")))
+static unsigned int at_hex_encode_ssse3(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   const __m128i digits = _mm_setr_epi8(
+         '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+   const __m128i low_mask = _mm_set1_epi8(0x0f);
+   unsigned int i = 0;
+
+   for (; i + 16 <= size; i += 16) {
+
+      __m128i b = _mm_loadu_si128((const __m128i*)(data + i));
+      __m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(b, 4), low_mask));
+      __m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(b, low_mask));
+
+      _mm_storeu_si128((__m128i*)(out + 2 * i), _mm_unpacklo_epi8(high, low));
+      _mm_storeu_si128((__m128i*)(out + 2 * i + 16), _mm_unpackhi_epi8(high, low));
+   }
+
+   return i;
+}
+
+// Base64 kernels after W. Mula and D. Lemire, "Faster Base64 Encoding and
+// Decoding using AVX2 Instructions". Validation and translation use two
+// nibble lookups, packing uses multiply-add.
+
+#define AT_BASE64_LUT_LO \
+   0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+#define AT_BASE64_LUT_HI \
+   0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define AT_BASE64_LUT_ROLL \
+   0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define AT_BASE64_PACK \
+   2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+#define AT_BASE64_SPREAD \
+   1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+#define AT_BASE64_LUT_ENCODE \
+   65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0
+
+__attribute__((target("avx2")))
+static unsigned int at_base64_decode_avx2(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   const __m256i lut_lo = _mm256_setr_epi8(AT_BASE64_LUT_LO, AT_BASE64_LUT_LO);
+   const __m256i lut_hi = _mm256_setr_epi8(AT_BASE64_LUT_HI, AT_BASE64_LUT_HI);
+   const __m256i lut_roll = _mm256_setr_epi8(AT_BASE64_LUT_ROLL, AT_BASE64_LUT_ROLL);
+   const __m256i pack = _mm256_setr_epi8(AT_BASE64_PACK, AT_BASE64_PACK);
+   const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+   unsigned int i = 0;
+
+   // A block writes 32 bytes of which 24 are output, the 16 characters
+   // left behind make sure the extra bytes stay inside the output
+   for (; i + 48 <= size; i += 32) {
+
+      __m256i c = _mm256_loadu_si256((const __m256i*)(in + i));
+      __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(c, 4), mask_2f);
+      __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(c, mask_2f));
+      __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+
+      if (_mm256_testz_si256(lo, hi) == 0)
+         break;
+
+      __m256i eq_2f = _mm256_cmpeq_epi8(c, mask_2f);
+      __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+      __m256i values = _mm256_add_epi8(c, roll);
+
+      __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+      merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+      merged = _mm256_shuffle_epi8(merged, pack);
+      merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+
+      _mm256_storeu_si256((__m256i*)(out + i / 4 * 3), merged);
+   }
+
+   return i;
+}
+
+__attribute__((target("ssse3")))
+static unsigned int at_base64_decode_ssse3(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   const __m128i lut_lo = _mm_setr_epi8(AT_BASE64_LUT_LO);
+   const __m128i lut_hi = _mm_setr_epi8(AT_BASE64_LUT_HI);
+   const __m128i lut_roll = _mm_setr_epi8(AT_BASE64_LUT_ROLL);
+   const __m128i pack = _mm_setr_epi8(AT_BASE64_PACK);
+   const __m128i mask_2f = _mm_set1_epi8(0x2f);
+   unsigned int i = 0;
+
+   for (; i + 24 <= size; i += 16) {
+
+      __m128i c = _mm_loadu_si128((const __m128i*)(in + i));
+      __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(c, 4), mask_2f);
+      __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(c, mask_2f));
+      __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+         break;
+
+      __m128i eq_2f = _mm_cmpeq_epi8(c, mask_2f);
+      __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+      __m128i values = _mm_add_epi8(c, roll);
+
+      __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+      merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+
+      _mm_storeu_si128((__m128i*)(out + i / 4 * 3), _mm_shuffle_epi8(merged, pack));
+   }
+
+   return i;
+}
+
+// 12 input bytes in a lane to 16 six bit values, one per byte
+#define AT_BASE64_ENCODE_VALUES(mm, si, in, spread) ( \
+   mm##_or_##si( \
+      mm##_mulhi_epu16( \
+         mm##_and_##si(mm##_shuffle_epi8(in, spread), mm##_set1_epi32(0x0fc0fc00)), \
+         mm##_set1_epi32(0x04000040)), \
+      mm##_mullo_epi16( \
+         mm##_and_##si(mm##_shuffle_epi8(in, spread), mm##_set1_epi32(0x003f03f0)), \
+         mm##_set1_epi32(0x01000010))))
+
+// Six bit values to characters, an offset per range of the alphabet
+#define AT_BASE64_ENCODE_CHARS(mm, v, lut) ( \
+   mm##_add_epi8(v, mm##_shuffle_epi8(lut, \
+      mm##_sub_epi8( \
+         mm##_subs_epu8(v, mm##_set1_epi8(51)), \
+         mm##_cmpgt_epi8(v, mm##_set1_epi8(25))))))
+
+__attribute__((target("avx2")))
+static unsigned int at_base64_encode_avx2(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   const __m256i spread = _mm256_setr_epi8(AT_BASE64_SPREAD, AT_BASE64_SPREAD);
+   const __m256i lut = _mm256_setr_epi8(AT_BASE64_LUT_ENCODE, AT_BASE64_LUT_ENCODE);
+   unsigned int i = 0;
+
+   // Two 16 byte loads, 12 bytes used from each
+   for (; i + 28 <= size; i += 24) {
+
+      __m256i in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + i))),
+            _mm_loadu_si128((const __m128i*)(data + i + 12)), 1);
+
+      __m256i values = AT_BASE64_ENCODE_VALUES(_mm256, si256, in, spread);
+      _mm256_storeu_si256((__m256i*)(out + i / 3 * 4), AT_BASE64_ENCODE_CHARS(_mm256, values, lut));
+   }
+
+   return i;
+}
+
+__attribute__((target("ssse3")))
+static unsigned int at_base64_encode_ssse3(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   const __m128i spread = _mm_setr_epi8(AT_BASE64_SPREAD);
+   const __m128i lut = _mm_setr_epi8(AT_BASE64_LUT_ENCODE);
+   unsigned int i = 0;
+
+   for (; i + 16 <= size; i += 12) {
+
+      __m128i in = _mm_loadu_si128((const __m128i*)(data + i));
+      __m128i values = AT_BASE64_ENCODE_VALUES(_mm, si128, in, spread);
+      _mm_storeu_si128((__m128i*)(out + i / 3 * 4), AT_BASE64_ENCODE_CHARS(_mm, values, lut));
+   }
+
+   return i;
+}
+
+#endif // AT_CODEC_X86
+
+// Scalar code, also the tail after the vector kernels
+
+static bool at_hex_decode_scalar(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   for (unsigned int i = 0; i < size; i += 2) {
+
+      unsigned char high = at_hex_values[in[i]];
+      unsigned char low = at_hex_values[in[i + 1]];
+
+      if ((high | low) == AT_CODEC_INVALID)
+         return false;
+
+      out[i / 2] = high << 4 | low;
+   }
+
+   return true;
+}
+
+static void at_hex_encode_scalar(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   for (unsigned int i = 0; i < size; ++i) {
+      out[2 * i] = at_hex_digits[data[i] >> 4];
+      out[2 * i + 1] = at_hex_digits[data[i] & 0x0f];
+   }
+}
+
+// Whole quantums without padding
+static bool at_base64_decode_scalar(const unsigned char *in, unsigned int size, unsigned char *out) {
+
+   for (unsigned int i = 0; i < size; i += 4) {
+
+      unsigned char a = at_base64_values[in[i]];
+      unsigned char b = at_base64_values[in[i + 1]];
+      unsigned char c = at_base64_values[in[i + 2]];
+      unsigned char d = at_base64_values[in[i + 3]];
+
+      if ((a | b | c | d) == AT_CODEC_INVALID)
+         return false;
+
+      out[i / 4 * 3] = a << 2 | b >> 4;
+      out[i / 4 * 3 + 1] = b << 4 | c >> 2;
+      out[i / 4 * 3 + 2] = c << 6 | d;
+   }
+
+   return true;
+}
+
+static void at_base64_encode_scalar(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   unsigned int i = 0;
+
+   for (; i + 3 <= size; i += 3, out += 4) {
+      out[0] = at_base64_digits[data[i] >> 2];
+      out[1] = at_base64_digits[(data[i] & 0x03) << 4 | data[i + 1] >> 4];
+      out[2] = at_base64_digits[(data[i + 1] & 0x0f) << 2 | data[i + 2] >> 6];
+      out[3] = at_base64_digits[data[i + 2] & 0x3f];
+   }
+
+   if (i + 1 == size) {
+      out[0] = at_base64_digits[data[i] >> 2];
+      out[1] = at_base64_digits[(data[i] & 0x03) << 4];
+      out[2] = '=';
+      out[3] = '=';
+   } else if (i + 2 == size) {
+      out[0] = at_base64_digits[data[i] >> 2];
+      out[1] = at_base64_digits[(data[i] & 0x03) << 4 | data[i + 1] >> 4];
+      out[2] = at_base64_digits[(data[i + 1] & 0x0f) << 2];
+      out[3] = '=';
+   }
+}
+
+bool at_hex_decode(const struct range_t *in, unsigned char *out, unsigned int *size) {
+
+   unsigned int length = in->end - in->begin;
+   unsigned int done = 0;
+
+   if (length % 2 != 0)
+      return false;
+
+#ifdef AT_CODEC_X86
+   if (at_codec_has_avx2()) {
+      done = at_hex_decode_avx2(in->begin, length, out);
+   } else if (at_codec_has_ssse3()) {
+      done = at_hex_decode_ssse3(in->begin, length, out);
+   }
+#endif
+
+   if (at_hex_decode_scalar(in->begin + done, length - done, out + done / 2) == false)
+      return false;
+
+   *size = length / 2;
+   return true;
+}
+
+bool at_base64_decode(const struct range_t *in, unsigned char *out, unsigned int *size) {
+
+   unsigned int length = in->end - in->begin;
+   unsigned int done = 0;
+
+   if (length % 4 != 0)
+      return false;
+
+   if (length == 0) {
+      *size = 0;
+      return true;
+   }
+
+   // The last quantum may be padded, "xx==" or "xxx="
+   const unsigned char *last = in->end - 4;
+   unsigned int padding = last[3] != '=' ? 0 : last[2] != '=' ? 1 : 2;
+
+#ifdef AT_CODEC_X86
+   if (at_codec_has_avx2()) {
+      done = at_base64_decode_avx2(in->begin, length - 4, out);
+   } else if (at_codec_has_ssse3()) {
+      done = at_base64_decode_ssse3(in->begin, length - 4, out);
+   }
+#endif
+
+   if (at_base64_decode_scalar(in->begin + done, length - 4 - done, out + done / 4 * 3) == false)
+      return false;
+
+   unsigned char a = at_base64_values[last[0]];
+   unsigned char b = at_base64_values[last[1]];
+   unsigned char c = padding < 2 ? at_base64_values[last[2]] : 0;
+   unsigned char d = padding < 1 ? at_base64_values[last[3]] : 0;
+
+   // Bits under the padding have to be zero
+   if ((a | b | c | d) == AT_CODEC_INVALID ||
+       (padding == 2 && (b & 0x0f) != 0) ||
+       (padding == 1 && (c & 0x03) != 0))
+      return false;
+
+   unsigned char *p = out + (length - 4) / 4 * 3;
+
+   p[0] = a << 2 | b >> 4;
+
+   if (padding < 2)
+      p[1] = b << 4 | c >> 2;
+
+   if (padding < 1)
+      p[2] = c << 6 | d;
+
+   *size = length / 4 * 3 - padding;
+   return true;
+}
+
+bool at_hex_decode_quoted(struct range_t *parameter, struct range_t *result) {
+
+   struct range_t value;
+   unsigned int size;
+
+   if (at_get_in_quota_value(parameter, &value) == false ||
+       at_hex_decode(&value, value.begin, &size) == false)
+      return false;
+
+   *result = range_create_cnt(value.begin, size);
+   return true;
+}
+
+bool at_base64_decode_quoted(struct range_t *parameter, struct range_t *result) {
+
+   struct range_t value;
+   unsigned int size;
+
+   if (at_get_in_quota_value(parameter, &value) == false ||
+       at_base64_decode(&value, value.begin, &size) == false)
+      return false;
+
+   *result = range_create_cnt(value.begin, size);
+   return true;
+}
+
+unsigned int at_hex_encode(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   unsigned int done = 0;
+
+#ifdef AT_CODEC_X86
+   if (at_codec_has_avx2()) {
+      done = at_hex_encode_avx2(data, size, out);
+   } else if (at_codec_has_ssse3()) {
+      done = at_hex_encode_ssse3(data, size, out);
+   }
+#endif
+
+   at_hex_encode_scalar(data + done, size - done, out + 2 * done);
+   return 2 * size;
+}
+
+unsigned int at_base64_encode(const unsigned char *data, unsigned int size, unsigned char *out) {
+
+   unsigned int done = 0;
+
+#ifdef AT_CODEC_X86
+   if (at_codec_has_avx2()) {
+      done = at_base64_encode_avx2(data, size, out);
+   } else if (at_codec_has_ssse3()) {
+      done = at_base64_encode_ssse3(data, size, out);
+   }
+#endif
+
+   at_base64_encode_scalar(data + done, size - done, out + done / 3 * 4);
+   return (size + 2) / 3 * 4;
+}
+
+void at_append_hex(struct at_context_t *ctx, const unsigned char *data, unsigned int size) {
+
+   while (size > 0) {
+
+      unsigned int space;
+      iterator_t out = at_output_reserve(ctx, 2, &space);
+
+      if (out == 0)
+         return;
+
+      unsigned int chunk = space / 2 < size ? space / 2 : size;
+
+      at_output_commit(ctx, out + at_hex_encode(data, chunk, out));
+      data += chunk;
+      size -= chunk;
+   }
+}
+
+void at_append_base64(struct at_context_t *ctx, const unsigned char *data, unsigned int size) {
+
+   while (size > 0) {
+
+      unsigned int space;
+      iterator_t out = at_output_reserve(ctx, 4, &space);
+
+      if (out == 0)
+         return;
+
+      // Whole groups of three, padding only at the end
+      unsigned int chunk = space / 4 * 3 < size ? space / 4 * 3 : size;
+
+      at_output_commit(ctx, out + at_base64_encode(data, chunk, out));
+      data += chunk;
+      size -= chunk;
+   }
+}
@@ -0,0 +1,26 @@
+#ifndef CODEC_INTERNAL_H
+#define CODEC_INTERNAL_H
+
+#include "codec.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AT_CODEC_X86
+#include <immintrin.h>
+#endif
+
+enum AT_CODEC_KERNELS {
+   AT_CODEC_SCALAR = 0,
+   AT_CODEC_SSSE3 = 1,
+   AT_CODEC_AVX2 = 2
+};
+
+// Caps the kernels the codecs use, for tests and benchmarks. Not thread safe.
+void at_codec_limit(enum AT_CODEC_KERNELS kernels);
+
+#ifdef AT_CODEC_X86
+// Kernels the CPU has and the limit allows
+bool at_codec_has_avx2(void);
+bool at_codec_has_ssse3(void);
+#endif
+
+#endif // CODEC_INTERNAL_H
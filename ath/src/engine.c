@@ -0,0 +1,950 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "engine.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Each shard is an epoll loop owning its channels and contexts. Other threads
+// talk to a shard only through its message queue and eventfd. Pool tasks sit
+// in per worker deques: the owner takes from the front, idle workers steal
+// from the back of the others. Descriptors are non-blocking, output the peer
+// does not take yet waits in the channel queue and the channel reads no more
+// input until the queue is drained.
+//
+// A channel is counted by the handle of the user, each message and task that
+// refers to it, and by the shard while it is open. The last of them frees it.
+
+#define AT_ENGINE_READ_SIZE 4096
+#define AT_ENGINE_EVENTS 64
+
+enum AT_ENGINE_MESSAGE {
+   AT_ENGINE_ADD,
+   AT_ENGINE_POST,
+   AT_ENGINE_DONE
+};
+
+struct at_engine_message_t {
+   enum AT_ENGINE_MESSAGE type;
+   struct at_channel_t *channel;
+   void (*work)(void *arg, struct at_function_result *result);
+   void (*function)(void *arg, struct at_context_t *ctx);
+   void *arg;
+   struct at_function_result result;
+   struct at_engine_message_t *prev;
+   struct at_engine_message_t *next;
+};
+
+struct at_engine_shard_t;
+
+struct at_channel_t {
+   struct at_engine_shard_t *shard;
+   int fd;
+   struct at_context_t *ctx;
+   void (*setup)(void *user, struct at_context_t *ctx);
+   void *user;
+   unsigned char *queue;
+   size_t queue_size;
+   size_t queue_capacity;
+   uint32_t events;
+   bool closed;
+   unsigned int refs;
+   struct at_channel_t *prev;
+   struct at_channel_t *next;
+   struct at_channel_t *next_closed;
+};
+
+struct at_engine_shard_t {
+   struct at_engine_t *engine;
+   unsigned int index;
+   pthread_t thread;
+   int epoll_fd;
+   int event_fd;
+   pthread_mutex_t lock;
+   struct at_engine_message_t *first;
+   struct at_engine_message_t *last;
+   struct at_channel_t *channels;
+   struct at_channel_t *closed;
+   unsigned long long channel_count;
+   unsigned long long inputs;
+   unsigned long long deferred;
+};
+
+struct at_engine_worker_t {
+   struct at_engine_t *engine;
+   unsigned int index;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   struct at_engine_message_t *first;
+   struct at_engine_message_t *last;
+};
+
+struct at_engine_t {
+   struct at_engine_shard_t *shards;
+   unsigned int shard_count;
+   struct at_engine_worker_t *workers;
+   unsigned int worker_count;
+   pthread_mutex_t idle_lock;
+   pthread_cond_t idle;
+   unsigned int pending;
+   bool stop_workers;
+   bool stop_shards;
+   unsigned int next_shard;
+   unsigned long long stolen;
+   struct at_buffer_pool_t *buffer_pool;
+};
+
+// Channel whose context is running on this thread
+static __thread struct at_channel_t *at_engine_current = 0;
+
+void at_engine_config_init(struct at_engine_config_t *config) {
+   config->shards = 0;
+   config->workers = 0;
+   config->pin = true;
+   config->buffer_pool = 0;
+}
+
+static void at_engine_wake(struct at_engine_shard_t *shard) {
+   uint64_t one = 1;
+   ssize_t r = write(shard->event_fd, &one, sizeof(one));
+   (void)r;
+}
+
+static void at_channel_ref(struct at_channel_t *channel) {
+   __atomic_fetch_add(&channel->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void at_channel_unref(struct at_channel_t *channel) {
+
+   if (__atomic_sub_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL) != 0)
+      return;
+
+   struct at_engine_shard_t *shard = channel->shard;
+
+   pthread_mutex_lock(&shard->lock);
+
+   if (channel->prev != 0) {
+      channel->prev->next = channel->next;
+   } else {
+      shard->channels = channel->next;
+   }
+
+   if (channel->next != 0) {
+      channel->next->prev = channel->prev;
+   }
+
+   pthread_mutex_unlock(&shard->lock);
+
+   free(channel);
+}
+
+static void at_engine_send(struct at_engine_shard_t *shard, struct at_engine_message_t *message) {
+
+   message->next = 0;
+
+   pthread_mutex_lock(&shard->lock);
+
+   bool was_empty = (shard->first == 0);
+
+   if (shard->last != 0) {
+      shard->last->next = message;
+   } else {
+      shard->first = message;
+   }
+   shard->last = message;
+
+   pthread_mutex_unlock(&shard->lock);
+
+   if (was_empty) {
+      at_engine_wake(shard);
+   }
+}
+
+static ssize_t at_engine_write(struct at_channel_t *channel, const unsigned char *data, size_t size) {
+
+   for (;;) {
+
+      ssize_t r = send(channel->fd, data, size, MSG_NOSIGNAL);
+
+      if (r < 0 && errno == ENOTSOCK) {
+         r = write(channel->fd, data, size);
+      }
+
+      if (r >= 0 || errno != EINTR)
+         return r;
+   }
+}
+
+// Reads while the queue is empty and no command is deferred, waits for room
+// to write otherwise
+static void at_engine_update(struct at_channel_t *channel) {
+
+   uint32_t events = 0;
+
+   if (channel->queue_size != 0) {
+      events = EPOLLOUT;
+   } else if (at_is_deferred(channel->ctx) == false) {
+      events = EPOLLIN;
+   }
+
+   if (channel->events == events)
+      return;
+
+   struct epoll_event event;
+   event.events = events;
+   event.data.ptr = channel;
+
+   if (epoll_ctl(channel->shard->epoll_fd, EPOLL_CTL_MOD, channel->fd, &event) == 0) {
+      channel->events = events;
+   }
+}
+
+static bool at_engine_enqueue(struct at_channel_t *channel, const unsigned char *data, size_t size) {
+
+   if (channel->queue_size + size > channel->queue_capacity) {
+
+      size_t capacity = channel->queue_capacity != 0 ? channel->queue_capacity : AT_ENGINE_READ_SIZE;
+
+      while (capacity < channel->queue_size + size) {
+         capacity *= 2;
+      }
+
+      unsigned char *queue = (unsigned char*)realloc(channel->queue, capacity);
+
+      if (queue == 0)
+         return false;
+
+      channel->queue = queue;
+      channel->queue_capacity = capacity;
+   }
+
+   memcpy(channel->queue + channel->queue_size, data, size);
+   channel->queue_size += size;
+
+   return true;
+}
+
+static void at_engine_output(void *user, struct range_t *data) {
+
+   struct at_channel_t *channel = (struct at_channel_t*)user;
+   iterator_t it = data->begin;
+
+   // Queued output goes first, the new one waits behind it
+   while (channel->queue_size == 0 && it != data->end) {
+
+      ssize_t r = at_engine_write(channel, it, data->end - it);
+
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         break;
+
+      // Peer is gone, end of input will close the channel
+      if (r < 0)
+         return;
+
+      it += r;
+   }
+
+   if (it == data->end)
+      return;
+
+   // Without room for the rest the response can not go out whole, hang up
+   if (at_engine_enqueue(channel, it, data->end - it) == false) {
+      shutdown(channel->fd, SHUT_RDWR);
+      return;
+   }
+
+   at_engine_update(channel);
+}
+
+static void at_engine_flush(struct at_channel_t *channel) {
+
+   size_t sent = 0;
+
+   while (sent < channel->queue_size) {
+
+      ssize_t r = at_engine_write(channel, channel->queue + sent, channel->queue_size - sent);
+
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+         break;
+
+      // Peer is gone, drop the rest and read the end of input
+      if (r < 0) {
+         sent = channel->queue_size;
+         break;
+      }
+
+      sent += r;
+   }
+
+   memmove(channel->queue, channel->queue + sent, channel->queue_size - sent);
+   channel->queue_size -= sent;
+
+   at_engine_update(channel);
+}
+
+static void at_engine_close(struct at_channel_t *channel) {
+
+   if (channel->closed)
+      return;
+
+   epoll_ctl(channel->shard->epoll_fd, EPOLL_CTL_DEL, channel->fd, 0);
+   close(channel->fd);
+
+   at_context_free(channel->ctx);
+   channel->ctx = 0;
+   free(channel->queue);
+   channel->queue = 0;
+   channel->queue_size = 0;
+   channel->closed = true;
+   __atomic_fetch_sub(&channel->shard->channel_count, 1, __ATOMIC_RELAXED);
+
+   // Later events of the current batch may still name the channel, the shard
+   // lets go of it after the batch
+   channel->next_closed = channel->shard->closed;
+   channel->shard->closed = channel;
+}
+
+static void at_engine_release_closed(struct at_engine_shard_t *shard) {
+
+   while (shard->closed != 0) {
+      struct at_channel_t *channel = shard->closed;
+      shard->closed = channel->next_closed;
+      at_channel_unref(channel);
+   }
+}
+
+static void at_engine_open(struct at_engine_shard_t *shard, struct at_channel_t *channel) {
+
+   if (shard->engine->buffer_pool != 0)
+      at_context_init_pooled(&channel->ctx, 0, shard->engine->buffer_pool);
+   else
+      at_context_init(&channel->ctx, 0);
+
+   int flags = fcntl(channel->fd, F_GETFL);
+
+   if (channel->ctx == 0 || flags < 0 || fcntl(channel->fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+      at_context_free(channel->ctx);
+      channel->ctx = 0;
+      close(channel->fd);
+      channel->closed = true;
+      return;
+   }
+
+   at_set_output_hook(channel->ctx, at_engine_output, channel);
+
+   if (channel->setup != 0) {
+      at_engine_current = channel;
+      channel->setup(channel->user, channel->ctx);
+      at_engine_current = 0;
+   }
+
+   // Output of the setup may already wait for the peer
+   struct epoll_event event;
+   event.events = channel->queue_size != 0 ? EPOLLOUT : EPOLLIN;
+   event.data.ptr = channel;
+
+   if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, channel->fd, &event) != 0) {
+      at_context_free(channel->ctx);
+      channel->ctx = 0;
+      free(channel->queue);
+      channel->queue = 0;
+      channel->queue_size = 0;
+      close(channel->fd);
+      channel->closed = true;
+      return;
+   }
+
+   channel->events = event.events;
+   at_channel_ref(channel);
+   __atomic_fetch_add(&shard->channel_count, 1, __ATOMIC_RELAXED);
+}
+
+static void at_engine_dispatch(struct at_engine_shard_t *shard, struct at_engine_message_t *message) {
+
+   struct at_channel_t *channel = message->channel;
+
+   switch (message->type) {
+
+   case AT_ENGINE_ADD:
+      at_engine_open(shard, channel);
+      break;
+
+   case AT_ENGINE_POST:
+      // Closed channels pass no context, the function only releases 'arg'
+      at_engine_current = channel->closed ? 0 : channel;
+      message->function(message->arg, channel->ctx);
+      at_engine_current = 0;
+      break;
+
+   case AT_ENGINE_DONE:
+      if (channel->closed) {
+         if (message->function != 0) {
+            message->function(message->arg, 0);
+         }
+         break;
+      }
+
+      at_engine_current = channel;
+
+      if (message->function != 0) {
+         message->function(message->arg, channel->ctx);
+      }
+
+      at_resume(channel->ctx, &message->result);
+      at_engine_current = 0;
+
+      // Held input may have deferred again
+      at_engine_update(channel);
+      break;
+   }
+
+   at_channel_unref(channel);
+   free(message);
+}
+
+static void at_engine_drain(struct at_engine_shard_t *shard) {
+
+   uint64_t count;
+   ssize_t r = read(shard->event_fd, &count, sizeof(count));
+   (void)r;
+
+   pthread_mutex_lock(&shard->lock);
+   struct at_engine_message_t *message = shard->first;
+   shard->first = 0;
+   shard->last = 0;
+   pthread_mutex_unlock(&shard->lock);
+
+   while (message != 0) {
+      struct at_engine_message_t *next = message->next;
+      at_engine_dispatch(shard, message);
+      message = next;
+   }
+}
+
+static void at_engine_read(struct at_channel_t *channel) {
+
+   unsigned char buffer[AT_ENGINE_READ_SIZE];
+
+   ssize_t r = read(channel->fd, buffer, sizeof(buffer));
+
+   if (r < 0 && (errno == EINTR || errno == EAGAIN))
+      return;
+
+   if (r <= 0) {
+      at_engine_close(channel);
+      return;
+   }
+
+   struct range_t data = range_create_cnt(buffer, r);
+
+   at_engine_current = channel;
+   at_process_input(channel->ctx, &data);
+   at_engine_current = 0;
+
+   __atomic_fetch_add(&channel->shard->inputs, 1, __ATOMIC_RELAXED);
+
+   // Leave further input in the kernel until the deferred command is done
+   // and the peer took the output
+   at_engine_update(channel);
+}
+
+static void *at_engine_shard_main(void *arg) {
+
+   struct at_engine_shard_t *shard = (struct at_engine_shard_t*)arg;
+   struct epoll_event events[AT_ENGINE_EVENTS];
+
+   for (;;) {
+
+      int n = epoll_wait(shard->epoll_fd, events, AT_ENGINE_EVENTS, -1);
+
+      for (int i = 0; i < n; ++i) {
+
+         if (events[i].data.ptr == 0) {
+            at_engine_drain(shard);
+         } else {
+            struct at_channel_t *channel = (struct at_channel_t*)events[i].data.ptr;
+
+            uint32_t ready = events[i].events;
+
+            // Closed while handling an earlier event of this batch
+            if (channel->closed == false && channel->queue_size != 0 &&
+                (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0) {
+               at_engine_flush(channel);
+            }
+
+            // Errors and hang ups read the end of input once nothing is queued
+            if (channel->closed == false && channel->queue_size == 0 &&
+                (ready & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+               at_engine_read(channel);
+            }
+         }
+      }
+
+      at_engine_release_closed(shard);
+
+      if (__atomic_load_n(&shard->engine->stop_shards, __ATOMIC_ACQUIRE)) {
+         at_engine_drain(shard);
+         break;
+      }
+   }
+
+   return 0;
+}
+
+static void at_engine_push(struct at_engine_worker_t *worker, struct at_engine_message_t *task) {
+
+   task->next = 0;
+
+   pthread_mutex_lock(&worker->lock);
+
+   task->prev = worker->last;
+
+   if (worker->last != 0) {
+      worker->last->next = task;
+   } else {
+      worker->first = task;
+   }
+   worker->last = task;
+
+   pthread_mutex_unlock(&worker->lock);
+}
+
+static struct at_engine_message_t *at_engine_pop_front(struct at_engine_worker_t *worker) {
+
+   pthread_mutex_lock(&worker->lock);
+
+   struct at_engine_message_t *task = worker->first;
+
+   if (task != 0) {
+      worker->first = task->next;
+
+      if (worker->first != 0) {
+         worker->first->prev = 0;
+      } else {
+         worker->last = 0;
+      }
+   }
+
+   pthread_mutex_unlock(&worker->lock);
+
+   return task;
+}
+
+static struct at_engine_message_t *at_engine_pop_back(struct at_engine_worker_t *worker) {
+
+   pthread_mutex_lock(&worker->lock);
+
+   struct at_engine_message_t *task = worker->last;
+
+   if (task != 0) {
+      worker->last = task->prev;
+
+      if (worker->last != 0) {
+         worker->last->next = 0;
+      } else {
+         worker->first = 0;
+      }
+   }
+
+   pthread_mutex_unlock(&worker->lock);
+
+   return task;
+}
+
+static struct at_engine_message_t *at_engine_take(struct at_engine_worker_t *worker) {
+
+   struct at_engine_t *engine = worker->engine;
+   struct at_engine_message_t *task = at_engine_pop_front(worker);
+
+   for (unsigned int i = 1; task == 0 && i < engine->worker_count; ++i) {
+
+      task = at_engine_pop_back(&engine->workers[(worker->index + i) % engine->worker_count]);
+
+      if (task != 0) {
+         __atomic_fetch_add(&engine->stolen, 1, __ATOMIC_RELAXED);
+      }
+   }
+
+   if (task != 0) {
+      __atomic_fetch_sub(&engine->pending, 1, __ATOMIC_RELAXED);
+   }
+
+   return task;
+}
+
+static void *at_engine_worker_main(void *arg) {
+
+   struct at_engine_worker_t *worker = (struct at_engine_worker_t*)arg;
+   struct at_engine_t *engine = worker->engine;
+
+   for (;;) {
+
+      struct at_engine_message_t *task = at_engine_take(worker);
+
+      if (task != 0) {
+         task->work(task->arg, &task->result);
+         task->type = AT_ENGINE_DONE;
+         at_engine_send(task->channel->shard, task);
+         continue;
+      }
+
+      pthread_mutex_lock(&engine->idle_lock);
+
+      while (__atomic_load_n(&engine->pending, __ATOMIC_RELAXED) == 0 && engine->stop_workers == false) {
+         pthread_cond_wait(&engine->idle, &engine->idle_lock);
+      }
+
+      bool stop = engine->stop_workers && __atomic_load_n(&engine->pending, __ATOMIC_RELAXED) == 0;
+
+      pthread_mutex_unlock(&engine->idle_lock);
+
+      if (stop)
+         break;
+   }
+
+   return 0;
+}
+
+void at_engine_defer(
+      struct at_function_context_t *fctx,
+      void (*work)(void *arg, struct at_function_result *result),
+      void (*done)(void *arg, struct at_context_t *ctx),
+      void *arg) {
+
+   struct at_channel_t *channel = at_engine_current;
+
+   // Only handlers running on an engine channel can defer, others answer ERROR
+   if (channel == 0 || channel->ctx != fctx->context)
+      return;
+
+   struct at_engine_message_t *task = (struct at_engine_message_t*)malloc(sizeof(struct at_engine_message_t));
+
+   if (task == 0)
+      return;
+
+   struct at_engine_t *engine = channel->shard->engine;
+
+   task->type = AT_ENGINE_DONE;
+   task->channel = channel;
+   task->work = work;
+   task->function = done;
+   task->arg = arg;
+   at_channel_ref(channel);
+
+   at_function_result_init(&task->result);
+   at_unknown_error(&task->result);
+
+   at_defer(fctx);
+
+   // Tasks of a shard go to the same worker first, others steal them when idle
+   at_engine_push(&engine->workers[channel->shard->index % engine->worker_count], task);
+
+   pthread_mutex_lock(&engine->idle_lock);
+   __atomic_fetch_add(&engine->pending, 1, __ATOMIC_RELAXED);
+   pthread_cond_signal(&engine->idle);
+   pthread_mutex_unlock(&engine->idle_lock);
+
+   __atomic_fetch_add(&channel->shard->deferred, 1, __ATOMIC_RELAXED);
+}
+
+struct at_channel_t *at_engine_add_channel(
+      struct at_engine_t *engine,
+      int fd,
+      void (*setup)(void *user, struct at_context_t *ctx),
+      void *user) {
+
+   struct at_channel_t *channel = (struct at_channel_t*)malloc(sizeof(struct at_channel_t));
+   struct at_engine_message_t *message = (struct at_engine_message_t*)malloc(sizeof(struct at_engine_message_t));
+
+   if (channel == 0 || message == 0) {
+      free(channel);
+      free(message);
+      return 0;
+   }
+
+   unsigned int index = __atomic_fetch_add(&engine->next_shard, 1, __ATOMIC_RELAXED) % engine->shard_count;
+   struct at_engine_shard_t *shard = &engine->shards[index];
+
+   channel->shard = shard;
+   channel->fd = fd;
+   channel->ctx = 0;
+   channel->setup = setup;
+   channel->user = user;
+   channel->queue = 0;
+   channel->queue_size = 0;
+   channel->queue_capacity = 0;
+   channel->events = 0;
+   channel->closed = false;
+   channel->next_closed = 0;
+
+   // One for the handle, one for the message
+   channel->refs = 2;
+
+   pthread_mutex_lock(&shard->lock);
+   channel->prev = 0;
+   channel->next = shard->channels;
+   if (shard->channels != 0) {
+      shard->channels->prev = channel;
+   }
+   shard->channels = channel;
+   pthread_mutex_unlock(&shard->lock);
+
+   message->type = AT_ENGINE_ADD;
+   message->channel = channel;
+   at_engine_send(shard, message);
+
+   return channel;
+}
+
+void at_channel_post(
+      struct at_channel_t *channel,
+      void (*function)(void *arg, struct at_context_t *ctx),
+      void *arg) {
+
+   struct at_engine_message_t *message = (struct at_engine_message_t*)malloc(sizeof(struct at_engine_message_t));
+
+   if (message == 0)
+      return;
+
+   message->type = AT_ENGINE_POST;
+   message->channel = channel;
+   message->function = function;
+   message->arg = arg;
+
+   at_channel_ref(channel);
+   at_engine_send(channel->shard, message);
+}
+
+void at_channel_release(struct at_channel_t *channel) {
+   if (channel != 0)
+      at_channel_unref(channel);
+}
+
+unsigned int at_channel_shard(struct at_channel_t *channel) {
+   return channel->shard->index;
+}
+
+unsigned int at_engine_shards(struct at_engine_t *engine) {
+   return engine->shard_count;
+}
+
+void at_engine_get_stats(struct at_engine_t *engine, struct at_engine_stats_t *stats) {
+
+   stats->channels = 0;
+   stats->inputs = 0;
+   stats->deferred = 0;
+   stats->stolen = __atomic_load_n(&engine->stolen, __ATOMIC_RELAXED);
+
+   for (unsigned int i = 0; i < engine->shard_count; ++i) {
+      stats->channels += __atomic_load_n(&engine->shards[i].channel_count, __ATOMIC_RELAXED);
+      stats->inputs += __atomic_load_n(&engine->shards[i].inputs, __ATOMIC_RELAXED);
+      stats->deferred += __atomic_load_n(&engine->shards[i].deferred, __ATOMIC_RELAXED);
+   }
+}
+
+// Cleans up after itself on failure
+// The n-th CPU, round robin, of those the process may run on. A process
+// limited by taskset or a cpuset keeps its shards within its own CPUs.
+static bool at_engine_allowed_cpu(unsigned int n, int *cpu) {
+
+   cpu_set_t allowed;
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+      return false;
+
+   n %= CPU_COUNT(&allowed);
+
+   for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &allowed) && n-- == 0) {
+         *cpu = i;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool at_engine_shard_init(struct at_engine_t *engine, unsigned int index, bool pin) {
+
+   struct at_engine_shard_t *shard = &engine->shards[index];
+
+   shard->engine = engine;
+   shard->index = index;
+   shard->first = 0;
+   shard->last = 0;
+   shard->channels = 0;
+   shard->closed = 0;
+   shard->channel_count = 0;
+   shard->inputs = 0;
+   shard->deferred = 0;
+   pthread_mutex_init(&shard->lock, 0);
+
+   shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   shard->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+   struct epoll_event event;
+   event.events = EPOLLIN;
+   event.data.ptr = 0;
+
+   if (shard->epoll_fd < 0 || shard->event_fd < 0 ||
+       epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->event_fd, &event) != 0 ||
+       pthread_create(&shard->thread, 0, at_engine_shard_main, shard) != 0) {
+
+      if (shard->epoll_fd >= 0)
+         close(shard->epoll_fd);
+      if (shard->event_fd >= 0)
+         close(shard->event_fd);
+      pthread_mutex_destroy(&shard->lock);
+      return false;
+   }
+
+   int cpu;
+
+   if (pin && at_engine_allowed_cpu(index, &cpu)) {
+      cpu_set_t set;
+
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(shard->thread, sizeof(set), &set);
+   }
+
+   return true;
+}
+
+// Stops the first 'workers' workers and 'shards' shards, the ones started,
+// closes the channels and frees the engine
+static void at_engine_stop(struct at_engine_t *engine, unsigned int workers, unsigned int shards) {
+
+   // Workers finish the queued tasks first, shards then deliver their results
+   pthread_mutex_lock(&engine->idle_lock);
+   engine->stop_workers = true;
+   pthread_cond_broadcast(&engine->idle);
+   pthread_mutex_unlock(&engine->idle_lock);
+
+   for (unsigned int i = 0; i < engine->worker_count; ++i) {
+      if (i < workers)
+         pthread_join(engine->workers[i].thread, 0);
+      pthread_mutex_destroy(&engine->workers[i].lock);
+   }
+
+   __atomic_store_n(&engine->stop_shards, true, __ATOMIC_RELEASE);
+
+   for (unsigned int i = 0; i < shards; ++i) {
+      at_engine_wake(&engine->shards[i]);
+   }
+
+   for (unsigned int i = 0; i < shards; ++i) {
+
+      struct at_engine_shard_t *shard = &engine->shards[i];
+
+      pthread_join(shard->thread, 0);
+
+      // Handles not released yet go too
+      struct at_channel_t *channel = shard->channels;
+
+      while (channel != 0) {
+         struct at_channel_t *next = channel->next;
+
+         if (channel->closed == false && channel->ctx != 0) {
+            at_engine_close(channel);
+         }
+
+         free(channel);
+         channel = next;
+      }
+
+      close(shard->epoll_fd);
+      close(shard->event_fd);
+      pthread_mutex_destroy(&shard->lock);
+   }
+
+   pthread_mutex_destroy(&engine->idle_lock);
+   pthread_cond_destroy(&engine->idle);
+
+   free(engine->shards);
+   free(engine->workers);
+   free(engine);
+}
+
+struct at_engine_t *at_engine_create(const struct at_engine_config_t *config) {
+
+   struct at_engine_config_t defaults;
+
+   if (config == 0) {
+      at_engine_config_init(&defaults);
+      config = &defaults;
+   }
+
+   struct at_engine_t *engine = (struct at_engine_t*)malloc(sizeof(struct at_engine_t));
+
+   if (engine == 0)
+      return 0;
+
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+   engine->shard_count = config->shards != 0 ? config->shards : (cpus > 0 ? cpus : 1);
+   engine->worker_count = config->workers != 0 ? config->workers : engine->shard_count;
+   engine->shards = (struct at_engine_shard_t*)calloc(engine->shard_count, sizeof(struct at_engine_shard_t));
+   engine->workers = (struct at_engine_worker_t*)calloc(engine->worker_count, sizeof(struct at_engine_worker_t));
+   engine->pending = 0;
+   engine->stop_workers = false;
+   engine->stop_shards = false;
+   engine->next_shard = 0;
+   engine->stolen = 0;
+   engine->buffer_pool = config->buffer_pool;
+
+   pthread_mutex_init(&engine->idle_lock, 0);
+   pthread_cond_init(&engine->idle, 0);
+
+   if (engine->shards == 0 || engine->workers == 0) {
+      pthread_mutex_destroy(&engine->idle_lock);
+      pthread_cond_destroy(&engine->idle);
+      free(engine->shards);
+      free(engine->workers);
+      free(engine);
+      return 0;
+   }
+
+   for (unsigned int i = 0; i < engine->worker_count; ++i) {
+      struct at_engine_worker_t *worker = &engine->workers[i];
+
+      worker->engine = engine;
+      worker->index = i;
+      worker->first = 0;
+      worker->last = 0;
+      pthread_mutex_init(&worker->lock, 0);
+   }
+
+   // Workers steal from each other, start them once all deques exist. Without
+   // all of its threads the engine gives up and stops those already running.
+   unsigned int workers = 0;
+   unsigned int shards = 0;
+
+   while (workers < engine->worker_count &&
+          pthread_create(&engine->workers[workers].thread, 0, at_engine_worker_main, &engine->workers[workers]) == 0)
+      workers++;
+
+   while (workers == engine->worker_count && shards < engine->shard_count &&
+          at_engine_shard_init(engine, shards, config->pin))
+      shards++;
+
+   if (workers != engine->worker_count || shards != engine->shard_count) {
+      at_engine_stop(engine, workers, shards);
+      return 0;
+   }
+
+   return engine;
+}
+
+void at_engine_free(struct at_engine_t *engine) {
+   at_engine_stop(engine, engine->worker_count, engine->shard_count);
+}
@@ -0,0 +1,182 @@
+#include "lexer_internal.h"
+
+#include <ctype.h>
+
+// Classes for the default S3 and S5 registers, computed at compile time.
+// Carriage return and line feed count as space where they do not end a line,
+// so hosts sending CR LF or LF work with either terminator.
+
+#define AT_CLASS_OF(c) ( \
+   ((((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z')) ? AT_CLASS_ALPHA : 0) | \
+   (((c) >= '0' && (c) <= '9') ? AT_CLASS_DIGIT : 0) | \
+   (((c) == '+' || (c) == '&' || (c) == '^') ? AT_CLASS_TAG_PREFIX : 0) | \
+   (((c) == ' ' || (c) == '\r' || (c) == '\n') ? AT_CLASS_SPACE : 0) | \
+   ((c) == '"' ? AT_CLASS_QUOTE : 0) | \
+   ((c) == ';' ? AT_CLASS_SEPARATOR : 0) | \
+   ((c) == AT_DEFAULT_S3 ? AT_CLASS_TERMINATOR : 0) | \
+   ((c) == '/' ? AT_CLASS_REPEAT : 0) | \
+   ((c) == AT_DEFAULT_S5 ? AT_CLASS_BACKSPACE : 0))
+
+#define AT_CLASS_ROW(r) \
+   AT_CLASS_OF(r + 0), AT_CLASS_OF(r + 1), AT_CLASS_OF(r + 2), AT_CLASS_OF(r + 3), \
+   AT_CLASS_OF(r + 4), AT_CLASS_OF(r + 5), AT_CLASS_OF(r + 6), AT_CLASS_OF(r + 7), \
+   AT_CLASS_OF(r + 8), AT_CLASS_OF(r + 9), AT_CLASS_OF(r + 10), AT_CLASS_OF(r + 11), \
+   AT_CLASS_OF(r + 12), AT_CLASS_OF(r + 13), AT_CLASS_OF(r + 14), AT_CLASS_OF(r + 15)
+
+const unsigned short at_default_classes[256] = {
+   AT_CLASS_ROW(0x00), AT_CLASS_ROW(0x10), AT_CLASS_ROW(0x20), AT_CLASS_ROW(0x30),
+   AT_CLASS_ROW(0x40), AT_CLASS_ROW(0x50), AT_CLASS_ROW(0x60), AT_CLASS_ROW(0x70),
+   AT_CLASS_ROW(0x80), AT_CLASS_ROW(0x90), AT_CLASS_ROW(0xa0), AT_CLASS_ROW(0xb0),
+   AT_CLASS_ROW(0xc0), AT_CLASS_ROW(0xd0), AT_CLASS_ROW(0xe0), AT_CLASS_ROW(0xf0)
+};
+
+void at_lexer_reset(struct at_lexer_t *lexer, bool prefix) {
+   lexer->state = AT_LEX_SPACE;
+   lexer->prefix = prefix;
+   lexer->bad_prefix = false;
+   lexer->quoted = false;
+   lexer->started = false;
+   lexer->overflow = false;
+   lexer->line_begin = 0;
+   lexer->line_end = 0;
+   lexer->command_end = 0;
+   lexer->count = 0;
+}
+
+static void at_lexer_end_command(struct at_lexer_t *lexer, unsigned short offset) {
+
+   if (lexer->count == AT_LINE_COMMANDS_MAX) {
+      lexer->overflow = true;
+      lexer->state = AT_LEX_SPACE;
+      return;
+   }
+
+   struct at_token_t *token = &lexer->tokens[lexer->count];
+
+   switch (lexer->state) {
+   case AT_LEX_SPACE:
+      token->begin = offset;
+      token->tag_end = offset;
+      token->end = offset;
+      lexer->bad_prefix |= lexer->prefix && lexer->count == 0;
+      break;
+   case AT_LEX_PREFIX:
+      lexer->bad_prefix = true;
+      *token = lexer->current;
+      break;
+   case AT_LEX_TAG_FIRST:
+   case AT_LEX_TAG:
+      // Trailing space would have ended the tag
+      token->begin = lexer->current.begin;
+      token->tag_end = lexer->command_end;
+      token->end = lexer->command_end;
+      break;
+   default:
+      token->begin = lexer->current.begin;
+      token->tag_end = lexer->current.tag_end;
+      token->end = lexer->command_end;
+      break;
+   }
+
+   lexer->count++;
+   lexer->state = AT_LEX_SPACE;
+}
+
+bool at_lexer_feed(
+      struct at_lexer_t *lexer,
+      const unsigned short *classes,
+      unsigned char *line,
+      unsigned short offset) {
+
+   unsigned char c = line[offset];
+   unsigned short cls = classes[c];
+   bool assignment = false;
+
+   if ((cls & AT_CLASS_SPACE) == 0) {
+
+      if (lexer->started == false) {
+         lexer->started = true;
+         lexer->line_begin = offset;
+      }
+
+      lexer->line_end = offset + 1;
+   }
+
+   if (cls & AT_CLASS_QUOTE) {
+      lexer->quoted = !lexer->quoted;
+   } else if ((cls & AT_CLASS_SEPARATOR) && lexer->quoted == false) {
+      at_lexer_end_command(lexer, offset);
+      return false;
+   }
+
+   switch (lexer->state) {
+   case AT_LEX_SPACE:
+      if (cls & AT_CLASS_SPACE)
+         return false;
+
+      lexer->current.begin = offset;
+
+      if (lexer->prefix && lexer->count == 0) {
+         lexer->state = (c == 'a' || c == 'A') ? AT_LEX_PREFIX : AT_LEX_REST;
+         lexer->bad_prefix = lexer->state == AT_LEX_REST;
+         break;
+      }
+
+      lexer->state = AT_LEX_TAG_FIRST;
+      // fall through
+   case AT_LEX_TAG_FIRST:
+      if (cls & (AT_CLASS_TAG_PREFIX | AT_CLASS_ALPHA)) {
+         line[offset] = tolower(c);
+         lexer->state = AT_LEX_TAG;
+         break;
+      }
+
+      lexer->current.tag_end = offset;
+      lexer->state = AT_LEX_REST;
+      assignment = c == '=' && lexer->prefix && lexer->count == 0;
+      break;
+   case AT_LEX_TAG:
+      if (cls & (AT_CLASS_ALPHA | AT_CLASS_DIGIT)) {
+         line[offset] = tolower(c);
+         break;
+      }
+
+      lexer->current.tag_end = offset;
+      lexer->state = AT_LEX_REST;
+      assignment = c == '=' && lexer->prefix && lexer->count == 0;
+      break;
+   case AT_LEX_PREFIX:
+      if (c == 't' || c == 'T') {
+         lexer->current.begin = offset + 1;
+         lexer->state = AT_LEX_TAG_FIRST;
+      } else {
+         lexer->bad_prefix = true;
+         lexer->state = AT_LEX_REST;
+      }
+      break;
+   default:
+      break;
+   }
+
+   if ((cls & AT_CLASS_SPACE) == 0)
+      lexer->command_end = offset + 1;
+
+   return assignment;
+}
+
+void at_lexer_end(struct at_lexer_t *lexer) {
+   at_lexer_end_command(lexer, lexer->line_end);
+}
+
+void at_lexer_run(
+      struct at_lexer_t *lexer,
+      const unsigned short *classes,
+      unsigned char *line,
+      unsigned short size,
+      bool prefix) {
+
+   at_lexer_reset(lexer, prefix);
+
+   for (unsigned short i = 0; i != size; ++i)
+      at_lexer_feed(lexer, classes, line, i);
+}
@@ -0,0 +1,93 @@
+#ifndef LEXER_INTERNAL_H
+#define LEXER_INTERNAL_H
+
+#include "at.h"
+
+// Byte classes of the command parser, one table load per input byte.
+// Terminator and backspace follow the S3 and S5 registers of a context.
+enum AT_CHAR_CLASS {
+   AT_CLASS_ALPHA = 0x0001,
+   AT_CLASS_DIGIT = 0x0002,
+   AT_CLASS_TAG_PREFIX = 0x0004,  // '+', '&', '^' start an extended tag
+   AT_CLASS_SPACE = 0x0008,       // trimmed around lines and commands
+   AT_CLASS_QUOTE = 0x0010,
+   AT_CLASS_SEPARATOR = 0x0020,   // ';' between commands of a line
+   AT_CLASS_TERMINATOR = 0x0040,  // S3
+   AT_CLASS_REPEAT = 0x0080,      // '/' of A/
+   AT_CLASS_BACKSPACE = 0x0100    // S5
+};
+
+// Bytes that need more than being stored in the input buffer
+#define AT_CLASS_INPUT_CONTROL (AT_CLASS_TERMINATOR | AT_CLASS_REPEAT | AT_CLASS_BACKSPACE)
+
+#define AT_DEFAULT_S3 '\r'
+#define AT_DEFAULT_S4 '\n'
+#define AT_DEFAULT_S5 '\b'
+
+extern const unsigned short at_default_classes[256];
+
+#if AT_INPUT_BUFFER_SIZE > 0xffff
+#error AT_INPUT_BUFFER_SIZE does not fit the token offsets
+#endif
+
+enum AT_LEX_STATE {
+   AT_LEX_SPACE,      // before a command
+   AT_LEX_PREFIX,     // after the 'A' of the line prefix
+   AT_LEX_TAG_FIRST,  // at the first character of the tag
+   AT_LEX_TAG,
+   AT_LEX_REST        // parameters or the type character
+};
+
+// A command of a line as offsets into the line, space trimmed. Empty
+// commands begin and end at the ';' or the end of line after them.
+struct at_token_t {
+   unsigned short begin;
+   unsigned short tag_end;
+   unsigned short end;
+};
+
+// Resumable tokenizer: it is fed one byte at a time while the line is being
+// buffered, so a line terminator only has to dispatch the commands.
+struct at_lexer_t {
+   unsigned char state;
+   bool prefix;           // the first command has to start with "AT"
+   bool bad_prefix;
+   bool quoted;
+   bool started;
+   bool overflow;         // more than AT_LINE_COMMANDS_MAX commands
+   unsigned short line_begin;
+   unsigned short line_end;
+   unsigned short command_end;
+   unsigned short count;
+   struct at_token_t current;
+   struct at_token_t tokens[AT_LINE_COMMANDS_MAX];
+};
+
+#define AT_LEXER_TOKEN_BYTES (AT_LINE_COMMANDS_MAX * sizeof(struct at_token_t))
+
+void at_lexer_reset(struct at_lexer_t *lexer, bool prefix);
+
+// Takes line[offset], tag characters are lowercased in place. Returns true
+// for the '=' right after the tag of the first command of a line.
+bool at_lexer_feed(
+      struct at_lexer_t *lexer,
+      const unsigned short *classes,
+      unsigned char *line,
+      unsigned short offset);
+
+// Closes the last command of the line
+void at_lexer_end(struct at_lexer_t *lexer);
+
+void at_lexer_run(
+      struct at_lexer_t *lexer,
+      const unsigned short *classes,
+      unsigned char *line,
+      unsigned short size,
+      bool prefix);
+
+// Length of the line without leading and trailing space
+static inline unsigned short at_lexer_line_size(const struct at_lexer_t *lexer) {
+   return lexer->started ? lexer->line_end - lexer->line_begin : 0;
+}
+
+#endif // LEXER_INTERNAL_H
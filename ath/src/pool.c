@@ -0,0 +1,151 @@
+#include "pool.h"
+#include "pool_internal.h"
+#include "at_internal.h"
+
+#include <pthread.h>
+
+// Idle regular buffers form a list linked through their first bytes. Large
+// buffers are rare and big, they are freed when returned. Everything comes
+// from the default allocator at the time the pool is created.
+
+struct at_pool_buffer_t {
+   struct at_pool_buffer_t *next;
+};
+
+struct at_buffer_pool_t {
+   pthread_mutex_t lock;
+   struct at_allocator_t allocator;
+   unsigned int buffer_size;
+   unsigned int large_size;
+   unsigned int max_idle;
+   struct at_pool_buffer_t *idle;
+   struct at_buffer_pool_stats_t stats;
+};
+
+struct at_buffer_pool_t *at_buffer_pool_create(unsigned int buffer_size, unsigned int large_size, unsigned int max_idle) {
+
+   const struct at_allocator_t *allocator = at_get_default_allocator();
+   struct at_buffer_pool_t *p = (struct at_buffer_pool_t*)allocator->alloc(allocator->user_data, sizeof(struct at_buffer_pool_t));
+
+   if (p == 0)
+      return 0;
+
+   memset(p, 0, sizeof(struct at_buffer_pool_t));
+   p->allocator = *allocator;
+
+   if (buffer_size < AT_OUTPUT_BUFFER_SIZE)
+      buffer_size = AT_OUTPUT_BUFFER_SIZE;
+
+   p->buffer_size = buffer_size;
+   p->large_size = large_size > buffer_size ? large_size : buffer_size;
+   p->max_idle = max_idle;
+   pthread_mutex_init(&p->lock, 0);
+
+   return p;
+}
+
+void at_buffer_pool_free(struct at_buffer_pool_t *pool) {
+
+   struct at_allocator_t allocator = pool->allocator;
+
+   while (pool->idle != 0) {
+      struct at_pool_buffer_t *next = pool->idle->next;
+      allocator.free(allocator.user_data, pool->idle, pool->buffer_size);
+      pool->idle = next;
+   }
+
+   pthread_mutex_destroy(&pool->lock);
+   allocator.free(allocator.user_data, pool, sizeof(struct at_buffer_pool_t));
+}
+
+void at_buffer_pool_get_stats(struct at_buffer_pool_t *pool, struct at_buffer_pool_stats_t *stats) {
+   pthread_mutex_lock(&pool->lock);
+   *stats = pool->stats;
+   pthread_mutex_unlock(&pool->lock);
+}
+
+// Called with the lock held
+static void at_buffer_pool_count_take(struct at_buffer_pool_t *pool) {
+
+   pool->stats.taken++;
+   pool->stats.in_use++;
+
+   if (pool->stats.in_use > pool->stats.peak_in_use)
+      pool->stats.peak_in_use = pool->stats.in_use;
+}
+
+unsigned char *at_buffer_pool_take(
+      struct at_buffer_pool_t *pool,
+      unsigned int size,
+      unsigned int *capacity,
+      bool *allocated) {
+
+   *allocated = false;
+
+   if (size > pool->large_size)
+      return 0;
+
+   bool large = size > pool->buffer_size;
+
+   *capacity = large ? pool->large_size : pool->buffer_size;
+
+   pthread_mutex_lock(&pool->lock);
+
+   if (large == false && pool->idle != 0) {
+
+      struct at_pool_buffer_t *b = pool->idle;
+      pool->idle = b->next;
+      pool->stats.idle--;
+      at_buffer_pool_count_take(pool);
+
+      pthread_mutex_unlock(&pool->lock);
+      return (unsigned char*)b;
+   }
+
+   pthread_mutex_unlock(&pool->lock);
+
+   // Allocated outside of the lock, counted under it
+   *allocated = true;
+   unsigned char *b = (unsigned char*)pool->allocator.alloc(pool->allocator.user_data, *capacity);
+
+   pthread_mutex_lock(&pool->lock);
+
+   if (b != 0) {
+      at_buffer_pool_count_take(pool);
+      pool->stats.allocated++;
+      pool->stats.bytes += *capacity;
+
+      if (large)
+         pool->stats.large++;
+   } else {
+      pool->stats.failed++;
+   }
+
+   pthread_mutex_unlock(&pool->lock);
+
+   return b;
+}
+
+void at_buffer_pool_return(struct at_buffer_pool_t *pool, unsigned char *buffer, unsigned int capacity) {
+
+   struct at_pool_buffer_t *b = (struct at_pool_buffer_t*)buffer;
+   bool keep = false;
+
+   pthread_mutex_lock(&pool->lock);
+
+   pool->stats.in_use--;
+
+   if (capacity == pool->buffer_size && pool->stats.idle < pool->max_idle) {
+      b->next = pool->idle;
+      pool->idle = b;
+      pool->stats.idle++;
+      keep = true;
+   } else {
+      pool->stats.bytes -= capacity;
+   }
+
+   pthread_mutex_unlock(&pool->lock);
+
+   if (keep == false)
+      pool->allocator.free(pool->allocator.user_data, b, capacity);
+}
@@ -0,0 +1,17 @@
+#ifndef AT_POOL_INTERNAL_H
+#define AT_POOL_INTERNAL_H
+
+#include "pool.h"
+
+// A buffer of at least 'size' bytes, a regular one when it fits, 0 when out
+// of memory or 'size' exceeds the large buffers. Its size goes to 'capacity',
+// 'allocated' tells whether the pool had to allocate, successfully or not.
+unsigned char *at_buffer_pool_take(
+      struct at_buffer_pool_t *pool,
+      unsigned int size,
+      unsigned int *capacity,
+      bool *allocated);
+
+void at_buffer_pool_return(struct at_buffer_pool_t *pool, unsigned char *buffer, unsigned int capacity);
+
+#endif // AT_POOL_INTERNAL_H
@@ -0,0 +1,481 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "proxy.h"
+#include "at_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Downstream bytes are spliced into 'pipe' and teed into 'copy', which is
+// read to find line ends and final results. Bytes of a line stay in 'pipe'
+// until the line is complete: response lines are then spliced on upstream,
+// final results and unsolicited lines are drained, the latter relayed from
+// the parsed copy. Descriptors splice() does not support, a pty for
+// example, switch the proxy to plain reads. Memory comes from the default
+// allocator at the time the proxy is created.
+
+#define AT_PROXY_READ_SIZE 4096
+#define AT_PROXY_LINE_SIZE 256
+#define AT_PROXY_COMMAND_SIZE (AT_INPUT_BUFFER_SIZE + 3)
+
+struct at_proxy_request_t {
+   struct at_context_t *ctx;
+   unsigned int size;
+   char command[AT_PROXY_COMMAND_SIZE];
+};
+
+struct at_proxy_channel_t {
+   struct at_context_t *ctx;
+   int upstream;
+   struct at_proxy_channel_t *next;
+};
+
+struct at_proxy_t {
+   struct at_allocator_t allocator;
+   int downstream;
+   bool splice;
+   int pipe[2];
+   int copy[2];
+   struct at_proxy_channel_t *channels;
+   struct at_proxy_request_t *queue;
+   unsigned int capacity;
+   unsigned int head;
+   unsigned int count;
+   bool in_flight;
+   // Blank lines, then the line being received
+   unsigned char line[AT_PROXY_LINE_SIZE];
+   unsigned int line_size;
+   unsigned int line_start;
+   bool long_line;
+   char detailed[AT_PROXY_LINE_SIZE];
+   struct at_proxy_stats_t stats;
+};
+
+static size_t at_proxy_queue_bytes(unsigned int queue_size) {
+   return (queue_size != 0 ? queue_size : 1) * sizeof(struct at_proxy_request_t);
+}
+
+struct at_proxy_t *at_proxy_create(int downstream, unsigned int queue_size) {
+
+   const struct at_allocator_t *allocator = at_get_default_allocator();
+   struct at_proxy_t *p = (struct at_proxy_t*)allocator->alloc(allocator->user_data, sizeof(struct at_proxy_t));
+
+   if (p == 0)
+      return 0;
+
+   memset(p, 0, sizeof(struct at_proxy_t));
+   p->allocator = *allocator;
+   p->queue = (struct at_proxy_request_t*)allocator->alloc(allocator->user_data, at_proxy_queue_bytes(queue_size));
+
+   if (p->queue == 0) {
+      allocator->free(allocator->user_data, p, sizeof(struct at_proxy_t));
+      return 0;
+   }
+
+   p->downstream = downstream;
+   p->capacity = queue_size;
+   p->pipe[0] = p->pipe[1] = p->copy[0] = p->copy[1] = -1;
+
+   p->splice = pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) == 0 &&
+               pipe2(p->copy, O_NONBLOCK | O_CLOEXEC) == 0;
+
+   return p;
+}
+
+void at_proxy_free(struct at_proxy_t *proxy) {
+
+   for (int i = 0; i < 2; ++i) {
+      if (proxy->pipe[i] >= 0)
+         close(proxy->pipe[i]);
+      if (proxy->copy[i] >= 0)
+         close(proxy->copy[i]);
+   }
+
+   struct at_allocator_t allocator = proxy->allocator;
+
+   while (proxy->channels != 0) {
+      struct at_proxy_channel_t *next = proxy->channels->next;
+      at_set_command_fallback(proxy->channels->ctx, 0, 0);
+      allocator.free(allocator.user_data, proxy->channels, sizeof(struct at_proxy_channel_t));
+      proxy->channels = next;
+   }
+
+   allocator.free(allocator.user_data, proxy->queue, at_proxy_queue_bytes(proxy->capacity));
+   allocator.free(allocator.user_data, proxy, sizeof(struct at_proxy_t));
+}
+
+static struct at_proxy_channel_t *at_proxy_channel(struct at_proxy_t *proxy, struct at_context_t *ctx) {
+
+   for (struct at_proxy_channel_t *c = proxy->channels; c != 0; c = c->next) {
+      if (c->ctx == ctx)
+         return c;
+   }
+
+   return 0;
+}
+
+static bool at_proxy_write(int fd, const void *data, size_t size) {
+
+   const char *it = (const char*)data;
+
+   while (size != 0) {
+
+      ssize_t r = write(fd, it, size);
+
+      if (r < 0 && errno == EINTR)
+         continue;
+
+      if (r <= 0)
+         return false;
+
+      it += r;
+      size -= r;
+   }
+
+   return true;
+}
+
+// Discards 'size' bytes from the head of the pipe, already parsed
+static void at_proxy_drain(struct at_proxy_t *proxy, size_t size) {
+
+   unsigned char scratch[AT_PROXY_LINE_SIZE];
+
+   while (proxy->splice && size != 0) {
+
+      ssize_t r = read(proxy->pipe[0], scratch, size < sizeof(scratch) ? size : sizeof(scratch));
+
+      if (r <= 0)
+         return;
+
+      size -= r;
+   }
+}
+
+static void at_proxy_resume(struct at_proxy_t *proxy, struct at_context_t *ctx, const struct at_function_result *result);
+
+// Writes queued commands until one is in flight
+static void at_proxy_send(struct at_proxy_t *proxy) {
+
+   while (proxy->in_flight == false && proxy->count != 0) {
+
+      struct at_proxy_request_t *r = &proxy->queue[proxy->head];
+
+      if (r->ctx != 0 && at_proxy_write(proxy->downstream, r->command, r->size)) {
+         proxy->in_flight = true;
+         return;
+      }
+
+      struct at_context_t *ctx = r->ctx;
+
+      proxy->head = (proxy->head + 1) % proxy->capacity;
+      proxy->count--;
+
+      if (ctx != 0) {
+         struct at_function_result result;
+         at_unknown_error(&result);
+         proxy->stats.rejected++;
+         at_proxy_resume(proxy, ctx, &result);
+      }
+   }
+}
+
+static void at_proxy_resume(struct at_proxy_t *proxy, struct at_context_t *ctx, const struct at_function_result *result) {
+   // May forward the next held command of the context
+   at_resume(ctx, result);
+   at_proxy_send(proxy);
+}
+
+static void at_proxy_forward(struct at_function_result *r, struct at_function_context_t *fctx) {
+
+   struct at_proxy_t *proxy = (struct at_proxy_t*)fctx->user_data;
+   unsigned int size = range_size(&fctx->parameters);
+
+   if (proxy->count == proxy->capacity || size + 3 > AT_PROXY_COMMAND_SIZE) {
+      proxy->stats.rejected++;
+      at_return_operation_not_allowed_error(r);
+      return;
+   }
+
+   struct at_proxy_request_t *request = &proxy->queue[(proxy->head + proxy->count) % proxy->capacity];
+
+   request->ctx = fctx->context;
+   request->size = size + 3;
+   request->command[0] = 'A';
+   request->command[1] = 'T';
+   memcpy(request->command + 2, fctx->parameters.begin, size);
+   request->command[size + 2] = '\r';
+
+   proxy->count++;
+
+   // A command written right away is deferred, a failed one fails here,
+   // the context is still inside its handler
+   if (proxy->in_flight == false) {
+
+      if (at_proxy_write(proxy->downstream, request->command, request->size) == false) {
+         proxy->count--;
+         proxy->stats.rejected++;
+         at_unknown_error(r);
+         return;
+      }
+
+      proxy->in_flight = true;
+   }
+
+   proxy->stats.forwarded++;
+   at_defer(fctx);
+}
+
+bool at_proxy_attach(struct at_proxy_t *proxy, struct at_context_t *ctx, int upstream) {
+
+   if (proxy->capacity == 0 || at_proxy_channel(proxy, ctx) != 0)
+      return false;
+
+   struct at_proxy_channel_t *c = (struct at_proxy_channel_t*)proxy->allocator.alloc(proxy->allocator.user_data, sizeof(struct at_proxy_channel_t));
+
+   if (c == 0)
+      return false;
+
+   c->ctx = ctx;
+   c->upstream = upstream;
+   c->next = proxy->channels;
+   proxy->channels = c;
+
+   at_set_command_fallback(ctx, at_proxy_forward, proxy);
+   return true;
+}
+
+void at_proxy_detach(struct at_proxy_t *proxy, struct at_context_t *ctx) {
+
+   struct at_proxy_channel_t **link = &proxy->channels;
+
+   while (*link != 0 && (*link)->ctx != ctx)
+      link = &(*link)->next;
+
+   if (*link == 0)
+      return;
+
+   struct at_proxy_channel_t *c = *link;
+   *link = c->next;
+   proxy->allocator.free(proxy->allocator.user_data, c, sizeof(struct at_proxy_channel_t));
+
+   at_set_command_fallback(ctx, 0, 0);
+
+   // Responses to its commands are dropped, the one in flight still ends
+   for (unsigned int i = 0; i < proxy->count; ++i) {
+
+      struct at_proxy_request_t *r = &proxy->queue[(proxy->head + i) % proxy->capacity];
+
+      if (r->ctx == ctx)
+         r->ctx = 0;
+   }
+}
+
+static void at_proxy_relay(struct at_proxy_t *proxy, struct at_context_t *ctx, const unsigned char *data, size_t size) {
+
+   struct at_proxy_channel_t *c = at_proxy_channel(proxy, ctx);
+
+   if (c == 0) {
+      at_proxy_drain(proxy, size);
+      return;
+   }
+
+   if (proxy->splice && c->upstream >= 0) {
+
+      // Earlier output of the context goes first
+      at_flush_output(ctx);
+
+      while (size != 0) {
+
+         ssize_t r = splice(proxy->pipe[0], 0, c->upstream, 0, size, SPLICE_F_MOVE);
+
+         if (r < 0 && errno == EINTR)
+            continue;
+
+         if (r <= 0)
+            break;
+
+         proxy->stats.spliced += r;
+         data += r;
+         size -= r;
+      }
+
+      if (size == 0)
+         return;
+   }
+
+   at_proxy_drain(proxy, size);
+   proxy->stats.copied += size;
+   at_relay(ctx, data, size, false);
+}
+
+// "OK", "ERROR", "+CME ERROR: <err>" and "+CMS ERROR: <err>" end a command
+static bool at_proxy_final_result(struct at_proxy_t *proxy, const unsigned char *text, size_t size, struct at_function_result *result) {
+
+   if (size == 2 && memcmp(text, "OK", 2) == 0) {
+      at_ok_result(result);
+      return true;
+   }
+
+   if (size == 5 && memcmp(text, "ERROR", 5) == 0) {
+      at_unknown_error(result);
+      return true;
+   }
+
+   if (size < 12 || (memcmp(text, "+CME ERROR:", 11) != 0 && memcmp(text, "+CMS ERROR:", 11) != 0))
+      return false;
+
+   text += 11;
+   size -= 11;
+
+   while (size != 0 && *text == ' ') {
+      text++;
+      size--;
+   }
+
+   memcpy(proxy->detailed, text, size);
+   proxy->detailed[size] = 0;
+
+   int code = 0;
+   size_t i = 0;
+
+   while (i < size && text[i] >= '0' && text[i] <= '9' && code < 100000)
+      code = code * 10 + (text[i++] - '0');
+
+   result->result = false;
+   result->code = (i == size && size != 0) ? code : 100;
+   result->detailed = proxy->detailed;
+   return true;
+}
+
+// Blank lines go with the line after them
+static void at_proxy_line(struct at_proxy_t *proxy, bool complete) {
+
+   const unsigned char *text = proxy->line + proxy->line_start;
+   size_t size = proxy->line_size - proxy->line_start;
+
+   while (size != 0 && (text[size - 1] == '\r' || text[size - 1] == '\n'))
+      size--;
+
+   if (complete && size == 0 && proxy->long_line == false && proxy->line_size < AT_PROXY_LINE_SIZE) {
+      proxy->line_start = proxy->line_size;
+      return;
+   }
+
+   struct at_proxy_request_t *r = &proxy->queue[proxy->head];
+   struct at_function_result result;
+
+   if (proxy->in_flight && proxy->long_line == false && complete &&
+       at_proxy_final_result(proxy, text, size, &result)) {
+
+      struct at_context_t *ctx = r->ctx;
+
+      at_proxy_drain(proxy, proxy->line_size);
+      proxy->line_size = proxy->line_start = 0;
+
+      proxy->head = (proxy->head + 1) % proxy->capacity;
+      proxy->count--;
+      proxy->in_flight = false;
+
+      if (ctx != 0) {
+         at_proxy_resume(proxy, ctx, &result);
+      } else {
+         at_proxy_send(proxy);
+      }
+
+      return;
+   }
+
+   if (proxy->in_flight) {
+      at_proxy_relay(proxy, r->ctx, proxy->line, proxy->line_size);
+   } else {
+
+      at_proxy_drain(proxy, proxy->line_size);
+
+      for (struct at_proxy_channel_t *c = proxy->channels; c != 0; c = c->next)
+         at_relay(c->ctx, proxy->line, proxy->line_size, true);
+
+      if (proxy->long_line == false)
+         proxy->stats.unsolicited++;
+   }
+
+   // The rest of an overlong line follows the same way
+   proxy->long_line = complete == false;
+   proxy->line_size = proxy->line_start = 0;
+}
+
+static void at_proxy_parse(struct at_proxy_t *proxy, const unsigned char *data, size_t size) {
+
+   for (size_t i = 0; i < size; ++i) {
+
+      proxy->line[proxy->line_size++] = data[i];
+
+      if (data[i] == '\n') {
+         at_proxy_line(proxy, true);
+      } else if (proxy->line_size == AT_PROXY_LINE_SIZE) {
+         at_proxy_line(proxy, false);
+      }
+   }
+}
+
+// Drops the pipes, bytes in them are in the line buffer already
+static void at_proxy_unsplice(struct at_proxy_t *proxy, unsigned char *buffer, size_t *size) {
+
+   ssize_t r = read(proxy->pipe[0], buffer, *size);
+   size_t skip = proxy->line_size;
+
+   *size = (r > 0 && (size_t)r > skip) ? r - skip : 0;
+   memmove(buffer, buffer + skip, *size);
+
+   proxy->splice = false;
+}
+
+bool at_proxy_process(struct at_proxy_t *proxy) {
+
+   unsigned char buffer[AT_PROXY_READ_SIZE + AT_PROXY_LINE_SIZE];
+   ssize_t n;
+
+   if (proxy->splice) {
+
+      n = splice(proxy->downstream, 0, proxy->pipe[1], 0, AT_PROXY_READ_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+      if (n < 0 && errno == EINVAL) {
+         proxy->splice = false;
+      } else if (n > 0) {
+
+         // The pipe still holds the partial line, it is teed again
+         size_t size = proxy->line_size + n;
+         ssize_t teed = tee(proxy->pipe[0], proxy->copy[1], size, SPLICE_F_NONBLOCK);
+         ssize_t r = teed == (ssize_t)size ? read(proxy->copy[0], buffer, size) : -1;
+
+         if (r == (ssize_t)size) {
+            at_proxy_parse(proxy, buffer + proxy->line_size, n);
+         } else {
+
+            while (teed > 0 && read(proxy->copy[0], buffer, sizeof(buffer)) > 0)
+               ;
+
+            at_proxy_unsplice(proxy, buffer, &size);
+            at_proxy_parse(proxy, buffer, size);
+         }
+
+         return true;
+      }
+   }
+
+   if (proxy->splice == false)
+      n = read(proxy->downstream, buffer, AT_PROXY_READ_SIZE);
+
+   if (n > 0) {
+      at_proxy_parse(proxy, buffer, n);
+      return true;
+   }
+
+   return n < 0 && (errno == EAGAIN || errno == EINTR);
+}
+
+void at_proxy_get_stats(struct at_proxy_t *proxy, struct at_proxy_stats_t *stats) {
+   *stats = proxy->stats;
+}
@@ -19,24 +19,11 @@ struct range_t range_empty(void) {
    return r;
 }
 
-struct range_t range_create_it(iterator_t begin, iterator_t end) {
-   struct range_t r;
-   r.begin = begin;
-   r.end = end;
-   return r;
-}
-
-bool range_is_empty(struct range_t *range) {
-   return range->begin == range->end;
-}
-
-unsigned int range_size(struct range_t *range) {
-   return range->end - range->begin;
-}
-
-int is_digit(unsigned char v) {
-   return v >= '0' && v <= '9';
-}
+// External definitions of the inline helpers of range.h
+extern inline struct range_t range_create_it(iterator_t begin, iterator_t end);
+extern inline bool range_is_empty(struct range_t *range);
+extern inline unsigned int range_size(struct range_t *range);
+extern inline int is_digit(unsigned char v);
 
 bool range_convert_to_int(struct range_t *range, int *result) {
 
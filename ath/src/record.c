@@ -0,0 +1,225 @@
+#include "record.h"
+
+#include <limits.h>
+#include <time.h>
+
+// File layout: "ATHR" magic, version byte, then records of
+//   type (1 byte), time delta in ns, [prefix size, prefix], data size, data
+// where numbers are LEB128 varints and the prefix is present only for
+// unsolicited records.
+
+#define AT_RECORD_VERSION 1
+
+static const unsigned char at_record_magic[4] = { 'A', 'T', 'H', 'R' };
+
+struct at_recorder_t {
+   FILE *file;
+   unsigned long long start_ns;
+   unsigned long long last_ns;
+};
+
+struct at_record_reader_t {
+   FILE *file;
+   unsigned long long timestamp_ns;
+   unsigned char *buffer;
+   unsigned int buffer_size;
+};
+
+static unsigned long long at_record_now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void at_record_write_varint(FILE *file, unsigned long long value) {
+   unsigned char buff[10];
+   unsigned int size = 0;
+
+   do {
+      unsigned char b = value & 0x7f;
+      value >>= 7;
+
+      if (value != 0)
+         b |= 0x80;
+
+      buff[size++] = b;
+   } while (value != 0);
+
+   fwrite(buff, 1, size, file);
+}
+
+static bool at_record_read_varint(FILE *file, unsigned long long *value) {
+   *value = 0;
+
+   for (unsigned int shift = 0; shift < 64; shift += 7) {
+      int c = fgetc(file);
+
+      if (c == EOF)
+         return false;
+
+      *value |= (unsigned long long)(c & 0x7f) << shift;
+
+      if ((c & 0x80) == 0)
+         return true;
+   }
+
+   return false;
+}
+
+// Sizes the buffer can not hold are taken for a corrupt file
+static bool at_record_read_size(FILE *file, unsigned long long *size) {
+   return at_record_read_varint(file, size) && *size <= UINT_MAX;
+}
+
+static void at_record_write_range(FILE *file, const struct range_t *range) {
+   at_record_write_varint(file, range_size((struct range_t*)range));
+   fwrite(range->begin, 1, range_size((struct range_t*)range), file);
+}
+
+static void at_recorder_hook(void *user, const struct at_record_event_t *event) {
+
+   struct at_recorder_t *recorder = (struct at_recorder_t*)user;
+
+   unsigned long long now = at_record_now_ns() - recorder->start_ns;
+
+   fputc(event->type, recorder->file);
+   at_record_write_varint(recorder->file, now - recorder->last_ns);
+
+   if (event->type == AT_RECORD_UNSOLICITED) {
+      at_record_write_range(recorder->file, &event->prefix);
+   }
+
+   at_record_write_range(recorder->file, &event->data);
+
+   recorder->last_ns = now;
+}
+
+struct at_recorder_t *at_recorder_open(const char *path) {
+
+   struct at_recorder_t *recorder = (struct at_recorder_t*)malloc(sizeof(struct at_recorder_t));
+
+   if (recorder == 0)
+      return 0;
+
+   recorder->file = fopen(path, "wb");
+
+   if (recorder->file == 0) {
+      free(recorder);
+      return 0;
+   }
+
+   fwrite(at_record_magic, 1, sizeof(at_record_magic), recorder->file);
+   fputc(AT_RECORD_VERSION, recorder->file);
+
+   recorder->start_ns = at_record_now_ns();
+   recorder->last_ns = 0;
+
+   return recorder;
+}
+
+void at_recorder_attach(struct at_recorder_t *recorder, struct at_context_t *ctx) {
+   at_set_record_hook(ctx, at_recorder_hook, recorder);
+}
+
+void at_recorder_close(struct at_recorder_t *recorder) {
+   fclose(recorder->file);
+   free(recorder);
+}
+
+struct at_record_reader_t *at_record_reader_open(const char *path) {
+
+   struct at_record_reader_t *reader = (struct at_record_reader_t*)malloc(sizeof(struct at_record_reader_t));
+
+   if (reader == 0)
+      return 0;
+
+   reader->file = fopen(path, "rb");
+   reader->timestamp_ns = 0;
+   reader->buffer = 0;
+   reader->buffer_size = 0;
+
+   unsigned char header[sizeof(at_record_magic) + 1];
+
+   if (reader->file == 0 ||
+       fread(header, 1, sizeof(header), reader->file) != sizeof(header) ||
+       memcmp(header, at_record_magic, sizeof(at_record_magic)) != 0 ||
+       header[sizeof(at_record_magic)] != AT_RECORD_VERSION) {
+
+      at_record_reader_close(reader);
+      return 0;
+   }
+
+   return reader;
+}
+
+static bool at_record_reserve(struct at_record_reader_t *reader, unsigned long long size) {
+
+   if (size <= reader->buffer_size)
+      return true;
+
+   if (size > UINT_MAX)
+      return false;
+
+   unsigned char *p = (unsigned char*)realloc(reader->buffer, size);
+
+   if (p == 0)
+      return false;
+
+   reader->buffer = p;
+   reader->buffer_size = size;
+   return true;
+}
+
+bool at_record_read(struct at_record_reader_t *reader, struct at_record_t *record) {
+
+   int type = fgetc(reader->file);
+
+   if (type != AT_RECORD_INPUT && type != AT_RECORD_OUTPUT &&
+       type != AT_RECORD_UNSOLICITED && type != AT_RECORD_UNSOLICITED_LINE)
+      return false;
+
+   unsigned long long delta;
+   unsigned long long prefix_size = 0;
+   unsigned long long data_size;
+
+   if (at_record_read_varint(reader->file, &delta) == false)
+      return false;
+
+   // Prefix and data share the buffer, each followed by a terminating zero
+   if (type == AT_RECORD_UNSOLICITED) {
+      if (at_record_read_size(reader->file, &prefix_size) == false ||
+          at_record_reserve(reader, prefix_size + 1) == false ||
+          fread(reader->buffer, 1, prefix_size, reader->file) != prefix_size)
+         return false;
+   }
+
+   if (at_record_read_size(reader->file, &data_size) == false ||
+       at_record_reserve(reader, prefix_size + data_size + 2) == false)
+      return false;
+
+   unsigned char *data = reader->buffer + prefix_size + 1;
+
+   if (fread(data, 1, data_size, reader->file) != data_size)
+      return false;
+
+   data[data_size] = 0;
+   reader->buffer[prefix_size] = 0;
+   reader->timestamp_ns += delta;
+
+   record->type = (enum AT_RECORD_TYPE)type;
+   record->timestamp_ns = reader->timestamp_ns;
+   record->prefix = range_create_cnt(reader->buffer, prefix_size);
+   record->data = range_create_cnt(data, data_size);
+
+   return true;
+}
+
+void at_record_reader_close(struct at_record_reader_t *reader) {
+
+   if (reader->file != 0) {
+      fclose(reader->file);
+   }
+
+   free(reader->buffer);
+   free(reader);
+}
@@ -0,0 +1,369 @@
+#include "registry.h"
+#include "registry_internal.h"
+#include "at_internal.h"
+
+#include <pthread.h>
+
+// Readers publish the epoch they entered in, 0 while outside of dispatch. A
+// writer swaps the snapshot pointer, then advances the epoch; the replaced
+// snapshot is retired with the epoch before the advance. Readers that may
+// have loaded it entered in that epoch or earlier, so it is freed once every
+// active reader entered later. All atomics are sequentially consistent,
+// which orders the reader's epoch store before its snapshot load. Sets,
+// registries and readers come from the default allocator at the time they
+// are created.
+
+// Registry snapshots are command sets owned by the registry
+struct at_command_set_t {
+   struct at_allocator_t allocator;
+   size_t size;
+   unsigned int refs;
+   unsigned long long version;
+   unsigned long long retired_epoch;
+   void (*reclaim)(void *arg);
+   void *arg;
+   struct at_command_set_t *next;
+   unsigned int count;
+   struct at_command_t commands[];
+};
+
+struct at_registry_reader_t {
+   struct at_registry_t *registry;
+   unsigned long long epoch;
+   struct at_command_set_t *snapshot;
+   unsigned int depth;
+   bool used;
+   struct at_registry_reader_t *next;
+};
+
+struct at_registry_t {
+   struct at_allocator_t allocator;
+   struct at_command_set_t *current;
+   unsigned long long epoch;
+   unsigned long long version;
+   pthread_mutex_t lock;
+   struct at_registry_reader_t *readers;
+   struct at_command_set_t *retired;
+};
+
+static int at_command_set_compare(const void *a, const void *b) {
+
+   const struct at_command_t *x = (const struct at_command_t*)a;
+   const struct at_command_t *y = (const struct at_command_t*)b;
+   int c = strcmp(x->tag, y->tag);
+
+   return c != 0 ? c : (int)x->cmd_type - (int)y->cmd_type;
+}
+
+// Commands, sorted for binary search, and their tags in one block
+static struct at_command_set_t *at_command_set_build(
+      const struct at_command_t *commands,
+      unsigned int count,
+      void (*reclaim)(void *arg),
+      void *arg) {
+
+   size_t size = sizeof(struct at_command_set_t) + count * sizeof(struct at_command_t);
+
+   for (unsigned int i = 0; i < count; ++i)
+      size += strlen(commands[i].tag) + 1;
+
+   const struct at_allocator_t *allocator = at_get_default_allocator();
+   struct at_command_set_t *s = (struct at_command_set_t*)allocator->alloc(allocator->user_data, size);
+
+   if (s == 0)
+      return 0;
+
+   s->allocator = *allocator;
+   s->size = size;
+
+   char *tags = (char*)&s->commands[count];
+
+   for (unsigned int i = 0; i < count; ++i) {
+
+      size_t tag_size = strlen(commands[i].tag) + 1;
+
+      memcpy(tags, commands[i].tag, tag_size);
+      s->commands[i] = commands[i];
+      s->commands[i].tag = tags;
+      tags += tag_size;
+   }
+
+   qsort(s->commands, count, sizeof(struct at_command_t), at_command_set_compare);
+
+   s->refs = 1;
+   s->version = 0;
+   s->count = count;
+   s->reclaim = reclaim;
+   s->arg = arg;
+   s->next = 0;
+
+   return s;
+}
+
+struct at_command_set_t *at_command_set_create(const struct at_command_t *commands, unsigned int count) {
+   return at_command_set_build(commands, count, 0, 0);
+}
+
+struct at_command_set_t *at_command_set_retain(struct at_command_set_t *set) {
+   __atomic_fetch_add(&set->refs, 1, __ATOMIC_RELAXED);
+   return set;
+}
+
+void at_command_set_release(struct at_command_set_t *set) {
+
+   if (set == 0 || __atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL) != 0)
+      return;
+
+   if (set->reclaim != 0)
+      set->reclaim(set->arg);
+
+   set->allocator.free(set->allocator.user_data, set, set->size);
+}
+
+void at_set_command_set(struct at_context_t *ctx, struct at_command_set_t *set) {
+
+   struct at_command_set_t **current = at_get_command_set(ctx);
+
+   if (set != 0)
+      at_command_set_retain(set);
+
+   at_command_set_release(*current);
+   *current = set;
+}
+
+const struct at_command_t *at_command_set_find(
+      const struct at_command_set_t *set,
+      const struct range_t *tag,
+      enum AT_CMD_TYPE cmd_type) {
+
+   size_t tag_size = tag->end - tag->begin;
+   unsigned int low = 0;
+   unsigned int high = set->count;
+
+   while (low < high) {
+
+      unsigned int middle = low + (high - low) / 2;
+      const struct at_command_t *c = &set->commands[middle];
+
+      size_t c_size = strlen(c->tag);
+      int order = memcmp(c->tag, tag->begin, c_size < tag_size ? c_size : tag_size);
+
+      if (order == 0)
+         order = c_size < tag_size ? -1 : (c_size > tag_size ? 1 : (int)c->cmd_type - (int)cmd_type);
+
+      if (order == 0)
+         return c;
+
+      if (order < 0) {
+         low = middle + 1;
+      } else {
+         high = middle;
+      }
+   }
+
+   return 0;
+}
+
+struct at_registry_t *at_registry_create(void) {
+
+   const struct at_allocator_t *allocator = at_get_default_allocator();
+   struct at_registry_t *r = (struct at_registry_t*)allocator->alloc(allocator->user_data, sizeof(struct at_registry_t));
+
+   if (r == 0)
+      return 0;
+
+   r->allocator = *allocator;
+   r->current = 0;
+   r->epoch = 1;
+   r->version = 0;
+   r->readers = 0;
+   r->retired = 0;
+   pthread_mutex_init(&r->lock, 0);
+
+   return r;
+}
+
+void at_registry_free(struct at_registry_t *registry) {
+
+   if (registry->current != 0)
+      at_command_set_release(registry->current);
+
+   while (registry->retired != 0) {
+      struct at_command_set_t *next = registry->retired->next;
+      at_command_set_release(registry->retired);
+      registry->retired = next;
+   }
+
+   struct at_allocator_t allocator = registry->allocator;
+
+   while (registry->readers != 0) {
+      struct at_registry_reader_t *next = registry->readers->next;
+      allocator.free(allocator.user_data, registry->readers, sizeof(struct at_registry_reader_t));
+      registry->readers = next;
+   }
+
+   pthread_mutex_destroy(&registry->lock);
+   allocator.free(allocator.user_data, registry, sizeof(struct at_registry_t));
+}
+
+// Called with the lock held
+static unsigned int at_registry_reclaim_locked(struct at_registry_t *registry) {
+
+   unsigned long long oldest = ~0ull;
+   unsigned int waiting = 0;
+
+   for (struct at_registry_reader_t *p = registry->readers; p != 0; p = p->next) {
+
+      unsigned long long epoch = __atomic_load_n(&p->epoch, __ATOMIC_SEQ_CST);
+
+      if (epoch != 0 && epoch < oldest)
+         oldest = epoch;
+   }
+
+   struct at_command_set_t **link = &registry->retired;
+
+   while (*link != 0) {
+
+      struct at_command_set_t *s = *link;
+
+      if (s->retired_epoch < oldest) {
+         *link = s->next;
+         at_command_set_release(s);
+      } else {
+         link = &s->next;
+         waiting++;
+      }
+   }
+
+   return waiting;
+}
+
+unsigned long long at_registry_publish(
+      struct at_registry_t *registry,
+      const struct at_command_t *commands,
+      unsigned int count,
+      void (*reclaim)(void *arg),
+      void *arg) {
+
+   struct at_command_set_t *s = at_command_set_build(commands, count, reclaim, arg);
+
+   if (s == 0)
+      return 0;
+
+   pthread_mutex_lock(&registry->lock);
+
+   s->version = registry->version + 1;
+
+   struct at_command_set_t *old = __atomic_exchange_n(&registry->current, s, __ATOMIC_SEQ_CST);
+
+   if (old != 0) {
+      old->retired_epoch = __atomic_fetch_add(&registry->epoch, 1, __ATOMIC_SEQ_CST);
+      old->next = registry->retired;
+      registry->retired = old;
+   }
+
+   __atomic_store_n(&registry->version, s->version, __ATOMIC_RELEASE);
+
+   at_registry_reclaim_locked(registry);
+
+   pthread_mutex_unlock(&registry->lock);
+
+   return s->version;
+}
+
+unsigned long long at_registry_version(struct at_registry_t *registry) {
+   return __atomic_load_n(&registry->version, __ATOMIC_ACQUIRE);
+}
+
+unsigned int at_registry_reclaim(struct at_registry_t *registry) {
+
+   pthread_mutex_lock(&registry->lock);
+   unsigned int waiting = at_registry_reclaim_locked(registry);
+   pthread_mutex_unlock(&registry->lock);
+
+   return waiting;
+}
+
+bool at_registry_attach(struct at_registry_t *registry, struct at_context_t *ctx) {
+
+   struct at_registry_reader_t **slot = at_get_registry_reader(ctx);
+
+   if (*slot != 0)
+      return false;
+
+   pthread_mutex_lock(&registry->lock);
+
+   struct at_registry_reader_t *reader = registry->readers;
+
+   while (reader != 0 && reader->used)
+      reader = reader->next;
+
+   if (reader == 0) {
+
+      reader = (struct at_registry_reader_t*)registry->allocator.alloc(registry->allocator.user_data, sizeof(struct at_registry_reader_t));
+
+      if (reader != 0) {
+         reader->registry = registry;
+         reader->next = registry->readers;
+         registry->readers = reader;
+      }
+   }
+
+   if (reader != 0) {
+      reader->epoch = 0;
+      reader->snapshot = 0;
+      reader->depth = 0;
+      reader->used = true;
+   }
+
+   pthread_mutex_unlock(&registry->lock);
+
+   *slot = reader;
+   return reader != 0;
+}
+
+struct at_registry_t *at_registry_of(struct at_registry_reader_t *reader) {
+   return reader->registry;
+}
+
+void at_registry_release(struct at_registry_reader_t *reader) {
+
+   pthread_mutex_lock(&reader->registry->lock);
+   __atomic_store_n(&reader->epoch, 0, __ATOMIC_SEQ_CST);
+   reader->used = false;
+   pthread_mutex_unlock(&reader->registry->lock);
+}
+
+void at_registry_enter(struct at_registry_reader_t *reader) {
+
+   if (reader->depth++ != 0)
+      return;
+
+   struct at_registry_t *registry = reader->registry;
+
+   __atomic_store_n(&reader->epoch, __atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+   reader->snapshot = __atomic_load_n(&registry->current, __ATOMIC_SEQ_CST);
+}
+
+void at_registry_leave(struct at_registry_reader_t *reader) {
+
+   if (--reader->depth != 0)
+      return;
+
+   reader->snapshot = 0;
+   __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+const struct at_command_t *at_registry_find(
+      struct at_registry_reader_t *reader,
+      const struct range_t *tag,
+      enum AT_CMD_TYPE cmd_type) {
+
+   struct at_command_set_t *s = reader->snapshot;
+
+   return s != 0 ? at_command_set_find(s, tag, cmd_type) : 0;
+}
+
+unsigned long long at_registry_snapshot_version(struct at_registry_reader_t *reader) {
+   return reader->snapshot != 0 ? reader->snapshot->version : 0;
+}
@@ -0,0 +1,36 @@
+#ifndef AT_REGISTRY_INTERNAL_H
+#define AT_REGISTRY_INTERNAL_H
+
+#include "registry.h"
+
+// Read side of a registry for one context. Dispatch enters before looking up
+// a command and leaves after its handler returned, the snapshot seen on
+// entry stays alive in between.
+struct at_registry_reader_t;
+
+void at_registry_enter(struct at_registry_reader_t *reader);
+void at_registry_leave(struct at_registry_reader_t *reader);
+
+const struct at_command_t *at_registry_find(
+      struct at_registry_reader_t *reader,
+      const struct range_t *tag,
+      enum AT_CMD_TYPE cmd_type);
+
+// Version of the snapshot entered, 0 outside dispatch or before the first
+// publish
+unsigned long long at_registry_snapshot_version(struct at_registry_reader_t *reader);
+
+// The reader slot of a freed context is reused by the next attach
+void at_registry_release(struct at_registry_reader_t *reader);
+
+struct at_registry_t *at_registry_of(struct at_registry_reader_t *reader);
+struct at_registry_reader_t **at_get_registry_reader(struct at_context_t *ctx);
+
+const struct at_command_t *at_command_set_find(
+      const struct at_command_set_t *set,
+      const struct range_t *tag,
+      enum AT_CMD_TYPE cmd_type);
+
+struct at_command_set_t **at_get_command_set(struct at_context_t *ctx);
+
+#endif // AT_REGISTRY_INTERNAL_H
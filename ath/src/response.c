@@ -0,0 +1,156 @@
+#include "at.h"
+#include "at_internal.h"
+
+// Longest field written in one piece, "-2147483648"
+#define AT_RESPONSE_NUMBER_MAX 11
+
+#if AT_OUTPUT_BUFFER_SIZE < AT_RESPONSE_NUMBER_MAX
+#error The response builder needs AT_OUTPUT_BUFFER_SIZE of at least 11
+#endif
+
+static const char at_response_hex_digits[] = "0123456789ABCDEF";
+
+static void at_response_tag(struct at_response_t *r) {
+   at_append_text(r->ctx, r->tag);
+   at_append_text(r->ctx, ": ");
+   r->fields = 0;
+}
+
+// Separator before every field but the first of a row, then room for
+// 'size'. 0 when no output buffer can be had, the field is dropped.
+static iterator_t at_response_field(struct at_response_t *r, unsigned int size) {
+
+   unsigned int space;
+   bool separator = r->fields++ != 0;
+
+   iterator_t out = at_output_reserve(r->ctx, size + separator, &space);
+
+   if (out == 0)
+      return 0;
+
+   if (separator)
+      *out++ = ',';
+
+   return out;
+}
+
+// Digits written backwards from the end of the field
+static void at_response_number(struct at_response_t *r, bool negative, unsigned int value, unsigned int base, unsigned int digits) {
+
+   unsigned int count = 1;
+
+   for (unsigned int v = value; v >= base; v /= base)
+      count++;
+
+   if (count < digits)
+      count = digits;
+
+   iterator_t out = at_response_field(r, count + negative);
+
+   if (out == 0)
+      return;
+
+   if (negative)
+      *out++ = '-';
+
+   iterator_t end = out + count;
+
+   for (iterator_t p = end; p != out; value /= base)
+      *--p = at_response_hex_digits[value % base];
+
+   at_output_commit(r->ctx, end);
+}
+
+void at_response_begin(struct at_response_t *r, struct at_context_t *ctx, const char *tag) {
+   r->ctx = ctx;
+   r->tag = tag;
+   at_append_line(ctx, "");
+   at_response_tag(r);
+}
+
+void at_response_int(struct at_response_t *r, int value) {
+
+   if (value < 0) {
+      at_response_number(r, true, 0u - (unsigned int)value, 10, 0);
+   } else {
+      at_response_number(r, false, value, 10, 0);
+   }
+}
+
+void at_response_uint(struct at_response_t *r, unsigned int value) {
+   at_response_number(r, false, value, 10, 0);
+}
+
+void at_response_hex(struct at_response_t *r, unsigned int value, unsigned int digits) {
+
+   if (digits > 8)
+      digits = 8;
+
+   at_response_number(r, false, value, 16, digits);
+}
+
+void at_response_string_range(struct at_response_t *r, const struct range_t *text) {
+
+   unsigned int space;
+   iterator_t out = at_response_field(r, 1);
+   iterator_t end;
+
+   if (out == 0)
+      return;
+
+   *out++ = '"';
+   at_output_commit(r->ctx, out);
+
+   out = at_output_reserve(r->ctx, 3, &space);
+   end = out + space;
+
+   for (iterator_t it = text->begin; it != text->end; ++it) {
+
+      unsigned char c = *it;
+
+      if (end - out < 3) {
+         at_output_commit(r->ctx, out);
+         out = at_output_reserve(r->ctx, 3, &space);
+         end = out + space;
+
+         if (out == 0)
+            return;
+      }
+
+      if (c < 0x20 || c == '"' || c == '\\' || c == 0x7f) {
+         *out++ = '\\';
+         *out++ = at_response_hex_digits[c >> 4];
+         *out++ = at_response_hex_digits[c & 0x0f];
+      } else {
+         *out++ = c;
+      }
+   }
+
+   at_output_commit(r->ctx, out);
+   at_append_char(r->ctx, '"');
+}
+
+void at_response_string(struct at_response_t *r, const char *text) {
+   struct range_t range = get_range((unsigned char*)text);
+   at_response_string_range(r, &range);
+}
+
+void at_response_raw(struct at_response_t *r, const char *text) {
+
+   iterator_t out = at_response_field(r, 0);
+
+   if (out == 0)
+      return;
+
+   at_output_commit(r->ctx, out);
+   at_append_text(r->ctx, text);
+}
+
+void at_response_row(struct at_response_t *r) {
+   at_append_line(r->ctx, "");
+   at_response_tag(r);
+}
+
+void at_response_end(struct at_response_t *r) {
+   at_append_line(r->ctx, "");
+}
@@ -0,0 +1,70 @@
+#include "result_internal.h"
+
+// Final result codes for every (verbose mode, CMEE level, error code)
+// combination, formatted once at compile time. Index 0 is the numeric
+// (ATV0) form terminated by S3, index 1 the verbose (ATV1) form.
+
+#define AT_BLOB(text) { text, sizeof(text) - 1 }
+
+#define AT_FINAL_RESULT(text) { AT_BLOB(text "\r"), AT_BLOB("\r\n" text "\r\n") }
+
+struct at_error_blobs_t {
+   int code;
+   const char *text;
+   struct at_result_blob_t by_code[2];
+   struct at_result_blob_t by_text[2];
+};
+
+#define AT_ERROR_BLOBS(code, function, text) \
+   { code, text, AT_FINAL_RESULT("+CME ERROR: " #code), AT_FINAL_RESULT("+CME ERROR: " text) },
+
+static const struct at_result_blob_t at_ok_blobs[2] = {
+   AT_BLOB("0\r"),
+   AT_BLOB("\r\nOK\r\n")
+};
+
+static const struct at_result_blob_t at_error_blobs[2] = {
+   AT_BLOB("4\r"),
+   AT_BLOB("\r\nERROR\r\n")
+};
+
+static const struct at_error_blobs_t at_cme_error_blobs[] = {
+   AT_ERROR_LIST(AT_ERROR_BLOBS)
+};
+
+const struct at_result_blob_t *at_get_result_blob(
+      bool verbose,
+      int cmee_level,
+      const struct at_function_result *result) {
+
+   int v = verbose ? 1 : 0;
+
+   if (result->result) {
+      return &at_ok_blobs[v];
+   }
+
+   if (cmee_level == 0) {
+      return &at_error_blobs[v];
+   }
+
+   for (unsigned int i = 0; i < sizeof(at_cme_error_blobs) / sizeof(at_cme_error_blobs[0]); ++i) {
+
+      const struct at_error_blobs_t *e = &at_cme_error_blobs[i];
+
+      if (e->code != result->code)
+         continue;
+
+      if (cmee_level == 1) {
+         return &e->by_code[v];
+      }
+
+      // Handlers may report a code with their own text
+      if (result->detailed != 0 && strcmp(result->detailed, e->text) == 0) {
+         return &e->by_text[v];
+      }
+
+      return 0;
+   }
+
+   return 0;
+}
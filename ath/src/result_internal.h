@@ -0,0 +1,29 @@
+#ifndef RESULT_INTERNAL_H
+#define RESULT_INTERNAL_H
+
+#include "at.h"
+
+// Error codes with the function that returns them and their +CME ERROR
+// texts, X(code, function, text). The functions and the precomputed result
+// blobs are both generated from this list.
+#define AT_ERROR_LIST(X) \
+   X(3, at_return_operation_not_allowed_error, "Operation not allowed") \
+   X(4, at_return_operation_not_supported_error, "Operation not supported") \
+   X(20, at_return_memory_full_error, "Memory full") \
+   X(21, at_return_invalid_index_error, "Invalid index") \
+   X(22, at_return_not_found_error, "Not found") \
+   X(24, at_text_string_too_long_error, "Text string too long") \
+   X(25, at_invalid_chars_error, "Invalid characters in text string") \
+   X(100, at_unknown_error, "Unknown error")
+
+struct at_result_blob_t {
+   const char *data;
+   unsigned int size;
+};
+
+const struct at_result_blob_t *at_get_result_blob(
+      bool verbose,
+      int cmee_level,
+      const struct at_function_result *result);
+
+#endif // RESULT_INTERNAL_H
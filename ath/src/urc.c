@@ -0,0 +1,266 @@
+#include "at.h"
+#include "at_internal.h"
+
+#define AT_URC_PRIORITIES (AT_URC_HIGH + 1)
+
+// A pending URC, "prefix\0text\0" in one buffer that is kept for reuse
+struct at_urc_entry_t {
+   char *data;
+   unsigned int capacity;
+   enum AT_URC_PRIORITY priority;
+   struct at_urc_entry_t *next;
+};
+
+struct at_urc_fifo_t {
+   struct at_urc_entry_t *head;
+   struct at_urc_entry_t *tail;
+};
+
+struct at_urc_queue_t {
+   unsigned int capacity;
+   unsigned int pending;
+   struct at_urc_entry_t *entries;
+   struct at_urc_entry_t *free;
+   struct at_urc_fifo_t fifo[AT_URC_PRIORITIES];
+   struct at_urc_stats_t stats;
+};
+
+void at_urc_queue_free(struct at_context_t *ctx, struct at_urc_queue_t *queue) {
+
+   if (queue == 0)
+      return;
+
+   for (unsigned int i = 0; i < queue->capacity; ++i)
+      at_free(ctx, queue->entries[i].data, queue->entries[i].capacity);
+
+   at_free(ctx, queue->entries, queue->capacity * sizeof(struct at_urc_entry_t));
+   at_free(ctx, queue, sizeof(struct at_urc_queue_t));
+}
+
+bool at_set_urc_queue(struct at_context_t *ctx, unsigned int capacity) {
+
+   struct at_urc_queue_t **queue = at_get_urc_queue(ctx);
+
+   // Pending URCs go out before the queue is replaced
+   if (*queue != 0) {
+      at_send_unsolicited(ctx, (*queue)->pending);
+      at_urc_queue_free(ctx, *queue);
+      *queue = 0;
+   }
+
+   if (capacity == 0)
+      return true;
+
+   struct at_urc_queue_t *q = (struct at_urc_queue_t*)at_alloc(ctx, sizeof(struct at_urc_queue_t));
+
+   if (q == 0)
+      return false;
+
+   memset(q, 0, sizeof(struct at_urc_queue_t));
+   q->entries = (struct at_urc_entry_t*)at_alloc(ctx, capacity * sizeof(struct at_urc_entry_t));
+
+   if (q->entries == 0) {
+      at_free(ctx, q, sizeof(struct at_urc_queue_t));
+      return false;
+   }
+
+   memset(q->entries, 0, capacity * sizeof(struct at_urc_entry_t));
+
+   q->capacity = capacity;
+
+   for (unsigned int i = 0; i < capacity; ++i) {
+      q->entries[i].next = q->free;
+      q->free = &q->entries[i];
+   }
+
+   *queue = q;
+   return true;
+}
+
+static void at_urc_push(struct at_urc_fifo_t *fifo, struct at_urc_entry_t *e) {
+
+   e->next = 0;
+
+   if (fifo->tail != 0) {
+      fifo->tail->next = e;
+   } else {
+      fifo->head = e;
+   }
+
+   fifo->tail = e;
+}
+
+static struct at_urc_entry_t *at_urc_pop(struct at_urc_fifo_t *fifo) {
+
+   struct at_urc_entry_t *e = fifo->head;
+
+   fifo->head = e->next;
+
+   if (fifo->head == 0)
+      fifo->tail = 0;
+
+   return e;
+}
+
+static void at_urc_unlink(struct at_urc_fifo_t *fifo, struct at_urc_entry_t *e) {
+
+   struct at_urc_entry_t *previous = 0;
+   struct at_urc_entry_t *p = fifo->head;
+
+   while (p != e) {
+      previous = p;
+      p = p->next;
+   }
+
+   if (previous != 0) {
+      previous->next = e->next;
+   } else {
+      fifo->head = e->next;
+   }
+
+   if (fifo->tail == e)
+      fifo->tail = previous;
+}
+
+// Pending URC with the same prefix, the queue is short so a scan will do
+static struct at_urc_entry_t *at_urc_find(struct at_urc_queue_t *q, const char *prefix) {
+
+   for (unsigned int i = 0; i < AT_URC_PRIORITIES; ++i) {
+      for (struct at_urc_entry_t *e = q->fifo[i].head; e != 0; e = e->next) {
+         if (strcmp(e->data, prefix) == 0)
+            return e;
+      }
+   }
+
+   return 0;
+}
+
+static bool at_urc_store(struct at_context_t *ctx, struct at_urc_entry_t *e, const char *prefix, const char *text) {
+
+   size_t prefix_size = strlen(prefix) + 1;
+   size_t text_size = strlen(text) + 1;
+
+   if (prefix_size + text_size > e->capacity) {
+
+      char *p = (char*)at_realloc(ctx, e->data, e->capacity, prefix_size + text_size);
+
+      if (p == 0)
+         return false;
+
+      e->data = p;
+      e->capacity = prefix_size + text_size;
+   }
+
+   memcpy(e->data, prefix, prefix_size);
+   memcpy(e->data + prefix_size, text, text_size);
+   return true;
+}
+
+void at_queue_unsolicited(
+      struct at_context_t *ctx,
+      const char *prefix,
+      const char *text,
+      enum AT_URC_PRIORITY priority) {
+
+   struct at_urc_queue_t *q = *at_get_urc_queue(ctx);
+
+   if (q == 0) {
+      at_add_unsolicited(ctx, prefix, text);
+      return;
+   }
+
+   struct at_urc_entry_t *e = at_urc_find(q, prefix);
+
+   if (e != 0) {
+
+      // Only the newest state of a prefix is worth sending
+      if (at_urc_store(ctx, e, prefix, text) == false) {
+         q->stats.dropped++;
+         return;
+      }
+
+      if (e->priority != priority) {
+         at_urc_unlink(&q->fifo[e->priority], e);
+         e->priority = priority;
+         at_urc_push(&q->fifo[priority], e);
+      }
+
+      q->stats.merged++;
+      return;
+   }
+
+   if (q->free == 0) {
+
+      unsigned int lowest = 0;
+
+      while (q->fifo[lowest].head == 0)
+         lowest++;
+
+      if (lowest > (unsigned int)priority) {
+         q->stats.dropped++;
+         return;
+      }
+
+      e = at_urc_pop(&q->fifo[lowest]);
+      q->pending--;
+      q->stats.dropped++;
+   } else {
+      e = q->free;
+      q->free = e->next;
+   }
+
+   if (at_urc_store(ctx, e, prefix, text) == false) {
+      e->next = q->free;
+      q->free = e;
+      q->stats.dropped++;
+      return;
+   }
+
+   e->priority = priority;
+   at_urc_push(&q->fifo[priority], e);
+   q->pending++;
+   q->stats.queued++;
+}
+
+unsigned int at_send_unsolicited(struct at_context_t *ctx, unsigned int max) {
+
+   struct at_urc_queue_t *q = *at_get_urc_queue(ctx);
+   unsigned int sent = 0;
+
+   if (q == 0)
+      return 0;
+
+   for (int i = AT_URC_HIGH; i >= AT_URC_LOW && sent < max; --i) {
+
+      while (q->fifo[i].head != 0 && sent < max) {
+
+         struct at_urc_entry_t *e = at_urc_pop(&q->fifo[i]);
+
+         at_add_unsolicited(ctx, e->data, e->data + strlen(e->data) + 1);
+
+         e->next = q->free;
+         q->free = e;
+         q->pending--;
+         q->stats.sent++;
+         sent++;
+      }
+   }
+
+   return sent;
+}
+
+unsigned int at_pending_unsolicited(struct at_context_t *ctx) {
+   struct at_urc_queue_t *q = *at_get_urc_queue(ctx);
+   return q != 0 ? q->pending : 0;
+}
+
+void at_get_urc_stats(struct at_context_t *ctx, struct at_urc_stats_t *stats) {
+
+   struct at_urc_queue_t *q = *at_get_urc_queue(ctx);
+
+   if (q != 0) {
+      *stats = q->stats;
+   } else {
+      memset(stats, 0, sizeof(*stats));
+   }
+}
@@ -0,0 +1,12 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Each benchmark prints its results as "name: key value ..." lines.
+
+void flush_policy_bench(void);
+void linkage_bench(void);
+void engine_bench(void);
+void codec_bench(void);
+void pool_bench(void);
+
+#endif // BENCH_H
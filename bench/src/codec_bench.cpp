@@ -0,0 +1,102 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "codec.h"
+   #include "codec_internal.h"
+}
+
+#include "bench.h"
+
+// Decode and encode throughput of the hex, base64 and UCS2 codecs for each
+// kernel level, in GB/s of encoded text. The UCS2 text is mostly ASCII with
+// an accented letter every 64 characters.
+
+namespace {
+
+const unsigned int payload_size = 1 << 20;
+const std::chrono::milliseconds duration(200);
+
+const char *kernel_name(AT_CODEC_KERNELS kernels) {
+   switch (kernels) {
+   case AT_CODEC_SCALAR: return "scalar";
+   case AT_CODEC_SSSE3: return "ssse3";
+   default: return "avx2";
+   }
+}
+
+template <typename F>
+double rate(unsigned int text_size, F f) {
+
+   unsigned long long rounds = 0;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   std::chrono::steady_clock::time_point now = start;
+
+   while (now - start < duration) {
+      for (int i = 0; i < 16; ++i)
+         f();
+
+      rounds += 16;
+      now = std::chrono::steady_clock::now();
+   }
+
+   return rounds * text_size / std::chrono::duration<double>(now - start).count() / 1e9;
+}
+
+}
+
+void codec_bench(void) {
+
+   std::vector<unsigned char> data(payload_size);
+   for (unsigned int i = 0; i < payload_size; ++i)
+      data[i] = i * 2654435761u >> 13;
+
+   std::vector<unsigned char> hex(2 * payload_size);
+   std::vector<unsigned char> base64((payload_size + 2) / 3 * 4);
+   std::vector<unsigned char> out(base64.size() / 4 * 3);
+
+   at_hex_encode(data.data(), payload_size, hex.data());
+   at_base64_encode(data.data(), payload_size, base64.data());
+
+   std::vector<unsigned char> text;
+   for (unsigned int i = 0; text.size() < payload_size; ++i) {
+      if (i % 64 == 63) {
+         text.push_back(0xc3);
+         text.push_back(0xa9);
+      } else {
+         text.push_back('a' + i % 26);
+      }
+   }
+
+   std::vector<unsigned char> ucs2(4 * text.size());
+   ucs2.resize(at_ucs2_hex_encode(text.data(), text.size(), ucs2.data()));
+
+   range_t hex_range = range_create_cnt(hex.data(), hex.size());
+   range_t ucs2_range = range_create_cnt(ucs2.data(), ucs2.size());
+   range_t base64_range = range_create_cnt(base64.data(), base64.size());
+   unsigned int size;
+
+   for (AT_CODEC_KERNELS kernels : { AT_CODEC_SCALAR, AT_CODEC_SSSE3, AT_CODEC_AVX2 }) {
+
+      at_codec_limit(kernels);
+
+      double hex_decode = rate(hex.size(), [&] { at_hex_decode(&hex_range, out.data(), &size); });
+      double hex_encode = rate(hex.size(), [&] { at_hex_encode(data.data(), payload_size, hex.data()); });
+      double base64_decode = rate(base64.size(), [&] { at_base64_decode(&base64_range, out.data(), &size); });
+      double base64_encode = rate(base64.size(), [&] { at_base64_encode(data.data(), payload_size, base64.data()); });
+      double ucs2_decode = rate(ucs2.size(), [&] { at_ucs2_hex_decode(&ucs2_range, out.data(), &size); });
+      double ucs2_encode = rate(ucs2.size(), [&] { at_ucs2_hex_encode(text.data(), text.size(), ucs2.data()); });
+
+      std::cout << "codec: kernels " << kernel_name(kernels)
+                << " hex_decode_gbs " << hex_decode
+                << " hex_encode_gbs " << hex_encode
+                << " base64_decode_gbs " << base64_decode
+                << " base64_encode_gbs " << base64_encode
+                << " ucs2_decode_gbs " << ucs2_decode
+                << " ucs2_encode_gbs " << ucs2_encode << std::endl;
+   }
+
+   at_codec_limit(AT_CODEC_AVX2);
+}
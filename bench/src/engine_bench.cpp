@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "engine.h"
+   #include <poll.h>
+   #include <sys/socket.h>
+   #include <unistd.h>
+}
+
+#include "bench.h"
+
+// Drives many socketpair channels through the engine with 1, 2, 4 ... shards
+// and reports the command rate. Each command does a little parsing work so
+// the engine side, not the client threads, is the bottleneck.
+
+namespace {
+
+const unsigned int channel_count = 512;
+const unsigned int pipeline = 16;
+const std::chrono::milliseconds duration(500);
+
+void work_handler(struct at_function_result *r, at_function_context_t *ctx) {
+
+   unsigned int h = 0;
+   for (iterator_t it = ctx->parameters.begin; it != ctx->parameters.end; ++it)
+      h = h * 31 + *it;
+
+   // Stands for the per command work of a real handler
+   for (unsigned int i = 0; i < 2000; ++i)
+      h = h * 1103515245u + 12345u;
+
+   at_append_int(ctx->context, h & 0xff);
+   at_append_text(ctx->context, "\r\n");
+   at_ok_result(r);
+}
+
+void setup(void *user, struct at_context_t *ctx) {
+   at_command_add(ctx, "+work", AT_ASSIGNMENT_COMMAND, work_handler);
+   at_set_flush_policy(ctx, AT_FLUSH_PER_INPUT);
+}
+
+// Closed loop client: a batch of commands per channel, then all responses
+void client(const std::vector<int> &fds, std::atomic<bool> &stop, unsigned long long &commands) {
+
+   std::string batch;
+   for (unsigned int i = 0; i < pipeline; ++i)
+      batch += "AT+WORK=" + std::to_string(i) + "\r";
+
+   char buffer[4096];
+
+   while (stop.load(std::memory_order_relaxed) == false) {
+
+      for (int fd : fds) {
+         if (write(fd, batch.data(), batch.size()) != (ssize_t)batch.size())
+            return;
+      }
+
+      for (int fd : fds) {
+
+         unsigned int oks = 0;
+
+         while (oks < pipeline) {
+            ssize_t r = read(fd, buffer, sizeof(buffer));
+
+            if (r <= 0)
+               return;
+
+            // Every response ends with "OK\r\n"
+            for (ssize_t i = 0; i < r; ++i) {
+               if (buffer[i] == 'K')
+                  oks++;
+            }
+         }
+
+         commands += pipeline;
+      }
+   }
+}
+
+double run(unsigned int shards, unsigned int clients) {
+
+   at_engine_config_t config;
+   at_engine_config_init(&config);
+   config.shards = shards;
+   config.workers = 1;
+
+   at_engine_t *engine = at_engine_create(&config);
+
+   std::vector<std::vector<int>> fds(clients);
+   std::string echo_off = "ATE0\r";
+   char buffer[64];
+
+   for (unsigned int i = 0; i < channel_count; ++i) {
+      int pair[2];
+
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+         break;
+
+      at_channel_release(at_engine_add_channel(engine, pair[1], setup, 0));
+
+      if (write(pair[0], echo_off.data(), echo_off.size()) != (ssize_t)echo_off.size() ||
+          read(pair[0], buffer, sizeof(buffer)) <= 0)
+         break;
+
+      fds[i % clients].push_back(pair[0]);
+   }
+
+   std::atomic<bool> stop(false);
+   std::vector<unsigned long long> commands(clients, 0);
+   std::vector<std::thread> threads;
+
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   for (unsigned int i = 0; i < clients; ++i)
+      threads.emplace_back(client, std::cref(fds[i]), std::ref(stop), std::ref(commands[i]));
+
+   std::this_thread::sleep_for(duration);
+   stop = true;
+
+   for (std::thread &t : threads)
+      t.join();
+
+   double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+   for (std::vector<int> &v : fds) {
+      for (int fd : v)
+         close(fd);
+   }
+
+   at_engine_free(engine);
+
+   unsigned long long total = 0;
+   for (unsigned long long c : commands)
+      total += c;
+
+   return total / seconds;
+}
+
+}
+
+void engine_bench(void) {
+
+   unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+   unsigned int clients = std::max(1u, cpus / 2);
+   double single = 0;
+
+   for (unsigned int shards = 1; shards <= cpus; shards *= 2) {
+
+      double rate = run(shards, clients);
+
+      if (shards == 1)
+         single = rate;
+
+      std::cout << "engine: shards " << shards
+                << " channels " << channel_count
+                << " commands/s " << rate
+                << " speedup " << rate / single << std::endl;
+   }
+}
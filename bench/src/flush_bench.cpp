@@ -0,0 +1,162 @@
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <string>
+
+extern "C" {
+   #include "at.h"
+}
+
+#include "bench.h"
+
+// Simulated link: input arrives on a fixed schedule, the clock is virtual so
+// the added latency is only what the flush policy holds output back.
+
+namespace {
+
+const unsigned long long duration_us = 2000000;
+const unsigned long long tick_us = 50;
+const unsigned long long unsolicited_period_us = 2500;
+
+unsigned long long now_us = 0;
+
+unsigned long writes = 0;
+std::deque<unsigned long long> outstanding;
+unsigned long long latency_sum = 0;
+unsigned long long latency_max = 0;
+unsigned long completed = 0;
+
+const char final_result[] = "OK\r\n";
+unsigned int match = 0;
+
+unsigned long long clock_us(void) {
+   return now_us;
+}
+
+void output_function(range_t *data) {
+
+   writes++;
+
+   for (iterator_t it = data->begin; it != data->end; ++it) {
+
+      match = (*it == final_result[match]) ? match + 1 : (*it == final_result[0] ? 1 : 0);
+
+      if (match == sizeof(final_result) - 1) {
+         match = 0;
+
+         if (outstanding.empty() == false) {
+            unsigned long long latency = now_us - outstanding.front();
+            outstanding.pop_front();
+
+            latency_sum += latency;
+            latency_max = latency > latency_max ? latency : latency_max;
+            completed++;
+         }
+      }
+   }
+}
+
+struct workload {
+   const char *name;
+   unsigned int bytes_per_chunk;
+   unsigned long long chunk_period_us;
+};
+
+struct policy {
+   const char *name;
+   AT_FLUSH_POLICY policy;
+   unsigned int budget_bytes;
+   unsigned int budget_us;
+};
+
+void run(const workload &w, const policy &p) {
+
+   writes = 0;
+   outstanding.clear();
+   latency_sum = 0;
+   latency_max = 0;
+   completed = 0;
+   match = 0;
+   now_us = 0;
+
+   at_context_t *context;
+   at_context_init(&context, output_function);
+   at_set_clock(context, clock_us);
+   at_set_flush_policy(context, p.policy);
+   at_set_flush_budget(context, p.budget_bytes, p.budget_us);
+
+   std::string line = "AT+CMEE?\r";
+   std::string script;
+
+   while (script.size() < 65536)
+      script += line;
+
+   size_t offset = 0;
+   unsigned long long next_chunk = 0;
+   unsigned long long next_unsolicited = unsolicited_period_us;
+
+   for (now_us = 0; now_us < duration_us; now_us += tick_us) {
+
+      if (now_us >= next_unsolicited) {
+         at_add_unsolicited(context, "STATUS", "1");
+         next_unsolicited += unsolicited_period_us;
+      }
+
+      if (now_us >= next_chunk) {
+
+         range_t r = range_create_cnt((iterator_t)&script[offset], w.bytes_per_chunk);
+
+         for (iterator_t it = r.begin; it != r.end; ++it) {
+            if (*it == '\r')
+               outstanding.push_back(now_us);
+         }
+
+         at_process_input(context, &r);
+
+         offset += w.bytes_per_chunk;
+         if (offset + w.bytes_per_chunk > script.size())
+            offset = 0;
+
+         next_chunk += w.chunk_period_us;
+      }
+
+      at_flush_poll(context);
+   }
+
+   at_flush_output(context);
+   at_context_free(context);
+
+   std::cout << "flush: workload " << w.name
+             << " policy " << p.name
+             << " commands " << completed
+             << " writes " << writes
+             << " writes/command " << (completed ? double(writes) / completed : 0.0)
+             << " added_latency_avg_us " << (completed ? double(latency_sum) / completed : 0.0)
+             << " added_latency_max_us " << latency_max
+             << std::endl;
+}
+
+}
+
+void flush_policy_bench(void) {
+
+   static const workload workloads[] = {
+      { "interactive", 1, 1000 },
+      { "scripted", 9, 500 },
+      { "batch", 72, 4000 },
+   };
+
+   static const policy policies[] = {
+      { "per_response", AT_FLUSH_PER_RESPONSE, 0, 0 },
+      { "on_full", AT_FLUSH_ON_FULL, 0, 0 },
+      { "per_input", AT_FLUSH_PER_INPUT, 0, 0 },
+      { "coalesce_24b_200us", AT_FLUSH_COALESCE, 24, 200 },
+      { "coalesce_1ms", AT_FLUSH_COALESCE, 0, 1000 },
+   };
+
+   for (const workload &w : workloads) {
+      for (const policy &p : policies) {
+         run(w, p);
+      }
+   }
+}
@@ -0,0 +1,109 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+extern "C" {
+   #include "at.h"
+   #include <dlfcn.h>
+}
+
+#include "bench.h"
+
+// Runs the same parser workload through the static LTO build linked into
+// this program and through the shared library loaded with dlopen().
+
+namespace {
+
+struct ath_api {
+   void (*context_init)(at_context_t **ctx, void (*flush)(range_t*));
+   void (*process_input)(at_context_t *ctx, range_t *data);
+   void (*context_free)(at_context_t *ctx);
+};
+
+const unsigned int iterations = 200;
+
+unsigned long long output_bytes = 0;
+
+void output_function(range_t *data) {
+   output_bytes += data->end - data->begin;
+}
+
+double run(const ath_api &api, std::string script, unsigned long lines) {
+
+   at_context_t *context;
+   api.context_init(&context, output_function);
+
+   std::string echo_off = "ATE0\r";
+   range_t r = range_create_cnt((iterator_t)&echo_off[0], echo_off.size());
+   api.process_input(context, &r);
+
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   for (unsigned int i = 0; i < iterations; ++i) {
+      // Input arrives in 64 byte reads
+      for (size_t offset = 0; offset < script.size(); offset += 64) {
+         size_t size = script.size() - offset < 64 ? script.size() - offset : 64;
+         r = range_create_cnt((iterator_t)&script[offset], size);
+         api.process_input(context, &r);
+      }
+   }
+
+   double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+   api.context_free(context);
+
+   return ns / (double(lines) * iterations);
+}
+
+}
+
+void linkage_bench(void) {
+
+   static const char *commands[] = {
+      "AT\r",
+      "AT+CMEE?\r",
+      "AT;+CMEE=1\r",
+      "AT+CMEE=?\r",
+      "AT+CPIN=\"1234\"\r",
+   };
+
+   std::string script;
+   unsigned long lines = 0;
+
+   while (script.size() < 65536) {
+      script += commands[lines % (sizeof(commands) / sizeof(commands[0]))];
+      lines++;
+   }
+
+   ath_api static_api = { at_context_init, at_process_input, at_context_free };
+
+   double static_ns = run(static_api, script, lines);
+
+   std::cout << "linkage: build static_lto ns/line " << static_ns << std::endl;
+
+   void *library = dlopen(ATH_SHARED_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+
+   if (library == 0) {
+      std::cout << "linkage: shared library not available: " << dlerror() << std::endl;
+      return;
+   }
+
+   ath_api shared_api;
+   shared_api.context_init = (void (*)(at_context_t**, void (*)(range_t*)))dlsym(library, "at_context_init");
+   shared_api.process_input = (void (*)(at_context_t*, range_t*))dlsym(library, "at_process_input");
+   shared_api.context_free = (void (*)(at_context_t*))dlsym(library, "at_context_free");
+
+   if (shared_api.context_init == 0 || shared_api.process_input == 0 || shared_api.context_free == 0) {
+      std::cout << "linkage: shared library symbols missing" << std::endl;
+      dlclose(library);
+      return;
+   }
+
+   double shared_ns = run(shared_api, script, lines);
+
+   std::cout << "linkage: build shared ns/line " << shared_ns << std::endl
+             << "linkage: static_lto/shared " << static_ns / shared_ns
+             << " (" << (1.0 - static_ns / shared_ns) * 100.0 << "% faster)" << std::endl;
+
+   dlclose(library);
+}
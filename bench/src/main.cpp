@@ -0,0 +1,41 @@
+#include <cstring>
+#include <iostream>
+
+#include "bench.h"
+
+struct benchmark {
+   const char *name;
+   void (*run)(void);
+};
+
+static const benchmark benchmarks[] = {
+   { "flush", flush_policy_bench },
+   { "linkage", linkage_bench },
+   { "engine", engine_bench },
+   { "codec", codec_bench },
+   { "pool", pool_bench },
+};
+
+int main (int argc, char **args) {
+
+   bool found = false;
+
+   for (const benchmark &b : benchmarks) {
+
+      if (argc > 1 && strcmp(args[1], b.name) != 0)
+         continue;
+
+      found = true;
+      b.run();
+   }
+
+   if (found == false) {
+      std::cerr << "Usage: " << args[0] << " [benchmark]" << std::endl << "Benchmarks:";
+      for (const benchmark &b : benchmarks)
+         std::cerr << " " << b.name;
+      std::cerr << std::endl;
+      return 1;
+   }
+
+   return 0;
+}
@@ -0,0 +1,95 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "pool.h"
+}
+
+#include "bench.h"
+
+// Clones 20000 channels with and without a shared output buffer pool, sends
+// each one a status command and reports the buffer memory per idle channel,
+// the memory held while responses are in flight and the time per command.
+
+namespace {
+
+const unsigned int channel_count = 20000;
+const unsigned int rounds = 20;
+
+void null_output(range_t *data) {
+}
+
+void run(const char *name, at_buffer_pool_t *pool) {
+
+   at_context_t *prototype;
+
+   if (pool != nullptr)
+      at_context_init_pooled(&prototype, null_output, pool);
+   else
+      at_context_init(&prototype, null_output);
+
+   std::string echo_off = "ATE0\r";
+   range_t r = range_create_cnt((iterator_t)&echo_off[0], echo_off.size());
+   at_process_input(prototype, &r);
+
+   std::vector<at_context_t*> channels(channel_count);
+   size_t block_bytes = 0;
+
+   for (at_context_t *&c : channels) {
+      at_context_clone(&c, prototype);
+
+      at_alloc_stats_t stats;
+      at_get_alloc_stats(c, &stats);
+      block_bytes += stats.bytes;
+   }
+
+   std::string line = "AT+CMEE?;+CSCS?\r";
+   auto begin = std::chrono::steady_clock::now();
+
+   for (unsigned int i = 0; i < rounds; ++i) {
+      for (at_context_t *c : channels) {
+         r = range_create_cnt((iterator_t)&line[0], line.size());
+         at_process_input(c, &r);
+      }
+   }
+
+   auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+
+   size_t idle_bytes = 0;
+
+   for (at_context_t *c : channels)
+      idle_bytes += at_get_buffer_bytes(c);
+
+   size_t pool_bytes = 0;
+
+   if (pool != nullptr) {
+      at_buffer_pool_stats_t stats;
+      at_buffer_pool_get_stats(pool, &stats);
+      pool_bytes = stats.bytes;
+   }
+
+   std::cout << "pool: output " << name
+             << " buffer_bytes/idle_channel " << idle_bytes / channel_count
+             << " context_bytes/channel " << block_bytes / channel_count
+             << " pool_bytes " << pool_bytes
+             << " ns/command " << ns / (rounds * channel_count) << std::endl;
+
+   for (at_context_t *c : channels)
+      at_context_free(c);
+
+   at_context_free(prototype);
+}
+
+}
+
+void pool_bench(void) {
+
+   run("own", nullptr);
+
+   at_buffer_pool_t *pool = at_buffer_pool_create(AT_OUTPUT_BUFFER_SIZE, 4096, 64);
+   run("pooled", pool);
+   at_buffer_pool_free(pool);
+}
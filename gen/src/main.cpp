@@ -0,0 +1,528 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include <unistd.h>
+}
+
+// Reads a command manifest and emits C source holding a static command
+// registry and a lookup function for at_set_command_lookup(). Tags are
+// case folded and placed with a minimal perfect hash (hash and displace),
+// so the lookup is one hash, one switch and one compare.
+//
+// Manifest lines:  tag  type  handler  [parameters]
+//   type        standalone, assignment or status
+//   parameters  comma separated i (integer), s ("string"), * (anything),
+//               a trailing ? marks a parameter optional; checked before the
+//               handler runs, a mismatch answers "operation not supported"
+
+struct manifest_command {
+   std::string tag;
+   std::string type;
+   std::string handler;
+   std::string parameters;
+   int line;
+};
+
+struct manifest_tag {
+   std::string tag;
+   std::vector<size_t> commands;
+};
+
+static const char *type_names[][2] = {
+   { "standalone", "AT_STANDALONE_COMMAND" },
+   { "assignment", "AT_ASSIGNMENT_COMMAND" },
+   { "status", "AT_STATUS_COMMAND" },
+};
+
+// Must match the hash emitted into the generated source
+static uint32_t tag_hash(const std::string &tag, uint32_t seed) {
+   uint32_t h = 2166136261u ^ seed;
+
+   for (unsigned char c : tag) {
+      h ^= c;
+      h *= 16777619u;
+   }
+
+   h ^= h >> 15;
+   return h;
+}
+
+static std::string lowercase(std::string s) {
+   for (char &c : s)
+      c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+   return s;
+}
+
+static const char *type_constant(const std::string &type) {
+   for (auto &t : type_names) {
+      if (type == t[0])
+         return t[1];
+   }
+   return nullptr;
+}
+
+static bool valid_parameters(const std::string &spec) {
+   bool optional = false;
+   std::stringstream items(spec);
+   std::string item;
+
+   while (std::getline(items, item, ',')) {
+
+      if (item.empty() || item.size() > 2 || (item[0] != 'i' && item[0] != 's' && item[0] != '*'))
+         return false;
+
+      if (item.size() == 2) {
+         if (item[1] != '?')
+            return false;
+         optional = true;
+      } else if (optional) {
+         // Only trailing parameters may be optional
+         return false;
+      }
+   }
+
+   return true;
+}
+
+static bool valid_identifier(const std::string &s) {
+   if (s.empty() || isdigit(static_cast<unsigned char>(s[0])))
+      return false;
+
+   for (char c : s) {
+      if (!isalnum(static_cast<unsigned char>(c)) && c != '_')
+         return false;
+   }
+   return true;
+}
+
+static std::string c_string(const std::string &s) {
+   std::string r = "\"";
+
+   for (char c : s) {
+      if (c == '"' || c == '\\')
+         r += '\\';
+      r += c;
+   }
+
+   return r + "\"";
+}
+
+static bool read_manifest(const char *path, std::vector<manifest_command> &commands) {
+
+   std::ifstream in(path);
+
+   if (!in) {
+      std::cerr << path << ": cannot open manifest" << std::endl;
+      return false;
+   }
+
+   std::map<std::pair<std::string, std::string>, int> seen;
+   std::string text;
+   int line = 0;
+   bool ok = true;
+
+   while (std::getline(in, text)) {
+
+      line++;
+
+      size_t comment = text.find('#');
+      if (comment != std::string::npos)
+         text.erase(comment);
+
+      std::stringstream fields(text);
+      manifest_command c;
+
+      if (!(fields >> c.tag))
+         continue;
+
+      c.line = line;
+      c.tag = lowercase(c.tag);
+
+      if (c.tag == "\"\"")
+         c.tag.clear();
+
+      std::string extra;
+
+      if (!(fields >> c.type >> c.handler) || ((fields >> c.parameters) && (fields >> extra))) {
+         std::cerr << path << ":" << line << ": expected tag, type, handler and optional parameters" << std::endl;
+         ok = false;
+         continue;
+      }
+
+      c.type = lowercase(c.type);
+
+      if (type_constant(c.type) == nullptr) {
+         std::cerr << path << ":" << line << ": unknown command type '" << c.type << "'" << std::endl;
+         ok = false;
+         continue;
+      }
+
+      if (!valid_identifier(c.handler)) {
+         std::cerr << path << ":" << line << ": invalid handler symbol '" << c.handler << "'" << std::endl;
+         ok = false;
+         continue;
+      }
+
+      if (!c.parameters.empty() && (c.type != "assignment" || !valid_parameters(c.parameters))) {
+         std::cerr << path << ":" << line << ": invalid parameters '" << c.parameters << "'" << std::endl;
+         ok = false;
+         continue;
+      }
+
+      auto key = std::make_pair(c.tag, c.type);
+      auto first = seen.find(key);
+
+      if (first != seen.end()) {
+         std::cerr << path << ":" << line << ": duplicate command '" << c.tag << "' " << c.type
+                   << ", first defined at line " << first->second << std::endl;
+         ok = false;
+         continue;
+      }
+
+      seen[key] = line;
+      commands.push_back(c);
+   }
+
+   if (ok && commands.empty()) {
+      std::cerr << path << ": no commands" << std::endl;
+      ok = false;
+   }
+
+   return ok;
+}
+
+// Hash and displace: tags go to buckets by seed 0, the largest buckets are
+// placed first, each with the first seed that sends all its tags to free slots.
+static bool build_hash(const std::vector<manifest_tag> &tags, uint32_t bucket_count,
+                       std::vector<uint32_t> &seeds, std::vector<size_t> &slots) {
+
+   const uint32_t n = tags.size();
+   std::vector<std::vector<size_t>> buckets(bucket_count);
+
+   for (size_t i = 0; i < tags.size(); ++i)
+      buckets[tag_hash(tags[i].tag, 0) % bucket_count].push_back(i);
+
+   std::vector<uint32_t> order(bucket_count);
+   for (uint32_t i = 0; i < bucket_count; ++i)
+      order[i] = i;
+
+   std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return buckets[a].size() > buckets[b].size();
+   });
+
+   seeds.assign(bucket_count, 0);
+   slots.assign(n, SIZE_MAX);
+
+   for (uint32_t b : order) {
+
+      if (buckets[b].empty())
+         break;
+
+      uint32_t seed = 1;
+
+      for (; seed < 0x10000; ++seed) {
+
+         std::vector<uint32_t> taken;
+
+         for (size_t t : buckets[b]) {
+            uint32_t slot = tag_hash(tags[t].tag, seed) % n;
+
+            if (slots[slot] != SIZE_MAX || std::find(taken.begin(), taken.end(), slot) != taken.end())
+               break;
+
+            taken.push_back(slot);
+         }
+
+         if (taken.size() == buckets[b].size()) {
+            for (size_t i = 0; i < taken.size(); ++i)
+               slots[taken[i]] = buckets[b][i];
+            break;
+         }
+      }
+
+      if (seed == 0x10000)
+         return false;
+
+      seeds[b] = seed;
+   }
+
+   return true;
+}
+
+static void write_header(std::ostream &out, const std::string &name, const char *manifest) {
+
+   std::string guard = name;
+   for (char &c : guard)
+      c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+
+   out << "// Generated by ath-gen from " << manifest << ", do not edit\n"
+       << "#ifndef " << guard << "_H\n"
+       << "#define " << guard << "_H\n\n"
+       << "#include \"at.h\"\n\n"
+       << "extern const struct at_command_t " << name << "_commands[];\n"
+       << "extern const unsigned int " << name << "_command_count;\n\n"
+       << "// Expects the case folded tag, as passed by at_set_command_lookup()\n"
+       << "const struct at_command_t *" << name << "_lookup(void *user, const struct range_t *tag, enum AT_CMD_TYPE cmd_type);\n\n"
+       << "void " << name << "_install(struct at_context_t *ctx);\n\n"
+       << "#endif // " << guard << "_H\n";
+}
+
+static void write_source(std::ostream &out, const std::string &name, const char *manifest,
+                         const std::string &header, const std::vector<manifest_command> &commands,
+                         const std::vector<manifest_tag> &tags, const std::vector<uint32_t> &seeds,
+                         const std::vector<size_t> &slots) {
+
+   bool checks = false;
+   std::vector<std::string> handlers;
+
+   for (const manifest_command &c : commands) {
+      if (std::find(handlers.begin(), handlers.end(), c.handler) == handlers.end())
+         handlers.push_back(c.handler);
+      if (!c.parameters.empty())
+         checks = true;
+   }
+
+   out << "// Generated by ath-gen from " << manifest << ", do not edit\n"
+       << "#include \"" << header << "\"\n\n"
+       << "#include <string.h>\n\n";
+
+   for (const std::string &h : handlers)
+      out << "void " << h << "(struct at_function_result *r, struct at_function_context_t *ctx);\n";
+
+   out << "\n";
+
+   if (checks) {
+      out << "static bool " << name << "_check_parameters(struct range_t *parameters, const char *spec) {\n"
+          << "\n"
+          << "   iterator_t it = parameters->begin;\n"
+          << "   bool more = (range_is_empty(parameters) == false);\n"
+          << "\n"
+          << "   while (*spec != 0) {\n"
+          << "\n"
+          << "      char kind = spec[0];\n"
+          << "      bool optional = (spec[1] == '?');\n"
+          << "\n"
+          << "      spec += optional ? 2 : 1;\n"
+          << "      if (*spec == ',')\n"
+          << "         spec++;\n"
+          << "\n"
+          << "      // Missing parameters are fine from the first optional one on\n"
+          << "      if (more == false)\n"
+          << "         return optional;\n"
+          << "\n"
+          << "      struct range_t p;\n"
+          << "      it = at_get_parameter(it, parameters->end, &p);\n"
+          << "      more = (p.end != parameters->end);\n"
+          << "\n"
+          << "      if (kind == 'i' && (range_is_empty(&p) || range_all_digits(&p) == false))\n"
+          << "         return false;\n"
+          << "\n"
+          << "      if (kind == 's' && (range_size(&p) < 2 || p.begin[0] != '\"' || p.end[-1] != '\"'))\n"
+          << "         return false;\n"
+          << "   }\n"
+          << "\n"
+          << "   return more == false;\n"
+          << "}\n\n";
+
+      for (size_t i = 0; i < commands.size(); ++i) {
+         const manifest_command &c = commands[i];
+
+         if (c.parameters.empty())
+            continue;
+
+         out << "static void " << name << "_checked_" << i << "(struct at_function_result *r, struct at_function_context_t *ctx) {\n"
+             << "   if (" << name << "_check_parameters(&ctx->parameters, " << c_string(c.parameters) << "))\n"
+             << "      " << c.handler << "(r, ctx);\n"
+             << "   else\n"
+             << "      at_return_operation_not_supported_error(r);\n"
+             << "}\n\n";
+      }
+   }
+
+   // Registry in slot order, commands sharing a tag are adjacent
+   std::vector<size_t> registry_index(commands.size());
+   std::vector<size_t> first_entry(tags.size());
+   size_t entry = 0;
+
+   out << "const struct at_command_t " << name << "_commands[] = {\n";
+
+   for (size_t slot = 0; slot < slots.size(); ++slot) {
+
+      const manifest_tag &t = tags[slots[slot]];
+      first_entry[slots[slot]] = entry;
+
+      for (size_t ci : t.commands) {
+         const manifest_command &c = commands[ci];
+
+         std::string function = c.parameters.empty() ? c.handler : name + "_checked_" + std::to_string(ci);
+
+         out << "   { " << c_string(c.tag) << ", " << type_constant(c.type) << ", " << function << ", 0 },\n";
+         registry_index[ci] = entry++;
+      }
+   }
+
+   out << "};\n\n"
+       << "const unsigned int " << name << "_command_count = " << commands.size() << ";\n\n";
+
+   out << "static const unsigned short " << name << "_seeds[" << seeds.size() << "] = {";
+
+   for (size_t i = 0; i < seeds.size(); ++i)
+      out << ((i % 12) == 0 ? "\n   " : " ") << seeds[i] << ",";
+
+   out << "\n};\n\n";
+
+   out << "static unsigned int " << name << "_hash(const unsigned char *p, unsigned int size, unsigned int seed) {\n"
+       << "   unsigned int h = 2166136261u ^ seed;\n"
+       << "\n"
+       << "   while (size-- != 0) {\n"
+       << "      h ^= *p++;\n"
+       << "      h *= 16777619u;\n"
+       << "   }\n"
+       << "\n"
+       << "   return h ^ (h >> 15);\n"
+       << "}\n\n";
+
+   size_t min_size = SIZE_MAX;
+   size_t max_size = 0;
+
+   for (const manifest_tag &t : tags) {
+      min_size = std::min(min_size, t.tag.size());
+      max_size = std::max(max_size, t.tag.size());
+   }
+
+   out << "const struct at_command_t *" << name << "_lookup(void *user, const struct range_t *tag, enum AT_CMD_TYPE cmd_type) {\n"
+       << "\n"
+       << "   (void)user;\n"
+       << "\n"
+       << "   unsigned int size = tag->end - tag->begin;\n"
+       << "\n"
+       << "   if (size < " << min_size << " || size > " << max_size << ")\n"
+       << "      return 0;\n"
+       << "\n"
+       << "   unsigned int seed = " << name << "_seeds[" << name << "_hash(tag->begin, size, 0) % " << seeds.size() << "];\n"
+       << "\n"
+       << "   switch (" << name << "_hash(tag->begin, size, seed) % " << tags.size() << ") {\n";
+
+   for (size_t slot = 0; slot < slots.size(); ++slot) {
+
+      const manifest_tag &t = tags[slots[slot]];
+
+      out << "   case " << slot << ":\n"
+          << "      if (size != " << t.tag.size();
+
+      if (!t.tag.empty())
+         out << " || memcmp(tag->begin, " << c_string(t.tag) << ", " << t.tag.size() << ") != 0";
+
+      out << ")\n"
+          << "         return 0;\n";
+
+      if (t.commands.size() == 1) {
+         const manifest_command &c = commands[t.commands[0]];
+         out << "      return (cmd_type == " << type_constant(c.type) << ") ? &" << name << "_commands["
+             << registry_index[t.commands[0]] << "] : 0;\n";
+         continue;
+      }
+
+      out << "      switch (cmd_type) {\n";
+
+      for (size_t ci : t.commands) {
+         out << "      case " << type_constant(commands[ci].type) << ": return &" << name << "_commands["
+             << registry_index[ci] << "];\n";
+      }
+
+      out << "      default: return 0;\n"
+          << "      }\n";
+   }
+
+   out << "   }\n"
+       << "\n"
+       << "   return 0;\n"
+       << "}\n\n"
+       << "void " << name << "_install(struct at_context_t *ctx) {\n"
+       << "   at_set_command_lookup(ctx, " << name << "_lookup, 0);\n"
+       << "}\n";
+}
+
+static void usage(const char *name){
+   std::cerr << "Usage: " << name << " -n NAME -o OUTPUT MANIFEST" << std::endl
+             << "  -n  prefix of the generated symbols" << std::endl
+             << "  -o  output path without extension, writes OUTPUT.c and OUTPUT.h" << std::endl;
+}
+
+int main (int argc, char **args) {
+
+   std::string name;
+   std::string output;
+   int opt;
+
+   while ((opt = getopt(argc, args, "n:o:h")) != -1) {
+      switch (opt) {
+      case 'n':
+         name = optarg;
+         break;
+      case 'o':
+         output = optarg;
+         break;
+      default:
+         usage(args[0]);
+         return 2;
+      }
+   }
+
+   if (optind + 1 != argc || output.empty() || !valid_identifier(name)) {
+      usage(args[0]);
+      return 2;
+   }
+
+   const char *manifest = args[optind];
+   std::vector<manifest_command> commands;
+
+   if (!read_manifest(manifest, commands))
+      return 1;
+
+   std::vector<manifest_tag> tags;
+   std::map<std::string, size_t> tag_index;
+
+   for (size_t i = 0; i < commands.size(); ++i) {
+      auto it = tag_index.find(commands[i].tag);
+
+      if (it == tag_index.end()) {
+         it = tag_index.emplace(commands[i].tag, tags.size()).first;
+         tags.push_back(manifest_tag{ commands[i].tag, {} });
+      }
+
+      tags[it->second].commands.push_back(i);
+   }
+
+   std::vector<uint32_t> seeds;
+   std::vector<size_t> slots;
+   uint32_t bucket_count = (tags.size() + 3) / 4;
+
+   while (!build_hash(tags, bucket_count, seeds, slots))
+      bucket_count++;
+
+   std::string header = output + ".h";
+   std::ofstream h(header);
+   std::ofstream c(output + ".c");
+
+   if (!h || !c) {
+      std::cerr << output << ": cannot write output" << std::endl;
+      return 1;
+   }
+
+   std::string source = manifest;
+   source = source.substr(source.find_last_of('/') + 1);
+
+   write_header(h, name, source.c_str());
+   write_source(c, name, source.c_str(), header.substr(header.find_last_of('/') + 1), commands, tags, seeds, slots);
+
+   return (h && c) ? 0 : 1;
+}
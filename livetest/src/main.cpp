@@ -1,14 +1,57 @@
-
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <vector>
 
 extern "C" {
     #include "at.h"
+    #include "record.h"
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
 }
 
+typedef std::chrono::steady_clock clock_type;
+
+const size_t input_block_size = 65536;
+const size_t output_block_size = 65536;
+
+static unsigned char output_block[output_block_size];
+static size_t output_size = 0;
+static bool output_discard = false;
+static unsigned long long output_bytes = 0;
+
+static void output_sink_flush(){
+   size_t offset = 0;
+
+   while (offset < output_size) {
+      long w = write(1, output_block + offset, output_size - offset);
+      if (w <= 0)
+         break;
+      offset += w;
+   }
+
+   output_size = 0;
+}
 
 void output_function(range_t *data){
-   for (iterator_t it = data->begin; it != data->end; ++it) {
-      std::cout << *it;
+
+   output_bytes += range_size(data);
+
+   if (output_discard)
+      return;
+
+   for (iterator_t it = data->begin; it != data->end; ) {
+
+      if (output_size == output_block_size)
+         output_sink_flush();
+
+      size_t chunk = std::min<size_t>(data->end - it, output_block_size - output_size);
+      std::copy(it, it + chunk, output_block + output_size);
+      output_size += chunk;
+      it += chunk;
    }
 }
 
@@ -19,32 +62,224 @@ void  exit(struct at_function_result *r,  at_function_context_t *ctx){
    exit_flag = true;
 }
 
+struct statistics {
+   unsigned long long lines = 0;
+   unsigned long long bytes = 0;
+   std::vector<uint64_t> latencies;
+   clock_type::duration line_time = clock_type::duration::zero();
+   bool after_cr = false;
+};
+
+// Feeds a block line by line, so every completed line gets a latency sample.
+// LF is accepted as line terminator: a bare LF is passed on as a CR, the LF
+// of CR LF is skipped. The block itself is not changed.
+static void process_block(at_context_t *context, iterator_t begin, iterator_t end, statistics &stats){
+
+   static unsigned char terminator[] = { '\r' };
+
+   stats.bytes += end - begin;
+
+   while (begin != end && exit_flag == false) {
+
+      if (stats.after_cr) {
+         stats.after_cr = false;
+
+         if (*begin == '\n') {
+            ++begin;
+            continue;
+         }
+      }
+
+      iterator_t it = begin;
+      while (it != end && *it != '\r' && *it != '\n')
+         ++it;
+
+      bool complete = it != end;
+      bool lf = complete && *it == '\n';
+
+      range_t r;
+      r.begin = begin;
+      r.end = complete && lf == false ? it + 1 : it;
+
+      clock_type::time_point start = clock_type::now();
+      at_process_input(context, &r);
+
+      if (lf) {
+         range_t t = range_create_cnt(terminator, sizeof(terminator));
+         at_process_input(context, &t);
+      }
+
+      stats.line_time += clock_type::now() - start;
+
+      if (complete) {
+         // Bare terminators are not counted as lines
+         if (it != begin) {
+            stats.lines++;
+            stats.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stats.line_time).count());
+         }
+         stats.line_time = clock_type::duration::zero();
+         stats.after_cr = lf == false;
+         ++it;
+      }
+
+      begin = it;
+   }
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p){
+   if (sorted.empty())
+      return 0;
+   size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+   return sorted[i];
+}
+
+static void print_statistics(statistics &stats, clock_type::duration elapsed){
+
+   double seconds = std::chrono::duration<double>(elapsed).count();
+
+   if (seconds <= 0)
+      seconds = 1e-9;
+
+   std::sort(stats.latencies.begin(), stats.latencies.end());
+
+   std::cerr << "lines: " << stats.lines
+             << " input bytes: " << stats.bytes
+             << " output bytes: " << output_bytes
+             << " time: " << seconds << " s" << std::endl
+             << "lines/s: " << stats.lines / seconds
+             << " bytes/s: " << stats.bytes / seconds << std::endl
+             << "line latency ns: p50 " << percentile(stats.latencies, 0.50)
+             << " p90 " << percentile(stats.latencies, 0.90)
+             << " p99 " << percentile(stats.latencies, 0.99)
+             << " p99.9 " << percentile(stats.latencies, 0.999)
+             << " max " << (stats.latencies.empty() ? 0 : stats.latencies.back())
+             << std::endl;
+}
+
+static void usage(const char *name){
+   std::cerr << "Usage: " << name << " [-f FILE] [-n] [-s] [-r FILE]" << std::endl
+             << "  -f  map FILE of command lines and process it instead of stdin" << std::endl
+             << "  -n  discard output (as /dev/null)" << std::endl
+             << "  -s  print throughput and line latency statistics at exit" << std::endl
+             << "  -r  record the session to FILE for ath-replay" << std::endl;
+}
+
 int main (int argc, char **args) {
 
+   const char *input_file = 0;
+   const char *record_file = 0;
+   bool print_stats = false;
+
+   int opt;
+
+   while ((opt = getopt(argc, args, "f:nsr:h")) != -1) {
+      switch (opt) {
+      case 'f':
+         input_file = optarg;
+         print_stats = true;
+         break;
+      case 'n':
+         output_discard = true;
+         break;
+      case 's':
+         print_stats = true;
+         break;
+      case 'r':
+         record_file = optarg;
+         break;
+      default:
+         usage(args[0]);
+         return 1;
+      }
+   }
+
    at_context_t *context;
    at_context_init(&context, output_function);
 
    at_command_add(context, "+exit", AT_STANDALONE_COMMAND, exit);
 
+   at_recorder_t *recorder = 0;
+
+   if (record_file != 0) {
+      recorder = at_recorder_open(record_file);
+
+      if (recorder == 0) {
+         perror("record");
+         return 1;
+      }
+
+      at_recorder_attach(recorder, context);
+   }
+
    at_add_unsolicited_line(context, "+POWERON");
    at_add_unsolicited(context, "STATUS", "BOOTING");
 
-   while (true) {
+   statistics stats;
+   clock_type::time_point start = clock_type::now();
 
-      uint8_t c = getchar();
+   if (input_file != 0) {
 
-      if (c == 10)
-         c = 13;
+      int fd = open(input_file, O_RDONLY);
 
-      range_t r;
-      r.begin = &c;
-      r.end = r.begin + 1;
+      if (fd == -1) {
+         perror("open");
+         return 1;
+      }
 
-      at_process_input(context, &r);
+      struct stat st;
 
-      if (exit_flag)
-         break;
+      if (fstat(fd, &st) == -1) {
+         perror("fstat");
+         return 1;
+      }
+
+      if (st.st_size > 0) {
+         // Private writable mapping: LF to CR conversion stays in memory
+         void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+         if (p == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+         }
+
+         madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+         iterator_t begin = static_cast<iterator_t>(p);
+         process_block(context, begin, begin + st.st_size, stats);
+
+         munmap(p, st.st_size);
+      }
+
+      close(fd);
+
+   } else {
+
+      static unsigned char input_block[input_block_size];
+
+      while (exit_flag == false) {
+
+         // Show pending output before blocking on the terminal
+         output_sink_flush();
+
+         long r = read(0, input_block, input_block_size);
+
+         if (r <= 0)
+            break;
+
+         process_block(context, input_block, input_block + r, stats);
+      }
    }
 
+   clock_type::duration elapsed = clock_type::now() - start;
+
+   output_sink_flush();
+   at_context_free(context);
+
+   if (recorder != 0)
+      at_recorder_close(recorder);
+
+   if (print_stats)
+      print_statistics(stats, elapsed);
+
    return 1;
 }
@@ -0,0 +1,727 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include "at.h"
+    #include "engine.h"
+    #include <fcntl.h>
+    #include <netdb.h>
+    #include <poll.h>
+    #include <stdlib.h>
+    #include <sys/epoll.h>
+    #include <sys/socket.h>
+    #include <sys/timerfd.h>
+    #include <sys/un.h>
+    #include <termios.h>
+    #include <unistd.h>
+}
+
+// Drives a command mix over many channels at a target rate and measures the
+// time from writing the terminating '\r' to reading the final result code.
+// Channels are pty pairs or socketpairs served by an in-process engine, or
+// connections to a running server. The report is a JSON object so runs of
+// different builds can be compared by script.
+
+typedef std::chrono::steady_clock clock_type;
+
+struct command {
+   std::string line;
+   unsigned int weight;
+   unsigned long long sent;
+   unsigned long long errors;
+   std::vector<uint64_t> latencies;
+};
+
+struct in_flight {
+   clock_type::time_point start;
+   size_t command;
+};
+
+struct channel {
+   int fd;
+   bool open;
+   std::string line;
+   std::deque<in_flight> pending;
+   clock_type::time_point next_send;
+   unsigned long long sent;
+   size_t position;
+};
+
+struct options {
+   unsigned int channels = 1;
+   std::string target = "pty";
+   double rate = 0;
+   bool open_loop = false;
+   double duration = 5;
+   unsigned long long commands = 0;
+   const char *script = 0;
+   bool random_order = false;
+   unsigned int seed = 1;
+   unsigned int window = 64;
+   unsigned int timeout_ms = 5000;
+   unsigned int shards = 1;
+   std::string label;
+};
+
+struct totals {
+   unsigned long long sent = 0;
+   unsigned long long completed = 0;
+   unsigned long long errors = 0;
+   unsigned long long timeouts = 0;
+   unsigned long long io_errors = 0;
+   unsigned long long skipped = 0;
+};
+
+static void usage(const char *name){
+   std::cerr << "Usage: " << name << " [-n CHANNELS] [-T TARGET] [-r RATE] [-o] [-d SECONDS] [-c COMMANDS]" << std::endl
+             << "       [-f SCRIPT] [-x] [-s SEED] [-w WINDOW] [-t MS] [-j SHARDS] [-l LABEL]" << std::endl
+             << "  -n  channels (default 1)" << std::endl
+             << "  -T  pty or socket channels of an in-process engine (default pty)," << std::endl
+             << "      unix:PATH or HOST:PORT to connect to a running server" << std::endl
+             << "  -r  commands per second per channel, 0 for back to back (default 0)" << std::endl
+             << "  -o  open loop: send on schedule without waiting for the previous result, needs -r" << std::endl
+             << "  -d  run for SECONDS (default 5)" << std::endl
+             << "  -c  stop after COMMANDS per channel instead" << std::endl
+             << "  -f  command script, one command per line with an optional leading weight" << std::endl
+             << "  -x  pick script commands at random by weight instead of in turn" << std::endl
+             << "  -s  random seed (default 1)" << std::endl
+             << "  -w  open loop commands in flight per channel before sends are skipped (default 64)" << std::endl
+             << "  -t  final result timeout in ms (default 5000)" << std::endl
+             << "  -j  shards of the in-process engine (default 1)" << std::endl
+             << "  -l  label copied to the report, e.g. the build under test" << std::endl;
+}
+
+static void add_command(std::vector<command> &mix, const std::string &line, unsigned int weight){
+   command c;
+   c.line = line;
+   c.weight = weight;
+   c.sent = 0;
+   c.errors = 0;
+   mix.push_back(c);
+}
+
+// Lines are "AT..." or "WEIGHT AT...", '#' starts a comment
+static bool load_script(const char *file, std::vector<command> &mix){
+
+   std::ifstream in(file);
+   std::string line;
+
+   if (!in)
+      return false;
+
+   while (std::getline(in, line)) {
+
+      line.erase(0, line.find_first_not_of(" \t"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+
+      if (line.empty() || line[0] == '#')
+         continue;
+
+      unsigned int weight = 1;
+
+      if (line[0] >= '0' && line[0] <= '9') {
+         size_t end;
+         weight = std::stoul(line, &end);
+         line.erase(0, line.find_first_not_of(" \t", end));
+      }
+
+      if (weight != 0 && line.empty() == false)
+         add_command(mix, line, weight);
+   }
+
+   return mix.empty() == false;
+}
+
+static void default_mix(std::vector<command> &mix){
+   add_command(mix, "AT", 4);
+   add_command(mix, "AT+CMEE?", 2);
+   add_command(mix, "AT+CMEE=1", 2);
+   add_command(mix, "ATS3?", 1);
+   add_command(mix, "AT+CMEE=?", 1);
+   add_command(mix, "AT+UNKNOWN", 1);
+}
+
+static bool set_raw_mode(int fd){
+
+   struct termios tio;
+
+   if (tcgetattr(fd, &tio) == -1)
+      return false;
+
+   cfmakeraw(&tio);
+   tio.c_cc[VMIN] = 1;
+   tio.c_cc[VTIME] = 0;
+
+   return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+// Returns the client side, the engine gets the other one
+static int open_pty(at_engine_t *engine){
+
+   int master = posix_openpt(O_RDWR | O_NOCTTY);
+   char name[256];
+
+   if (master == -1)
+      return -1;
+
+   if (grantpt(master) == -1 || unlockpt(master) == -1 ||
+       ptsname_r(master, name, sizeof(name)) != 0 || set_raw_mode(master) == false) {
+      close(master);
+      return -1;
+   }
+
+   int slave = open(name, O_RDWR | O_NOCTTY);
+
+   if (slave == -1) {
+      close(master);
+      return -1;
+   }
+
+   at_channel_release(at_engine_add_channel(engine, master, 0, 0));
+   return slave;
+}
+
+static int open_socketpair(at_engine_t *engine){
+
+   int pair[2];
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+      return -1;
+
+   at_channel_release(at_engine_add_channel(engine, pair[1], 0, 0));
+   return pair[0];
+}
+
+static int connect_target(const std::string &target){
+
+   if (target.compare(0, 5, "unix:") == 0) {
+
+      struct sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+
+      if (target.size() - 5 >= sizeof(address.sun_path))
+         return -1;
+
+      strcpy(address.sun_path, target.c_str() + 5);
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+      if (fd != -1 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+         close(fd);
+         return -1;
+      }
+
+      return fd;
+   }
+
+   size_t colon = target.rfind(':');
+
+   if (colon == std::string::npos)
+      return -1;
+
+   std::string host = target.substr(0, colon);
+   std::string port = target.substr(colon + 1);
+
+   struct addrinfo hints;
+   struct addrinfo *addresses;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+
+   if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+      return -1;
+
+   int fd = -1;
+
+   for (struct addrinfo *a = addresses; a != 0 && fd == -1; a = a->ai_next) {
+
+      fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+      if (fd != -1 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+         close(fd);
+         fd = -1;
+      }
+   }
+
+   freeaddrinfo(addresses);
+   return fd;
+}
+
+static bool is_final_result(const std::string &line, bool &error){
+
+   error = true;
+
+   if (line == "OK") {
+      error = false;
+      return true;
+   }
+
+   return line == "ERROR" ||
+          line.compare(0, 11, "+CME ERROR:") == 0 ||
+          line.compare(0, 11, "+CMS ERROR:") == 0 ||
+          line == "NO CARRIER" ||
+          line == "BUSY" ||
+          line == "NO ANSWER" ||
+          line == "NO DIALTONE";
+}
+
+// Reads what is available and completes the commands whose final result
+// arrived. Echo, information responses and unsolicited lines are skipped.
+static bool receive(channel &ch, std::vector<command> &mix, totals &t, std::vector<uint64_t> &latencies){
+
+   char buffer[4096];
+   ssize_t r = read(ch.fd, buffer, sizeof(buffer));
+
+   if (r < 0 && errno == EINTR)
+      return true;
+
+   if (r <= 0)
+      return false;
+
+   clock_type::time_point now = clock_type::now();
+
+   for (ssize_t i = 0; i < r; ++i) {
+
+      if (buffer[i] != '\r' && buffer[i] != '\n') {
+         ch.line += buffer[i];
+         continue;
+      }
+
+      bool error;
+
+      if (ch.line.empty() == false && is_final_result(ch.line, error) && ch.pending.empty() == false) {
+
+         in_flight f = ch.pending.front();
+         uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - f.start).count();
+
+         ch.pending.pop_front();
+         latencies.push_back(ns);
+         mix[f.command].latencies.push_back(ns);
+         t.completed++;
+
+         if (error) {
+            mix[f.command].errors++;
+            t.errors++;
+         }
+      }
+
+      ch.line.clear();
+   }
+
+   return true;
+}
+
+static size_t next_command(channel &ch, const std::vector<command> &mix, bool random_order,
+                           std::mt19937 &random, std::discrete_distribution<size_t> &pick){
+
+   if (random_order)
+      return pick(random);
+
+   size_t c = ch.position;
+   ch.position = (ch.position + 1) % mix.size();
+   return c;
+}
+
+static bool send_command(channel &ch, size_t c, std::vector<command> &mix, totals &t){
+
+   std::string data = mix[c].line + "\r";
+
+   if (write(ch.fd, data.data(), data.size()) != (ssize_t)data.size())
+      return false;
+
+   in_flight f;
+   f.start = clock_type::now();
+   f.command = c;
+
+   ch.pending.push_back(f);
+   ch.sent++;
+   mix[c].sent++;
+   t.sent++;
+   return true;
+}
+
+// Echo off so responses are not interleaved with echoed commands, not measured
+static bool warm_up(channel &ch, unsigned int timeout_ms){
+
+   std::vector<command> mix;
+   std::vector<uint64_t> latencies;
+   totals t;
+
+   add_command(mix, "ATE0", 1);
+
+   if (send_command(ch, 0, mix, t) == false)
+      return false;
+
+   clock_type::time_point deadline = clock_type::now() + std::chrono::milliseconds(timeout_ms);
+
+   while (ch.pending.empty() == false) {
+
+      int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_type::now()).count();
+
+      if (remaining <= 0)
+         return false;
+
+      // poll(), descriptors of large runs are past FD_SETSIZE
+      struct pollfd p = { ch.fd, POLLIN, 0 };
+
+      if (poll(&p, 1, remaining) > 0 && receive(ch, mix, t, latencies) == false)
+         return false;
+   }
+
+   return true;
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p){
+   if (sorted.empty())
+      return 0;
+   size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+   return sorted[i];
+}
+
+static std::string json_string(const std::string &s){
+
+   std::ostringstream out;
+
+   out << '"';
+
+   for (unsigned char c : s) {
+      if (c == '"' || c == '\\') {
+         out << '\\' << c;
+      } else if (c < 0x20) {
+         char escaped[8];
+         snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+         out << escaped;
+      } else {
+         out << c;
+      }
+   }
+
+   out << '"';
+   return out.str();
+}
+
+static void print_latency(std::vector<uint64_t> &latencies){
+
+   std::sort(latencies.begin(), latencies.end());
+
+   uint64_t sum = 0;
+   for (uint64_t l : latencies)
+      sum += l;
+
+   std::cout << "{\"p50\": " << percentile(latencies, 0.50)
+             << ", \"p90\": " << percentile(latencies, 0.90)
+             << ", \"p99\": " << percentile(latencies, 0.99)
+             << ", \"p99.9\": " << percentile(latencies, 0.999)
+             << ", \"max\": " << (latencies.empty() ? 0 : latencies.back())
+             << ", \"mean\": " << (latencies.empty() ? 0 : sum / latencies.size())
+             << "}";
+}
+
+int main (int argc, char **args) {
+
+   options o;
+   int opt;
+
+   while ((opt = getopt(argc, args, "n:T:r:od:c:f:xs:w:t:j:l:h")) != -1) {
+      switch (opt) {
+      case 'n':
+         o.channels = atoi(optarg);
+         break;
+      case 'T':
+         o.target = optarg;
+         break;
+      case 'r':
+         o.rate = atof(optarg);
+         break;
+      case 'o':
+         o.open_loop = true;
+         break;
+      case 'd':
+         o.duration = atof(optarg);
+         break;
+      case 'c':
+         o.commands = strtoull(optarg, 0, 10);
+         break;
+      case 'f':
+         o.script = optarg;
+         break;
+      case 'x':
+         o.random_order = true;
+         break;
+      case 's':
+         o.seed = atoi(optarg);
+         break;
+      case 'w':
+         o.window = atoi(optarg);
+         break;
+      case 't':
+         o.timeout_ms = atoi(optarg);
+         break;
+      case 'j':
+         o.shards = atoi(optarg);
+         break;
+      case 'l':
+         o.label = optarg;
+         break;
+      default:
+         usage(args[0]);
+         return 2;
+      }
+   }
+
+   if (optind != argc || o.channels == 0 || o.rate < 0 || (o.open_loop && o.rate <= 0) || o.window == 0) {
+      usage(args[0]);
+      return 2;
+   }
+
+   std::vector<command> mix;
+
+   if (o.script != 0) {
+      if (load_script(o.script, mix) == false) {
+         std::cerr << "Cannot read commands from " << o.script << std::endl;
+         return 2;
+      }
+   } else {
+      default_mix(mix);
+      o.random_order = true;
+   }
+
+   at_engine_t *engine = 0;
+
+   if (o.target == "pty" || o.target == "socket") {
+
+      at_engine_config_t config;
+      at_engine_config_init(&config);
+      config.shards = o.shards;
+      config.workers = 1;
+
+      engine = at_engine_create(&config);
+
+      if (engine == 0) {
+         std::cerr << "Cannot start the engine" << std::endl;
+         return 2;
+      }
+   }
+
+   std::vector<channel> channels(o.channels);
+   int epoll_fd = epoll_create1(0);
+   int timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+
+   struct epoll_event event;
+   event.events = EPOLLIN;
+   event.data.u64 = o.channels;
+   epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+
+   for (unsigned int i = 0; i < o.channels; ++i) {
+
+      channel &ch = channels[i];
+
+      if (o.target == "pty") {
+         ch.fd = open_pty(engine);
+      } else if (o.target == "socket") {
+         ch.fd = open_socketpair(engine);
+      } else {
+         ch.fd = connect_target(o.target);
+      }
+
+      ch.open = true;
+      ch.position = i % mix.size();
+
+      if (ch.fd == -1 || warm_up(ch, o.timeout_ms) == false) {
+         std::cerr << "Cannot open channel " << i << " to " << o.target << std::endl;
+         return 2;
+      }
+
+      ch.sent = 0;
+
+      event.events = EPOLLIN;
+      event.data.u64 = i;
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ch.fd, &event);
+   }
+
+   std::mt19937 random(o.seed);
+   std::vector<double> weights;
+
+   for (command &c : mix)
+      weights.push_back(c.weight);
+
+   std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+
+   clock_type::duration interval = clock_type::duration::zero();
+
+   if (o.rate > 0)
+      interval = std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(1.0 / o.rate));
+
+   clock_type::time_point start = clock_type::now();
+   clock_type::time_point end = start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(o.duration));
+   std::chrono::milliseconds timeout(o.timeout_ms);
+
+   // Spread the channels over the first interval so they do not send in step
+   for (unsigned int i = 0; i < o.channels; ++i)
+      channels[i].next_send = start + interval * i / o.channels;
+
+   totals t;
+   std::vector<uint64_t> latencies;
+   unsigned int active = o.channels;
+
+   while (active > 0) {
+
+      clock_type::time_point now = clock_type::now();
+      clock_type::time_point wake = now + timeout;
+      bool sending = o.commands == 0 && now < end;
+
+      active = 0;
+
+      for (channel &ch : channels) {
+
+         if (ch.open == false)
+            continue;
+
+         bool more = sending || (o.commands != 0 && ch.sent < o.commands);
+
+         if (ch.pending.empty() == false && now - ch.pending.front().start > timeout) {
+            // A late result could not be told apart from the next one
+            t.timeouts += ch.pending.size();
+            ch.pending.clear();
+            ch.open = false;
+            continue;
+         }
+
+         while (more && now >= ch.next_send && (o.open_loop || ch.pending.empty())) {
+
+            if (o.open_loop && ch.pending.size() >= o.window) {
+               t.skipped++;
+            } else if (send_command(ch, next_command(ch, mix, o.random_order, random, pick), mix, t) == false) {
+               t.io_errors++;
+               ch.open = false;
+               break;
+            }
+
+            // Closed loop paces from the send, open loop keeps the schedule
+            ch.next_send = o.open_loop ? ch.next_send + interval : now + interval;
+            more = sending || (o.commands != 0 && ch.sent < o.commands);
+
+            if (interval == clock_type::duration::zero())
+               break;
+         }
+
+         if (ch.open == false)
+            continue;
+
+         if (more || ch.pending.empty() == false)
+            active++;
+
+         if (more && (o.open_loop || ch.pending.empty()))
+            wake = std::min(wake, ch.next_send);
+
+         if (ch.pending.empty() == false)
+            wake = std::min(wake, ch.pending.front().start + timeout);
+      }
+
+      if (sending)
+         wake = std::min(wake, end);
+
+      if (active == 0)
+         break;
+
+      struct itimerspec spec;
+      memset(&spec, 0, sizeof(spec));
+
+      long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wake - clock_type::now()).count();
+
+      if (ns > 0) {
+         spec.it_value.tv_sec = ns / 1000000000;
+         spec.it_value.tv_nsec = ns % 1000000000;
+         timerfd_settime(timer_fd, 0, &spec, 0);
+      }
+
+      struct epoll_event events[64];
+      int n = epoll_wait(epoll_fd, events, 64, ns > 0 ? -1 : 0);
+
+      for (int i = 0; i < n; ++i) {
+
+         if (events[i].data.u64 == o.channels) {
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+               // Disarmed before it was read
+            }
+            continue;
+         }
+
+         channel &ch = channels[events[i].data.u64];
+
+         if (ch.open && receive(ch, mix, t, latencies) == false) {
+            t.io_errors += ch.pending.size() + 1;
+            ch.pending.clear();
+            ch.open = false;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ch.fd, 0);
+         }
+      }
+   }
+
+   double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+   if (seconds <= 0)
+      seconds = 1e-9;
+
+   for (channel &ch : channels)
+      close(ch.fd);
+
+   close(timer_fd);
+   close(epoll_fd);
+
+   if (engine != 0)
+      at_engine_free(engine);
+
+   std::cout << "{" << std::endl
+             << "  \"tool\": \"ath-loadgen\"," << std::endl
+             << "  \"label\": " << json_string(o.label) << "," << std::endl
+             << "  \"target\": " << json_string(o.target) << "," << std::endl
+             << "  \"channels\": " << o.channels << "," << std::endl
+             << "  \"loop\": \"" << (o.open_loop ? "open" : "closed") << "\"," << std::endl
+             << "  \"rate\": " << o.rate << "," << std::endl
+             << "  \"seconds\": " << seconds << "," << std::endl
+             << "  \"sent\": " << t.sent << "," << std::endl
+             << "  \"completed\": " << t.completed << "," << std::endl
+             << "  \"errors\": " << t.errors << "," << std::endl
+             << "  \"timeouts\": " << t.timeouts << "," << std::endl
+             << "  \"io_errors\": " << t.io_errors << "," << std::endl
+             << "  \"skipped\": " << t.skipped << "," << std::endl
+             << "  \"throughput\": " << t.completed / seconds << "," << std::endl
+             << "  \"latency_ns\": ";
+
+   print_latency(latencies);
+
+   std::cout << "," << std::endl
+             << "  \"commands\": [" << std::endl;
+
+   for (size_t i = 0; i < mix.size(); ++i) {
+
+      std::cout << "    {\"command\": " << json_string(mix[i].line)
+                << ", \"sent\": " << mix[i].sent
+                << ", \"completed\": " << mix[i].latencies.size()
+                << ", \"errors\": " << mix[i].errors
+                << ", \"latency_ns\": ";
+
+      print_latency(mix[i].latencies);
+
+      std::cout << "}" << (i + 1 < mix.size() ? "," : "") << std::endl;
+   }
+
+   std::cout << "  ]" << std::endl
+             << "}" << std::endl;
+
+   return t.timeouts + t.io_errors != 0 ? 1 : 0;
+}
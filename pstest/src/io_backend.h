@@ -0,0 +1,36 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Pseudo-terminal I/O driver used by pstest.
+//
+// Output produced by the AT context is queued with queue_write() and handed
+// to the kernel in batches by submit(), so a response costs no extra
+// syscalls on top of the one that waits for the next input chunk.
+class io_backend {
+public:
+   virtual ~io_backend() {}
+
+   virtual bool open(int fd) = 0;
+
+   // Submits queued output and waits for the next input chunk.
+   // Returns the number of bytes available at *data, 0 or less on EOF/error.
+   virtual long wait_input(std::uint8_t **data) = 0;
+
+   // Copies output into the pending write batch.
+   virtual void queue_write(const std::uint8_t *data, std::size_t size) = 0;
+
+   // Blocks until all queued output is written.
+   virtual void drain() = 0;
+
+   virtual const char *name() const = 0;
+
+   unsigned long syscalls = 0;
+};
+
+io_backend *io_backend_create_uring(void);
+io_backend *io_backend_create_epoll(void);
+
+#endif // IO_BACKEND_H
@@ -0,0 +1,97 @@
+#include "io_backend.h"
+
+#include <cerrno>
+#include <vector>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <unistd.h>
+}
+
+namespace {
+
+const std::size_t input_buffer_size = 4096;
+
+class epoll_backend : public io_backend {
+public:
+   ~epoll_backend() override {
+      if (epfd != -1)
+         close(epfd);
+   }
+
+   bool open(int new_fd) override {
+      fd = new_fd;
+      epfd = epoll_create1(0);
+
+      if (epfd == -1)
+         return false;
+
+      epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+
+      return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+   }
+
+   long wait_input(std::uint8_t **data) override {
+
+      drain();
+
+      epoll_event ev;
+      int n;
+
+      do {
+         n = epoll_wait(epfd, &ev, 1, -1);
+         syscalls++;
+      } while (n == -1 && errno == EINTR);
+
+      if (n <= 0)
+         return -1;
+
+      long r = read(fd, input, input_buffer_size);
+      syscalls++;
+
+      *data = input;
+      return r;
+   }
+
+   void queue_write(const std::uint8_t *data, std::size_t size) override {
+      output.insert(output.end(), data, data + size);
+   }
+
+   void drain() override {
+
+      std::size_t offset = 0;
+
+      while (offset < output.size()) {
+         long w = write(fd, output.data() + offset, output.size() - offset);
+         syscalls++;
+
+         if (w < 0) {
+            if (errno == EINTR)
+               continue;
+            break;
+         }
+
+         offset += w;
+      }
+
+      output.clear();
+   }
+
+   const char *name() const override {
+      return "epoll";
+   }
+
+private:
+   int fd = -1;
+   int epfd = -1;
+   std::uint8_t input[input_buffer_size];
+   std::vector<std::uint8_t> output;
+};
+
+}
+
+io_backend *io_backend_create_epoll(void) {
+   return new epoll_backend();
+}
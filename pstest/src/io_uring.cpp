@@ -0,0 +1,291 @@
+#include "io_backend.h"
+
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+// io_uring driven through the raw syscalls, so pstest does not depend on
+// liburing. One read stays posted into a registered buffer; queued output is
+// submitted as a fixed-buffer write together with the re-armed read in one
+// io_uring_enter(). Waiting ends with the read, a write finishing first costs
+// another enter but never holds up the input.
+
+namespace {
+
+const std::size_t input_buffer_size = 4096;
+const std::size_t output_buffer_size = 65536;
+const unsigned ring_entries = 8;
+
+const std::uint64_t read_tag = 1;
+const std::uint64_t write_tag = 2;
+
+enum {
+   input_buffer_index = 0,
+   output_buffer_index = 1
+};
+
+class uring_backend : public io_backend {
+public:
+   ~uring_backend() override {
+      if (sqes != 0)
+         munmap(sqes, sqes_size);
+
+      if (cq_ptr != 0 && cq_ptr != sq_ptr)
+         munmap(cq_ptr, cq_ring_size);
+
+      if (sq_ptr != 0)
+         munmap(sq_ptr, sq_ring_size);
+
+      if (ring_fd != -1)
+         close(ring_fd);
+   }
+
+   bool open(int new_fd) override {
+
+      fd = new_fd;
+
+      io_uring_params p;
+      std::memset(&p, 0, sizeof(p));
+
+      ring_fd = syscall(__NR_io_uring_setup, ring_entries, &p);
+
+      if (ring_fd < 0) {
+         ring_fd = -1;
+         return false;
+      }
+
+      sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+      bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+      if (single_mmap) {
+         if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+         cq_ring_size = sq_ring_size;
+      }
+
+      sq_ptr = map(sq_ring_size, IORING_OFF_SQ_RING);
+
+      if (sq_ptr == 0)
+         return false;
+
+      cq_ptr = single_mmap ? sq_ptr : map(cq_ring_size, IORING_OFF_CQ_RING);
+
+      if (cq_ptr == 0)
+         return false;
+
+      sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+
+      if (sqes == 0)
+         return false;
+
+      std::uint8_t *sq = static_cast<std::uint8_t*>(sq_ptr);
+      sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+      sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+      sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+      std::uint8_t *cq = static_cast<std::uint8_t*>(cq_ptr);
+      cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+      cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+      iovec buffers[2];
+      buffers[input_buffer_index].iov_base = input;
+      buffers[input_buffer_index].iov_len = input_buffer_size;
+      buffers[output_buffer_index].iov_base = output;
+      buffers[output_buffer_index].iov_len = output_buffer_size;
+
+      return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers, 2) == 0;
+   }
+
+   long wait_input(std::uint8_t **data) override {
+
+      if (read_ready == false && read_armed == false) {
+         prepare(IORING_OP_READ_FIXED, input, input_buffer_size, input_buffer_index, read_tag);
+         read_armed = true;
+      }
+
+      submit_pending_write();
+
+      // Any completion wakes the wait, a finished write just waits again
+      while (read_ready == false) {
+         if (enter(1) < 0)
+            return -1;
+      }
+
+      read_ready = false;
+      *data = input;
+      return read_result;
+   }
+
+   void queue_write(const std::uint8_t *data, std::size_t size) override {
+
+      while (size > 0) {
+
+         if (pending_end == output_buffer_size)
+            drain();
+
+         std::size_t chunk = output_buffer_size - pending_end;
+
+         if (chunk > size)
+            chunk = size;
+
+         std::memcpy(output + pending_end, data, chunk);
+         pending_end += chunk;
+         data += chunk;
+         size -= chunk;
+      }
+   }
+
+   void drain() override {
+
+      submit_pending_write();
+
+      while (write_inflight) {
+
+         if (enter(1) < 0)
+            break;
+
+         submit_pending_write();
+      }
+   }
+
+   const char *name() const override {
+      return "io_uring";
+   }
+
+private:
+   void *map(std::size_t size, unsigned long long offset) {
+      void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+      return p == MAP_FAILED ? 0 : p;
+   }
+
+   void prepare(std::uint8_t opcode, std::uint8_t *addr, unsigned len, unsigned buf_index, std::uint64_t tag) {
+
+      unsigned tail = *sq_tail;
+      unsigned index = tail & sq_mask;
+      io_uring_sqe *sqe = &sqes[index];
+
+      std::memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = opcode;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<std::uint64_t>(addr);
+      sqe->len = len;
+      sqe->off = static_cast<std::uint64_t>(-1);
+      sqe->buf_index = buf_index;
+      sqe->user_data = tag;
+
+      sq_array[index] = index;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      to_submit++;
+   }
+
+   void submit_pending_write() {
+
+      if (write_inflight || pending_begin == pending_end)
+         return;
+
+      write_len = pending_end - pending_begin;
+      prepare(IORING_OP_WRITE_FIXED, output + pending_begin, write_len, output_buffer_index, write_tag);
+      write_inflight = true;
+   }
+
+   int enter(unsigned min_complete) {
+
+      long r;
+
+      do {
+         r = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, 0, 0);
+         syscalls++;
+      } while (r < 0 && errno == EINTR);
+
+      if (r < 0)
+         return -1;
+
+      to_submit = 0;
+      reap();
+      return 0;
+   }
+
+   void reap() {
+
+      unsigned head = *cq_head;
+
+      while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+
+         io_uring_cqe *cqe = &cqes[head & cq_mask];
+
+         if (cqe->user_data == read_tag) {
+            read_armed = false;
+            read_ready = true;
+            read_result = cqe->res;
+         } else if (cqe->user_data == write_tag) {
+            write_inflight = false;
+
+            if (cqe->res < 0) {
+               // Peer is gone, drop the batch
+               pending_begin = pending_end;
+            } else {
+               pending_begin += cqe->res;
+            }
+
+            if (pending_begin == pending_end) {
+               pending_begin = 0;
+               pending_end = 0;
+            }
+         }
+
+         head++;
+      }
+
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+   }
+
+   int fd = -1;
+   int ring_fd = -1;
+
+   void *sq_ptr = 0;
+   void *cq_ptr = 0;
+   std::size_t sq_ring_size = 0;
+   std::size_t cq_ring_size = 0;
+   io_uring_sqe *sqes = 0;
+   std::size_t sqes_size = 0;
+
+   unsigned *sq_tail = 0;
+   unsigned sq_mask = 0;
+   unsigned *sq_array = 0;
+   unsigned *cq_head = 0;
+   unsigned *cq_tail = 0;
+   unsigned cq_mask = 0;
+   io_uring_cqe *cqes = 0;
+
+   unsigned to_submit = 0;
+
+   bool read_armed = false;
+   bool read_ready = false;
+   long read_result = 0;
+
+   bool write_inflight = false;
+   unsigned write_len = 0;
+   std::size_t pending_begin = 0;
+   std::size_t pending_end = 0;
+
+   std::uint8_t input[input_buffer_size];
+   std::uint8_t output[output_buffer_size];
+};
+
+}
+
+io_backend *io_backend_create_uring(void) {
+   return new uring_backend();
+}
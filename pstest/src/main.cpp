@@ -3,17 +3,25 @@
 
 extern "C" {
 #include "at.h"
+#include "record.h"
 #include <fcntl.h>
 #include <stdlib.h>
+#include <sys/wait.h>
+#include <termios.h>
 #include <unistd.h>
 }
 
 #include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "io_backend.h"
 
 int masterfd;
+io_backend *backend;
 
 void output_function(range_t *data){
-   write(masterfd, data->begin, range_size(data));
+   backend->queue_write(data->begin, range_size(data));
 }
 
 bool exit_flag = false;
@@ -23,14 +31,145 @@ void  exit(struct at_function_result *r,  at_function_context_t *ctx){
    r->result = true;
 }
 
+static void usage(const char *name) {
+   std::cerr << "Usage: " << name << " [-b uring|epoll] [-B COMMANDS] [-m VMIN] [-t VTIME] [-r FILE]" << std::endl
+             << "  -b  I/O backend, io_uring with epoll fallback by default" << std::endl
+             << "  -B  run a built-in client sending COMMANDS commands and print syscall statistics" << std::endl
+             << "  -m  termios VMIN of the -B client terminal, bytes per read (default 1)" << std::endl
+             << "  -t  termios VTIME of the -B client terminal, inter-byte timeout in 1/10 s (default 0)" << std::endl
+             << "  -r  record the session to FILE for ath-replay" << std::endl;
+}
+
+static bool set_raw_mode(int fd, int vmin, int vtime) {
+
+   struct termios tio;
+
+   if (tcgetattr(fd, &tio) == -1)
+      return false;
+
+   cfmakeraw(&tio);
+   tio.c_cc[VMIN] = vmin;
+   tio.c_cc[VTIME] = vtime;
+
+   return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+// VMIN and VTIME only govern reads on the terminal side, so they are set by
+// the client on the slave it reads responses from
+static void run_client(const char *slavename, long commands, int vmin, int vtime) {
+
+   int fd = open(slavename, O_RDWR | O_NOCTTY);
+
+   if (fd == -1) {
+      perror("open slave");
+      _exit(1);
+   }
+
+   if (set_raw_mode(fd, vmin, vtime) == false) {
+      perror("tcsetattr slave");
+      _exit(1);
+   }
+
+   static const char *workload[] = {
+      "AT\r",
+      "AT+CMEE?\r",
+      "AT+CMEE=1\r",
+      "AT;+CMEE=?\r"
+   };
+
+   for (long i = 0; i < commands; ++i) {
+
+      const char *cmd = workload[i % (sizeof(workload) / sizeof(workload[0]))];
+
+      if (write(fd, cmd, strlen(cmd)) < 0)
+         _exit(1);
+
+      std::string response;
+      char buffer[256];
+
+      while (response.find("OK\r\n") == std::string::npos &&
+             response.find("ERROR") == std::string::npos) {
+
+         long r = read(fd, buffer, sizeof(buffer));
+
+         // With VMIN 0 a read may time out without data
+         if (r < 0)
+            _exit(1);
+
+         response.append(buffer, r);
+      }
+   }
+
+   const char exit_cmd[] = "AT+EXIT\r";
+
+   if (write(fd, exit_cmd, sizeof(exit_cmd) - 1) < 0)
+      _exit(1);
+
+   // Keep the slave open until the server has answered
+   char buffer[256];
+   while (read(fd, buffer, sizeof(buffer)) > 0) {
+   }
+
+   _exit(0);
+}
+
 int main (int argc, char **args) {
 
+   std::string backend_name;
+   long bench_commands = 0;
+   int vmin = 1;
+   int vtime = 0;
+   const char *record_file = 0;
+
+   int opt;
+
+   while ((opt = getopt(argc, args, "b:B:m:t:r:h")) != -1) {
+      switch (opt) {
+      case 'b':
+         backend_name = optarg;
+         break;
+      case 'B':
+         bench_commands = atol(optarg);
+         break;
+      case 'm':
+         vmin = atoi(optarg);
+         break;
+      case 't':
+         vtime = atoi(optarg);
+         break;
+      case 'r':
+         record_file = optarg;
+         break;
+      default:
+         usage(args[0]);
+         return 1;
+      }
+   }
+
+   if (vmin < 0 || vmin > 255 || vtime < 0 || vtime > 255) {
+      std::cerr << "VMIN and VTIME must be in range 0-255" << std::endl;
+      return 1;
+   }
+
    at_context_t *context;
    at_context_init(&context, output_function);
 
    at_command_add(context, "+exit", AT_STANDALONE_COMMAND, exit);
 
-   masterfd =  posix_openpt(O_RDWR);
+   at_recorder_t *recorder = 0;
+
+   if (record_file != 0) {
+      recorder = at_recorder_open(record_file);
+
+      if (recorder == 0) {
+         perror("record");
+         return 1;
+      }
+
+      at_recorder_attach(recorder, context);
+   }
+
+   masterfd =  posix_openpt(O_RDWR | O_NOCTTY);
 
    if (masterfd == -1) {
       perror("open ptmx");
@@ -54,29 +193,106 @@ int main (int argc, char **args) {
       abort();
    }
 
+   // Raw mode: no line discipline echo or CR/LF translation on top of the
+   // AT echo
+   if (set_raw_mode(masterfd, 1, 0) == false) {
+      perror("tcsetattr");
+      abort();
+   }
+
+   if (backend_name.empty() || backend_name == "uring") {
+      backend = io_backend_create_uring();
+
+      if (backend->open(masterfd) == false) {
+         delete backend;
+         backend = 0;
+
+         if (backend_name.empty() == false) {
+            std::cerr << "io_uring is not available" << std::endl;
+            return 1;
+         }
+      }
+   }
+
+   if (backend == 0) {
+      if (backend_name.empty() == false && backend_name != "epoll") {
+         usage(args[0]);
+         return 1;
+      }
+
+      backend = io_backend_create_epoll();
+
+      if (backend->open(masterfd) == false) {
+         perror("epoll");
+         abort();
+      }
+   }
+
+   pid_t client = -1;
+   int slavefd = -1;
+
+   if (bench_commands > 0) {
+      // Hold the slave side open so the master never reports a hangup
+      // before the client has connected.
+      slavefd = open(slavename, O_RDWR | O_NOCTTY);
+      client = fork();
 
-   std::cout << "Terminal: "
-             << slavename
-             << std::endl;
+      if (client == 0) {
+         close(masterfd);
+         close(slavefd);
+         run_client(slavename, bench_commands, vmin, vtime);
+      }
+   } else {
+      std::cout << "Terminal: "
+                << slavename
+                << std::endl;
+   }
 
-   uint8_t buffer[128];
+   unsigned long lines = 0;
 
    while (true) {
 
-      long r =  read (masterfd, buffer, 128);
+      std::uint8_t *buffer;
+      long r = backend->wait_input(&buffer);
 
       if (r <= 0) {
          break;
       }
+
       range_t range;
       range.begin = buffer;
       range.end = range.begin + r;
 
+      for (iterator_t it = range.begin; it != range.end; ++it) {
+         if (*it == '\r')
+            lines++;
+      }
+
       at_process_input(context, &range);
 
       if (exit_flag)
          break;
    }
 
+   backend->drain();
+
+   if (client > 0) {
+      close(masterfd);
+      close(slavefd);
+      waitpid(client, 0, 0);
+
+      std::cout << "backend: " << backend->name()
+                << " commands: " << lines
+                << " syscalls: " << backend->syscalls
+                << " syscalls/command: " << (lines ? double(backend->syscalls) / lines : 0.0)
+                << std::endl;
+   }
+
+   at_context_free(context);
+   delete backend;
+
+   if (recorder != 0)
+      at_recorder_close(recorder);
+
    return 1;
 }
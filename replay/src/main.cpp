@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+    #include "at.h"
+    #include "record.h"
+    #include <unistd.h>
+}
+
+// Feeds a session recorded with at_recorder_attach() through a fresh
+// context and checks that it produces the recorded output byte for byte.
+// The context gets the same command set as the livetest and pstest examples.
+// Commands of other servers answer what the recording says they answered,
+// which verifies nothing about them, so they are reported apart.
+
+typedef std::chrono::steady_clock clock_type;
+
+struct replay_record {
+   AT_RECORD_TYPE type;
+   uint64_t timestamp_ns;
+   std::string data;
+   std::string prefix;
+};
+
+static std::string replay_output;
+static std::string expected_output;
+
+// Texts of recorded "+CME ERROR" results, which outlive the command
+static std::list<std::string> replay_errors;
+
+// Commands answered from the recording and how often
+static std::map<std::string, unsigned int> replay_unverified;
+
+void output_function(range_t *data){
+   replay_output.append(data->begin, data->end);
+}
+
+void  exit(struct at_function_result *r,  at_function_context_t *ctx){
+   r->result = true;
+}
+
+// Answers a command without handler with the recorded information text up to
+// the next final result code, and that result. Final results are only found
+// in the verbose format with the default S3 and S4, in other modes the
+// command fails and the replay reports a mismatch.
+static void replay_unknown(struct at_function_result *r, at_function_context_t *ctx){
+
+   replay_unverified[std::string(ctx->parameters.begin, ctx->parameters.end)]++;
+
+   at_flush_output(ctx->context);
+
+   size_t offset = replay_output.size();
+
+   // Already out of step, the mismatch is reported at the end
+   if (expected_output.compare(0, offset, replay_output) != 0)
+      return;
+
+   static const std::string finals[] = { "\r\nOK\r\n", "\r\nERROR\r\n", "\r\n+CME ERROR: " };
+   size_t end = std::string::npos;
+   int final = -1;
+
+   for (int i = 0; i < 3; ++i) {
+      size_t p = expected_output.find(finals[i], offset);
+      if (p < end) {
+         end = p;
+         final = i;
+      }
+   }
+
+   if (final < 0)
+      return;
+
+   std::string text = expected_output.substr(offset, end - offset);
+   range_t range = range_create_cnt((iterator_t)&text[0], text.size());
+   at_append_range(ctx->context, &range);
+
+   if (final == 0) {
+      at_ok_result(r);
+      return;
+   }
+
+   r->result = false;
+
+   if (final == 1)
+      return;
+
+   size_t begin = end + finals[2].size();
+   std::string error = expected_output.substr(begin, expected_output.find("\r\n", begin) - begin);
+   char *rest;
+   long code = strtol(error.c_str(), &rest, 10);
+
+   // Numeric with AT+CMEE=1, the text with AT+CMEE=2
+   if (error.empty() == false && *rest == 0) {
+      r->code = code;
+   } else {
+      replay_errors.push_back(error);
+      r->code = 100;
+      r->detailed = replay_errors.back().c_str();
+   }
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &sorted, double p){
+   if (sorted.empty())
+      return 0;
+   size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+   return sorted[i];
+}
+
+static void usage(const char *name){
+   std::cerr << "Usage: " << name << " [-p] FILE" << std::endl
+             << "  -p  replay at the original pacing instead of as fast as possible" << std::endl;
+}
+
+int main (int argc, char **args) {
+
+   bool paced = false;
+   int opt;
+
+   while ((opt = getopt(argc, args, "ph")) != -1) {
+      switch (opt) {
+      case 'p':
+         paced = true;
+         break;
+      default:
+         usage(args[0]);
+         return 2;
+      }
+   }
+
+   if (optind + 1 != argc) {
+      usage(args[0]);
+      return 2;
+   }
+
+   at_record_reader_t *reader = at_record_reader_open(args[optind]);
+
+   if (reader == 0) {
+      std::cerr << "Cannot read recording " << args[optind] << std::endl;
+      return 2;
+   }
+
+   std::vector<replay_record> records;
+   at_record_t record;
+
+   while (at_record_read(reader, &record)) {
+
+      if (record.type == AT_RECORD_OUTPUT) {
+         expected_output.append(record.data.begin, record.data.end);
+         continue;
+      }
+
+      replay_record r;
+      r.type = record.type;
+      r.timestamp_ns = record.timestamp_ns;
+      r.data.assign(record.data.begin, record.data.end);
+      r.prefix.assign(record.prefix.begin, record.prefix.end);
+      records.push_back(r);
+   }
+
+   at_record_reader_close(reader);
+
+   at_context_t *context;
+   at_context_init(&context, output_function);
+
+   at_command_add(context, "+exit", AT_STANDALONE_COMMAND, exit);
+   at_set_command_fallback(context, replay_unknown, 0);
+
+   std::vector<uint64_t> latencies;
+   uint64_t input_bytes = 0;
+
+   clock_type::time_point start = clock_type::now();
+
+   for (replay_record &r : records) {
+
+      if (paced) {
+         std::this_thread::sleep_until(start + std::chrono::nanoseconds(r.timestamp_ns));
+      }
+
+      if (r.type == AT_RECORD_INPUT) {
+
+         range_t range = range_create_cnt((iterator_t)&r.data[0], r.data.size());
+
+         clock_type::time_point t = clock_type::now();
+         at_process_input(context, &range);
+         latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - t).count());
+
+         input_bytes += r.data.size();
+
+      } else if (r.type == AT_RECORD_UNSOLICITED_LINE) {
+         at_add_unsolicited_line(context, r.data.c_str());
+      } else {
+         at_add_unsolicited(context, r.prefix.c_str(), r.data.c_str());
+      }
+   }
+
+   at_flush_output(context);
+
+   double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+   if (seconds <= 0)
+      seconds = 1e-9;
+
+   at_context_free(context);
+
+   std::sort(latencies.begin(), latencies.end());
+
+   std::cout << "records: " << records.size()
+             << " input chunks: " << latencies.size()
+             << " input bytes: " << input_bytes
+             << " output bytes: " << replay_output.size()
+             << " time: " << seconds << " s" << std::endl
+             << "chunks/s: " << latencies.size() / seconds
+             << " bytes/s: " << input_bytes / seconds << std::endl
+             << "chunk latency ns: p50 " << percentile(latencies, 0.50)
+             << " p90 " << percentile(latencies, 0.90)
+             << " p99 " << percentile(latencies, 0.99)
+             << " p99.9 " << percentile(latencies, 0.999)
+             << " max " << (latencies.empty() ? 0 : latencies.back())
+             << std::endl;
+
+   if (replay_output != expected_output) {
+
+      size_t offset = 0;
+
+      while (offset < replay_output.size() &&
+             offset < expected_output.size() &&
+             replay_output[offset] == expected_output[offset]) {
+         offset++;
+      }
+
+      std::cout << "output: MISMATCH at byte " << offset
+                << " (recorded " << expected_output.size()
+                << " bytes, replayed " << replay_output.size() << " bytes)" << std::endl;
+      return 1;
+   }
+
+   if (replay_unverified.empty() == false) {
+
+      unsigned int count = 0;
+
+      for (const auto &c : replay_unverified)
+         count += c.second;
+
+      std::cout << "answered from the recording, not verified: " << count << " commands (";
+
+      for (auto i = replay_unverified.begin(); i != replay_unverified.end(); ++i)
+         std::cout << (i == replay_unverified.begin() ? "" : ", ") << i->first << " x" << i->second;
+
+      std::cout << ")" << std::endl;
+   }
+
+   std::cout << "output: match" << std::endl;
+
+   return 0;
+}
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 
+#include <string>
 #include <vector>
 
 extern "C" {
@@ -22,6 +23,846 @@ TEST(at_test, ptr_test) {
 
 }
 
+static std::string echo_test_output;
+static int echo_test_out_calls = 0;
+
+void echo_test_output_function(range_t *data){
+   echo_test_output.append(data->begin, data->end);
+   echo_test_out_calls++;
+}
+
+static void process_test_input(at_context_t *context, const char *text){
+   std::string s(text);
+   range_t r = range_create_cnt((iterator_t)&s[0], s.size());
+   at_process_input(context, &r);
+}
+
+static at_function_context_t defer_test_fctx;
+static std::string defer_test_parameters;
+
+void defer_test_function(struct at_function_result *r, at_function_context_t *ctx){
+   defer_test_fctx = *ctx;
+   defer_test_parameters.assign(ctx->parameters.begin, ctx->parameters.end);
+   at_defer(ctx);
+}
+
+static std::string stream_test_parameters;
+
+void stream_test_function(struct at_function_result *r, at_function_context_t *ctx){
+   stream_test_parameters.assign(ctx->parameters.begin, ctx->parameters.end);
+   at_ok_result(r);
+}
+
+struct stream_test_state {
+   int begins = 0;
+   int chunks = 0;
+   size_t size = 0;
+   unsigned int sum = 0;
+   std::string head;
+};
+
+void stream_test_begin(at_function_context_t *ctx){
+   stream_test_state *state = static_cast<stream_test_state*>(ctx->user_data);
+   *state = stream_test_state();
+   state->begins++;
+}
+
+void stream_test_data(at_function_context_t *ctx, range_t *data){
+   stream_test_state *state = static_cast<stream_test_state*>(ctx->user_data);
+   state->chunks++;
+   state->size += range_size(data);
+
+   for (iterator_t it = data->begin; it != data->end; ++it)
+      state->sum += *it;
+
+   if (state->head.size() < 8)
+      state->head.append(data->begin, data->end);
+}
+
+void stream_test_end(struct at_function_result *r, at_function_context_t *ctx){
+   stream_test_state *state = static_cast<stream_test_state*>(ctx->user_data);
+
+   if (state->head.compare(0, 3, "bad") == 0) {
+      at_return_operation_not_allowed_error(r);
+   } else {
+      at_append_line(ctx->context, ("+CERT: " + std::to_string(state->size)).c_str());
+      at_ok_result(r);
+   }
+}
+
+static int cache_test_calls = 0;
+static bool cache_test_fail = false;
+static unsigned long long cache_test_now = 0;
+
+static unsigned long long cache_test_clock(void){
+   return cache_test_now;
+}
+
+void cache_test_function(struct at_function_result *r, at_function_context_t *ctx){
+   cache_test_calls++;
+
+   if (cache_test_fail) {
+      at_return_not_found_error(r);
+      return;
+   }
+
+   struct at_response_t response;
+   at_response_begin(&response, ctx->context, "+CGMI");
+   at_response_string(&response, "ath modem, a long manufacturer identification");
+   at_response_end(&response);
+   at_ok_result(r);
+}
+
+struct alloc_test_pool {
+   size_t allocs = 0;
+   size_t frees = 0;
+   size_t bytes = 0;
+};
+
+static void *alloc_test_alloc(void *user_data, size_t size){
+   alloc_test_pool *pool = static_cast<alloc_test_pool*>(user_data);
+   pool->allocs++;
+   pool->bytes += size;
+   return malloc(size);
+}
+
+static void alloc_test_free(void *user_data, void *p, size_t size){
+   alloc_test_pool *pool = static_cast<alloc_test_pool*>(user_data);
+   pool->frees++;
+   pool->bytes -= size;
+   free(p);
+}
+
+void alloc_test_function(struct at_function_result *r, at_function_context_t *ctx){
+   at_append_line(ctx->context, "+CGMI: ath");
+   at_ok_result(r);
+}
+
+static std::string inputv_test_run(const std::vector<std::string> &fragments, int *calls){
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_flush_policy(context, AT_FLUSH_PER_INPUT);
+   at_command_add(context, "+defer", AT_STANDALONE_COMMAND, defer_test_function);
+
+   std::vector<std::string> data(fragments);
+   std::vector<range_t> iov;
+
+   for (std::string &f : data)
+      iov.push_back(range_create_cnt((iterator_t)&f[0], f.size()));
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+   at_process_inputv(context, iov.data(), iov.size());
+   *calls = echo_test_out_calls;
+
+   if (at_is_deferred(context)) {
+      at_function_result result;
+      at_ok_result(&result);
+      at_resume(context, &result);
+   }
+
+   at_flush_output(context);
+   at_context_free(context);
+
+   return echo_test_output;
+}
+
+TEST(at_test, test_42) {
+
+   int calls;
+
+   // Echo and responses of a batch go out in one write
+   std::string whole = inputv_test_run({ "AT\rAT\r" }, &calls);
+   std::string split = inputv_test_run({ "A", "T\rA", "", "T\r" }, &calls);
+   ASSERT_EQ(split, "AT\rAT\r\r\nOK\r\n\r\nOK\r\n");
+   ASSERT_EQ(split, whole);
+   ASSERT_EQ(calls, 1);
+
+   // Lines spanning fragments run as if the input came in one piece
+   whole = inputv_test_run({ "AT+CMEE=1;+CMEE?\rAT\rAT+CM" }, &calls);
+   split = inputv_test_run({ "AT+CM", "EE=1;+CM", "EE?\rA", "T\rAT+CM" }, &calls);
+   ASSERT_EQ(split, whole);
+   ASSERT_NE(whole.find("+CMEE: 1"), std::string::npos);
+
+   // Fragments after a deferred command are held in order
+   whole = inputv_test_run({ "AT+DEFER\rAT+CMEE?\rAT\r" }, &calls);
+   split = inputv_test_run({ "AT+DE", "FER\rAT+C", "MEE?\r", "AT\r" }, &calls);
+   ASSERT_EQ(split, whole);
+   ASSERT_NE(whole.find("+CMEE: 0"), std::string::npos);
+
+   // Nothing but empty fragments is no input
+   split = inputv_test_run({ "", "" }, &calls);
+   ASSERT_EQ(split, "");
+   ASSERT_EQ(calls, 0);
+}
+
+TEST(at_test, test_41) {
+
+   alloc_test_pool pool;
+   const at_allocator_t allocator = { alloc_test_alloc, alloc_test_free, &pool };
+
+   at_context_t *context;
+   at_context_init_with(&context, echo_test_output_function, &allocator);
+   at_command_add(context, "+cgmi", AT_STATUS_COMMAND, alloc_test_function);
+   ASSERT_TRUE(at_set_urc_queue(context, 4));
+
+   at_alloc_stats_t stats;
+   at_get_alloc_stats(context, &stats);
+   ASSERT_EQ(stats.allocs, pool.allocs);
+   ASSERT_EQ(stats.bytes, pool.bytes);
+   ASSERT_EQ(stats.peak, pool.bytes);
+
+   // The first change of S3 copies the class table
+   process_test_input(context, "ATE0\r");
+   process_test_input(context, "ATS3=13\r");
+
+   // Steady state input processing needs no memory
+   at_set_alloc_guard(context, true);
+   process_test_input(context, "AT+CMEE=1;+CGMI?;+CMEE?\r");
+   process_test_input(context, "ATS3=13\rAT+UNKNOWN\r");
+   at_get_alloc_stats(context, &stats);
+   ASSERT_EQ(stats.guarded, 0u);
+
+   // A deferred command holds the rest of its line and later input
+   at_command_add(context, "+defer", AT_STANDALONE_COMMAND, defer_test_function);
+   process_test_input(context, "AT+DEFER;+CGMI?\rAT\r");
+   at_get_alloc_stats(context, &stats);
+   ASSERT_NE(stats.guarded, 0u);
+
+   at_function_result result;
+   at_ok_result(&result);
+   at_resume(context, &result);
+
+   at_queue_unsolicited(context, "CSQ", "a text longer than before", AT_URC_LOW);
+   at_get_alloc_stats(context, &stats);
+   ASSERT_EQ(stats.bytes, pool.bytes);
+   ASSERT_GE(stats.peak, stats.bytes);
+
+   // Long command lists are freed without recursion
+   for (int i = 0; i < 200000; ++i)
+      at_command_add(context, "+cgmr", AT_STATUS_COMMAND, alloc_test_function);
+
+   at_context_free(context);
+   ASSERT_EQ(pool.bytes, 0u);
+   ASSERT_EQ(pool.frees, pool.allocs);
+
+   // The default allocator serves contexts created while it is set
+   alloc_test_pool global;
+   const at_allocator_t global_allocator = { alloc_test_alloc, alloc_test_free, &global };
+   at_set_default_allocator(&global_allocator);
+   at_context_init(&context, echo_test_output_function);
+   at_set_default_allocator(0);
+   ASSERT_NE(global.allocs, 0u);
+   at_context_free(context);
+   ASSERT_EQ(global.bytes, 0u);
+}
+
+TEST(at_test, test_40) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   ASSERT_TRUE(at_set_urc_queue(context, 3));
+
+   echo_test_output.clear();
+
+   // Newer state of a prefix replaces the pending one in place
+   at_queue_unsolicited(context, "CSQ", "10,99", AT_URC_LOW);
+   at_queue_unsolicited(context, "CREG", "2", AT_URC_NORMAL);
+   at_queue_unsolicited(context, "CSQ", "12,99", AT_URC_LOW);
+   ASSERT_EQ(at_pending_unsolicited(context), 2u);
+   ASSERT_EQ(echo_test_output, "");
+
+   // A full queue drops the oldest low priority URC first
+   at_queue_unsolicited(context, "RING", "", AT_URC_HIGH);
+   at_queue_unsolicited(context, "CMTI", "\"SM\",1", AT_URC_NORMAL);
+   ASSERT_EQ(at_pending_unsolicited(context), 3u);
+
+   // Nothing pending is less important than a new low priority URC
+   at_queue_unsolicited(context, "CBM", "1", AT_URC_LOW);
+
+   ASSERT_EQ(at_send_unsolicited(context, 1), 1u);
+   at_flush_output(context);
+   ASSERT_EQ(echo_test_output, "\r\n+RING: \r\n");
+
+   echo_test_output.clear();
+   at_queue_unsolicited(context, "CREG", "1", AT_URC_HIGH);
+   ASSERT_EQ(at_send_unsolicited(context, 10), 2u);
+   at_flush_output(context);
+   ASSERT_EQ(echo_test_output, "\r\n+CREG: 1\r\n\r\n+CMTI: \"SM\",1\r\n");
+   ASSERT_EQ(at_send_unsolicited(context, 10), 0u);
+
+   at_urc_stats_t stats;
+   at_get_urc_stats(context, &stats);
+   ASSERT_EQ(stats.queued, 4u);
+   ASSERT_EQ(stats.merged, 2u);
+   ASSERT_EQ(stats.dropped, 2u);
+   ASSERT_EQ(stats.sent, 3u);
+
+   // Without a queue URCs go out at once
+   at_set_urc_queue(context, 0);
+   echo_test_output.clear();
+   at_queue_unsolicited(context, "CSQ", "5,99", AT_URC_LOW);
+   at_flush_output(context);
+   ASSERT_EQ(echo_test_output, "\r\n+CSQ: 5,99\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_39) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_command_add(context, "+cgmi", AT_STATUS_COMMAND, cache_test_function);
+   at_command_add(context, "+cgmr", AT_STATUS_COMMAND, cache_test_function);
+   at_command_cache(context, "+cgmi", AT_STATUS_COMMAND, 0);
+   at_command_cache(context, "+cgmr", AT_STATUS_COMMAND, 1000);
+
+   process_test_input(context, "ATE0\r");
+
+   const std::string expected =
+         "\r\n+CGMI: \"ath modem, a long manufacturer identification\"\r\n\r\nOK\r\n";
+
+   // Polls replay the first output
+   for (int i = 0; i < 3; ++i) {
+      echo_test_output.clear();
+      process_test_input(context, "AT+CGMI?\r");
+      ASSERT_EQ(echo_test_output, expected);
+   }
+
+   ASSERT_EQ(cache_test_calls, 1);
+
+   at_cache_stats_t stats;
+   at_get_cache_stats(context, &stats);
+   ASSERT_EQ(stats.hits, 2u);
+   ASSERT_EQ(stats.misses, 1u);
+
+   at_invalidate(context, "+cgmi");
+   process_test_input(context, "AT+CGMI?;+CGMI?\r");
+   ASSERT_EQ(cache_test_calls, 2);
+
+   // A TTL needs the clock
+   process_test_input(context, "AT+CGMR?\r");
+   process_test_input(context, "AT+CGMR?\r");
+   ASSERT_EQ(cache_test_calls, 4);
+
+   cache_test_now = 5000;
+   at_set_clock(context, cache_test_clock);
+   process_test_input(context, "AT+CGMR?\r");
+   cache_test_now += 999;
+   process_test_input(context, "AT+CGMR?\r");
+   ASSERT_EQ(cache_test_calls, 5);
+   cache_test_now += 1;
+   process_test_input(context, "AT+CGMR?\r");
+   ASSERT_EQ(cache_test_calls, 6);
+
+   // Errors are not cached
+   at_invalidate(context, "+cgmi");
+   cache_test_fail = true;
+   echo_test_output.clear();
+   process_test_input(context, "AT+CGMI?\r");
+   process_test_input(context, "AT+CGMI?\r");
+   ASSERT_EQ(cache_test_calls, 8);
+   ASSERT_EQ(echo_test_output, "\r\nERROR\r\n\r\nERROR\r\n");
+   cache_test_fail = false;
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_38) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+
+   echo_test_output.clear();
+
+   struct at_response_t r;
+   at_response_begin(&r, context, "+CREG");
+   at_response_int(&r, 2);
+   at_response_uint(&r, 4294967295u);
+   at_response_hex(&r, 0xc3, 4);
+   at_response_hex(&r, 0xa5f3, 0);
+   at_response_int(&r, -2147483647 - 1);
+   at_response_raw(&r, "");
+   at_response_string(&r, "a\"b\\c\r\n");
+   at_response_end(&r);
+   at_flush_output(context);
+
+   ASSERT_EQ(echo_test_output, "\r\n+CREG: 2,4294967295,00C3,A5F3,-2147483648,,\"a\\22b\\5Cc\\0D\\0A\"\r\n");
+
+   // List responses, each row with its own fields
+   echo_test_output.clear();
+   at_response_begin(&r, context, "+CMGL");
+   at_response_int(&r, 1);
+   at_response_string(&r, "REC READ");
+   at_response_row(&r);
+   at_response_int(&r, 2);
+   at_response_string(&r, std::string(40, 'x').c_str());
+   at_response_end(&r);
+   at_flush_output(context);
+
+   ASSERT_EQ(echo_test_output, "\r\n+CMGL: 1,\"REC READ\"\r\n+CMGL: 2,\"" + std::string(40, 'x') + "\"\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_37) {
+
+   stream_test_state state;
+   const at_stream_command_t cert = {
+      "+cert", stream_test_begin, stream_test_data, stream_test_end, &state
+   };
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_stream_command_add(context, &cert);
+
+   process_test_input(context, "ATE0\r");
+
+   // A megabyte parameter through a 32 byte input buffer
+   std::string chunk(4096, 0);
+   unsigned int sum = 0;
+
+   for (size_t i = 0; i < chunk.size(); ++i) {
+      chunk[i] = 'a' + i % 26;
+      sum += (unsigned char)chunk[i];
+   }
+
+   echo_test_output.clear();
+   process_test_input(context, "AT+Cert=");
+
+   for (int i = 0; i < 256; ++i) {
+      range_t r = range_create_cnt((iterator_t)&chunk[0], chunk.size());
+      at_process_input(context, &r);
+   }
+
+   process_test_input(context, "\rAT+CMEE?\r");
+
+   ASSERT_EQ(state.begins, 1);
+   ASSERT_EQ(state.chunks, 256);
+   ASSERT_EQ(state.size, 256u * 4096u);
+   ASSERT_EQ(state.sum, 256u * sum);
+   ASSERT_EQ(echo_test_output, "+CERT: 1048576\r\n\r\nOK\r\n\r\n+CMEE: 0\r\n\r\nOK\r\n");
+
+   // Separators and quotes are parameter bytes, the handler sets the result
+   echo_test_output.clear();
+   process_test_input(context, "AT+CERT=\"x;y\";+CMEE?\r");
+   ASSERT_EQ(state.head, "\"x;y\";+CMEE?");
+   ASSERT_EQ(echo_test_output, "+CERT: 12\r\n\r\nOK\r\n");
+
+   echo_test_output.clear();
+   process_test_input(context, "AT+CERT=bad\r");
+   ASSERT_EQ(echo_test_output, "\r\nERROR\r\n");
+
+   // Only the first command of a line streams
+   echo_test_output.clear();
+   process_test_input(context, "AT;+CERT=1\r");
+   ASSERT_EQ(echo_test_output, "\r\nERROR\r\n");
+   ASSERT_EQ(state.head, "bad");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_36) {
+
+   const char *lines[] = {
+      "AT+CMEE=1;+CMEE?\r",
+      "  at+set=\"a;b\" ; +CMEE? \r",
+      "AT+SET=1;;+SET=2\r",
+      "A T\r",
+      "X;AT\r",
+      "AT+CMEE;+SET=3\r",
+      "AT+Set?\r",
+      "A\r\rAT\r",
+      "AT+SEX\bT=4\r",
+      "A/"
+   };
+
+   std::string whole;
+   std::string bytes;
+   std::string whole_parameters;
+
+   for (int pass = 0; pass < 2; ++pass) {
+
+      at_context_t *context;
+      at_context_init(&context, echo_test_output_function);
+      at_command_add(context, "+set", AT_ASSIGNMENT_COMMAND, stream_test_function);
+
+      process_test_input(context, "ATE0\r");
+      echo_test_output.clear();
+
+      std::string parameters;
+
+      for (const char *line : lines) {
+
+         stream_test_parameters.clear();
+
+         // The same lines in one chunk and one byte at a time
+         if (pass == 0) {
+            process_test_input(context, line);
+         } else {
+            for (const char *c = line; *c != 0; ++c) {
+               std::string b(1, *c);
+               process_test_input(context, b.c_str());
+            }
+         }
+
+         parameters += stream_test_parameters + "|";
+      }
+
+      if (pass == 0) {
+         whole = echo_test_output;
+         whole_parameters = parameters;
+      } else {
+         bytes = echo_test_output;
+         ASSERT_EQ(parameters, whole_parameters);
+      }
+
+      at_context_free(context);
+   }
+
+   ASSERT_EQ(whole, bytes);
+   ASSERT_EQ(whole_parameters, "|\"a;b\"|2||||||4|4|");
+   ASSERT_EQ(whole,
+         "\r\n+CMEE: 1\r\n\r\nOK\r\n"
+         "\r\n+CMEE: 1\r\n\r\nOK\r\n"
+         "\r\nOK\r\n"
+         "\r\n+CME ERROR: 4\r\n"
+         "\r\n+CME ERROR: 4\r\n"
+         "\r\n+CME ERROR: 4\r\n"
+         "\r\n+CME ERROR: 4\r\n"
+         "\r\nOK\r\n"
+         "\r\nOK\r\n"
+         "\r\nOK\r\n");
+}
+
+TEST(at_test, test_35) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+
+   process_test_input(context, "ATE0\r");
+
+   echo_test_output.clear();
+   process_test_input(context, "ATS3?;S4?;S5?\r");
+   ASSERT_EQ(echo_test_output, "\r\n013\r\n\r\n010\r\n\r\n008\r\n\r\nOK\r\n");
+
+   // Line feed terminated input, carriage returns count as space
+   process_test_input(context, "ATS4=0;S3=10\r");
+   process_test_input(context, "ATS4=13\n");
+   echo_test_output.clear();
+   process_test_input(context, "AT+CMEE?\nAT\r\n");
+   ASSERT_EQ(echo_test_output, "\n\r+CMEE: 0\n\r\n\rOK\n\r\n\rOK\n\r");
+
+   // Responses follow S3 and S4
+   process_test_input(context, "ATS4=0;S3=13\n");
+   process_test_input(context, "ATS4=0\r");
+   echo_test_output.clear();
+   process_test_input(context, "AT+UNKNOWN\r");
+   ASSERT_EQ(echo_test_output, std::string("\r\0ERROR\r\0", 9));
+
+   process_test_input(context, "ATS4=10;V0\r");
+   echo_test_output.clear();
+   process_test_input(context, "AT\r");
+   ASSERT_EQ(echo_test_output, "0\r");
+   process_test_input(context, "ATV1\r");
+
+   // S5 edits the line before it is parsed
+   process_test_input(context, "ATS5=127\r");
+   echo_test_output.clear();
+   process_test_input(context, "AT+CMEX\x7f" "E?\r");
+   ASSERT_EQ(echo_test_output, "\r\n+CMEE: 0\r\n\r\nOK\r\n");
+
+   echo_test_output.clear();
+   process_test_input(context, "ATS3=200\r");
+   ASSERT_EQ(echo_test_output, "\r\nERROR\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_34) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_command_add(context, "+slow", AT_ASSIGNMENT_COMMAND, defer_test_function);
+
+   process_test_input(context, "ATE0\r");
+   echo_test_output.clear();
+
+   // Input after a deferred command waits for its result
+   process_test_input(context, "AT+SLOW=1\rAT+CMEE?\r");
+   ASSERT_TRUE(at_is_deferred(context));
+   ASSERT_EQ(echo_test_output, "");
+   process_test_input(context, "AT\r");
+   ASSERT_EQ(echo_test_output, "");
+
+   // Parameters stay valid until the result comes
+   ASSERT_EQ(std::string(defer_test_fctx.parameters.begin, defer_test_fctx.parameters.end), "1");
+
+   struct at_function_result result;
+   at_ok_result(&result);
+   at_append_line(context, "+SLOW: 1");
+   at_resume(context, &result);
+
+   ASSERT_FALSE(at_is_deferred(context));
+   ASSERT_EQ(echo_test_output, "+SLOW: 1\r\n\r\nOK\r\n\r\n+CMEE: 0\r\n\r\nOK\r\n\r\nOK\r\n");
+
+   // Commands after a deferred one on the same line continue on success
+   echo_test_output.clear();
+   process_test_input(context, "AT+SLOW=2;+SLOW=3;+CMEE?\r");
+   ASSERT_EQ(defer_test_parameters, "2");
+   at_resume(context, &result);
+   ASSERT_EQ(defer_test_parameters, "3");
+   ASSERT_TRUE(at_is_deferred(context));
+   at_resume(context, &result);
+   ASSERT_EQ(echo_test_output, "\r\n+CMEE: 0\r\n\r\nOK\r\n");
+
+   // and are dropped on error
+   echo_test_output.clear();
+   process_test_input(context, "AT+SLOW=4;+CMEE?\r");
+   at_return_operation_not_allowed_error(&result);
+   at_resume(context, &result);
+   ASSERT_EQ(echo_test_output, "\r\nERROR\r\n");
+
+   // Immediate echo is not held back
+   process_test_input(context, "ATE1\r");
+   echo_test_output.clear();
+   process_test_input(context, "AT+SLOW=5\r");
+   process_test_input(context, "AT\r");
+   ASSERT_EQ(echo_test_output, "AT+SLOW=5\rAT\r");
+   at_ok_result(&result);
+   at_resume(context, &result);
+   ASSERT_EQ(echo_test_output, "AT+SLOW=5\rAT\r\r\nOK\r\n\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_33) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+
+   process_test_input(context, "ATE0\r");
+   process_test_input(context, "ATQ1\r");
+
+   echo_test_output.clear();
+
+   process_test_input(context, "AT\r");
+   process_test_input(context, "AT+CMEE?\r");
+   ASSERT_EQ(echo_test_output, "\r\n+CMEE: 0\r\n");
+
+   process_test_input(context, "ATQ0\r");
+   ASSERT_EQ(echo_test_output, "\r\n+CMEE: 0\r\n\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_32) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+
+   process_test_input(context, "ATE0\r");
+   process_test_input(context, "ATV0\r");
+   process_test_input(context, "AT+CMEE=1\r");
+
+   echo_test_output.clear();
+   process_test_input(context, "AT+UNKNOWN\r");
+   ASSERT_EQ(echo_test_output, "+CME ERROR: 4\r");
+
+   process_test_input(context, "AT+CMEE=2\r");
+   echo_test_output.clear();
+   process_test_input(context, "AT+UNKNOWN\r");
+   ASSERT_EQ(echo_test_output, "+CME ERROR: Operation not supported\r");
+
+   process_test_input(context, "ATV1\r");
+   echo_test_output.clear();
+   process_test_input(context, "AT+UNKNOWN\r");
+   ASSERT_EQ(echo_test_output, "\r\n+CME ERROR: Operation not supported\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_31) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+
+   process_test_input(context, "ATE0\r");
+
+   echo_test_output.clear();
+   process_test_input(context, "ATV0\r");
+   ASSERT_EQ(echo_test_output, "0\r");
+
+   echo_test_output.clear();
+   process_test_input(context, "AT+UNKNOWN\r");
+   ASSERT_EQ(echo_test_output, "4\r");
+
+   echo_test_output.clear();
+   process_test_input(context, "ATV1\r");
+   ASSERT_EQ(echo_test_output, "\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+static unsigned long long flush_test_clock_us = 0;
+
+unsigned long long flush_test_clock(void){
+   return flush_test_clock_us;
+}
+
+TEST(at_test, test_30) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_flush_policy(context, AT_FLUSH_COALESCE);
+   at_set_flush_budget(context, 0, 100);
+   at_set_clock(context, flush_test_clock);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+   flush_test_clock_us = 1000;
+
+   unsigned char cmd_buffer[] = "AT\r";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+   ASSERT_EQ(echo_test_out_calls, 0);
+
+   flush_test_clock_us = 1050;
+   at_flush_poll(context);
+   ASSERT_EQ(echo_test_out_calls, 0);
+
+   flush_test_clock_us = 1100;
+   at_flush_poll(context);
+   ASSERT_EQ(echo_test_out_calls, 1);
+   ASSERT_EQ(echo_test_output, "AT\r\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_29) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_flush_policy(context, AT_FLUSH_PER_INPUT);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+
+   unsigned char cmd_buffer[] = "AT\rAT\r";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+
+   ASSERT_EQ(echo_test_out_calls, 1);
+   ASSERT_EQ(echo_test_output, "AT\rAT\r\r\nOK\r\n\r\nOK\r\n");
+
+   at_add_unsolicited(context, "STATUS", "1");
+   ASSERT_EQ(echo_test_out_calls, 2);
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_28) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_flush_policy(context, AT_FLUSH_ON_FULL);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+
+   unsigned char cmd_buffer[] = "AT\r";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+   ASSERT_EQ(echo_test_out_calls, 0);
+
+   at_flush_output(context);
+   ASSERT_EQ(echo_test_out_calls, 1);
+   ASSERT_EQ(echo_test_output, "AT\r\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_27) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_echo_policy(context, AT_ECHO_DEFERRED);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+
+   unsigned char cmd_buffer[] = "AT";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+
+   ASSERT_EQ(echo_test_out_calls, 0);
+
+   unsigned char cmd_buffer2[] = "\r";
+   range_t cmd_range2 = get_range(cmd_buffer2);
+
+   at_process_input(context, &cmd_range2);
+
+   ASSERT_EQ(echo_test_out_calls, 1);
+   ASSERT_EQ(echo_test_output, "AT\r\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_26) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_echo_policy(context, AT_ECHO_MERGED);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+
+   unsigned char cmd_buffer[] = "AT\rA";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+
+   // Line echo merged with the response, unfinished line echoed at the end
+   ASSERT_EQ(echo_test_out_calls, 2);
+   ASSERT_EQ(echo_test_output, "AT\r\r\nOK\r\nA");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_25) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+
+   unsigned char cmd_buffer[] = "AT\r";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+
+   ASSERT_EQ(echo_test_out_calls, 2);
+   ASSERT_EQ(echo_test_output, "AT\r\r\nOK\r\n");
+
+   // Several lines in one chunk, all echoed before the first response
+   echo_test_output.clear();
+
+   unsigned char cmd_buffer2[] = "AT\rAT\r";
+   range_t cmd_range2 = get_range(cmd_buffer2);
+
+   at_process_input(context, &cmd_range2);
+
+   ASSERT_EQ(echo_test_output, "AT\rAT\r\r\nOK\r\n\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
 int test_24_out_calls = 0;
 int test_24_at_calls = 0;
 void test_24_output_function(range_t *data){
@@ -404,38 +1245,47 @@ TEST(at_test, test_10) {
    ASSERT_EQ(pin, 1111);
 }
 
+// Tag of a command with the byte classes of a fresh context
+static range_t get_tag_test(range_t *range){
+   at_context_t *context;
+   at_context_init(&context, nullptr);
+   range_t result = at_get_tag(context, range);
+   at_context_free(context);
+   return result;
+}
+
 TEST(at_test, test_09) {
    unsigned char i_buffer[] = "$cpin=\"1111\"";
    range_t i_range = get_range(i_buffer);
-   range_t result = at_get_tag(&i_range);
+   range_t result = get_tag_test(&i_range);
    ASSERT_TRUE( range_is_empty(&result));
 }
 
 TEST(at_test, test_08) {
    unsigned char i_buffer[] = "&cpin=\"1111\"";
    range_t i_range = get_range(i_buffer);
-   range_t result = at_get_tag(&i_range);
+   range_t result = get_tag_test(&i_range);
    ASSERT_TRUE(range_equals(&result, "&cpin"));
 }
 
 TEST(at_test, test_07) {
    unsigned char i_buffer[] = "+cpin=\"1111\"";
    range_t i_range = get_range(i_buffer);
-   range_t result = at_get_tag(&i_range);
+   range_t result = get_tag_test(&i_range);
    ASSERT_TRUE(range_equals( &result, "+cpin"));
 }
 
 TEST(at_test, test_06) {
    unsigned char i_buffer[] = "+cpin?";
    range_t i_range = get_range(i_buffer);
-   range_t result = at_get_tag(&i_range);
+   range_t result = get_tag_test(&i_range);
    ASSERT_TRUE(range_equals(&result, "+cpin"));
 }
 
 TEST(at_test, test_05) {
    unsigned char i_buffer[] = "AT";
    range_t i_range = get_range(i_buffer);
-   range_t result = at_get_tag(&i_range);
+   range_t result = get_tag_test(&i_range);
    ASSERT_TRUE(range_equals(&result, "AT"));
 }
 
@@ -506,3 +1356,90 @@ TEST(at_test, test_01) {
 
    at_context_free(context);
 }
+
+TEST(at_test, test_43) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   at_set_flush_policy(context, AT_FLUSH_COALESCE);
+   at_set_flush_budget(context, 16, 0);
+   at_set_clock(context, flush_test_clock);
+
+   echo_test_output.clear();
+   echo_test_out_calls = 0;
+   flush_test_clock_us = 1000;
+
+   // No time limit, the output waits for the byte budget
+   unsigned char cmd_buffer[] = "AT\r";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+   ASSERT_EQ(echo_test_out_calls, 0);
+
+   flush_test_clock_us = 100000;
+   at_flush_poll(context);
+   ASSERT_EQ(echo_test_out_calls, 0);
+
+   cmd_range = get_range(cmd_buffer);
+   at_process_input(context, &cmd_range);
+   ASSERT_EQ(echo_test_out_calls, 1);
+   ASSERT_EQ(echo_test_output, "AT\r\r\nOK\r\nAT\r\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_44) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   process_test_input(context, "ATE0\r");
+
+   // A line takes AT_LINE_COMMANDS_MAX commands
+   std::string line = "AT" + std::string(AT_LINE_COMMANDS_MAX - 1, ';') + "\r";
+   echo_test_output.clear();
+   process_test_input(context, line.c_str());
+   ASSERT_EQ(echo_test_output, "\r\nOK\r\n");
+
+   line = "AT" + std::string(AT_LINE_COMMANDS_MAX, ';') + "\r";
+   echo_test_output.clear();
+   process_test_input(context, line.c_str());
+   ASSERT_EQ(echo_test_output, "\r\nERROR\r\n");
+
+   // The next line starts over
+   echo_test_output.clear();
+   process_test_input(context, "AT;E0\r");
+   ASSERT_EQ(echo_test_output, "\r\nOK\r\n");
+
+   at_context_free(context);
+}
+
+TEST(at_test, test_45) {
+
+   at_context_t *context;
+   at_context_init(&context, echo_test_output_function);
+   process_test_input(context, "ATE0\r");
+
+   // No S register takes the byte of another one or one the parser uses
+   const char *rejected[] = {
+      "ATS3=10;S4=10\r", "ATS5=13\r", "ATS3=8\r", "ATS3=59\r", "ATS3=34\r",
+      "ATS3=32\r", "ATS5=65\r", "ATS5=97\r", "ATS3=48\r", "ATS4=43\r",
+      "ATS3=47\r", "ATS3=61\r", "ATS3=63\r", "ATS5=44\r", "ATS3=128\r"
+   };
+
+   for (const char *command : rejected) {
+      echo_test_output.clear();
+      process_test_input(context, command);
+      ASSERT_EQ(echo_test_output, "\r\nERROR\r\n") << command;
+   }
+
+   echo_test_output.clear();
+   process_test_input(context, "ATS3?;S4?;S5?\r");
+   ASSERT_EQ(echo_test_output, "\r\n013\r\n\r\n010\r\n\r\n008\r\n\r\nOK\r\n");
+
+   // Swapping S3 and S4 takes a free byte in between
+   echo_test_output.clear();
+   process_test_input(context, "ATS4=0;S3=10;S4=13\r");
+   ASSERT_EQ(echo_test_output, "\n\rOK\n\r");
+
+   at_context_free(context);
+}
@@ -0,0 +1,461 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "codec.h"
+   #include "codec_internal.h"
+}
+
+static const AT_CODEC_KERNELS codec_test_kernels[] = { AT_CODEC_SCALAR, AT_CODEC_SSSE3, AT_CODEC_AVX2 };
+
+static std::string codec_test_hex(const std::vector<unsigned char> &data){
+   static const char digits[] = "0123456789ABCDEF";
+   std::string s;
+   for (unsigned char c : data) {
+      s += digits[c >> 4];
+      s += digits[c & 0x0f];
+   }
+   return s;
+}
+
+static std::string codec_test_base64(const std::vector<unsigned char> &data){
+   static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   std::string s;
+   for (size_t i = 0; i < data.size(); i += 3) {
+      unsigned int v = data[i] << 16;
+      if (i + 1 < data.size()) v |= data[i + 1] << 8;
+      if (i + 2 < data.size()) v |= data[i + 2];
+      s += digits[v >> 18];
+      s += digits[(v >> 12) & 0x3f];
+      s += i + 1 < data.size() ? digits[(v >> 6) & 0x3f] : '=';
+      s += i + 2 < data.size() ? digits[v & 0x3f] : '=';
+   }
+   return s;
+}
+
+static bool codec_test_decode(bool base64, std::string text, std::vector<unsigned char> &out){
+   range_t in = range_create_cnt((iterator_t)&text[0], text.size());
+   unsigned int size = 0;
+   out.assign(text.size() + 1, 0);
+   bool ok = base64 ? at_base64_decode(&in, out.data(), &size) : at_hex_decode(&in, out.data(), &size);
+   out.resize(size);
+   return ok;
+}
+
+TEST(codec_tests, test01) {
+
+   std::mt19937 random(7);
+
+   for (AT_CODEC_KERNELS kernels : codec_test_kernels) {
+
+      at_codec_limit(kernels);
+
+      // Every length around the block sizes of the kernels, encode and decode
+      for (size_t size = 0; size < 300; ++size) {
+
+         std::vector<unsigned char> data(size);
+         for (unsigned char &c : data)
+            c = random();
+
+         std::string hex(2 * size, 0);
+         std::string base64((size + 2) / 3 * 4, 0);
+
+         ASSERT_EQ(at_hex_encode(data.data(), size, (unsigned char*)&hex[0]), hex.size());
+         ASSERT_EQ(at_base64_encode(data.data(), size, (unsigned char*)&base64[0]), base64.size());
+         ASSERT_EQ(hex, codec_test_hex(data));
+         ASSERT_EQ(base64, codec_test_base64(data));
+
+         std::vector<unsigned char> decoded;
+         ASSERT_TRUE(codec_test_decode(false, hex, decoded));
+         ASSERT_EQ(decoded, data);
+
+         for (char &c : hex)
+            c = tolower(c);
+
+         ASSERT_TRUE(codec_test_decode(false, hex, decoded));
+         ASSERT_EQ(decoded, data);
+
+         ASSERT_TRUE(codec_test_decode(true, base64, decoded));
+         ASSERT_EQ(decoded, data);
+
+         // Kernels never write past the decoded size
+         std::vector<unsigned char> exact(size);
+         range_t in = range_create_cnt((iterator_t)&base64[0], base64.size());
+         unsigned int exact_size;
+         ASSERT_TRUE(at_base64_decode(&in, exact.data(), &exact_size));
+         ASSERT_EQ(exact, data);
+         in = range_create_cnt((iterator_t)&hex[0], hex.size());
+         ASSERT_TRUE(at_hex_decode(&in, exact.data(), &exact_size));
+         ASSERT_EQ(exact, data);
+      }
+   }
+
+   at_codec_limit(AT_CODEC_AVX2);
+}
+
+TEST(codec_tests, test02) {
+
+   std::vector<unsigned char> data(120);
+   for (size_t i = 0; i < data.size(); ++i)
+      data[i] = i * 37;
+
+   const std::string hex = codec_test_hex(data);
+   const std::string base64 = codec_test_base64(data);
+   std::vector<unsigned char> decoded;
+
+   for (AT_CODEC_KERNELS kernels : codec_test_kernels) {
+
+      at_codec_limit(kernels);
+
+      // Any invalid character at any position is found
+      for (size_t position = 0; position < hex.size(); position += 7) {
+         for (int c = 0; c < 256; ++c) {
+
+            std::string s = hex;
+            s[position] = c;
+            bool valid = isxdigit(c);
+            ASSERT_EQ(codec_test_decode(false, s, decoded), valid) << position << " " << c;
+         }
+      }
+
+      for (size_t position = 0; position < base64.size(); position += 5) {
+         for (int c = 0; c < 256; ++c) {
+
+            std::string s = base64;
+            s[position] = c;
+            bool valid = isalnum(c) || c == '+' || c == '/';
+            ASSERT_EQ(codec_test_decode(true, s, decoded), valid) << position << " " << c;
+         }
+      }
+   }
+
+   at_codec_limit(AT_CODEC_AVX2);
+
+   ASSERT_FALSE(codec_test_decode(false, "ABC", decoded));
+   ASSERT_FALSE(codec_test_decode(true, "TWF", decoded));
+   ASSERT_FALSE(codec_test_decode(true, "T===", decoded));
+   ASSERT_FALSE(codec_test_decode(true, "TWF=TWFu", decoded));
+
+   // Bits under the padding have to be zero
+   ASSERT_FALSE(codec_test_decode(true, "TR==", decoded));
+   ASSERT_FALSE(codec_test_decode(true, "TWG=", decoded));
+
+   ASSERT_TRUE(codec_test_decode(true, "TQ==", decoded));
+   ASSERT_EQ(std::string(decoded.begin(), decoded.end()), "M");
+   ASSERT_TRUE(codec_test_decode(true, "TWE=", decoded));
+   ASSERT_EQ(std::string(decoded.begin(), decoded.end()), "Ma");
+   ASSERT_TRUE(codec_test_decode(true, "", decoded));
+   ASSERT_TRUE(decoded.empty());
+}
+
+static std::string codec_test_output;
+
+static void codec_test_output_function(range_t *data){
+   codec_test_output.append(data->begin, data->end);
+}
+
+TEST(codec_tests, test03) {
+
+   // Quoted parameters decode in place
+   unsigned char parameter[] = "\"48656c6C6f\"";
+   range_t range = get_range(parameter);
+   range_t result;
+
+   ASSERT_TRUE(at_hex_decode_quoted(&range, &result));
+   ASSERT_EQ(std::string(result.begin, result.end), "Hello");
+   ASSERT_EQ(result.begin, parameter + 1);
+
+   unsigned char parameter64[] = "\"SGVsbG8sIHdvcmxk\"";
+   range = get_range(parameter64);
+   ASSERT_TRUE(at_base64_decode_quoted(&range, &result));
+   ASSERT_EQ(std::string(result.begin, result.end), "Hello, world");
+
+   unsigned char unquoted[] = "48656c";
+   range = get_range(unquoted);
+   ASSERT_FALSE(at_hex_decode_quoted(&range, &result));
+
+   // Responses are encoded straight into the output buffer
+   at_context_t *context;
+   at_context_init(&context, codec_test_output_function);
+
+   std::string data(100, 0);
+   for (size_t i = 0; i < data.size(); ++i)
+      data[i] = i;
+
+   std::vector<unsigned char> bytes(data.begin(), data.end());
+
+   codec_test_output.clear();
+   at_append_text(context, "+HEX: ");
+   at_append_hex(context, bytes.data(), bytes.size());
+   at_append_line(context, "");
+   at_append_text(context, "+B64: ");
+   at_append_base64(context, bytes.data(), bytes.size());
+   at_append_line(context, "");
+   at_flush_output(context);
+
+   ASSERT_EQ(codec_test_output,
+         "+HEX: " + codec_test_hex(bytes) + "\r\n+B64: " + codec_test_base64(bytes) + "\r\n");
+
+   at_context_free(context);
+}
+
+static std::string codec_test_utf8(const std::u32string &text){
+   std::string s;
+   for (char32_t c : text) {
+      if (c < 0x80) {
+         s += (char)c;
+      } else if (c < 0x800) {
+         s += (char)(0xc0 | c >> 6);
+         s += (char)(0x80 | (c & 0x3f));
+      } else if (c < 0x10000) {
+         s += (char)(0xe0 | c >> 12);
+         s += (char)(0x80 | (c >> 6 & 0x3f));
+         s += (char)(0x80 | (c & 0x3f));
+      } else {
+         s += (char)(0xf0 | c >> 18);
+         s += (char)(0x80 | (c >> 12 & 0x3f));
+         s += (char)(0x80 | (c >> 6 & 0x3f));
+         s += (char)(0x80 | (c & 0x3f));
+      }
+   }
+   return s;
+}
+
+static std::string codec_test_ucs2(const std::u32string &text){
+   char unit[8];
+   std::string s;
+   for (char32_t c : text) {
+      if (c >= 0x10000) {
+         snprintf(unit, sizeof(unit), "%04X", 0xd800 + ((c - 0x10000) >> 10));
+         s += unit;
+         c = 0xdc00 + ((c - 0x10000) & 0x3ff);
+      }
+      snprintf(unit, sizeof(unit), "%04X", (unsigned int)c);
+      s += unit;
+   }
+   return s;
+}
+
+static bool codec_test_ucs2_decode(std::string text, std::string &out){
+   range_t in = range_create_cnt((iterator_t)&text[0], text.size());
+   unsigned int size = 0;
+   bool ok = at_ucs2_hex_decode(&in, in.begin, &size);
+   out.assign((const char*)in.begin, size);
+   return ok;
+}
+
+TEST(codec_tests, test04) {
+
+   std::mt19937 random(11);
+   static const char32_t others[] = { 0xe9, 0x3a9, 0x20ac, 0x4e2d, 0xfffd, 0x1f600, 0x10ffff };
+
+   for (AT_CODEC_KERNELS kernels : codec_test_kernels) {
+
+      at_codec_limit(kernels);
+
+      // ASCII runs of every length around the block sizes, other characters
+      // in between, converted both ways
+      for (size_t size = 0; size < 200; ++size) {
+
+         std::u32string text;
+         for (size_t i = 0; i < size; ++i) {
+            if (random() % 23 == 0) {
+               text += others[random() % 7];
+            } else {
+               text += (char32_t)(0x20 + random() % 0x5f);
+            }
+         }
+
+         std::string utf8 = codec_test_utf8(text);
+         std::string ucs2(4 * utf8.size(), 0);
+
+         ucs2.resize(at_ucs2_hex_encode((const unsigned char*)utf8.data(), utf8.size(), (unsigned char*)&ucs2[0]));
+         ASSERT_EQ(ucs2, codec_test_ucs2(text));
+
+         std::string decoded;
+         ASSERT_TRUE(codec_test_ucs2_decode(ucs2, decoded));
+         ASSERT_EQ(decoded, utf8);
+
+         for (char &c : ucs2)
+            c = tolower(c);
+
+         ASSERT_TRUE(codec_test_ucs2_decode(ucs2, decoded));
+         ASSERT_EQ(decoded, utf8);
+      }
+
+      // Any invalid digit at any position is found
+      std::string ucs2 = codec_test_ucs2(std::u32string(40, U'a'));
+      std::string decoded;
+
+      for (size_t position = 0; position < ucs2.size(); position += 3) {
+         std::string s = ucs2;
+         s[position] = 'g';
+         ASSERT_FALSE(codec_test_ucs2_decode(s, decoded)) << position;
+      }
+   }
+
+   at_codec_limit(AT_CODEC_AVX2);
+
+   std::string decoded;
+
+   // Surrogates come in pairs
+   ASSERT_FALSE(codec_test_ucs2_decode("D83D", decoded));
+   ASSERT_FALSE(codec_test_ucs2_decode("DE000041", decoded));
+   ASSERT_FALSE(codec_test_ucs2_decode("D83D0041", decoded));
+   ASSERT_FALSE(codec_test_ucs2_decode("004", decoded));
+   ASSERT_TRUE(codec_test_ucs2_decode("D83DDE00", decoded));
+   ASSERT_EQ(decoded, "\xf0\x9f\x98\x80");
+
+   // Invalid, overlong and truncated UTF-8 becomes U+FFFD
+   const std::string invalid = "A\x80\xc0\xaf\xed\xa0\x80\xe2\x82";
+   std::string ucs2(4 * invalid.size(), 0);
+   ucs2.resize(at_ucs2_hex_encode((const unsigned char*)invalid.data(), invalid.size(), (unsigned char*)&ucs2[0]));
+   ASSERT_EQ(ucs2, "0041" + std::string("FFFD") + "FFFDFFFD" + "FFFDFFFDFFFD" + "FFFDFFFD");
+}
+
+static std::string codec_test_name;
+
+static void codec_test_name_function(struct at_function_result *r, at_function_context_t *ctx){
+
+   unsigned char name[64];
+   range_t result;
+
+   if (at_charset_decode_quoted(ctx->context, &ctx->parameters, name, sizeof(name), &result) == false) {
+      at_invalid_chars_error(r);
+      return;
+   }
+
+   codec_test_name.assign(result.begin, result.end);
+
+   at_response_t response;
+   at_response_begin(&response, ctx->context, "+NAME");
+   at_response_charset_string(&response, codec_test_name.c_str());
+   at_response_end(&response);
+   at_ok_result(r);
+}
+
+static void codec_test_input(at_context_t *context, const char *text){
+   std::string s(text);
+   range_t r = range_create_cnt((iterator_t)&s[0], s.size());
+   codec_test_output.clear();
+   at_process_input(context, &r);
+   at_flush_output(context);
+}
+
+TEST(codec_tests, test05) {
+
+   at_context_t *context;
+   at_context_init(&context, codec_test_output_function);
+   at_command_add(context, "+name", AT_ASSIGNMENT_COMMAND, codec_test_name_function);
+
+   codec_test_input(context, "ATE0\r");
+   codec_test_input(context, "AT+CSCS?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CSCS: \"IRA\"\r\n\r\nOK\r\n");
+   codec_test_input(context, "AT+CSCS=?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CSCS: (\"IRA\",\"GSM\",\"UCS2\",\"HEX\")\r\n\r\nOK\r\n");
+   codec_test_input(context, "AT+CSCS=\"UTF8\"\r");
+   ASSERT_EQ(codec_test_output, "\r\nERROR\r\n");
+
+   // Parameters arrive and responses go out in the TE character set
+   codec_test_input(context, "AT+CSCS=\"ucs2\";+CSCS?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CSCS: \"UCS2\"\r\n\r\nOK\r\n");
+   ASSERT_EQ(at_get_charset(context), AT_CHARSET_UCS2);
+
+   codec_test_input(context, "AT+NAME=\"004A00F620AC\"\r");
+   ASSERT_EQ(codec_test_name, "J\xc3\xb6\xe2\x82\xac");
+   ASSERT_EQ(codec_test_output, "\r\n+NAME: \"004A00F620AC\"\r\n\r\nOK\r\n");
+
+   codec_test_input(context, "AT+NAME=\"004\"\r");
+   ASSERT_NE(codec_test_output.find("ERROR"), std::string::npos);
+
+   // Long strings are converted in pieces of the output buffer
+   std::string long_text;
+   for (int i = 0; i < 50; ++i)
+      long_text += "ab\xe2\x82\xac";
+
+   codec_test_output.clear();
+   at_append_charset(context, (const unsigned char*)long_text.data(), long_text.size());
+   at_flush_output(context);
+
+   std::string expected;
+   for (int i = 0; i < 50; ++i)
+      expected += "0061006220AC";
+
+   ASSERT_EQ(codec_test_output, expected);
+
+   // GSM uses the extension table, IRA and GSM strings are escaped
+   at_set_charset(context, AT_CHARSET_GSM);
+   codec_test_input(context, "AT+NAME=\"\x1b\x65 \x05\x1b\x3c\"\r");
+   ASSERT_EQ(codec_test_name, "\xe2\x82\xac \xc3\xa9[");
+   ASSERT_EQ(codec_test_output, "\r\n+NAME: \"\\1Be \\05\\1B<\"\r\n\r\nOK\r\n");
+
+   codec_test_output.clear();
+   at_append_charset(context, (const unsigned char*)"@$\xe4\xb8\xad", 5);
+   at_flush_output(context);
+   ASSERT_EQ(codec_test_output, std::string("\x00\x02?", 3));
+
+   at_set_charset(context, AT_CHARSET_IRA);
+   codec_test_input(context, "AT+NAME=\"a\\\"\r");
+   ASSERT_EQ(codec_test_output, "\r\n+NAME: \"a\\5C\"\r\n\r\nOK\r\n");
+
+   codec_test_output.clear();
+   at_append_charset(context, (const unsigned char*)"J\xc3\xb6rg", 5);
+   at_flush_output(context);
+   ASSERT_EQ(codec_test_output, "J?rg");
+
+   at_set_charset(context, AT_CHARSET_HEX);
+   codec_test_input(context, "AT+NAME=\"4A6f\"\r");
+   ASSERT_EQ(codec_test_name, "Jo");
+   ASSERT_EQ(codec_test_output, "\r\n+NAME: \"4A6F\"\r\n\r\nOK\r\n");
+
+   // Clones keep the character set
+   at_context_t *clone;
+   at_context_clone(&clone, context);
+   ASSERT_EQ(at_get_charset(clone), AT_CHARSET_HEX);
+   at_context_free(clone);
+
+   at_context_free(context);
+}
+
+static void codec_test_cached_function(struct at_function_result *r, at_function_context_t *ctx){
+   struct at_response_t response;
+   at_response_begin(&response, ctx->context, "+CGMI");
+   at_response_charset_string(&response, "J\xc3\xb6");
+   at_response_end(&response);
+   at_ok_result(r);
+}
+
+TEST(codec_tests, test06) {
+
+   at_context_t *context;
+   at_context_init(&context, codec_test_output_function);
+   at_command_add(context, "+cgmi", AT_STATUS_COMMAND, codec_test_cached_function);
+   at_command_cache(context, "+cgmi", AT_STATUS_COMMAND, 0);
+
+   codec_test_input(context, "ATE0\r");
+   codec_test_input(context, "AT+CGMI?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CGMI: \"J?\"\r\n\r\nOK\r\n");
+
+   // Cached output is not replayed in another character set
+   codec_test_input(context, "AT+CSCS=\"UCS2\";+CGMI?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CGMI: \"004A00F6\"\r\n\r\nOK\r\n");
+
+   codec_test_input(context, "AT+CSCS=\"IRA\";+CGMI?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CGMI: \"J?\"\r\n\r\nOK\r\n");
+
+   at_cache_stats_t stats;
+   at_get_cache_stats(context, &stats);
+   ASSERT_EQ(stats.hits, 0u);
+   ASSERT_EQ(stats.misses, 3u);
+
+   codec_test_input(context, "AT+CGMI?\r");
+   ASSERT_EQ(codec_test_output, "\r\n+CGMI: \"J?\"\r\n\r\nOK\r\n");
+   at_get_cache_stats(context, &stats);
+   ASSERT_EQ(stats.hits, 1u);
+
+   at_context_free(context);
+}
@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+
+#include "ath.hpp"
+
+struct cpp_test_output {
+   std::string data;
+
+   void operator()(std::string_view chunk) {
+      data.append(chunk);
+   }
+};
+
+static void cpp_test_cpin_status(ath::call &c) {
+   c.append_line("+CPIN: READY");
+   c.ok();
+}
+
+static void cpp_test_cpin_assignment(ath::call &c) {
+   std::string_view pin;
+
+   if (c.parameter_count() == 1 && ath::call::unquote(c.parameter(0), pin) && pin == "1234") {
+      c.ok();
+   } else {
+      c.not_allowed();
+   }
+}
+
+static constexpr auto cpp_test_commands = ath::make_command_table({
+   { "+cpin", AT_STATUS_COMMAND, ath::handler<cpp_test_cpin_status> },
+   { "+cpin", AT_ASSIGNMENT_COMMAND, ath::handler<cpp_test_cpin_assignment> },
+   { "+cgmi", AT_STANDALONE_COMMAND, ath::handler<cpp_test_cpin_status> },
+});
+
+static_assert(cpp_test_commands.size() == 3, "");
+static_assert(cpp_test_commands.find("+cgmi", AT_STANDALONE_COMMAND) != nullptr, "");
+static_assert(cpp_test_commands.find("+cpin", AT_ASSIGNMENT_COMMAND) != nullptr, "");
+static_assert(cpp_test_commands.find("+cpin", AT_STANDALONE_COMMAND) == nullptr, "");
+static_assert(cpp_test_commands.find("+cgmr", AT_STANDALONE_COMMAND) == nullptr, "");
+
+class cpp_test_modem {
+public:
+   int volume = 0;
+
+   void set_volume(ath::call &c) {
+      volume = static_cast<int>(c.parameter(0).size());
+      c.append(volume);
+      c.ok();
+   }
+};
+
+TEST(cpp_tests, test01) {
+
+   cpp_test_output output;
+   ath::context ctx(output);
+
+   int calls = 0;
+   std::string last;
+
+   auto handler = [&](ath::call &c) {
+      calls++;
+      last = std::string(c.parameters());
+      c.ok();
+   };
+
+   ctx.add("+test", AT_ASSIGNMENT_COMMAND, handler);
+   ctx.add("+plain", AT_STANDALONE_COMMAND, [](ath::call &c) { c.not_supported(); });
+
+   ctx.input("AT+TEST=1,\"a\"\r");
+   ctx.input("AT+PLAIN\r");
+
+   ASSERT_EQ(calls, 1);
+   ASSERT_EQ(last, "1,\"a\"");
+   ASSERT_EQ(output.data, "AT+TEST=1,\"a\"\r\r\nOK\r\nAT+PLAIN\r\r\nERROR\r\n");
+}
+
+TEST(cpp_tests, test02) {
+
+   cpp_test_output output;
+   cpp_test_modem modem;
+
+   ath::context ctx(output);
+   ctx.add<&cpp_test_modem::set_volume>("+vol", AT_ASSIGNMENT_COMMAND, modem);
+
+   ctx.input("ATE0\r");
+   ctx.input("AT+VOL=abc\r");
+
+   ASSERT_EQ(modem.volume, 3);
+   ASSERT_EQ(output.data, "ATE0\r\r\nOK\r\n3\r\nOK\r\n");
+}
+
+TEST(cpp_tests, test03) {
+
+   cpp_test_output output;
+   ath::context ctx(output);
+
+   ctx.set_commands(cpp_test_commands);
+
+   ctx.input("ATE0\r");
+   ctx.input("AT+CPIN?\rAT+CPIN=\"1234\"\rAT+CPIN=\"0000\"\rAT+CPIN=?\r");
+
+   ASSERT_EQ(output.data,
+             "ATE0\r\r\nOK\r\n"
+             "+CPIN: READY\r\n\r\nOK\r\n"
+             "\r\nOK\r\n"
+             "\r\nERROR\r\n"
+             "\r\nERROR\r\n");
+
+   // Lines end with S3 and S4
+   output.data.clear();
+   ctx.input("ATS4=0\rAT+CPIN?\r");
+
+   ASSERT_EQ(output.data, std::string("\r\0OK\r\0+CPIN: READY\r\0\r\0OK\r\0", 26));
+}
+
+TEST(cpp_tests, test04) {
+
+   cpp_test_output output;
+   ath::context first(output);
+   ath::context second(std::move(first));
+
+   ASSERT_TRUE(first.get() == nullptr);
+
+   second.input("AT\r");
+
+   ASSERT_EQ(output.data, "AT\r\r\nOK\r\n");
+}
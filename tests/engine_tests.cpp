@@ -0,0 +1,398 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "engine.h"
+   #include "pool.h"
+   #include <poll.h>
+   #include <sys/socket.h>
+   #include <unistd.h>
+}
+
+struct engine_test_channel {
+   int fd;
+   std::thread::id thread;
+   bool same_thread = true;
+   std::atomic<int> slow_calls{0};
+   std::atomic<int> released{0};
+};
+
+static void engine_test_check_thread(at_function_context_t *ctx){
+   engine_test_channel *c = static_cast<engine_test_channel*>(ctx->user_data);
+   if (c->thread != std::this_thread::get_id())
+      c->same_thread = false;
+}
+
+static void engine_test_work(void *arg, struct at_function_result *result){
+   engine_test_channel *c = static_cast<engine_test_channel*>(arg);
+   std::this_thread::sleep_for(std::chrono::milliseconds(2));
+   c->slow_calls++;
+   at_ok_result(result);
+}
+
+static void engine_test_done(void *arg, struct at_context_t *ctx){
+   engine_test_channel *c = static_cast<engine_test_channel*>(arg);
+   if (ctx == nullptr) {
+      c->released++;
+      return;
+   }
+   if (c->thread != std::this_thread::get_id())
+      c->same_thread = false;
+   at_append_line(ctx, "+SLOW: done");
+}
+
+static void engine_test_slow(struct at_function_result *r, at_function_context_t *ctx){
+   engine_test_check_thread(ctx);
+   at_engine_defer(ctx, engine_test_work, engine_test_done, ctx->user_data);
+}
+
+static void engine_test_fast(struct at_function_result *r, at_function_context_t *ctx){
+   engine_test_check_thread(ctx);
+   at_append_line(ctx->context, "+FAST: done");
+   at_ok_result(r);
+}
+
+// Far more than the socket takes at once
+static void engine_test_big(struct at_function_result *r, at_function_context_t *ctx){
+   for (int i = 0; i < 256; ++i)
+      at_append_line(ctx->context, std::string(1000, 'b').c_str());
+   at_ok_result(r);
+}
+
+static void engine_test_setup(void *user, struct at_context_t *ctx){
+   engine_test_channel *c = static_cast<engine_test_channel*>(user);
+   c->thread = std::this_thread::get_id();
+   at_command_add_ex(ctx, "+slow", AT_STANDALONE_COMMAND, engine_test_slow, c);
+   at_command_add_ex(ctx, "+fast", AT_STANDALONE_COMMAND, engine_test_fast, c);
+   at_command_add_ex(ctx, "+big", AT_STANDALONE_COMMAND, engine_test_big, c);
+}
+
+static void engine_test_post(void *arg, struct at_context_t *ctx){
+   if (ctx == nullptr) {
+      static_cast<engine_test_channel*>(arg)->released++;
+      return;
+   }
+   at_add_unsolicited(ctx, "RING", "1");
+}
+
+static std::string engine_test_read(int fd, size_t size){
+
+   std::string s;
+   char buffer[256];
+
+   while (s.size() < size) {
+
+      pollfd p = { fd, POLLIN, 0 };
+
+      if (poll(&p, 1, 5000) <= 0)
+         break;
+
+      ssize_t r = read(fd, buffer, sizeof(buffer));
+
+      if (r <= 0)
+         break;
+
+      s.append(buffer, r);
+   }
+
+   return s;
+}
+
+TEST(engine_tests, test01) {
+
+   at_engine_config_t config;
+   at_engine_config_init(&config);
+   config.shards = 2;
+   config.workers = 2;
+   config.pin = false;
+
+   at_engine_t *engine = at_engine_create(&config);
+   ASSERT_TRUE(engine != nullptr);
+   ASSERT_EQ(at_engine_shards(engine), 2u);
+
+   const int count = 8;
+   std::vector<engine_test_channel> channels(count);
+
+   for (int i = 0; i < count; ++i) {
+      int fds[2];
+      ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+      channels[i].fd = fds[0];
+      at_channel_t *c = at_engine_add_channel(engine, fds[1], engine_test_setup, &channels[i]);
+      ASSERT_TRUE(c != nullptr);
+      at_channel_release(c);
+   }
+
+   // Pipelined slow and fast commands answer in order on every channel
+   const std::string echo_off = "ATE0\r";
+   const std::string input = "AT+SLOW\rAT+FAST\rAT+SLOW;+FAST\rAT+FAST\r";
+   const std::string expected =
+         "+SLOW: done\r\n\r\nOK\r\n"
+         "+FAST: done\r\n\r\nOK\r\n"
+         "+SLOW: done\r\n+FAST: done\r\n\r\nOK\r\n"
+         "+FAST: done\r\n\r\nOK\r\n";
+
+   for (int i = 0; i < count; ++i) {
+      ASSERT_EQ(write(channels[i].fd, echo_off.data(), echo_off.size()), (ssize_t)echo_off.size());
+      ASSERT_EQ(engine_test_read(channels[i].fd, 11), "ATE0\r\r\nOK\r\n");
+   }
+
+   for (int i = 0; i < count; ++i) {
+      ASSERT_EQ(write(channels[i].fd, input.data(), input.size()), (ssize_t)input.size());
+   }
+
+   for (int i = 0; i < count; ++i) {
+      ASSERT_EQ(engine_test_read(channels[i].fd, expected.size()), expected);
+      ASSERT_EQ(channels[i].slow_calls, 2);
+      ASSERT_TRUE(channels[i].same_thread);
+   }
+
+   at_engine_stats_t stats;
+   at_engine_get_stats(engine, &stats);
+   ASSERT_EQ(stats.channels, (unsigned long long)count);
+   ASSERT_EQ(stats.deferred, 2ull * count);
+
+   for (int i = 0; i < count; ++i) {
+      close(channels[i].fd);
+   }
+
+   at_engine_free(engine);
+}
+
+TEST(engine_tests, test02) {
+
+   at_engine_config_t config;
+   at_engine_config_init(&config);
+   config.shards = 1;
+   config.workers = 1;
+   config.pin = false;
+
+   at_engine_t *engine = at_engine_create(&config);
+
+   int fds[2];
+   ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+   engine_test_channel channel;
+   channel.fd = fds[0];
+   at_channel_t *c = at_engine_add_channel(engine, fds[1], engine_test_setup, &channel);
+
+   at_channel_post(c, engine_test_post, &channel);
+
+   const std::string expected = "\r\n+RING: 1\r\n";
+   ASSERT_EQ(engine_test_read(channel.fd, expected.size()), expected);
+
+   // A handler outside an engine channel cannot defer and answers ERROR
+   at_context_t *context;
+   std::string output;
+   at_context_init(&context, 0);
+   at_set_output_hook(context, [](void *user, range_t *data) {
+      static_cast<std::string*>(user)->append(data->begin, data->end);
+   }, &output);
+   at_command_add_ex(context, "+slow", AT_STANDALONE_COMMAND, engine_test_slow, &channel);
+
+   unsigned char cmd[] = "AT+SLOW\r";
+   range_t range = get_range(cmd);
+   at_process_input(context, &range);
+
+   ASSERT_FALSE(at_is_deferred(context));
+   ASSERT_EQ(output, "AT+SLOW\r\r\nERROR\r\n");
+
+   at_context_free(context);
+
+   at_channel_release(c);
+   close(channel.fd);
+   at_engine_free(engine);
+}
+
+TEST(engine_tests, test03) {
+
+   at_buffer_pool_t *pool = at_buffer_pool_create(64, 1024, 4);
+
+   at_engine_config_t config;
+   at_engine_config_init(&config);
+   config.shards = 2;
+   config.workers = 2;
+   config.pin = false;
+   config.buffer_pool = pool;
+
+   at_engine_t *engine = at_engine_create(&config);
+   ASSERT_TRUE(engine != nullptr);
+
+   const int count = 8;
+   std::vector<engine_test_channel> channels(count);
+
+   for (int i = 0; i < count; ++i) {
+      int fds[2];
+      ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+      channels[i].fd = fds[0];
+      at_channel_t *c = at_engine_add_channel(engine, fds[1], engine_test_setup, &channels[i]);
+      ASSERT_TRUE(c != nullptr);
+      at_channel_release(c);
+   }
+
+   // Channels of both shards take their output buffers from the pool
+   const std::string input = "ATE0\rAT+SLOW;+FAST\r";
+   const std::string expected = "ATE0\rAT+SLOW;+FAST\r\r\nOK\r\n+SLOW: done\r\n+FAST: done\r\n\r\nOK\r\n";
+
+   for (int i = 0; i < count; ++i) {
+      ASSERT_EQ(write(channels[i].fd, input.data(), input.size()), (ssize_t)input.size());
+   }
+
+   for (int i = 0; i < count; ++i) {
+      ASSERT_EQ(engine_test_read(channels[i].fd, expected.size()), expected);
+   }
+
+   // A shard returns the buffer right after writing the response
+   at_buffer_pool_stats_t stats;
+
+   for (int i = 0; i < 500; ++i) {
+      at_buffer_pool_get_stats(pool, &stats);
+      if (stats.in_use == 0)
+         break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+
+   ASSERT_GE(stats.taken, 2ull * count);
+   ASSERT_EQ(stats.in_use, 0u);
+
+   for (int i = 0; i < count; ++i) {
+      close(channels[i].fd);
+   }
+
+   at_engine_free(engine);
+   at_buffer_pool_free(pool);
+}
+
+TEST(engine_tests, test04) {
+
+   at_engine_config_t config;
+   at_engine_config_init(&config);
+   config.shards = 1;
+   config.workers = 1;
+   config.pin = false;
+
+   at_engine_t *engine = at_engine_create(&config);
+   ASSERT_TRUE(engine != nullptr);
+
+   engine_test_channel channels[2];
+
+   for (engine_test_channel &channel : channels) {
+      int fds[2];
+      int size = 4096;
+      ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+      ASSERT_EQ(setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)), 0);
+      channel.fd = fds[0];
+      at_channel_t *c = at_engine_add_channel(engine, fds[1], engine_test_setup, &channel);
+      ASSERT_TRUE(c != nullptr);
+      at_channel_release(c);
+   }
+
+   const std::string echo_off = "ATE0\r";
+
+   for (engine_test_channel &channel : channels) {
+      ASSERT_EQ(write(channel.fd, echo_off.data(), echo_off.size()), (ssize_t)echo_off.size());
+      ASSERT_EQ(engine_test_read(channel.fd, 11), "ATE0\r\r\nOK\r\n");
+   }
+
+   // The first peer reads nothing, its output waits without holding the shard
+   const std::string big = "AT+BIG\rAT+FAST\r";
+   ASSERT_EQ(write(channels[0].fd, big.data(), big.size()), (ssize_t)big.size());
+
+   const std::string fast = "AT+FAST\r";
+   const std::string fast_expected = "+FAST: done\r\n\r\nOK\r\n";
+   ASSERT_EQ(write(channels[1].fd, fast.data(), fast.size()), (ssize_t)fast.size());
+   ASSERT_EQ(engine_test_read(channels[1].fd, fast_expected.size()), fast_expected);
+
+   // Everything arrives in order once the peer reads
+   std::string expected;
+
+   for (int i = 0; i < 256; ++i)
+      expected += std::string(1000, 'b') + "\r\n";
+
+   expected += "\r\nOK\r\n" + fast_expected;
+
+   ASSERT_EQ(engine_test_read(channels[0].fd, expected.size()), expected);
+
+   for (engine_test_channel &channel : channels) {
+      close(channel.fd);
+   }
+
+   at_engine_free(engine);
+}
+
+static at_engine_t *engine_test_engine = nullptr;
+
+// Outlasts the channel
+static void engine_test_wait_work(void *arg, struct at_function_result *result){
+   at_engine_stats_t stats;
+   for (int i = 0; i < 5000; ++i) {
+      at_engine_get_stats(engine_test_engine, &stats);
+      if (stats.channels == 0)
+         break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+   at_ok_result(result);
+}
+
+static void engine_test_wait(struct at_function_result *r, at_function_context_t *ctx){
+   at_engine_defer(ctx, engine_test_wait_work, engine_test_done, ctx->user_data);
+}
+
+static void engine_test_wait_setup(void *user, struct at_context_t *ctx){
+   at_command_add_ex(ctx, "+wait", AT_STANDALONE_COMMAND, engine_test_wait, user);
+}
+
+TEST(engine_tests, test05) {
+
+   at_engine_config_t config;
+   at_engine_config_init(&config);
+   config.shards = 1;
+   config.workers = 1;
+   config.pin = false;
+
+   at_engine_t *engine = at_engine_create(&config);
+   ASSERT_TRUE(engine != nullptr);
+   engine_test_engine = engine;
+
+   int fds[2];
+   ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+   engine_test_channel channel;
+   channel.fd = fds[0];
+   at_channel_t *c = at_engine_add_channel(engine, fds[1], engine_test_wait_setup, &channel);
+   ASSERT_TRUE(c != nullptr);
+
+   // The peer leaves while its command is deferred
+   const std::string input = "AT+WAIT\r";
+   ASSERT_EQ(write(channel.fd, input.data(), input.size()), (ssize_t)input.size());
+   close(channel.fd);
+
+   for (int i = 0; i < 5000 && channel.released < 1; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+   // 'done' and posted functions still release their argument
+   ASSERT_EQ(channel.released, 1);
+
+   at_channel_post(c, engine_test_post, &channel);
+
+   for (int i = 0; i < 5000 && channel.released < 2; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+   ASSERT_EQ(channel.released, 2);
+
+   at_engine_stats_t stats;
+   at_engine_get_stats(engine, &stats);
+   ASSERT_EQ(stats.channels, 0ull);
+
+   // The last reference frees the channel
+   at_channel_release(c);
+
+   at_engine_free(engine);
+   engine_test_engine = nullptr;
+}
@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+extern "C" {
+   #include "at.h"
+   #include "gen_test_commands.h"
+}
+
+static std::string gen_test_output;
+static std::string gen_test_last;
+
+void gen_test_output_function(range_t *data){
+   gen_test_output.append(data->begin, data->end);
+}
+
+extern "C" {
+
+void gen_test_cgmi(struct at_function_result *r, at_function_context_t *ctx){
+   gen_test_last = "cgmi";
+   at_ok_result(r);
+}
+
+void gen_test_cgmr(struct at_function_result *r, at_function_context_t *ctx){
+   gen_test_last = "cgmr";
+   at_ok_result(r);
+}
+
+void gen_test_cpin_status(struct at_function_result *r, at_function_context_t *ctx){
+   gen_test_last = "status";
+   at_ok_result(r);
+}
+
+void gen_test_cpin_set(struct at_function_result *r, at_function_context_t *ctx){
+   gen_test_last.assign(ctx->parameters.begin, ctx->parameters.end);
+   at_ok_result(r);
+}
+
+void gen_test_cmgs(struct at_function_result *r, at_function_context_t *ctx){
+   gen_test_last.assign(ctx->parameters.begin, ctx->parameters.end);
+   at_ok_result(r);
+}
+
+void gen_test_cops(struct at_function_result *r, at_function_context_t *ctx){
+   gen_test_last.assign(ctx->parameters.begin, ctx->parameters.end);
+   at_ok_result(r);
+}
+
+}
+
+static bool gen_test_run(at_context_t *context, const char *text) {
+
+   std::string input(text);
+   range_t range = range_create_cnt((iterator_t)&input[0], input.size());
+
+   gen_test_output.clear();
+   gen_test_last.clear();
+
+   at_process_input(context, &range);
+
+   return gen_test_output.find("OK") != std::string::npos;
+}
+
+TEST(gen_tests, test01) {
+
+   // Every registry entry is found under its own tag and type only
+   ASSERT_EQ(gen_test_commands_command_count, 12u);
+
+   for (unsigned int i = 0; i < gen_test_commands_command_count; ++i) {
+
+      const at_command_t *c = &gen_test_commands_commands[i];
+      std::string tag(c->tag);
+      range_t range = range_create_cnt((iterator_t)&tag[0], tag.size());
+
+      ASSERT_EQ(gen_test_commands_lookup(0, &range, c->cmd_type), c);
+
+      for (int type = AT_STANDALONE_COMMAND; type <= AT_STATUS_COMMAND; ++type) {
+         const at_command_t *other = gen_test_commands_lookup(0, &range, (AT_CMD_TYPE)type);
+         ASSERT_TRUE(other == 0 || (other->cmd_type == type && std::string(other->tag) == tag));
+      }
+   }
+
+   unsigned char unknown[] = "+cgsn";
+   range_t range = get_range(unknown);
+   ASSERT_TRUE(gen_test_commands_lookup(0, &range, AT_STANDALONE_COMMAND) == 0);
+}
+
+TEST(gen_tests, test02) {
+
+   at_context_t *context;
+   at_context_init(&context, gen_test_output_function);
+   gen_test_commands_install(context);
+
+   ASSERT_TRUE(gen_test_run(context, "ATE0\r"));
+
+   ASSERT_TRUE(gen_test_run(context, "AT+CGMI\r"));
+   ASSERT_EQ(gen_test_last, "cgmi");
+
+   ASSERT_TRUE(gen_test_run(context, "AT+cgmr\r"));
+   ASSERT_EQ(gen_test_last, "cgmr");
+
+   ASSERT_TRUE(gen_test_run(context, "AT&F\r"));
+   ASSERT_EQ(gen_test_last, "cgmr");
+
+   ASSERT_TRUE(gen_test_run(context, "AT+CPIN?\r"));
+   ASSERT_EQ(gen_test_last, "status");
+
+   ASSERT_FALSE(gen_test_run(context, "AT+CGSN\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CGMI?\r"));
+
+   // Built-ins and added commands still work next to the generated table
+   ASSERT_TRUE(gen_test_run(context, "AT+CMEE=1\r"));
+
+   at_context_free(context);
+}
+
+TEST(gen_tests, test03) {
+
+   at_context_t *context;
+   at_context_init(&context, gen_test_output_function);
+   gen_test_commands_install(context);
+
+   ASSERT_TRUE(gen_test_run(context, "ATE0\r"));
+
+   ASSERT_TRUE(gen_test_run(context, "AT+CPIN=\"1234\"\r"));
+   ASSERT_EQ(gen_test_last, "\"1234\"");
+   ASSERT_FALSE(gen_test_run(context, "AT+CPIN=1234\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CPIN=\"1234\",1\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CPIN=\r"));
+
+   ASSERT_TRUE(gen_test_run(context, "AT+CMGS=12\r"));
+   ASSERT_TRUE(gen_test_run(context, "AT+CMGS=12,129\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CMGS=12,abc\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CMGS=12,1,2\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CMGS=\r"));
+   ASSERT_TRUE(gen_test_last.empty());
+
+   ASSERT_TRUE(gen_test_run(context, "AT+COPS=0\r"));
+   ASSERT_TRUE(gen_test_run(context, "AT+COPS=1,2\r"));
+   ASSERT_TRUE(gen_test_run(context, "AT+COPS=1,,\"op\"\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+COPS=1,2,op\r"));
+
+   // Parameters that do not match are not supported
+   ASSERT_TRUE(gen_test_run(context, "AT+CMEE=1\r"));
+   ASSERT_FALSE(gen_test_run(context, "AT+CPIN=1234\r"));
+   ASSERT_EQ(gen_test_output, "\r\n+CME ERROR: 4\r\n");
+
+   at_context_free(context);
+}
@@ -0,0 +1,323 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "codec.h"
+   #include "pool.h"
+   #include "lexer_internal.h"
+}
+
+static std::string pool_test_output;
+static int pool_test_flushes = 0;
+
+static void pool_test_output_function(range_t *data){
+   pool_test_output.append(data->begin, data->end);
+   pool_test_flushes++;
+}
+
+static void pool_test_process(at_context_t *context, const char *text){
+   std::string s(text);
+   range_t r = range_create_cnt((iterator_t)&s[0], s.size());
+   at_process_input(context, &r);
+}
+
+static void pool_test_long(struct at_function_result *r, at_function_context_t *ctx){
+   at_append_line(ctx->context, std::string(150, 'x').c_str());
+   at_ok_result(r);
+}
+
+// Asks for room for the whole response first, so it goes out in one piece
+static void pool_test_large(struct at_function_result *r, at_function_context_t *ctx){
+   if (at_reserve_output(ctx->context, 200) == false) {
+      at_return_operation_not_supported_error(r);
+      return;
+   }
+   pool_test_long(r, ctx);
+}
+
+static void pool_test_huge(struct at_function_result *r, at_function_context_t *ctx){
+   if (at_reserve_output(ctx->context, 5000) == false) {
+      at_return_operation_not_supported_error(r);
+      return;
+   }
+   at_ok_result(r);
+}
+
+TEST(pool_tests, test01) {
+
+   at_buffer_pool_t *pool = at_buffer_pool_create(64, 1024, 4);
+   ASSERT_NE(pool, nullptr);
+
+   at_context_t *own;
+   at_context_init(&own, pool_test_output_function);
+   at_context_t *context;
+   at_context_init_pooled(&context, pool_test_output_function, pool);
+   ASSERT_NE(context, nullptr);
+
+   // Idle, the pooled context holds its input buffers alone
+   ASSERT_EQ(at_get_buffer_bytes(own), 2u * AT_INPUT_BUFFER_SIZE + AT_LEXER_TOKEN_BYTES + AT_OUTPUT_BUFFER_SIZE);
+   ASSERT_EQ(at_get_buffer_bytes(context), 2u * AT_INPUT_BUFFER_SIZE + AT_LEXER_TOKEN_BYTES);
+
+   at_alloc_stats_t own_stats;
+   at_alloc_stats_t stats;
+   at_get_alloc_stats(own, &own_stats);
+   at_get_alloc_stats(context, &stats);
+   ASSERT_EQ(own_stats.bytes - stats.bytes, (size_t)AT_OUTPUT_BUFFER_SIZE);
+
+   pool_test_process(context, "ATE0\r");
+
+   for (int i = 0; i < 3; ++i) {
+      pool_test_output.clear();
+      pool_test_process(context, "AT+CMEE?\r");
+      ASSERT_EQ(pool_test_output, "\r\n+CMEE: 0\r\n\r\nOK\r\n");
+   }
+
+   // The buffer went back after every response and was reused
+   at_buffer_pool_stats_t pool_stats;
+   at_buffer_pool_get_stats(pool, &pool_stats);
+   ASSERT_EQ(pool_stats.in_use, 0u);
+   ASSERT_EQ(pool_stats.peak_in_use, 1u);
+   ASSERT_EQ(pool_stats.idle, 1u);
+   ASSERT_EQ(pool_stats.allocated, 1u);
+   ASSERT_GE(pool_stats.taken, 4u);
+   ASSERT_EQ(pool_stats.bytes, 64u);
+   ASSERT_EQ(at_get_buffer_bytes(context), 2u * AT_INPUT_BUFFER_SIZE + AT_LEXER_TOKEN_BYTES);
+
+   // Responses longer than a buffer go out in buffer sized pieces
+   at_command_add(context, "+long", AT_STANDALONE_COMMAND, pool_test_long);
+   pool_test_output.clear();
+   pool_test_process(context, "AT+LONG\r");
+   ASSERT_EQ(pool_test_output, std::string(150, 'x') + "\r\n\r\nOK\r\n");
+
+   // Without a per response flush the buffer stays taken until the flush
+   at_set_flush_policy(context, AT_FLUSH_ON_FULL);
+   pool_test_output.clear();
+   pool_test_process(context, "AT\r");
+   ASSERT_EQ(pool_test_output, "");
+   ASSERT_EQ(at_get_buffer_bytes(context), 2u * AT_INPUT_BUFFER_SIZE + AT_LEXER_TOKEN_BYTES + 64u);
+   at_buffer_pool_get_stats(pool, &pool_stats);
+   ASSERT_EQ(pool_stats.in_use, 1u);
+
+   at_flush_output(context);
+   ASSERT_EQ(pool_test_output, "\r\nOK\r\n");
+   at_buffer_pool_get_stats(pool, &pool_stats);
+   ASSERT_EQ(pool_stats.in_use, 0u);
+
+   // Pending output is returned with the context
+   pool_test_process(context, "AT\r");
+   at_context_free(context);
+   at_context_free(own);
+   at_buffer_pool_get_stats(pool, &pool_stats);
+   ASSERT_EQ(pool_stats.in_use, 0u);
+
+   at_buffer_pool_free(pool);
+}
+
+TEST(pool_tests, test02) {
+
+   at_buffer_pool_t *pool = at_buffer_pool_create(64, 1024, 4);
+
+   at_context_t *own;
+   at_context_init(&own, pool_test_output_function);
+   at_context_t *context;
+   at_context_init_pooled(&context, pool_test_output_function, pool);
+   at_command_add(own, "+large", AT_STANDALONE_COMMAND, pool_test_large);
+   at_command_add(context, "+large", AT_STANDALONE_COMMAND, pool_test_large);
+   at_command_add(context, "+huge", AT_STANDALONE_COMMAND, pool_test_huge);
+   pool_test_process(own, "ATE0\r");
+   pool_test_process(context, "ATE0\r");
+
+   const std::string line = std::string(150, 'x') + "\r\n";
+
+   // Contexts with a buffer of their own have no large ones
+   pool_test_output.clear();
+   pool_test_process(own, "AT+LARGE\r");
+   ASSERT_EQ(pool_test_output, "\r\nERROR\r\n");
+
+   // A large buffer takes the whole response
+   pool_test_output.clear();
+   pool_test_flushes = 0;
+   pool_test_process(context, "AT+LARGE\r");
+   ASSERT_EQ(pool_test_output, line + "\r\nOK\r\n");
+   ASSERT_EQ(pool_test_flushes, 1);
+
+   // Large buffers are freed when returned
+   at_buffer_pool_stats_t stats;
+   at_buffer_pool_get_stats(pool, &stats);
+   ASSERT_EQ(stats.large, 1u);
+   ASSERT_EQ(stats.in_use, 0u);
+   ASSERT_EQ(stats.failed, 0u);
+   ASSERT_EQ(stats.bytes, 64u);
+
+   pool_test_output.clear();
+   pool_test_process(context, "AT+HUGE\r");
+   ASSERT_EQ(pool_test_output, "\r\nERROR\r\n");
+
+   at_context_free(own);
+   at_context_free(context);
+   at_buffer_pool_free(pool);
+}
+
+static void pool_test_null_output(range_t *data){
+}
+
+TEST(pool_tests, test03) {
+
+   at_buffer_pool_t *pool = at_buffer_pool_create(64, 1024, 2);
+
+   at_context_t *prototype;
+   at_context_init_pooled(&prototype, pool_test_null_output, pool);
+   pool_test_process(prototype, "ATE0\r");
+
+   // Clones share the pool, idle channels hold no output buffer
+   std::vector<at_context_t*> clones(1000);
+   size_t idle = 0;
+
+   for (at_context_t *&c : clones) {
+      at_context_clone(&c, prototype);
+      ASSERT_NE(c, nullptr);
+      idle += at_get_buffer_bytes(c);
+   }
+
+   ASSERT_EQ(idle / clones.size(), 2u * AT_INPUT_BUFFER_SIZE + AT_LEXER_TOKEN_BYTES);
+
+   // Channels on several threads take and return buffers at once
+   std::thread threads[4];
+
+   for (unsigned int i = 0; i < 4; ++i) {
+      threads[i] = std::thread([&clones, i]() {
+         std::string line = "AT+CMEE?;+CSCS?\r";
+         for (int n = 0; n < 50; ++n) {
+            for (size_t c = i; c < clones.size(); c += 4) {
+               range_t r = range_create_cnt((iterator_t)&line[0], line.size());
+               at_process_input(clones[c], &r);
+            }
+         }
+      });
+   }
+
+   for (std::thread &t : threads)
+      t.join();
+
+   at_buffer_pool_stats_t stats;
+   at_buffer_pool_get_stats(pool, &stats);
+   ASSERT_EQ(stats.in_use, 0u);
+   ASSERT_LE(stats.peak_in_use, 4u);
+   ASSERT_LE(stats.idle, 2u);
+   ASSERT_EQ(stats.bytes, stats.idle * 64u);
+   ASSERT_GE(stats.taken, 1000u * 50u);
+
+   for (at_context_t *c : clones)
+      at_context_free(c);
+
+   at_context_free(prototype);
+   at_buffer_pool_free(pool);
+}
+
+static bool pool_test_fail = false;
+
+static void *pool_test_alloc(void *user_data, size_t size){
+   return pool_test_fail ? nullptr : malloc(size);
+}
+
+static void pool_test_free(void *user_data, void *p, size_t size){
+   free(p);
+}
+
+static void pool_test_fields(struct at_function_result *r, at_function_context_t *ctx){
+   at_response_t response;
+   at_response_begin(&response, ctx->context, "+FIELDS");
+   at_response_int(&response, -12);
+   at_response_string(&response, "text");
+   at_response_end(&response);
+   at_append_hex(ctx->context, (const unsigned char*)"\x01\x02", 2);
+   at_ok_result(r);
+}
+
+TEST(pool_tests, test04) {
+
+   // Nothing kept idle, every response allocates
+   at_allocator_t allocator = { pool_test_alloc, pool_test_free, nullptr };
+   at_set_default_allocator(&allocator);
+   at_buffer_pool_t *pool = at_buffer_pool_create(64, 1024, 0);
+   at_set_default_allocator(nullptr);
+
+   at_context_t *context;
+   at_context_init_pooled(&context, pool_test_output_function, pool);
+   at_command_add(context, "+fields", AT_STANDALONE_COMMAND, pool_test_fields);
+   pool_test_process(context, "ATE0\r");
+   pool_test_process(context, "AT+CMEE=1\r");
+
+   // Out of memory the response is lost, the final result tells so
+   pool_test_fail = true;
+   pool_test_output.clear();
+   pool_test_process(context, "AT+FIELDS;+CMEE?\r");
+   ASSERT_EQ(pool_test_output, "\r\n+CME ERROR: 20\r\n");
+
+   at_buffer_pool_stats_t stats;
+   at_buffer_pool_get_stats(pool, &stats);
+   ASSERT_GT(stats.failed, 0u);
+   ASSERT_EQ(stats.in_use, 0u);
+
+   at_set_flush_policy(context, AT_FLUSH_ON_FULL);
+   pool_test_output.clear();
+   pool_test_process(context, "AT\r");
+   ASSERT_EQ(pool_test_output, "\r\n+CME ERROR: 20\r\n");
+   at_set_flush_policy(context, AT_FLUSH_PER_RESPONSE);
+
+   pool_test_fail = false;
+   pool_test_output.clear();
+   pool_test_process(context, "AT+FIELDS;+CMEE?\r");
+   ASSERT_EQ(pool_test_output, "\r\n+FIELDS: -12,\"text\"\r\n0102\r\n+CMEE: 1\r\n\r\nOK\r\n");
+
+   at_context_free(context);
+   at_buffer_pool_free(pool);
+}
+
+static int pool_test_guard_hits = 0;
+
+static void pool_test_guard_hook(void *user, size_t size){
+   pool_test_guard_hits++;
+}
+
+TEST(pool_tests, test05) {
+
+   at_buffer_pool_t *reusing = at_buffer_pool_create(64, 1024, 1);
+   at_buffer_pool_t *allocating = at_buffer_pool_create(64, 1024, 0);
+
+   at_context_t *first;
+   at_context_t *second;
+   at_context_init_pooled(&first, pool_test_output_function, reusing);
+   at_context_init_pooled(&second, pool_test_output_function, allocating);
+
+   for (at_context_t *c : { first, second }) {
+      pool_test_process(c, "ATE0\r");
+      at_set_alloc_guard(c, true);
+      at_set_alloc_guard_hook(c, pool_test_guard_hook, nullptr);
+   }
+
+   // Buffers kept idle in the pool cost no allocation
+   pool_test_guard_hits = 0;
+   pool_test_process(first, "AT\r");
+
+   at_alloc_stats_t stats;
+   at_get_alloc_stats(first, &stats);
+   ASSERT_EQ(stats.guarded, 0u);
+   ASSERT_EQ(pool_test_guard_hits, 0);
+
+   // Those the pool allocates while processing input count for the context
+   pool_test_process(second, "AT\r");
+
+   at_get_alloc_stats(second, &stats);
+   ASSERT_EQ(stats.guarded, 1u);
+   ASSERT_EQ(pool_test_guard_hits, 1);
+
+   at_context_free(first);
+   at_context_free(second);
+   at_buffer_pool_free(reusing);
+   at_buffer_pool_free(allocating);
+}
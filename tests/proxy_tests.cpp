@@ -0,0 +1,218 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+extern "C" {
+   #include "at.h"
+   #include "proxy.h"
+   #include <fcntl.h>
+   #include <sys/socket.h>
+   #include <unistd.h>
+}
+
+struct proxy_test_link {
+   int modem[2];
+   int host[2];
+};
+
+static void proxy_test_output(void *user, range_t *data){
+   int fd = *static_cast<int*>(user);
+   ASSERT_EQ(write(fd, data->begin, range_size(data)), (ssize_t)range_size(data));
+}
+
+static std::string proxy_test_read(int fd){
+   std::string s;
+   char buffer[512];
+   ssize_t n;
+   while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+      s.append(buffer, n);
+   return s;
+}
+
+static void proxy_test_write(int fd, const std::string &s){
+   ASSERT_EQ(write(fd, s.data(), s.size()), (ssize_t)s.size());
+}
+
+static void proxy_test_input(at_context_t *context, const char *text){
+   std::string s(text);
+   range_t r = range_create_cnt((iterator_t)&s[0], s.size());
+   at_process_input(context, &r);
+}
+
+static void proxy_test_local(struct at_function_result *r, at_function_context_t *ctx){
+   at_append_line(ctx->context, "");
+   at_append_line(ctx->context, "+LOCAL");
+   at_ok_result(r);
+}
+
+static void proxy_test_open(proxy_test_link &link){
+   ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, link.modem), 0);
+   ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, link.host), 0);
+   fcntl(link.modem[1], F_SETFL, O_NONBLOCK);
+   fcntl(link.host[1], F_SETFL, O_NONBLOCK);
+}
+
+static void proxy_test_close(proxy_test_link &link){
+   close(link.modem[0]);
+   close(link.modem[1]);
+   close(link.host[0]);
+   close(link.host[1]);
+}
+
+TEST(proxy_tests, test01) {
+
+   proxy_test_link link;
+   proxy_test_open(link);
+
+   at_proxy_t *proxy = at_proxy_create(link.modem[0], 4);
+   ASSERT_NE(proxy, nullptr);
+
+   at_context_t *context;
+   at_context_init(&context, nullptr);
+   at_set_output_hook(context, proxy_test_output, &link.host[0]);
+   at_command_add(context, "+local", AT_STANDALONE_COMMAND, proxy_test_local);
+   ASSERT_TRUE(at_proxy_attach(proxy, context, link.host[0]));
+
+   proxy_test_input(context, "ATE0\r");
+   proxy_test_read(link.host[1]);
+
+   // Local handlers win, the rest goes downstream
+   proxy_test_input(context, "AT+LOCAL;+COPS?\rAT\r");
+   ASSERT_EQ(proxy_test_read(link.modem[1]), "AT+cops?\r");
+   ASSERT_TRUE(at_is_deferred(context));
+
+   // The response arrives in pieces, the final result resumes the command
+   proxy_test_write(link.modem[1], "\r\n+COPS: 0,0,\"N");
+   ASSERT_TRUE(at_proxy_process(proxy));
+   proxy_test_write(link.modem[1], "ET\"\r\n\r\nOK\r\n");
+   ASSERT_TRUE(at_proxy_process(proxy));
+   ASSERT_FALSE(at_is_deferred(context));
+   at_flush_output(context);
+
+   ASSERT_EQ(proxy_test_read(link.host[1]),
+         "\r\n+LOCAL\r\n\r\n+COPS: 0,0,\"NET\"\r\n\r\nOK\r\n\r\nOK\r\n");
+
+   // Lines with nothing in flight are unsolicited
+   proxy_test_write(link.modem[1], "\r\n+CREG: 1\r\n");
+   ASSERT_TRUE(at_proxy_process(proxy));
+   at_flush_output(context);
+   ASSERT_EQ(proxy_test_read(link.host[1]), "\r\n+CREG: 1\r\n");
+
+   // Downstream errors come back in the format of the context
+   proxy_test_input(context, "AT+CMEE=1\rAT+CPIN?\r");
+   ASSERT_EQ(proxy_test_read(link.modem[1]), "AT+cpin?\r");
+   proxy_test_write(link.modem[1], "\r\n+CME ERROR: 10\r\n");
+   ASSERT_TRUE(at_proxy_process(proxy));
+   at_flush_output(context);
+   ASSERT_EQ(proxy_test_read(link.host[1]), "\r\nOK\r\n\r\n+CME ERROR: 10\r\n");
+
+   at_proxy_stats_t stats;
+   at_proxy_get_stats(proxy, &stats);
+   ASSERT_EQ(stats.forwarded, 2u);
+   ASSERT_EQ(stats.rejected, 0u);
+   ASSERT_EQ(stats.unsolicited, 1u);
+   ASSERT_EQ(stats.spliced, 20u);
+   ASSERT_EQ(stats.copied, 0u);
+
+   at_proxy_detach(proxy, context);
+   at_proxy_free(proxy);
+   at_context_free(context);
+   proxy_test_close(link);
+}
+
+TEST(proxy_tests, test02) {
+
+   proxy_test_link link;
+   proxy_test_open(link);
+
+   at_proxy_t *proxy = at_proxy_create(link.modem[0], 1);
+
+   at_context_t *first;
+   at_context_t *second;
+   at_context_init(&first, nullptr);
+   at_context_init(&second, nullptr);
+   at_set_output_hook(first, proxy_test_output, &link.host[0]);
+   at_set_output_hook(second, proxy_test_output, &link.host[0]);
+
+   // Without an upstream descriptor responses are copied into the output
+   ASSERT_TRUE(at_proxy_attach(proxy, first, -1));
+   ASSERT_TRUE(at_proxy_attach(proxy, second, -1));
+   ASSERT_FALSE(at_proxy_attach(proxy, second, -1));
+
+   proxy_test_input(first, "ATE0\r");
+   proxy_test_input(second, "ATE0\r");
+   proxy_test_read(link.host[1]);
+
+   // The in-flight queue is bounded
+   proxy_test_input(first, "AT+CSQ\r");
+   proxy_test_input(second, "AT+CSQ\r");
+   ASSERT_EQ(proxy_test_read(link.modem[1]), "AT+csq\r");
+   ASSERT_FALSE(at_is_deferred(second));
+   at_flush_output(second);
+   ASSERT_EQ(proxy_test_read(link.host[1]), "\r\nERROR\r\n");
+
+   proxy_test_write(link.modem[1], "\r\n+CSQ: 20,99\r\n\r\nOK\r\n");
+   ASSERT_TRUE(at_proxy_process(proxy));
+   at_flush_output(first);
+   ASSERT_EQ(proxy_test_read(link.host[1]), "\r\n+CSQ: 20,99\r\n\r\nOK\r\n");
+
+   at_proxy_stats_t stats;
+
+   // A detached context gets nothing, its command still completes downstream
+   proxy_test_input(first, "AT+CGMI\r");
+   at_proxy_detach(proxy, first);
+   proxy_test_write(link.modem[1], "\r\nath\r\n\r\nOK\r\n");
+   ASSERT_TRUE(at_proxy_process(proxy));
+   proxy_test_input(second, "AT+CGMR\r");
+   ASSERT_EQ(proxy_test_read(link.modem[1]), "AT+cgmi\rAT+cgmr\r");
+   at_flush_output(second);
+   ASSERT_EQ(proxy_test_read(link.host[1]), "");
+
+   at_proxy_get_stats(proxy, &stats);
+   ASSERT_EQ(stats.rejected, 1u);
+   ASSERT_EQ(stats.spliced, 0u);
+   ASSERT_EQ(stats.copied, 15u);
+
+   // End of downstream input
+   close(link.modem[1]);
+   ASSERT_FALSE(at_proxy_process(proxy));
+
+   at_proxy_free(proxy);
+   at_context_free(first);
+   at_context_free(second);
+   close(link.modem[0]);
+   close(link.host[0]);
+   close(link.host[1]);
+}
+
+TEST(proxy_tests, test03) {
+
+   proxy_test_link link;
+   proxy_test_open(link);
+
+   at_proxy_t *proxy = at_proxy_create(link.modem[0], 4);
+
+   at_context_t *context;
+   at_context_init(&context, nullptr);
+   at_set_output_hook(context, proxy_test_output, &link.host[0]);
+   ASSERT_TRUE(at_proxy_attach(proxy, context, -1));
+   proxy_test_input(context, "ATE0\r");
+
+   // A clone is not attached to the proxy and does not forward
+   at_context_t *clone;
+   at_context_clone(&clone, context);
+   ASSERT_NE(clone, nullptr);
+
+   at_proxy_free(proxy);
+   proxy_test_read(link.host[1]);
+
+   proxy_test_input(clone, "AT+CSQ\r");
+   at_flush_output(clone);
+   ASSERT_FALSE(at_is_deferred(clone));
+   ASSERT_EQ(proxy_test_read(link.host[1]), "\r\nERROR\r\n");
+   ASSERT_EQ(proxy_test_read(link.modem[1]), "");
+
+   at_context_free(clone);
+   at_context_free(context);
+   proxy_test_close(link);
+}
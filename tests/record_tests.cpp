@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+extern "C" {
+   #include "at.h"
+   #include "record.h"
+}
+
+static std::string record_test_output;
+
+void record_test_output_function(range_t *data){
+   record_test_output.append(data->begin, data->end);
+}
+
+TEST(record_tests, test01) {
+
+   const char *path = "record_tests_test01.bin";
+
+   at_context_t *context;
+   at_context_init(&context, record_test_output_function);
+
+   at_recorder_t *recorder = at_recorder_open(path);
+   ASSERT_TRUE(recorder != nullptr);
+
+   at_recorder_attach(recorder, context);
+
+   unsigned char cmd_buffer[] = "AT\r";
+   range_t cmd_range = get_range(cmd_buffer);
+
+   at_process_input(context, &cmd_range);
+   at_add_unsolicited(context, "STATUS", "READY");
+   at_add_unsolicited(context, "", "EMPTY");
+   at_add_unsolicited_line(context, "LINE");
+
+   at_context_free(context);
+   at_recorder_close(recorder);
+
+   at_record_reader_t *reader = at_record_reader_open(path);
+   ASSERT_TRUE(reader != nullptr);
+
+   std::string output;
+   int inputs = 0;
+   int unsolicited = 0;
+   int lines = 0;
+   at_record_t record;
+   unsigned long long last_timestamp = 0;
+
+   while (at_record_read(reader, &record)) {
+
+      ASSERT_GE(record.timestamp_ns, last_timestamp);
+      last_timestamp = record.timestamp_ns;
+
+      if (record.type == AT_RECORD_INPUT) {
+         ASSERT_TRUE(range_equals(&record.data, "AT\r"));
+         inputs++;
+      } else if (record.type == AT_RECORD_UNSOLICITED) {
+         // The empty prefix is kept apart from unsolicited lines
+         ASSERT_TRUE(range_equals(&record.prefix, unsolicited == 0 ? "STATUS" : ""));
+         ASSERT_TRUE(range_equals(&record.data, unsolicited == 0 ? "READY" : "EMPTY"));
+         unsolicited++;
+      } else if (record.type == AT_RECORD_UNSOLICITED_LINE) {
+         ASSERT_TRUE(range_equals(&record.data, "LINE"));
+         lines++;
+      } else {
+         output.append(record.data.begin, record.data.end);
+      }
+   }
+
+   at_record_reader_close(reader);
+   remove(path);
+
+   ASSERT_EQ(inputs, 1);
+   ASSERT_EQ(unsolicited, 2);
+   ASSERT_EQ(lines, 1);
+   ASSERT_EQ(output, record_test_output);
+}
+
+TEST(record_tests, test02) {
+   ASSERT_TRUE(at_record_reader_open("record_tests_missing.bin") == nullptr);
+}
+
+TEST(record_tests, test03) {
+
+   const char *path = "record_tests_test03.bin";
+
+   // An input record claiming 2^40 bytes of data after the header
+   at_recorder_close(at_recorder_open(path));
+
+   const unsigned char data[] = {
+      AT_RECORD_INPUT, 0, 0x80, 0x80, 0x80, 0x80, 0x80, 0x20
+   };
+
+   FILE *f = fopen(path, "ab");
+   ASSERT_TRUE(f != nullptr);
+   fwrite(data, 1, sizeof(data), f);
+   fclose(f);
+
+   at_record_reader_t *reader = at_record_reader_open(path);
+   ASSERT_TRUE(reader != nullptr);
+
+   at_record_t record;
+   ASSERT_FALSE(at_record_read(reader, &record));
+
+   at_record_reader_close(reader);
+   remove(path);
+}
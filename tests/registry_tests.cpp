@@ -0,0 +1,293 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+   #include "at.h"
+   #include "registry.h"
+}
+
+static std::string registry_test_output;
+
+static void registry_test_output_function(range_t *data){
+   registry_test_output.append(data->begin, data->end);
+}
+
+static void registry_test_process(at_context_t *context, const char *text){
+   std::string s(text);
+   range_t r = range_create_cnt((iterator_t)&s[0], s.size());
+   at_process_input(context, &r);
+}
+
+static void registry_test_plugin(struct at_function_result *r, at_function_context_t *ctx){
+   at_append_line(ctx->context, static_cast<const char*>(ctx->user_data));
+   at_ok_result(r);
+}
+
+static int registry_test_reclaimed = 0;
+
+static void registry_test_reclaim(void *arg){
+   registry_test_reclaimed += *static_cast<int*>(arg);
+}
+
+static at_registry_t *registry_test_registry;
+static int registry_test_version = 3;
+
+// Replaces the snapshot it was found in
+static void registry_test_reload(struct at_function_result *r, at_function_context_t *ctx){
+   const at_command_t commands[] = {
+      { "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: 3" },
+   };
+   at_registry_publish(registry_test_registry, commands, 1, registry_test_reclaim, &registry_test_version);
+   at_ok_result(r);
+}
+
+TEST(registry_tests, test01) {
+
+   at_registry_t *registry = at_registry_create();
+   registry_test_registry = registry;
+   ASSERT_EQ(at_registry_version(registry), 0u);
+
+   at_context_t *context;
+   at_context_init(&context, registry_test_output_function);
+   ASSERT_TRUE(at_registry_attach(registry, context));
+   ASSERT_FALSE(at_registry_attach(registry, context));
+   registry_test_process(context, "ATE0\r");
+
+   int one = 1;
+   int two = 2;
+   const at_command_t v1[] = {
+      { "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: 1" },
+      { "+reload", AT_STANDALONE_COMMAND, registry_test_reload, nullptr },
+      { "+cmee", AT_STATUS_COMMAND, registry_test_plugin, (void*)"+CMEE: override" },
+   };
+   ASSERT_EQ(at_registry_publish(registry, v1, 3, registry_test_reclaim, &one), 1u);
+
+   registry_test_output.clear();
+   registry_test_process(context, "AT+PLUG;+CMEE?\r");
+   ASSERT_EQ(registry_test_output, "+PLUG: 1\r\n+CMEE: override\r\n\r\nOK\r\n");
+
+   const at_command_t v2[] = {
+      { "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: 2" },
+      { "+reload", AT_STANDALONE_COMMAND, registry_test_reload, nullptr },
+   };
+   ASSERT_EQ(at_registry_publish(registry, v2, 2, registry_test_reclaim, &two), 2u);
+   ASSERT_EQ(registry_test_reclaimed, 1);
+
+   // The snapshot a handler runs from outlives its replacement until the
+   // handler returns, the next command of the line sees the new one
+   registry_test_output.clear();
+   registry_test_process(context, "AT+RELOAD;+PLUG\r");
+   ASSERT_EQ(registry_test_output, "+PLUG: 3\r\n\r\nOK\r\n");
+   ASSERT_EQ(registry_test_reclaimed, 1);
+   ASSERT_EQ(at_registry_reclaim(registry), 0u);
+   ASSERT_EQ(registry_test_reclaimed, 3);
+   ASSERT_EQ(at_registry_version(registry), 3u);
+
+   at_context_free(context);
+   at_registry_free(registry);
+   ASSERT_EQ(registry_test_reclaimed, 6);
+}
+
+static void registry_test_count(void *arg){
+   static_cast<std::atomic<int>*>(arg)->fetch_add(1);
+}
+
+static void registry_test_null_output(range_t *data){
+}
+
+TEST(registry_tests, test02) {
+
+   at_registry_t *registry = at_registry_create();
+   std::atomic<int> reclaimed{0};
+   std::atomic<bool> stop{false};
+   std::atomic<long> dispatched{0};
+
+   const at_command_t commands[] = {
+      { "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: 1" },
+   };
+   at_registry_publish(registry, commands, 1, registry_test_count, &reclaimed);
+
+   // Readers dispatch while the writer keeps replacing the command set
+   std::thread readers[2];
+
+   for (std::thread &t : readers) {
+      t = std::thread([&]() {
+         at_context_t *context;
+         at_context_init(&context, registry_test_null_output);
+         at_registry_attach(registry, context);
+
+         std::string line = "AT+PLUG\r";
+         range_t r;
+
+         while (stop == false) {
+            r = range_create_cnt((iterator_t)&line[0], line.size());
+            at_process_input(context, &r);
+            dispatched++;
+         }
+
+         at_context_free(context);
+      });
+   }
+
+   const int publishes = 2000;
+
+   for (int i = 0; i < publishes; ++i)
+      ASSERT_NE(at_registry_publish(registry, commands, 1, registry_test_count, &reclaimed), 0u);
+
+   while (dispatched < 1000)
+      std::this_thread::yield();
+
+   stop = true;
+
+   for (std::thread &t : readers)
+      t.join();
+
+   ASSERT_EQ(at_registry_reclaim(registry), 0u);
+   ASSERT_EQ(reclaimed, publishes);
+   ASSERT_EQ(at_registry_version(registry), publishes + 1u);
+
+   at_registry_free(registry);
+   ASSERT_EQ(reclaimed, publishes + 1);
+}
+
+TEST(registry_tests, test03) {
+
+   const at_command_t commands[] = {
+      { "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: shared" },
+      { "+cgmi", AT_STATUS_COMMAND, registry_test_plugin, (void*)"+CGMI: ath" },
+      { "+cscs", AT_STATUS_COMMAND, registry_test_plugin, (void*)"+CSCS: shared" },
+   };
+   at_command_set_t *set = at_command_set_create(commands, 3);
+
+   at_context_t *prototype;
+   at_context_init(&prototype, registry_test_output_function);
+   at_set_command_set(prototype, set);
+   at_command_set_release(set);
+   registry_test_process(prototype, "ATE0\r");
+   registry_test_process(prototype, "AT+CMEE=1\r");
+   registry_test_process(prototype, "ATS4=7\r");
+
+   std::vector<at_context_t*> clones(100);
+
+   for (at_context_t *&c : clones) {
+      at_context_clone(&c, prototype);
+      ASSERT_NE(c, nullptr);
+
+      at_alloc_stats_t stats;
+      at_get_alloc_stats(c, &stats);
+      ASSERT_EQ(stats.allocs, 1u);
+   }
+
+   // The set overrides the built-in command
+   registry_test_output.clear();
+   registry_test_process(clones[2], "AT+CSCS?\r");
+   ASSERT_EQ(registry_test_output, "+CSCS: shared\r\a\r\aOK\r\a");
+
+   // The overlay of one context hides the shared command from it alone
+   at_command_add_ex(clones[0], "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: own");
+
+   registry_test_output.clear();
+   registry_test_process(clones[0], "AT+PLUG\r");
+   ASSERT_EQ(registry_test_output, "+PLUG: own\r\a\r\aOK\r\a");
+
+   registry_test_output.clear();
+   registry_test_process(clones[1], "AT+PLUG;+CGMI?;+CMEE?;+NONE\r");
+   ASSERT_EQ(registry_test_output, "+PLUG: shared\r\a+CGMI: ath\r\a\r\a+CMEE: 1\r\a\r\a+CME ERROR: 4\r\a");
+
+   // The set outlives the prototype while clones use it
+   at_context_free(prototype);
+
+   for (at_context_t *c : clones) {
+      registry_test_output.clear();
+      registry_test_process(c, "AT+CGMI?\r");
+      ASSERT_EQ(registry_test_output, "+CGMI: ath\r\a\r\aOK\r\a");
+      at_context_free(c);
+   }
+}
+
+static size_t registry_test_allocated = 0;
+
+static void *registry_test_alloc(void *user_data, size_t size){
+   registry_test_allocated += size;
+   return malloc(size);
+}
+
+static void registry_test_free(void *user_data, void *p, size_t size){
+   registry_test_allocated -= size;
+   free(p);
+}
+
+TEST(registry_tests, test04) {
+
+   // Registries and their snapshots take the default allocator they were created with
+   at_allocator_t allocator = { registry_test_alloc, registry_test_free, nullptr };
+   at_set_default_allocator(&allocator);
+   at_registry_t *registry = at_registry_create();
+
+   const at_command_t commands[] = {
+      { "+plug", AT_STANDALONE_COMMAND, registry_test_plugin, (void*)"+PLUG: 1" },
+   };
+
+   ASSERT_NE(at_registry_publish(registry, commands, 1, nullptr, nullptr), 0u);
+   at_set_default_allocator(nullptr);
+
+   ASSERT_GT(registry_test_allocated, 0u);
+
+   ASSERT_NE(at_registry_publish(registry, commands, 1, nullptr, nullptr), 0u);
+   at_registry_free(registry);
+
+   // The snapshot published with malloc went back to malloc
+   ASSERT_EQ(registry_test_allocated, 0u);
+}
+
+TEST(registry_tests, test05) {
+
+   at_registry_t *registry = at_registry_create();
+
+   at_context_t *context;
+   at_context_init(&context, registry_test_output_function);
+   ASSERT_TRUE(at_registry_attach(registry, context));
+   at_command_cache(context, "+cgmi", AT_STATUS_COMMAND, 0);
+   registry_test_process(context, "ATE0\r");
+
+   const at_command_t v1[] = {
+      { "+cgmi", AT_STATUS_COMMAND, registry_test_plugin, (void*)"+CGMI: 1" },
+   };
+   at_registry_publish(registry, v1, 1, nullptr, nullptr);
+
+   for (int i = 0; i < 2; ++i) {
+      registry_test_output.clear();
+      registry_test_process(context, "AT+CGMI?\r");
+      ASSERT_EQ(registry_test_output, "+CGMI: 1\r\n\r\nOK\r\n");
+   }
+
+   // The handler of the new snapshot runs, not the output of the old one
+   const at_command_t v2[] = {
+      { "+cgmi", AT_STATUS_COMMAND, registry_test_plugin, (void*)"+CGMI: 2" },
+   };
+   at_registry_publish(registry, v2, 1, nullptr, nullptr);
+
+   for (int i = 0; i < 2; ++i) {
+      registry_test_output.clear();
+      registry_test_process(context, "AT+CGMI?\r");
+      ASSERT_EQ(registry_test_output, "+CGMI: 2\r\n\r\nOK\r\n");
+   }
+
+   // So does a command added to the context
+   at_command_add_ex(context, "+cgmi", AT_STATUS_COMMAND, registry_test_plugin, (void*)"+CGMI: own");
+   registry_test_output.clear();
+   registry_test_process(context, "AT+CGMI?\r");
+   ASSERT_EQ(registry_test_output, "+CGMI: own\r\n\r\nOK\r\n");
+
+   at_cache_stats_t stats;
+   at_get_cache_stats(context, &stats);
+   ASSERT_EQ(stats.hits, 2u);
+   ASSERT_EQ(stats.misses, 3u);
+
+   at_context_free(context);
+   at_registry_free(registry);
+}